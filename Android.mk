@@ -25,6 +25,17 @@ LOCAL_C_INCLUDES += system/core/include
 LOCAL_STATIC_LIBRARIES := libcutils libc libmincrypt
 include $(BUILD_STATIC_LIBRARY)
 
+# Crypto extension kernels for verifier_hash.c; only these get the
+# instruction set flags, the dispatcher checks the CPU before using them.
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := verifier_hash_accel.c
+LOCAL_CFLAGS := -O2 -Wall -Wno-unused-parameter
+LOCAL_CFLAGS_arm64 := -march=armv8-a+crypto
+LOCAL_CFLAGS_x86 := -msse4.1 -msha
+LOCAL_CFLAGS_x86_64 := -msse4.1 -msha
+LOCAL_MODULE := libverifier_hash_accel
+include $(BUILD_STATIC_LIBRARY)
+
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
@@ -37,6 +48,14 @@ LOCAL_SRC_FILES := \
     mtdutils/mounts.c \
     extendedcommands.c \
     nandroid.c \
+    nandroid_archive.c \
+    nandroid_compress.c \
+    nandroid_dedup.c \
+    nandroid_digest.c \
+    nandroid_journal.c \
+    nandroid_sched.c \
+    nandroid_stats.c \
+    nandroid_stream.c \
     ../../system/core/toolbox/dynarray.c \
     ../../system/core/toolbox/getprop.c \
     ../../system/core/toolbox/newfs_msdos.c \
@@ -47,6 +66,8 @@ LOCAL_SRC_FILES := \
     adb_install.c \
     asn1_decoder.c \
     verifier.c \
+    verifier_cache.c \
+    verifier_hash.c \
     fuse_sdcard_provider.c \
     propsrvc/legacy_property_service.c
 
@@ -142,6 +163,7 @@ LOCAL_C_INCLUDES := \
 	external/stlport/stlport
 
 LOCAL_STATIC_LIBRARIES := \
+    libverifier_hash_accel \
     libext4_utils_static \
     libmake_ext4fs \
     libminizip \
@@ -191,6 +213,10 @@ ifeq ($(TARGET_USERIMAGES_USE_EXT4), true)
 	LOCAL_STATIC_LIBRARIES += libext4_utils_static libz liblz4-static
 endif
 
+ifeq ($(TARGET_RECOVERY_USES_ZSTD),true)
+	LOCAL_STATIC_LIBRARIES += libzstd
+endif
+
 ifeq ($(BOARD_USES_BML_OVER_MTD),true)
 LOCAL_STATIC_LIBRARIES += libbml_over_mtd
 endif
@@ -255,7 +281,6 @@ endif
 
 LOCAL_ADDITIONAL_DEPENDENCIES += \
     killrecovery.sh \
-    nandroid-md5.sh \
     parted \
     sdparted
 
@@ -310,14 +335,6 @@ LOCAL_CFLAGS := -Dmain=reboot_main
 LOCAL_SRC_FILES := ../../system/core/reboot/reboot.c
 include $(BUILD_STATIC_LIBRARY)
 
-include $(CLEAR_VARS)
-LOCAL_MODULE := nandroid-md5.sh
-LOCAL_MODULE_TAGS := optional
-LOCAL_MODULE_CLASS := RECOVERY_EXECUTABLES
-LOCAL_MODULE_PATH := $(TARGET_RECOVERY_ROOT_OUT)/sbin
-LOCAL_SRC_FILES := nandroid-md5.sh
-include $(BUILD_PREBUILT)
-
 include $(CLEAR_VARS)
 LOCAL_MODULE := killrecovery.sh
 LOCAL_MODULE_TAGS := optional
@@ -336,7 +353,7 @@ include $(CLEAR_VARS)
 
 LOCAL_CFLAGS += -Wno-unused-parameter
 
-LOCAL_SRC_FILES := verifier_test.c asn1_decoder.c verifier.c
+LOCAL_SRC_FILES := verifier_test.c asn1_decoder.c verifier.c verifier_hash.c
 
 LOCAL_C_INCLUDES += \
 	system/extras/ext4_utils \
@@ -350,8 +367,17 @@ LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_MODULE_TAGS := tests
 
 LOCAL_LDFLAGS += -Wl,--no-fatal-warnings
-LOCAL_STATIC_LIBRARIES := libmincrypt libminuictr libminzip libcutils libstdc++ libc
+LOCAL_STATIC_LIBRARIES := libverifier_hash_accel libmincrypt libminuictr libminzip libcutils libstdc++ libc
+
+include $(BUILD_EXECUTABLE)
 
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := verifier_hash_bench.c verifier_hash.c
+LOCAL_CFLAGS += -O2 -Wall -Wno-unused-parameter
+LOCAL_MODULE := verifier_hash_bench
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_TAGS := tests
+LOCAL_STATIC_LIBRARIES := libverifier_hash_accel libmincrypt libc
 include $(BUILD_EXECUTABLE)
 
 commands_recovery_local_path := $(LOCAL_PATH)
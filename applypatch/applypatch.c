@@ -839,6 +839,24 @@ int applypatch(const char* source_filename,
     return result;
 }
 
+// Opens the device of an "EMMC:<device>:..." filename for reading.
+static int OpenPartitionSource(const char* filename) {
+    char* copy = strdup(filename);
+    char* device;
+    int fd = -1;
+
+    strtok(copy, ":");
+    device = strtok(NULL, ":");
+    if (device != NULL) {
+        fd = open(device, O_RDONLY);
+        if (fd < 0) {
+            printf("failed to open %s: %s\n", device, strerror(errno));
+        }
+    }
+    free(copy);
+    return fd;
+}
+
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
                           FileContents* copy_file,
@@ -958,6 +976,22 @@ static int GenerateTarget(FileContents* source_file,
             return 1;
         }
 
+        // An eMMC source has been backed up and its sha1 checked by now,
+        // so a bsdiff patch reads it back from the device a window at a
+        // time. It's freed before the target is staged, so the two are
+        // never in memory together.
+        PatchSource ps = { source_to_use->data, -1, 0, source_to_use->size };
+        if (patch->size >= 8 && memcmp(patch->data, "BSDIFF40", 8) == 0 &&
+            source_to_use == source_file && made_copy &&
+            strncmp(source_filename, "EMMC:", 5) == 0) {
+            ps.fd = OpenPartitionSource(source_filename);
+            if (ps.fd >= 0) {
+                free(source_file->data);
+                source_file->data = NULL;
+                ps.data = NULL;
+            }
+        }
+
         SinkFn sink = NULL;
         void* token = NULL;
         output = -1;
@@ -970,6 +1004,7 @@ static int GenerateTarget(FileContents* source_file,
             if (msi.buffer == NULL) {
                 printf("failed to alloc %ld bytes for output\n",
                        (long)target_size);
+                if (ps.fd >= 0) close(ps.fd);
                 return 1;
             }
             msi.pos = 0;
@@ -987,6 +1022,7 @@ static int GenerateTarget(FileContents* source_file,
             if (output < 0) {
                 printf("failed to open output file %s: %s\n",
                        outname, strerror(errno));
+                if (ps.fd >= 0) close(ps.fd);
                 return 1;
             }
             sink = FileSink;
@@ -1002,8 +1038,17 @@ static int GenerateTarget(FileContents* source_file,
 
         if (header_bytes_read >= 8 &&
             memcmp(header, "BSDIFF40", 8) == 0) {
-            result = ApplyBSDiffPatch(source_to_use->data, source_to_use->size,
-                                      patch, 0, sink, token, &ctx);
+            size_t peak_memory = 0;
+            size_t staged = output < 0 ? target_size : 0;
+            size_t in_memory = ps.data ? ps.size : 0;
+
+            result = ApplyBSDiffPatchSource(&ps, patch, 0, sink, token, &ctx,
+                                            &peak_memory);
+            printf("bspatch peak memory %ld bytes (patching %ld, staged target %ld, "
+                   "source %ld %s)\n",
+                   (long)(peak_memory + staged + in_memory), (long)peak_memory,
+                   (long)staged, (long)ps.size,
+                   ps.data ? "in memory" : "read from device");
         } else if (header_bytes_read >= 8 &&
                    memcmp(header, "IMGDIFF2", 8) == 0) {
             result = ApplyImagePatch(source_to_use->data, source_to_use->size,
@@ -1013,6 +1058,10 @@ static int GenerateTarget(FileContents* source_file,
             return 1;
         }
 
+        if (ps.fd >= 0) {
+            close(ps.fd);
+        }
+
         if (output >= 0) {
             if (fsync(output) != 0) {
                 printf("failed to fsync file \"%s\" (%s)\n", outname, strerror(errno));
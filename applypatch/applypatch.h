@@ -75,6 +75,23 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
                         const Value* patch, ssize_t patch_offset,
                         unsigned char** new_data, ssize_t* new_size);
 
+// The old data for a patch: data, or if that's NULL, size bytes of fd
+// starting at offset, read a window at a time.
+typedef struct {
+    const unsigned char* data;
+    int fd;
+    off64_t offset;
+    ssize_t size;
+} PatchSource;
+
+// Streams the patch: the new data goes to sink a window at a time, so
+// neither the old nor the new data has to be in memory.  If peak_memory
+// isn't NULL it gets the most memory the patch used at once.
+int ApplyBSDiffPatchSource(const PatchSource* source,
+                           const Value* patch, ssize_t patch_offset,
+                           SinkFn sink, void* token, SHA_CTX* ctx,
+                           size_t* peak_memory);
+
 // imgpatch.c
 int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                     const Value* patch,
@@ -24,6 +24,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -98,30 +99,129 @@ int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
     return 0;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
+// Output (and source data read from a file) go through windows of this
+// size, so patching takes about this much memory on top of the three
+// bzip2 decoders, whatever the size of the old and new data.
+#define BSPATCH_WINDOW (256 * 1024)
+
+// Space in front of every block handed to bzip2, to remember its size.
+#define ALLOC_HEADER 16
+
+typedef struct {
+    size_t current;
+    size_t peak;
+} MemoryUse;
+
+static void UseMemory(MemoryUse* use, ssize_t bytes) {
+    use->current += bytes;
+    if (use->current > use->peak) {
+        use->peak = use->current;
+    }
+}
+
+static void* CountingAlloc(void* opaque, int items, int size) {
+    size_t bytes = (size_t)items * size;
+    unsigned char* p = malloc(bytes + ALLOC_HEADER);
+    if (p == NULL) {
+        return NULL;
+    }
+    *(size_t*)p = bytes;
+    UseMemory((MemoryUse*)opaque, bytes);
+    return p + ALLOC_HEADER;
+}
 
-    unsigned char* new_data;
-    ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
+static void CountingFree(void* opaque, void* ptr) {
+    if (ptr != NULL) {
+        unsigned char* p = (unsigned char*)ptr - ALLOC_HEADER;
+        UseMemory((MemoryUse*)opaque, -(ssize_t)*(size_t*)p);
+        free(p);
+    }
+}
+
+static int InitStream(bz_stream* stream, char* data, ssize_t size, MemoryUse* use,
+                      const char* what) {
+    int bzerr;
+
+    memset(stream, 0, sizeof(*stream));
+    stream->next_in = data;
+    stream->avail_in = size;
+    stream->bzalloc = CountingAlloc;
+    stream->bzfree = CountingFree;
+    stream->opaque = use;
+    if ((bzerr = BZ2_bzDecompressInit(stream, 0, 0)) != BZ_OK) {
+        printf("failed to bzinit %s stream (%d)\n", what, bzerr);
         return -1;
     }
+    return 0;
+}
 
-    if (sink(new_data, new_size, token) < new_size) {
-        printf("short write of output: %d (%s)\n", errno, strerror(errno));
-        return 1;
+// The old data, in memory or read from a file a window at a time.
+typedef struct {
+    const PatchSource* source;
+    unsigned char* window;
+    off64_t start;
+    ssize_t length;
+} SourceWindow;
+
+// Adds the old data at [oldpos, oldpos + len) to buf.  Bytes outside
+// the old data are left alone; len is at most BSPATCH_WINDOW.
+static int AddOldData(SourceWindow* sw, unsigned char* buf, off64_t oldpos, ssize_t len) {
+    const PatchSource* source = sw->source;
+    off64_t lo = oldpos < 0 ? 0 : oldpos;
+    off64_t hi = oldpos + len > source->size ? source->size : oldpos + len;
+    const unsigned char* old;
+    off64_t i;
+
+    if (lo >= hi) {
+        return 0;
+    }
+
+    if (source->data != NULL) {
+        old = source->data + lo;
+    } else {
+        if (lo < sw->start || hi > sw->start + sw->length) {
+            ssize_t want = source->size - lo < BSPATCH_WINDOW ?
+                           source->size - lo : BSPATCH_WINDOW;
+            ssize_t got = 0;
+
+            while (got < want) {
+                ssize_t r = TEMP_FAILURE_RETRY(pread64(source->fd, sw->window + got,
+                                                       want - got, source->offset + lo + got));
+                if (r <= 0) {
+                    printf("failed to read old data at %lld: %s\n",
+                           (long long)(lo + got), r < 0 ? strerror(errno) : "end of file");
+                    return -1;
+                }
+                got += r;
+            }
+            sw->start = lo;
+            sw->length = want;
+        }
+        old = sw->window + (lo - sw->start);
     }
-    if (ctx) SHA_update(ctx, new_data, new_size);
-    free(new_data);
 
+    buf += lo - oldpos;
+    for (i = 0; i < hi - lo; ++i) {
+        buf[i] += old[i];
+    }
     return 0;
 }
 
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        unsigned char** new_data, ssize_t* new_size) {
+static int FlushOutput(unsigned char* data, ssize_t len, SinkFn sink, void* token,
+                       SHA_CTX* ctx) {
+    if (len == 0) {
+        return 0;
+    }
+    if (sink(data, len, token) < len) {
+        printf("short write of output: %d (%s)\n", errno, strerror(errno));
+        return -1;
+    }
+    if (ctx) SHA_update(ctx, data, len);
+    return 0;
+}
+
+static int ReadHeader(const Value* patch, ssize_t patch_offset,
+                      ssize_t* ctrl_len, ssize_t* data_len, ssize_t* new_size) {
     // Patch data format:
     //   0       8       "BSDIFF40"
     //   8       8       X
@@ -137,68 +237,65 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
     unsigned char* header = (unsigned char*) patch->data + patch_offset;
     if (memcmp(header, "BSDIFF40", 8) != 0) {
         printf("corrupt bsdiff patch file header (magic number)\n");
-        return 1;
+        return -1;
     }
 
-    ssize_t ctrl_len, data_len;
-    ctrl_len = offtin(header+8);
-    data_len = offtin(header+16);
+    *ctrl_len = offtin(header+8);
+    *data_len = offtin(header+16);
     *new_size = offtin(header+24);
 
-    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
+    if (*ctrl_len < 0 || *data_len < 0 || *new_size < 0) {
         printf("corrupt patch file header (data lengths)\n");
-        return 1;
-    }
-
-    int bzerr;
-
-    bz_stream cstream;
-    cstream.next_in = patch->data + patch_offset + 32;
-    cstream.avail_in = ctrl_len;
-    cstream.bzalloc = NULL;
-    cstream.bzfree = NULL;
-    cstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&cstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit control stream (%d)\n", bzerr);
+        return -1;
     }
+    return 0;
+}
 
-    bz_stream dstream;
-    dstream.next_in = patch->data + patch_offset + 32 + ctrl_len;
-    dstream.avail_in = data_len;
-    dstream.bzalloc = NULL;
-    dstream.bzfree = NULL;
-    dstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&dstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit diff stream (%d)\n", bzerr);
+int ApplyBSDiffPatchSource(const PatchSource* source,
+                           const Value* patch, ssize_t patch_offset,
+                           SinkFn sink, void* token, SHA_CTX* ctx,
+                           size_t* peak_memory) {
+    ssize_t ctrl_len, data_len, new_size;
+    bz_stream cstream, dstream, estream;
+    int streams = 0;
+    int result = 1;
+    MemoryUse use = { 0, 0 };
+    SourceWindow sw = { source, NULL, 0, 0 };
+    unsigned char* out = NULL;
+    ssize_t out_len = 0;
+
+    if (ReadHeader(patch, patch_offset, &ctrl_len, &data_len, &new_size) != 0) {
+        return 1;
     }
 
-    bz_stream estream;
-    estream.next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
-    estream.avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
-    estream.bzalloc = NULL;
-    estream.bzfree = NULL;
-    estream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&estream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit extra stream (%d)\n", bzerr);
+    char* p = patch->data + patch_offset + 32;
+    if (InitStream(&cstream, p, ctrl_len, &use, "control") != 0) goto done;
+    ++streams;
+    if (InitStream(&dstream, p + ctrl_len, data_len, &use, "diff") != 0) goto done;
+    ++streams;
+    if (InitStream(&estream, p + ctrl_len + data_len,
+                   patch->size - (patch_offset + 32 + ctrl_len + data_len),
+                   &use, "extra") != 0) goto done;
+    ++streams;
+
+    out = malloc(BSPATCH_WINDOW);
+    if (source->data == NULL) {
+        sw.window = malloc(BSPATCH_WINDOW);
     }
-
-    *new_data = malloc(*new_size);
-    if (*new_data == NULL) {
-        printf("failed to allocate %ld bytes of memory for output file\n",
-               (long)*new_size);
-        return 1;
+    if (out == NULL || (source->data == NULL && sw.window == NULL)) {
+        printf("failed to allocate patch windows\n");
+        goto done;
     }
+    UseMemory(&use, source->data == NULL ? 2 * BSPATCH_WINDOW : BSPATCH_WINDOW);
 
-    off_t oldpos = 0, newpos = 0;
+    off64_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
-    int i;
     unsigned char buf[24];
-    while (newpos < *new_size) {
+    while (newpos < new_size) {
         // Read control data
         if (FillBuffer(buf, 24, &cstream) != 0) {
             printf("error while reading control stream\n");
-            return 1;
+            goto done;
         }
         ctrl[0] = offtin(buf);
         ctrl[1] = offtin(buf+8);
@@ -206,51 +303,126 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
 
         if (ctrl[0] < 0 || ctrl[1] < 0) {
             printf("corrupt patch (negative byte counts)\n");
-            return 1;
+            goto done;
         }
 
         // Sanity check
-        if (newpos + ctrl[0] > *new_size) {
+        if (newpos + ctrl[0] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
-        }
-
-        // Read diff string
-        if (FillBuffer(*new_data + newpos, ctrl[0], &dstream) != 0) {
-            printf("error while reading diff stream\n");
-            return 1;
+            goto done;
         }
 
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
+        // Read diff string and add old data to it, a window at a time
+        off_t left = ctrl[0];
+        while (left > 0) {
+            ssize_t n = BSPATCH_WINDOW - out_len < left ? BSPATCH_WINDOW - out_len : left;
+            if (FillBuffer(out + out_len, n, &dstream) != 0) {
+                printf("error while reading diff stream\n");
+                goto done;
+            }
+            if (AddOldData(&sw, out + out_len, oldpos, n) != 0) {
+                goto done;
+            }
+            out_len += n;
+            oldpos += n;
+            newpos += n;
+            left -= n;
+            if (out_len == BSPATCH_WINDOW) {
+                if (FlushOutput(out, out_len, sink, token, ctx) != 0) goto done;
+                out_len = 0;
             }
         }
 
-        // Adjust pointers
-        newpos += ctrl[0];
-        oldpos += ctrl[0];
-
         // Sanity check
-        if (newpos + ctrl[1] > *new_size) {
+        if (newpos + ctrl[1] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
+            goto done;
         }
 
         // Read extra string
-        if (FillBuffer(*new_data + newpos, ctrl[1], &estream) != 0) {
-            printf("error while reading extra stream\n");
-            return 1;
+        left = ctrl[1];
+        while (left > 0) {
+            ssize_t n = BSPATCH_WINDOW - out_len < left ? BSPATCH_WINDOW - out_len : left;
+            if (FillBuffer(out + out_len, n, &estream) != 0) {
+                printf("error while reading extra stream\n");
+                goto done;
+            }
+            out_len += n;
+            newpos += n;
+            left -= n;
+            if (out_len == BSPATCH_WINDOW) {
+                if (FlushOutput(out, out_len, sink, token, ctx) != 0) goto done;
+                out_len = 0;
+            }
         }
 
         // Adjust pointers
-        newpos += ctrl[1];
         oldpos += ctrl[2];
     }
 
-    BZ2_bzDecompressEnd(&cstream);
-    BZ2_bzDecompressEnd(&dstream);
-    BZ2_bzDecompressEnd(&estream);
+    if (FlushOutput(out, out_len, sink, token, ctx) != 0) goto done;
+    result = 0;
+
+done:
+    if (peak_memory) *peak_memory = use.peak;
+    if (streams > 2) BZ2_bzDecompressEnd(&estream);
+    if (streams > 1) BZ2_bzDecompressEnd(&dstream);
+    if (streams > 0) BZ2_bzDecompressEnd(&cstream);
+    free(out);
+    free(sw.window);
+    return result;
+}
+
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, SHA_CTX* ctx) {
+    PatchSource source = { old_data, -1, 0, old_size };
+
+    return ApplyBSDiffPatchSource(&source, patch, patch_offset, sink, token, ctx, NULL);
+}
+
+typedef struct {
+    unsigned char* data;
+    ssize_t size;
+    ssize_t pos;
+} BufferSinkInfo;
+
+static ssize_t BufferSink(const unsigned char* data, ssize_t len, void* token) {
+    BufferSinkInfo* bsi = (BufferSinkInfo*)token;
+    if (bsi->size - bsi->pos < len) {
+        return -1;
+    }
+    memcpy(bsi->data + bsi->pos, data, len);
+    bsi->pos += len;
+    return len;
+}
+
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        unsigned char** new_data, ssize_t* new_size) {
+    PatchSource source = { old_data, -1, 0, old_size };
+    BufferSinkInfo bsi;
+    ssize_t ctrl_len, data_len;
+
+    if (ReadHeader(patch, patch_offset, &ctrl_len, &data_len, new_size) != 0) {
+        return 1;
+    }
+
+    *new_data = malloc(*new_size);
+    if (*new_data == NULL) {
+        printf("failed to allocate %ld bytes of memory for output file\n",
+               (long)*new_size);
+        return 1;
+    }
+
+    bsi.data = *new_data;
+    bsi.size = *new_size;
+    bsi.pos = 0;
+    if (ApplyBSDiffPatchSource(&source, patch, patch_offset, BufferSink, &bsi,
+                               NULL, NULL) != 0) {
+        free(*new_data);
+        *new_data = NULL;
+        return 1;
+    }
     return 0;
 }
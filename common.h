@@ -83,6 +83,8 @@ void ui_set_background(int icon);
 //   seconds - expected time interval (progress bar moves at this minimum rate)
 void ui_show_progress(float portion, int seconds);
 void ui_set_progress(float fraction);  // 0.0 - 1.0 within the defined scope
+// One line of text under the progress bar (throughput, time left), NULL clears it.
+void ui_set_progress_text(const char* text);
 
 // Default allocation of progress bar segments to operations
 static const int VERIFICATION_PROGRESS_TIME = 60;
@@ -163,5 +165,8 @@ FILE* fopen_path(const char *path, const char *mode);
 int ui_get_selected_item();
 int ui_is_showing_back_button();
 int install_zip(const char* packagefilepath);
+// Installs the packages in order, stopping at the first that fails, and
+// sums up what didn't install.
+int install_zips(const char* const* packagefilepaths, int count);
 
 #endif  // RECOVERY_COMMON_H
@@ -53,6 +53,8 @@
 
 #include "extendedcommands.h"
 #include "nandroid.h"
+#include "nandroid_dedup.h"
+#include "nandroid_journal.h"
 #include "mtdutils/mounts.h"
 #include "flashutils/flashutils.h"
 #include "edify/expr.h"
@@ -701,12 +703,15 @@ void show_multi_flash_menu() {
             sprintf(confirm, "Yes - Install from %s", basename(zip_folder));
             if (confirm_selection("Install selected files?", confirm))
             {
+                const char** selected = (const char**) malloc(numFiles * sizeof(char*));
+                int num_selected = 0;
                 for(i=2; i < numFiles+2; i++) {
-                    if (strncmp(list[i], "(x)", 3) == 0) {
-                        if (install_zip(files[i-2]) != 0)
-                            break;
-                    }
+                    if (strncmp(list[i], "(x)", 3) == 0)
+                        selected[num_selected++] = files[i-2];
                 }
+                if (num_selected > 0)
+                    install_zips(selected, num_selected);
+                free(selected);
             }
         }
         free_string_array(list);
@@ -754,6 +759,14 @@ static void show_nandroid_delete_menu(const char* path) {
         ui_print("-- Deleting %s\n", basename(file));
         sprintf(tmp, "rm -rf %s", file);
         __system(tmp);
+
+        // drop the chunks only the deleted backup was using
+        struct stat st;
+        sprintf(tmp, "%s/clockworkmod/backup/%s", path, DEDUP_STORE_DIR);
+        if (stat(tmp, &st) == 0) {
+            ui_print("Freeing unused backup chunks...\n");
+            dedup_collect_garbage(tmp);
+        }
         ui_print("Backup deleted!\n");
     }
 
@@ -1648,13 +1661,31 @@ static void choose_default_backup_format() {
     char **list;
     char* list_tar_default[] = { "tar (default)",
                                  "tar + gzip",
+                                 "tar + parallel gzip",
+                                 "incremental (dedup)",
                                  NULL };
     char* list_tgz_default[] = { "tar",
                                  "tar + gzip (default)",
+                                 "tar + parallel gzip",
+                                 "incremental (dedup)",
+                                 NULL };
+    char* list_pgz_default[] = { "tar",
+                                 "tar + gzip",
+                                 "tar + parallel gzip (default)",
+                                 "incremental (dedup)",
+                                 NULL };
+    char* list_dup_default[] = { "tar",
+                                 "tar + gzip",
+                                 "tar + parallel gzip",
+                                 "incremental (dedup) (default)",
                                  NULL };
 
     if (fmt == NANDROID_BACKUP_FORMAT_TGZ) {
         list = list_tgz_default;
+    } else if (fmt == NANDROID_BACKUP_FORMAT_PGZ) {
+        list = list_pgz_default;
+    } else if (fmt == NANDROID_BACKUP_FORMAT_DUP) {
+        list = list_dup_default;
     } else {
         list = list_tar_default;
     }
@@ -1671,6 +1702,73 @@ static void choose_default_backup_format() {
             write_string_to_file(path, "tgz");
             ui_print("Default backup format set to tar + gzip.\n");
             break;
+        case 2:
+            write_string_to_file(path, "pgz");
+            ui_print("Default backup format set to tar + parallel gzip.\n");
+            break;
+        case 3:
+            write_string_to_file(path, "dup");
+            ui_print("Default backup format set to incremental (dedup).\n");
+            break;
+    }
+}
+
+#define MAX_RESUMABLE_BACKUPS 32
+
+// Lists the backups of every storage with an interrupted backup or
+// restore, and resumes the chosen one from its journal.
+static void show_nandroid_resume_menu() {
+    char* storages[] = { get_primary_storage_path(), get_extra_storage_path(), get_usb_storage_path() };
+    const char* headers[] = { "Choose an operation to resume", NULL };
+    char* list[MAX_RESUMABLE_BACKUPS + 1];
+    char* paths[MAX_RESUMABLE_BACKUPS];
+    int operations[MAX_RESUMABLE_BACKUPS];
+    char tmp[PATH_MAX];
+    int count = 0;
+    int i, j;
+
+    for (i = 0; i < 3; i++) {
+        int num_dirs = 0;
+        if (storages[i] == NULL || ensure_path_mounted(storages[i]) != 0)
+            continue;
+        sprintf(tmp, "%s/clockworkmod/backup/", storages[i]);
+        char** dirs = gather_files(tmp, NULL, &num_dirs);
+        for (j = 0; j < num_dirs && count < MAX_RESUMABLE_BACKUPS; j++) {
+            char arg[16];
+            // drop the trailing slash
+            dirs[j][strlen(dirs[j]) - 1] = '\0';
+            int operation = nandroid_journal_probe(dirs[j], arg);
+            if (operation == 0)
+                continue;
+            sprintf(tmp, "%s %s", operation == JOURNAL_BACKUP ? "Resume backup" : "Resume restore of",
+                    basename(dirs[j]));
+            list[count] = strdup(tmp);
+            paths[count] = strdup(dirs[j]);
+            operations[count] = operation;
+            count++;
+        }
+        free_string_array(dirs);
+    }
+    list[count] = NULL;
+
+    if (count == 0) {
+        ui_print("No interrupted backup or restore found.\n");
+        return;
+    }
+
+    int chosen_item = get_menu_selection(headers, list, 0, 0);
+    if (chosen_item >= 0 && chosen_item < count) {
+        if (operations[chosen_item] == JOURNAL_BACKUP) {
+            if (confirm_selection("Resume backup?", "Yes - Resume backup"))
+                nandroid_resume_backup(paths[chosen_item]);
+        } else if (confirm_selection("Resume restore?", "Yes - Resume restore")) {
+            nandroid_resume_restore(paths[chosen_item]);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        free(list[i]);
+        free(paths[i]);
     }
 }
 
@@ -1750,6 +1848,7 @@ void show_nandroid_menu() {
 					"ADVANCED Backup Restore",
 					"Default backup format",
 					"Toggle MD5 Verification",
+					"RESUME interrupted Backup/Restore",
 					NULL,
 					NULL,
 					NULL,
@@ -1761,18 +1860,18 @@ void show_nandroid_menu() {
 
     if (num_extra_volumes != 0) {
 	    if (extra_path != NULL) {
-			list[6] = "BACKUP to ExtraSD";
-			list[7] = "RESTORE from ExtraSD";
-			list[8] = "DELETE Backup from ExtraSD";
+			list[7] = "BACKUP to ExtraSD";
+			list[8] = "RESTORE from ExtraSD";
+			list[9] = "DELETE Backup from ExtraSD";
 		}
 	}
 	if (usb_path != NULL && ensure_path_mounted(usb_path) == 0) {
-		list[9] = "BACKUP to USB-Drive";
-		list[10] = "RESTORE from USB-Drive";
-		list[11] = "DELETE Backup from USB-Drive";
+		list[10] = "BACKUP to USB-Drive";
+		list[11] = "RESTORE from USB-Drive";
+		list[12] = "DELETE Backup from USB-Drive";
 	}
 #ifdef RECOVERY_EXTEND_NANDROID_MENU
-    extend_nandroid_menu(list, 12, sizeof(list) / sizeof(char*));
+    extend_nandroid_menu(list, 13, sizeof(list) / sizeof(char*));
 #endif
 
     for (;;) {
@@ -1814,6 +1913,9 @@ void show_nandroid_menu() {
                 toggle_md5_check();
                 break;           
             case 6:
+                show_nandroid_resume_menu();
+                break;
+            case 7:
                 {
                     char backup_path[PATH_MAX];
                     time_t t = time(NULL);
@@ -1830,13 +1932,13 @@ void show_nandroid_menu() {
                     nandroid_backup(backup_path);
                 }
                 break;
-            case 7:
+            case 8:
 				show_nandroid_restore_menu(extra_path);
                 break;
-            case 8:
+            case 9:
 				show_nandroid_delete_menu(extra_path);
                 break;           
-            case 9:
+            case 10:
                 {
                     char backup_path[PATH_MAX];
                     time_t t = time(NULL);
@@ -1853,16 +1955,16 @@ void show_nandroid_menu() {
                     nandroid_backup(backup_path);
                 }
                 break;
-            case 10:
+            case 11:
 				show_nandroid_restore_menu(usb_path);
                 break;
-            case 11:
+            case 12:
 				show_nandroid_delete_menu(usb_path);
                 break;   
                     
             default:
 #ifdef RECOVERY_EXTEND_NANDROID_MENU
-                handle_nandroid_menu(12, chosen_item);
+                handle_nandroid_menu(13, chosen_item);
 #endif
                 break;
         }
@@ -19,6 +19,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -34,6 +35,7 @@
 #include "mtdutils/mtdutils.h"
 #include "roots.h"
 #include "verifier.h"
+#include "verifier_cache.h"
 #include "recovery_ui.h"
 
 #include "cutils/properties.h"
@@ -88,9 +90,12 @@ static int unset_legacy_props() {
     return 0;
 }
 
-// If the package contains an update binary, extract it and run it.
+static const char* const binary = "/tmp/update_binary";
+
+// If the package contains an update binary, extract it and check what
+// property environment it needs. Closes zip.
 static int
-try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache) {
+prepare_update_binary(ZipArchive *zip, bool* legacy) {
 
     const ZipEntry* binary_entry =
             mzFindZipEntry(zip, ASSUMED_UPDATE_BINARY_NAME);
@@ -99,7 +104,6 @@ try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache) {
         return INSTALL_CORRUPT;
     }
 
-    const char* binary = "/tmp/update_binary";
     unlink(binary);
     int fd = creat(binary, 0755);
     if (fd < 0) {
@@ -162,8 +166,16 @@ try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache) {
     }
     fclose(updaterfile);
 
+    *legacy = foundsetperm && !foundsetmeta;
+    return INSTALL_SUCCESS;
+}
+
+// Runs the update binary prepare_update_binary() extracted.
+static int
+run_update_binary(const char *path, bool legacy, int* wipe_cache) {
+
     /* Set legacy properties */
-    if (foundsetperm && !foundsetmeta) {
+    if (legacy) {
         ui_print("Using legacy property environment for update-binary...\n");
         ui_print("Please upgrade to latest binary...\n");
         if (set_legacy_props() != 0) {
@@ -290,18 +302,24 @@ try_update_binary(const char *path, ZipArchive *zip, int* wipe_cache) {
     return INSTALL_SUCCESS;
 }
 
-static int
-really_install_package(const char *path, int* wipe_cache, bool needs_mount)
-{
-	int ret = 0;
-	
-    ui_set_background(BACKGROUND_ICON_INSTALLING);
-    ui_print("Finding update package...\n");
-    ui_show_indeterminate_progress();
-    
-    // Resolve symlink in case legacy /sdcard path is used
-    // Requires: symlink uses absolute path
-    char new_path[PATH_MAX];
+typedef struct {
+    MemMapping* map;
+    Certificate* keys;
+    int num_keys;
+    bool show_progress;
+    int result;
+} VerifyJob;
+
+static void* verify_thread(void* cookie) {
+    VerifyJob* job = (VerifyJob*)cookie;
+    job->result = verify_mapped_file(job->map, job->keys, job->num_keys, job->show_progress);
+    return NULL;
+}
+
+// Resolve symlink in case legacy /sdcard path is used
+// Requires: symlink uses absolute path
+static const char*
+resolve_package_path(const char *path, char* new_path) {
     if (strlen(path) > 1) {
         char *rest = strchr(path + 1, '/');
         if (rest != NULL) {
@@ -318,6 +336,62 @@ really_install_package(const char *path, int* wipe_cache, bool needs_mount)
             free(root);
         }
     }
+    return path;
+}
+
+// Everything after the package was opened and, if it had to be, verified:
+// deal with the signature check result and run the update binary.
+// verify is NULL if the package wasn't verified.
+static int
+install_opened_package(const char *path, MemMapping* map, int err, int prepared,
+                       bool legacy, const VerifyJob* verify, int* wipe_cache)
+{
+    int ret;
+
+    if (verify != NULL) {
+        LOGI("verify_file returned %d\n", verify->result);
+        if (verify->result == VERIFY_SUCCESS) {
+            verifier_cache_store(path, map, PUBLIC_KEYS_FILE);
+        } else {
+            LOGE("signature verification failed\n");
+            ui_show_text(1);
+            if (!confirm_selection("Install Untrusted Package?", "Yes - Install untrusted zip")) {
+                ret = INSTALL_CORRUPT;
+                goto out;
+            }
+        }
+    }
+
+    if (err != 0) {
+        LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
+        ret = INSTALL_CORRUPT;
+        goto out;
+    }
+    if (prepared != INSTALL_SUCCESS) {
+        ret = prepared;
+        goto out;
+    }
+
+    /* Verify and install the contents of the package.
+     */
+    ui_print("Installing update...\n");
+    ret = run_update_binary(path, legacy, wipe_cache);
+
+out:
+    if (ret != INSTALL_SUCCESS)
+        unlink(binary);
+    return ret;
+}
+
+static int
+really_install_package(const char *path, int* wipe_cache, bool needs_mount)
+{
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_print("Finding update package...\n");
+    ui_show_indeterminate_progress();
+    
+    char new_path[PATH_MAX];
+    path = resolve_package_path(path, new_path);
 
     LOGI("Update location: %s\n", path);
 
@@ -337,13 +411,22 @@ really_install_package(const char *path, int* wipe_cache, bool needs_mount)
 
     ui_print("Opening update package...\n");
 
-    int err;
+    VerifyJob verify;
+    pthread_t verify_thread_id;
+    bool verify_threaded = false;
+    bool verify_full = signature_check_enabled;
 
-    if (signature_check_enabled) {
+    if (signature_check_enabled && verifier_cache_lookup(path, &map, PUBLIC_KEYS_FILE)) {
+        ui_print("Package verified before and unchanged.\n");
+        verify_full = false;
+    }
+
+    if (verify_full) {
         int numKeys;
         Certificate* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
         if (loadedKeys == NULL) {
             LOGE("Failed to load keys\n");
+            sysReleaseMap(&map);
             return INSTALL_CORRUPT;
         }
         LOGI("%d key(s) loaded from %s\n", numKeys, PUBLIC_KEYS_FILE);
@@ -356,46 +439,220 @@ really_install_package(const char *path, int* wipe_cache, bool needs_mount)
                 VERIFICATION_PROGRESS_FRACTION,
                 VERIFICATION_PROGRESS_TIME);
 
-        err = verify_file(map.addr, map.length, loadedKeys, numKeys);
-        free(loadedKeys);
-        LOGI("verify_file returned %d\n", err);
-        if (err != VERIFY_SUCCESS) {
-            LOGE("signature verification failed\n");
-            sysReleaseMap(&map);
-            ui_show_text(1);
-            if (!confirm_selection("Install Untrusted Package?", "Yes - Install untrusted zip"))
-                ret = INSTALL_CORRUPT;
-                goto out;
-        }
+        verify.map = &map;
+        verify.keys = loadedKeys;
+        verify.num_keys = numKeys;
+        verify.show_progress = true;
+        if (pthread_create(&verify_thread_id, NULL, verify_thread, &verify) == 0)
+            verify_threaded = true;
+        else
+            verify_thread(&verify);
     }
 
-    /* Try to open the package.
+    /* While the signature is being checked, open the package and get
+     * the update binary ready. Nothing runs until verification passed.
      */
     ZipArchive zip;
-    err = mzOpenZipArchive(map.addr, map.length, &zip);
-    if (err != 0) {
-        LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
-        sysReleaseMap(&map);
-        ret = INSTALL_CORRUPT;
-        goto out;
+    bool legacy = false;
+    int prepared = INSTALL_CORRUPT;
+    int err = mzOpenZipArchive(map.addr, map.length, &zip);
+    if (err == 0) {
+        mzSetZipArchiveMapping(&zip, &map);
+        prepared = prepare_update_binary(&zip, &legacy);
     }
 
-    /* Verify and install the contents of the package.
-     */
-    ui_print("Installing update...\n");
-    int result = try_update_binary(path, &zip, wipe_cache);
+    if (verify_full) {
+        if (verify_threaded)
+            pthread_join(verify_thread_id, NULL);
+        free(verify.keys);
+    }
+
+    int ret = install_opened_package(path, &map, err, prepared, legacy,
+                                     verify_full ? &verify : NULL, wipe_cache);
 
     sysReleaseMap(&map);
+    set_perf_mode(0);
+    ui_set_background(BACKGROUND_ICON_NONE);
+    return ret;
+}
 
-out:
+/* A package of an install queue: mapped, signature-checked and opened
+ * on a thread of its own while the packages before it install.
+ */
+typedef struct {
+    char path[PATH_MAX];        // where the package is, symlinks resolved
+    bool started;
+    bool threaded;
+    pthread_t thread;
+    bool mapped;
+    MemMapping map;
+    bool verify_full;           // not verified before and unchanged
+    VerifyJob verify;
+    int err;                    // mzOpenZipArchive() result
+    ZipArchive zip;
+} QueuedPackage;
+
+struct InstallQueue {
+    int count;
+    int depth;
+    QueuedPackage* packages;
+    const char** kept_paths;    // volumes that stay mounted meanwhile
+    Certificate* keys;
+    int num_keys;
+};
+
+static void* prepare_queued_thread(void* cookie) {
+    QueuedPackage* pkg = (QueuedPackage*)cookie;
+
+    pkg->err = mzOpenZipArchive(pkg->map.addr, pkg->map.length, &pkg->zip);
+    if (pkg->err == 0)
+        mzSetZipArchiveMapping(&pkg->zip, &pkg->map);
+    if (pkg->verify_full)
+        verify_thread(&pkg->verify);
+    return NULL;
+}
+
+// Maps the package and starts checking it in the background. Mounting
+// and the verified-package cache are only touched from here, on the
+// thread that runs the installs.
+static void start_queued_package(InstallQueue* q, int index, bool installing) {
+    QueuedPackage* pkg = &q->packages[index];
+
+    if (pkg->started)
+        return;
+    pkg->started = true;
+
+    ensure_path_mounted(pkg->path[0] == '@' ? pkg->path + 1 : pkg->path);
+    if (sysMapFile(pkg->path, &pkg->map) != 0)
+        return;
+    pkg->mapped = true;
+
+    pkg->verify_full = signature_check_enabled && q->keys != NULL &&
+            !verifier_cache_lookup(pkg->path, &pkg->map, PUBLIC_KEYS_FILE);
+    pkg->verify.map = &pkg->map;
+    pkg->verify.keys = q->keys;
+    pkg->verify.num_keys = q->num_keys;
+    // the progress bar belongs to the package being installed
+    pkg->verify.show_progress = installing;
+    pkg->verify.result = VERIFY_FAILURE;
+
+    if (pthread_create(&pkg->thread, NULL, prepare_queued_thread, pkg) == 0)
+        pkg->threaded = true;
+    else
+        prepare_queued_thread(pkg);
+}
+
+static void finish_queued_package(QueuedPackage* pkg) {
+    if (pkg->threaded) {
+        pthread_join(pkg->thread, NULL);
+        pkg->threaded = false;
+    }
+}
+
+static void release_queued_package(QueuedPackage* pkg) {
+    finish_queued_package(pkg);
+    if (pkg->mapped) {
+        if (pkg->err == 0)      // opened, but never installed
+            mzCloseZipArchive(&pkg->zip);
+        sysReleaseMap(&pkg->map);
+        pkg->mapped = false;
+    }
+}
+
+InstallQueue* install_queue_create(const char* const* paths, int count) {
+    InstallQueue* q = (InstallQueue*)calloc(1, sizeof(InstallQueue));
+    if (q == NULL)
+        return NULL;
+    q->packages = (QueuedPackage*)calloc(count, sizeof(QueuedPackage));
+    q->kept_paths = (const char**)calloc(count, sizeof(const char*));
+    if (q->packages == NULL || q->kept_paths == NULL) {
+        free(q->packages);
+        free(q->kept_paths);
+        free(q);
+        return NULL;
+    }
+    q->count = count;
+
+    char value[PROPERTY_VALUE_MAX];
+    property_get(INSTALL_QUEUE_DEPTH_PROPERTY, value, "2");
+    q->depth = atoi(value);
+    if (q->depth < 0)
+        q->depth = 0;
+    if (q->depth > INSTALL_QUEUE_MAX_DEPTH)
+        q->depth = INSTALL_QUEUE_MAX_DEPTH;
+
+    int i;
+    for (i = 0; i < count; i++) {
+        QueuedPackage* pkg = &q->packages[i];
+        const char* path = resolve_package_path(paths[i], pkg->path);
+        if (path != pkg->path)
+            strncpy(pkg->path, path, PATH_MAX - 1);
+        q->kept_paths[i] = pkg->path[0] == '@' ? pkg->path + 1 : pkg->path;
+    }
+    keep_mounted_for_install(q->kept_paths, count);
+
+    if (signature_check_enabled) {
+        q->keys = load_keys(PUBLIC_KEYS_FILE, &q->num_keys);
+        if (q->keys != NULL)
+            LOGI("%d key(s) loaded from %s\n", q->num_keys, PUBLIC_KEYS_FILE);
+    }
+    return q;
+}
+
+static int
+really_install_queued_package(InstallQueue* q, int index, int* wipe_cache)
+{
+    QueuedPackage* pkg = &q->packages[index];
+
+    ui_set_background(BACKGROUND_ICON_INSTALLING);
+    ui_print("Finding update package...\n");
+    ui_show_indeterminate_progress();
+    LOGI("Update location: %s\n", pkg->path);
+
+    if (signature_check_enabled && q->keys == NULL) {
+        LOGE("Failed to load keys\n");
+        return INSTALL_CORRUPT;
+    }
+    if (!pkg->mapped) {
+        LOGE("failed to map file\n");
+        return INSTALL_CORRUPT;
+    }
+
+    ui_print("Opening update package...\n");
+    if (signature_check_enabled && !pkg->verify_full)
+        ui_print("Package verified before and unchanged.\n");
+
+    set_perf_mode(1);
+    if (pkg->verify_full) {
+        ui_print("Verifying update package...\n");
+        if (pkg->verify.show_progress) {
+            ui_show_progress(
+                    VERIFICATION_PROGRESS_FRACTION,
+                    VERIFICATION_PROGRESS_TIME);
+        }
+    }
+    finish_queued_package(pkg);
+
+    bool legacy = false;
+    int prepared = INSTALL_CORRUPT;
+    int err = pkg->err;
+    if (err == 0) {
+        prepared = prepare_update_binary(&pkg->zip, &legacy);
+        pkg->err = -1;      // prepare_update_binary() closed it
+    }
+
+    int ret = install_opened_package(pkg->path, &pkg->map, err, prepared, legacy,
+                                     pkg->verify_full ? &pkg->verify : NULL, wipe_cache);
+
+    release_queued_package(pkg);
     set_perf_mode(0);
     ui_set_background(BACKGROUND_ICON_NONE);
     return ret;
 }
 
-int
-install_package(const char* path, int* wipe_cache, const char* install_file,
-                bool needs_mount)
+static int
+install_logged(const char* path, int* wipe_cache, const char* install_file,
+               bool needs_mount, InstallQueue* q, int index)
 {
     FILE* install_log = fopen_path(install_file, "w");
     if (install_log) {
@@ -408,6 +665,8 @@ install_package(const char* path, int* wipe_cache, const char* install_file,
     if (setup_install_mounts() != 0) {
         LOGE("failed to set up expected mounts for install; aborting\n");
         result = INSTALL_ERROR;
+    } else if (q != NULL) {
+        result = really_install_queued_package(q, index, wipe_cache);
     } else {
         result = really_install_package(path, wipe_cache, needs_mount);
     }
@@ -426,6 +685,41 @@ install_package(const char* path, int* wipe_cache, const char* install_file,
     return result;
 }
 
+int
+install_package(const char* path, int* wipe_cache, const char* install_file,
+                bool needs_mount)
+{
+    return install_logged(path, wipe_cache, install_file, needs_mount, NULL, 0);
+}
+
+int
+install_queue_install(InstallQueue* q, int index, int* wipe_cache,
+                      const char* install_file)
+{
+    int i;
+
+    // Get the next few packages going while this one installs.
+    for (i = index; i < q->count && i <= index + q->depth; i++)
+        start_queued_package(q, i, i == index);
+
+    return install_logged(q->packages[index].path, wipe_cache, install_file,
+                          true, q, index);
+}
+
+void install_queue_destroy(InstallQueue* q) {
+    int i;
+
+    if (q == NULL)
+        return;
+    for (i = 0; i < q->count; i++)
+        release_queued_package(&q->packages[i]);
+    keep_mounted_for_install(NULL, 0);
+    free(q->keys);
+    free(q->kept_paths);
+    free(q->packages);
+    free(q);
+}
+
 void
 set_perf_mode(bool enable) {
     property_set("recovery.perf.mode", enable ? "1" : "0");
@@ -30,6 +30,24 @@ int install_package(const char *root_path, int* wipe_cache,
                     
 void set_perf_mode(bool enable);
 
+// Installs a batch of packages one after another. While one package runs
+// its update binary, the next INSTALL_QUEUE_DEPTH_PROPERTY (default 2)
+// are mapped, signature-checked and opened in the background, so their
+// turn starts right away. The volumes holding them stay mounted until
+// the queue is destroyed.
+typedef struct InstallQueue InstallQueue;
+
+#define INSTALL_QUEUE_DEPTH_PROPERTY "ro.ctr.install_queue_depth"
+#define INSTALL_QUEUE_MAX_DEPTH 8
+
+InstallQueue* install_queue_create(const char* const* paths, int count);
+
+// Like install_package() for the package at index; install them in order.
+int install_queue_install(InstallQueue* q, int index, int* wipe_cache,
+                          const char* install_file);
+
+void install_queue_destroy(InstallQueue* q);
+
 #ifdef __cplusplus
 }
 #endif
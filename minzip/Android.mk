@@ -6,16 +6,26 @@ LOCAL_SRC_FILES := \
 	SysUtil.c \
 	DirUtil.c \
 	Inlines.c \
-	Zip.c
+	Zip.c \
+	Decoder.c
 
 LOCAL_C_INCLUDES := \
 	external/zlib \
 	external/safe-iop/include \
-	external/lzma/xz-embedded
+	external/lzma/xz-embedded \
+	external/lz4/lib
 
 LOCAL_STATIC_LIBRARIES := libselinux
 LOCAL_STATIC_LIBRARIES += libxz
 LOCAL_STATIC_LIBRARIES += libz
+LOCAL_STATIC_LIBRARIES += liblz4-static
+
+# zstd streams in packages; the recovery and updater link libzstd too.
+ifeq ($(TARGET_RECOVERY_USES_ZSTD),true)
+LOCAL_CFLAGS += -DHAVE_ZSTD
+LOCAL_C_INCLUDES += external/zstd/lib
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
 
 LOCAL_MODULE := libminzip
 
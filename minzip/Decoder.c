@@ -0,0 +1,334 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Built-in decompression backends for minzip: zlib inflate, xz-embedded,
+ * lz4 frames and, with HAVE_ZSTD, zstd.
+ */
+#include "zlib.h"
+#include "xz_config.h"
+#include "lz4frame.h"
+#ifdef HAVE_ZSTD
+#include "zstd.h"
+#endif
+
+#include <pthread.h>
+#include <string.h>
+
+#define LOG_TAG "minzip"
+#include "Zip.h"
+#include "Log.h"
+
+/* avail_in is only a uInt; feed zlib huge entries a piece at a time. */
+#define MAX_INFLATE_INPUT (1 << 30)
+
+static loff_t inflateDecode(const unsigned char *in, loff_t inLen,
+    unsigned char *buf, size_t batchLen,
+    ProcessZipEntryContentsFunction processFunction, void *cookie)
+{
+    loff_t total = 0;
+    loff_t inRemaining = inLen;
+    z_stream zstream;
+    int zerr;
+
+    /*
+     * Initialize the zlib stream.
+     */
+    memset(&zstream, 0, sizeof(zstream));
+    zstream.zalloc = Z_NULL;
+    zstream.zfree = Z_NULL;
+    zstream.opaque = Z_NULL;
+    zstream.next_in = (Bytef*) in;
+    zstream.avail_in = 0;
+    zstream.next_out = (Bytef*) buf;
+    zstream.avail_out = batchLen;
+    zstream.data_type = Z_UNKNOWN;
+
+    /*
+     * Use the undocumented "negative window bits" feature to tell zlib
+     * that there's no zlib header waiting for it.
+     */
+    zerr = inflateInit2(&zstream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+        if (zerr == Z_VERSION_ERROR) {
+            LOGE("Installed zlib is not compatible with linked version (%s)\n",
+                ZLIB_VERSION);
+        } else {
+            LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
+        }
+        return -1;
+    }
+
+    /*
+     * Loop while we have data.
+     */
+    do {
+        if (zstream.avail_in == 0 && inRemaining > 0) {
+            zstream.avail_in = inRemaining > MAX_INFLATE_INPUT ?
+                    MAX_INFLATE_INPUT : (uInt)inRemaining;
+            inRemaining -= zstream.avail_in;
+        }
+
+        /* uncompress the data */
+        zerr = inflate(&zstream, Z_NO_FLUSH);
+        if (zerr != Z_OK && zerr != Z_STREAM_END) {
+            LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
+            total = -1;
+            break;
+        }
+
+        /* write when we're full or when we're done */
+        if (zstream.avail_out == 0 ||
+            (zerr == Z_STREAM_END && zstream.avail_out != batchLen))
+        {
+            size_t procSize = zstream.next_out - buf;
+            LOGVV("+++ processing %d bytes\n", (int) procSize);
+            if (!processFunction(buf, procSize, cookie)) {
+                LOGW("Process function elected to fail (in inflate)\n");
+                total = -1;
+                break;
+            }
+            total += procSize;
+
+            zstream.next_out = (Bytef*) buf;
+            zstream.avail_out = batchLen;
+        }
+    } while (zerr == Z_OK);
+
+    inflateEnd(&zstream);        /* free up any allocated structures */
+
+    // total_out is only a uLong, so the total is counted here
+    return total;
+}
+
+static pthread_once_t xzTablesOnce = PTHREAD_ONCE_INIT;
+
+static void xzInitTables(void)
+{
+    xz_crc32_init();
+    xz_crc64_init();
+}
+
+static loff_t xzDecode(const unsigned char *in, loff_t inLen,
+    unsigned char *buf, size_t batchLen,
+    ProcessZipEntryContentsFunction processFunction, void *cookie)
+{
+    loff_t total = 0;
+    struct xz_buf b;
+    struct xz_dec *s;
+    enum xz_ret ret;
+
+    pthread_once(&xzTablesOnce, xzInitTables);
+    s = xz_dec_init(XZ_DYNALLOC, 1 << 26);
+    if (s == NULL) {
+        LOGE("XZ decompression alloc failed\n");
+        return -1;
+    }
+
+    b.in = in;
+    b.in_pos = 0;
+    b.in_size = inLen;
+    b.out = buf;
+    b.out_pos = 0;
+    b.out_size = batchLen;
+
+    do {
+        ret = xz_dec_run(s, &b);
+        LOGVV("+++ b.in_pos = %zu b.out_pos = %zu ret=%d\n", b.in_pos, b.out_pos, ret);
+        if (ret != XZ_OK && ret != XZ_STREAM_END) {
+            LOGE("xz_dec_run failed (ret=%d)\n", ret);
+            total = -1;
+            break;
+        }
+
+        if (b.out_pos == b.out_size || (ret == XZ_STREAM_END && b.out_pos > 0)) {
+            LOGVV("+++ processing %zu bytes\n", b.out_pos);
+            if (!processFunction(buf, b.out_pos, cookie)) {
+                LOGW("Process function elected to fail (in xz_dec)\n");
+                total = -1;
+                break;
+            }
+            total += b.out_pos;
+            b.out_pos = 0;
+        }
+    } while (ret == XZ_OK);
+
+    if (total != -1 && b.in_pos != b.in_size) {
+        LOGW("Size mismatch on file after xz_dec (%lld vs %zu)\n",
+                (long long)inLen, b.in_pos);
+    }
+    xz_dec_end(s);
+    return total;
+}
+
+#ifdef HAVE_ZSTD
+static loff_t zstdDecode(const unsigned char *in, loff_t inLen,
+    unsigned char *buf, size_t batchLen,
+    ProcessZipEntryContentsFunction processFunction, void *cookie)
+{
+    loff_t total = 0;
+    ZSTD_DStream *ds;
+    ZSTD_inBuffer input = { in, inLen, 0 };
+    ZSTD_outBuffer output = { buf, batchLen, 0 };
+
+    ds = ZSTD_createDStream();
+    if (ds == NULL || ZSTD_isError(ZSTD_initDStream(ds))) {
+        LOGE("zstd decompression alloc failed\n");
+        ZSTD_freeDStream(ds);
+        return -1;
+    }
+
+    /* Frames follow each other until the input runs out. */
+    while (true) {
+        size_t ret = ZSTD_decompressStream(ds, &output, &input);
+        if (ZSTD_isError(ret)) {
+            LOGE("zstd decompression failed (%s)\n", ZSTD_getErrorName(ret));
+            total = -1;
+            break;
+        }
+
+        bool full = output.pos == output.size;
+        bool end = ret == 0 && input.pos == input.size;
+        if ((full || end) && output.pos > 0) {
+            if (!processFunction(buf, output.pos, cookie)) {
+                LOGW("Process function elected to fail (in zstd)\n");
+                total = -1;
+                break;
+            }
+            total += output.pos;
+            output.pos = 0;
+        }
+        if (end)
+            break;
+        if (!full && input.pos == input.size) {
+            LOGE("zstd stream is truncated\n");
+            total = -1;
+            break;
+        }
+    }
+
+    ZSTD_freeDStream(ds);
+    return total;
+}
+#endif
+
+static loff_t lz4Decode(const unsigned char *in, loff_t inLen,
+    unsigned char *buf, size_t batchLen,
+    ProcessZipEntryContentsFunction processFunction, void *cookie)
+{
+    loff_t total = 0;
+    LZ4F_decompressionContext_t dctx;
+    size_t inPos = 0;
+    size_t used = 0;
+
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+        LOGE("lz4 decompression alloc failed\n");
+        return -1;
+    }
+
+    /* Frames follow each other until the input runs out. */
+    while (true) {
+        size_t outLen = batchLen - used;
+        size_t srcLen = (size_t)inLen - inPos;
+        size_t ret = LZ4F_decompress(dctx, buf + used, &outLen,
+                in + inPos, &srcLen, NULL);
+        if (LZ4F_isError(ret)) {
+            LOGE("lz4 decompression failed (%s)\n", LZ4F_getErrorName(ret));
+            total = -1;
+            break;
+        }
+        inPos += srcLen;
+        used += outLen;
+
+        bool end = ret == 0 && inPos == (size_t)inLen;
+        if ((used == batchLen || end) && used > 0) {
+            if (!processFunction(buf, used, cookie)) {
+                LOGW("Process function elected to fail (in lz4)\n");
+                total = -1;
+                break;
+            }
+            total += used;
+            used = 0;
+        }
+        if (end)
+            break;
+        if (outLen == 0 && inPos == (size_t)inLen) {
+            LOGE("lz4 stream is truncated\n");
+            total = -1;
+            break;
+        }
+    }
+
+    LZ4F_freeDecompressionContext(dctx);
+    return total;
+}
+
+static const MzDecoder builtinDecoders[MZ_CODEC_COUNT] = {
+    [MZ_CODEC_DEFLATE] = { "zlib", inflateDecode },
+    [MZ_CODEC_XZ]      = { "xz-embedded", xzDecode },
+#ifdef HAVE_ZSTD
+    [MZ_CODEC_ZSTD]    = { "zstd", zstdDecode },
+#endif
+    [MZ_CODEC_LZ4]     = { "lz4", lz4Decode },
+};
+
+static const MzDecoder* decoders[MZ_CODEC_COUNT];
+
+const MzDecoder* mzGetDecoder(int codec)
+{
+    if (codec < 0 || codec >= MZ_CODEC_COUNT)
+        return NULL;
+    if (decoders[codec] != NULL)
+        return decoders[codec];
+    return builtinDecoders[codec].decode != NULL ? &builtinDecoders[codec] : NULL;
+}
+
+void mzSetDecoder(int codec, const MzDecoder* decoder)
+{
+    if (codec >= 0 && codec < MZ_CODEC_COUNT)
+        decoders[codec] = decoder;
+}
+
+const char* mzCodecName(int codec)
+{
+    static const char* names[MZ_CODEC_COUNT] = { "deflate", "xz", "zstd", "lz4" };
+
+    if (codec < 0 || codec >= MZ_CODEC_COUNT)
+        return "unknown";
+    return names[codec];
+}
+
+int mzCodecForFileName(const char* fileName, unsigned int fileNameLen)
+{
+    static const struct {
+        const char* suffix;
+        int codec;
+    } suffixes[] = {
+        { ".xz", MZ_CODEC_XZ },
+        { ".zst", MZ_CODEC_ZSTD },
+        { ".lz4", MZ_CODEC_LZ4 },
+    };
+    unsigned int i;
+
+    for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        unsigned int len = strlen(suffixes[i].suffix);
+        if (fileNameLen >= len &&
+                memcmp(fileName + fileNameLen - len, suffixes[i].suffix, len) == 0) {
+            return suffixes[i].codec;
+        }
+    }
+    return -1;
+}
@@ -38,6 +38,13 @@ static int getFileStartAndLength(int fd, loff_t *start_, size_t *length_)
         return -1;
     }
 
+    // The whole package is mapped, so a 32-bit process (the updater is
+    // built 32-bit only) can't open one of 4GB or more.
+    if ((unsigned long long)(end - start) > SIZE_MAX) {
+        LOGE("file is too large to map (%lld bytes) in a %d-bit process\n",
+             (long long)(end - start), (int)sizeof(void*) * 8);
+        return -1;
+    }
     length = end - start;
     if (length == 0) {
         LOGE("file is empty\n");
@@ -91,52 +98,170 @@ static int sysMapFD(int fd, MemMapping* pMap)
     }
     pMap->ranges[0].addr = memPtr;
     pMap->ranges[0].length = length;
+    pMap->fd = fd;
+    pMap->offset = start;
 
     return 0;
 }
 
-static int sysMapBlockFile(FILE* mapf, MemMapping* pMap)
+/* Largest block map accepted; a fully fragmented 4GB package takes
+ * about 20MB.
+ */
+#define MAX_BLOCK_MAP_SIZE (64 * 1024 * 1024)
+
+/* Data read from the start of a block map once it is set up: the end of
+ * the package, with the signature and the central directory, is what
+ * the verifier and the zip parser look at first.
+ */
+#define BLOCK_MAP_INITIAL_PREFETCH (1024 * 1024)
+
+/*
+ * Read all of a block map file, NUL-terminated.
+ */
+static char* readBlockMapFile(const char* fn)
 {
-    char block_dev[PATH_MAX+1];
-    size_t size;
-    unsigned int blksize;
-    size_t blocks;
-    unsigned int range_count;
-    unsigned int i;
+    char* buf = NULL;
+    size_t size = 0, used = 0;
+    ssize_t n;
 
-    if (fgets(block_dev, sizeof(block_dev), mapf) == NULL) {
-        LOGW("failed to read block device from header\n");
-        return -1;
+    int fd = open(fn, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGV("Unable to open '%s': %s\n", fn, strerror(errno));
+        return NULL;
     }
-    for (i = 0; i < sizeof(block_dev); ++i) {
-        if (block_dev[i] == '\n') {
-            block_dev[i] = 0;
-            break;
+    do {
+        if (size - used < 4096) {
+            size = size == 0 ? 64 * 1024 : size * 2;
+            char* grown = size <= MAX_BLOCK_MAP_SIZE ? realloc(buf, size + 1) : NULL;
+            if (grown == NULL) {
+                LOGE("block map %s is too large\n", fn);
+                free(buf);
+                close(fd);
+                return NULL;
+            }
+            buf = grown;
         }
+        n = TEMP_FAILURE_RETRY(read(fd, buf + used, size - used));
+        if (n > 0)
+            used += n;
+    } while (n > 0);
+    close(fd);
+    if (n < 0) {
+        LOGW("failed to read block map %s: %s\n", fn, strerror(errno));
+        free(buf);
+        return NULL;
     }
+    buf[used] = '\0';
+    return buf;
+}
 
-    if (fscanf(mapf, "%zu %u\n%u\n", &size, &blksize, &range_count) != 3) {
-        LOGW("failed to parse block map header\n");
+static bool parseNumber(char** p, unsigned long long* value)
+{
+    char* end;
+
+    while (**p == ' ' || **p == '\t' || **p == '\r' || **p == '\n')
+        (*p)++;
+    if (**p < '0' || **p > '9')
+        return false;
+    errno = 0;
+    *value = strtoull(*p, &end, 10);
+    if (errno != 0)
+        return false;
+    *p = end;
+    return true;
+}
+
+static int sysMapBlockFile(const char* fn, MemMapping* pMap)
+{
+    char* map = readBlockMapFile(fn);
+    char* p;
+    char* block_dev;
+    unsigned long long size, blksize, range_count, start, end;
+    size_t blocks = 0;
+    MappedBlockRange* ranges = NULL;
+    unsigned char* reserve = MAP_FAILED;
+    int count = 0;
+    int fd = -1;
+    unsigned int i;
+
+    if (map == NULL)
         return -1;
+
+    block_dev = map;
+    p = strchr(map, '\n');
+    if (p == NULL || p - map > PATH_MAX) {
+        LOGW("failed to read block device from header\n");
+        goto fail;
     }
-    if (blksize != 0) {
-        blocks = ((size-1) / blksize) + 1;
+    *p++ = '\0';
+
+    if (!parseNumber(&p, &size) || !parseNumber(&p, &blksize) ||
+            !parseNumber(&p, &range_count)) {
+        LOGW("failed to parse block map header\n");
+        goto fail;
     }
-    if (size == 0 || blksize == 0 || blocks > SIZE_MAX / blksize || range_count == 0) {
-        LOGE("invalid data in block map file: size %zu, blksize %u, range_count %u\n",
+    if (size == 0 || size > SIZE_MAX || blksize == 0 || blksize > UINT_MAX ||
+            (size - 1) / blksize + 1 > SIZE_MAX / blksize ||
+            range_count == 0 || range_count > (size - 1) / blksize + 1 ||
+            range_count > INT_MAX || range_count > SIZE_MAX / sizeof(MappedBlockRange)) {
+        LOGE("invalid data in block map file: size %llu, blksize %llu, range_count %llu\n",
              size, blksize, range_count);
-        return -1;
+        goto fail;
     }
+    blocks = (size - 1) / blksize + 1;
 
-    pMap->range_count = range_count;
-    pMap->ranges = calloc(range_count, sizeof(MappedRange));
+    /* Merge ranges that continue where the previous one ended; a
+     * fragmented file often has long runs of them.
+     */
+    ranges = malloc(range_count * sizeof(MappedBlockRange));
+    if (ranges == NULL) {
+        LOGE("malloc failed: %s\n", strerror(errno));
+        goto fail;
+    }
+    size_t remaining_size = blocks * blksize;
+    loff_t offset = 0;
+    for (i = 0; i < range_count; ++i) {
+        if (!parseNumber(&p, &start) || !parseNumber(&p, &end)) {
+            LOGW("failed to parse range %d in block map\n", i);
+            goto fail;
+        }
+        if (end <= start || (end - start) > SIZE_MAX / blksize ||
+                (end - start) * blksize > remaining_size ||
+                start > (unsigned long long)INT64_MAX / blksize) {
+            LOGE("unexpected range in block map: %llu %llu\n", start, end);
+            goto fail;
+        }
+        size_t length = (end - start) * blksize;
+        loff_t dev_offset = (loff_t)start * blksize;
+        if (count > 0 && ranges[count-1].dev_offset + (loff_t)ranges[count-1].length == dev_offset) {
+            ranges[count-1].length += length;
+        } else {
+            ranges[count].offset = offset;
+            ranges[count].dev_offset = dev_offset;
+            ranges[count].length = length;
+            count++;
+        }
+        offset += length;
+        remaining_size -= length;
+    }
+    if (remaining_size != 0) {
+        LOGE("ranges in block map are invalid: remaining_size = %zu\n", remaining_size);
+        goto fail;
+    }
+
+    fd = open(block_dev, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGW("failed to open block device %s: %s\n", block_dev, strerror(errno));
+        goto fail;
+    }
+
+    pMap->ranges = calloc(count, sizeof(MappedRange));
     if (pMap->ranges == NULL) {
-        LOGE("calloc(%u, %zu) failed: %s\n", range_count, sizeof(MappedRange), strerror(errno));
-        return -1;
+        LOGE("calloc(%d, %zu) failed: %s\n", count, sizeof(MappedRange), strerror(errno));
+        goto fail;
     }
 
     // Reserve enough contiguous address space for the whole file.
-    unsigned char* reserve;
 #if (PLATFORM_SDK_VERSION >= 21)
     reserve = mmap64(NULL, blocks * blksize, PROT_NONE, MAP_PRIVATE | MAP_ANON, -1, 0);
 #else
@@ -145,92 +270,65 @@ static int sysMapBlockFile(FILE* mapf, MemMapping* pMap)
 #endif
     if (reserve == MAP_FAILED) {
         LOGW("failed to reserve address space: %s\n", strerror(errno));
-        free(pMap->ranges);
-        return -1;
+        goto fail;
     }
 
-    pMap->ranges[range_count-1].addr = reserve;
-    pMap->ranges[range_count-1].length = blocks * blksize;
-
-    int fd = open(block_dev, O_RDONLY);
-    if (fd < 0) {
-        LOGW("failed to open block device %s: %s\n", block_dev, strerror(errno));
-        munmap(reserve, blocks * blksize);
-        free(pMap->ranges);
-        return -1;
-    }
-
-    unsigned char* next = reserve;
-    size_t remaining_size = blocks * blksize;
-    bool success = 1;
-    for (i = 0; i < range_count; ++i) {
-        size_t start, end;
-        if (fscanf(mapf, "%zu %zu\n", &start, &end) != 2) {
-            LOGW("failed to parse range %d in block map\n", i);
-            success = 0;
-            break;
-        }
-        size_t length = (end - start) * blksize;
-        if (end <= start || (end - start) > SIZE_MAX / blksize || length > remaining_size) {
-          LOGE("unexpected range in block map: %zu %zu\n", start, end);
-          success = 0;
-          break;
-        }
-
-        void* addr = mmap64(next, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, ((off64_t)start)*blksize);
+    /* The merged ranges tile the reservation, so unmapping them
+     * releases all of it.
+     */
+    for (i = 0; i < (unsigned int)count; ++i) {
+        void* addr = mmap64(reserve + ranges[i].offset, ranges[i].length, PROT_READ,
+                MAP_PRIVATE | MAP_FIXED, fd, ranges[i].dev_offset);
         if (addr == MAP_FAILED) {
             LOGW("failed to map block %d: %s\n", i, strerror(errno));
-            success = 0;
-            break;
+            goto fail;
         }
         pMap->ranges[i].addr = addr;
-        pMap->ranges[i].length = length;
-
-        next += length;
-        remaining_size -= length;
-    }
-    if (success && remaining_size != 0) {
-      LOGE("ranges in block map are invalid: remaining_size = %zu\n", remaining_size);
-      success = 0;
-    }
-    if (!success) {
-      close(fd);
-      munmap(reserve, blocks * blksize);
-      free(pMap->ranges);
-      return -1;
+        pMap->ranges[i].length = ranges[i].length;
     }
 
-    close(fd);
+    free(map);
     pMap->addr = reserve;
     pMap->length = size;
+    pMap->range_count = count;
+    pMap->dev_fd = fd;
+    pMap->block_range_count = count;
+    pMap->block_ranges = ranges;
 
-    LOGI("mmapped %d ranges\n", range_count);
+    LOGI("mmapped %d ranges (%llu in block map)\n", count, range_count);
 
+    sysPrefetchMap(pMap, size > BLOCK_MAP_INITIAL_PREFETCH ?
+            size - BLOCK_MAP_INITIAL_PREFETCH : 0, BLOCK_MAP_INITIAL_PREFETCH);
     return 0;
+
+fail:
+    if (reserve != MAP_FAILED)
+        munmap(reserve, blocks * blksize);
+    free(pMap->ranges);
+    pMap->ranges = NULL;
+    if (fd >= 0)
+        close(fd);
+    free(ranges);
+    free(map);
+    return -1;
 }
 
 int sysMapFile(const char* fn, MemMapping* pMap)
 {
     memset(pMap, 0, sizeof(*pMap));
+    pMap->fd = -1;
+    pMap->dev_fd = -1;
 
     if (fn && fn[0] == '@') {
         // A map of blocks
-        FILE* mapf = fopen(fn+1, "r");
-        if (mapf == NULL) {
-            LOGV("Unable to open '%s': %s\n", fn+1, strerror(errno));
-            return -1;
-        }
-
-        if (sysMapBlockFile(mapf, pMap) != 0) {
+        if (sysMapBlockFile(fn+1, pMap) != 0) {
             LOGW("Map of '%s' failed\n", fn);
-            fclose(mapf);
             return -1;
         }
-
-        fclose(mapf);
     } else {
         // This is a regular file.
-        int fd = open(fn, O_RDONLY, 0);
+        // Kept open for the life of the map; don't leak it to children.
+        int fd = open(fn, O_RDONLY | O_CLOEXEC, 0);
         if (fd < 0) {
             LOGE("Unable to open '%s': %s\n", fn, strerror(errno));
             return -1;
@@ -241,8 +339,6 @@ int sysMapFile(const char* fn, MemMapping* pMap)
             close(fd);
             return -1;
         }
-
-        close(fd);
     }
     return 0;
 }
@@ -262,4 +358,100 @@ void sysReleaseMap(MemMapping* pMap)
     free(pMap->ranges);
     pMap->ranges = NULL;
     pMap->range_count = 0;
+    if (pMap->fd >= 0) {
+        close(pMap->fd);
+        pMap->fd = -1;
+    }
+    if (pMap->dev_fd >= 0) {
+        close(pMap->dev_fd);
+        pMap->dev_fd = -1;
+    }
+    free(pMap->block_ranges);
+    pMap->block_ranges = NULL;
+    pMap->block_range_count = 0;
+}
+
+int sysLocateMap(const MemMapping* pMap, loff_t offset, int* fd,
+        loff_t* fdOffset, size_t* contiguous)
+{
+    if (offset < 0 || (size_t)offset >= pMap->length)
+        return -1;
+
+    if (pMap->dev_fd < 0) {
+        if (pMap->fd < 0)
+            return -1;
+        *fd = pMap->fd;
+        *fdOffset = pMap->offset + offset;
+        *contiguous = pMap->length - offset;
+        return 0;
+    }
+
+    /* the last range starting at or before offset */
+    int lo = 0, hi = pMap->block_range_count;
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+        if (pMap->block_ranges[mid].offset <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    const MappedBlockRange* range = &pMap->block_ranges[lo];
+    size_t length = range->length;
+    if (range->offset + (loff_t)length > (loff_t)pMap->length)
+        length = pMap->length - range->offset;     // the last block is partly used
+
+    *fd = pMap->dev_fd;
+    *fdOffset = range->dev_offset + (offset - range->offset);
+    *contiguous = length - (offset - range->offset);
+    return 0;
+}
+
+int sysReadMap(const MemMapping* pMap, loff_t offset, void* buf,
+        size_t length)
+{
+    unsigned char* p = (unsigned char*)buf;
+
+    while (length > 0) {
+        int fd;
+        loff_t fdOffset;
+        size_t contiguous;
+
+        if (sysLocateMap(pMap, offset, &fd, &fdOffset, &contiguous) != 0) {
+            LOGE("read of %zu bytes at %lld is outside the map\n",
+                 length, (long long)offset);
+            return -1;
+        }
+        size_t n = length < contiguous ? length : contiguous;
+        ssize_t got = TEMP_FAILURE_RETRY(pread64(fd, p, n, fdOffset));
+        if (got <= 0) {
+            LOGE("read of %zu bytes at %lld failed: %s\n", n, (long long)fdOffset,
+                 got < 0 ? strerror(errno) : "end of file");
+            return -1;
+        }
+        p += got;
+        offset += got;
+        length -= got;
+    }
+    return 0;
+}
+
+void sysPrefetchMap(const MemMapping* pMap, loff_t offset, size_t length)
+{
+    while (length > 0) {
+        int fd;
+        loff_t fdOffset;
+        size_t contiguous;
+
+        if (sysLocateMap(pMap, offset, &fd, &fdOffset, &contiguous) != 0)
+            return;
+        size_t n = length < contiguous ? length : contiguous;
+#if (PLATFORM_SDK_VERSION >= 21)
+        posix_fadvise64(fd, fdOffset, n, POSIX_FADV_WILLNEED);
+#else
+        // Older versions of Android do not have posix_fadvise64
+        posix_fadvise(fd, fdOffset, n, POSIX_FADV_WILLNEED);
+#endif
+        offset += n;
+        length -= n;
+    }
 }
@@ -18,6 +18,15 @@ typedef struct MappedRange {
     size_t length;
 } MappedRange;
 
+/*
+ * Where a piece of a block-mapped file is on its block device.
+ */
+typedef struct MappedBlockRange {
+    loff_t offset;                 /* in the file */
+    loff_t dev_offset;             /* on the device */
+    size_t length;
+} MappedBlockRange;
+
 /*
  * Use this to keep track of mapped segments.
  */
@@ -27,12 +36,27 @@ typedef struct MemMapping {
 
     int            range_count;
     MappedRange*   ranges;
+
+    int            fd;             /* file mapped at "offset", or -1 */
+    loff_t         offset;
+
+    /* block maps: the device and the pieces of the file on it, in
+     * file order, with adjacent blocks merged */
+    int               dev_fd;
+    int               block_range_count;
+    MappedBlockRange* block_ranges;
 } MemMapping;
 
 /*
  * Map a file into a private, read-only memory segment.  If 'fn'
  * begins with an '@' character, it is a map of blocks to be mapped,
- * otherwise it is treated as an ordinary file.
+ * otherwise it is treated as an ordinary file.  An ordinary file stays
+ * open in "pMap->fd" until the map is released, so its contents can
+ * also be read without going through the mapping; block maps leave
+ * it at -1 and keep their block device open in "pMap->dev_fd".
+ *
+ * The whole file is mapped at once, so it must fit the address space:
+ * a 32-bit process can't map 4GB or more, and in practice less.
  *
  * On success, "pMap" is filled in, and zero is returned.
  */
@@ -41,10 +65,37 @@ int sysMapFile(const char* fn, MemMapping* pMap);
 /*
  * Release the pages associated with a shared memory segment.
  *
- * This does not free "pMap"; it just releases the memory.
+ * This does not free "pMap"; it just releases the memory and closes
+ * the files.
  */
 void sysReleaseMap(MemMapping* pMap);
 
+/*
+ * Find where the mapped data at "offset" is stored: sets "*fd" and
+ * "*fdOffset" to the file or block device and the position there, and
+ * "*contiguous" to how many bytes follow it there.
+ *
+ * Returns zero on success, -1 if "offset" is out of range.
+ */
+int sysLocateMap(const MemMapping* pMap, loff_t offset, int* fd,
+        loff_t* fdOffset, size_t* contiguous);
+
+/*
+ * Read "length" bytes of the mapped data at "offset" into "buf" with
+ * pread(), without faulting in the mapping.  Long sequential reads of
+ * block maps are much cheaper this way.
+ *
+ * Returns zero on success.
+ */
+int sysReadMap(const MemMapping* pMap, loff_t offset, void* buf,
+        size_t length);
+
+/*
+ * Ask the kernel to start reading "length" bytes of the mapped data at
+ * "offset", piece by piece in file order.
+ */
+void sysPrefetchMap(const MemMapping* pMap, loff_t offset, size_t length);
+
 #ifdef __cplusplus
 }
 #endif
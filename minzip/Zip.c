@@ -5,14 +5,16 @@
  */
 #include "safe_iop.h"
 #include "zlib.h"
-#include "xz_config.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>   // for S_ISLNK()
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #define LOG_TAG "minzip"
@@ -24,8 +26,6 @@
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
 
-#define SORT_ENTRIES 1
-
 /*
  * Offset and length constants (java.util.zip naming convention).
  */
@@ -78,8 +78,21 @@ enum {
     LOCNAM = 26,
     LOCEXT = 28,
 
+    ZIP64_LOCSIG = 0x07064b50,   // PK67, right before the EOCD
+    ZIP64_LOCHDR = 20,
+    ZIP64_LOCOFF = 8,
+
+    ZIP64_ENDSIG = 0x06064b50,   // PK66
+    ZIP64_ENDHDR = 56,
+    ZIP64_ENDTOT = 32,
+    ZIP64_ENDOFF = 48,
+
+    ZIP64_EXTID = 0x0001,        // extra field with the 64-bit sizes
+
     STORED = 0,
     DEFLATED = 8,
+    ZSTD = 93,
+    XZ = 95,
 
     CENVEM_UNIX = 3 << 8,   // the high byte of CENVEM
 };
@@ -92,70 +105,81 @@ enum {
 static void dumpEntry(const ZipEntry* pEntry)
 {
     LOGI(" %p '%.*s'\n", pEntry->fileName,pEntry->fileNameLen,pEntry->fileName);
-    LOGI("   off=%ld comp=%ld uncomp=%ld how=%d\n", pEntry->offset,
+    LOGI("   off=%ld comp=%ld uncomp=%ld how=%d\n", pEntry->localHdrOffset,
         pEntry->compLen, pEntry->uncompLen, pEntry->compression);
 }
 #endif
 
 /*
- * (This is a mzHashTableLookup callback.)
- *
- * Compare two ZipEntry structs, by name.
+ * Compare the name of an entry with the nameLen bytes at name.  Names
+ * sort by their bytes, so all names starting with a given prefix are
+ * next to each other, right after the prefix itself.
  */
-static int hashcmpZipEntry(const void* ventry1, const void* ventry2)
+static int compareZipName(const ZipEntry* pEntry, const char* name,
+        unsigned int nameLen)
 {
-    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
-    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
-
-    if (entry1->fileNameLen != entry2->fileNameLen)
-        return entry1->fileNameLen - entry2->fileNameLen;
-    return memcmp(entry1->fileName, entry2->fileName, entry1->fileNameLen);
+    unsigned int len = pEntry->fileNameLen < nameLen ?
+            pEntry->fileNameLen : nameLen;
+    int diff = memcmp(pEntry->fileName, name, len);
+    if (diff != 0)
+        return diff;
+    if (pEntry->fileNameLen != nameLen)
+        return pEntry->fileNameLen < nameLen ? -1 : 1;
+    return 0;
 }
 
 /*
- * (This is a mzHashTableLookup callback.)
- *
- * find a ZipEntry struct by name.
+ * Like compareZipName(), but every name starting with prefix compares
+ * equal to it.
  */
-static int hashcmpZipName(const void* ventry, const void* vname)
+static int compareZipPrefix(const ZipEntry* pEntry, const char* prefix,
+        unsigned int prefixLen)
 {
-    const ZipEntry* entry = (const ZipEntry*) ventry;
-    const char* name = (const char*) vname;
-    unsigned int nameLen = strlen(name);
-
-    if (entry->fileNameLen != nameLen)
-        return entry->fileNameLen - nameLen;
-    return memcmp(entry->fileName, name, nameLen);
+    if (pEntry->fileNameLen >= prefixLen)
+        return memcmp(pEntry->fileName, prefix, prefixLen);
+    return compareZipName(pEntry, prefix, prefixLen);
 }
 
 /*
- * Compute the hash code for a ZipEntry filename.
+ * (This is a qsort callback.)
  *
- * Not expected to be compatible with any other hash function, so we init
- * to 2 to ensure it doesn't happen to match.
+ * Order entries by name; duplicates stay in central directory order,
+ * which is the order of their names in the mapping.
  */
-static unsigned int computeHash(const char* name, int nameLen)
+static int sortcmpZipEntry(const void* ventry1, const void* ventry2)
 {
-    unsigned int hash = 2;
-
-    while (nameLen--)
-        hash = hash * 31 + *name++;
+    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
+    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
+    int diff = compareZipName(entry1, entry2->fileName, entry2->fileNameLen);
 
-    return hash;
+    if (diff != 0)
+        return diff;
+    if (entry1->fileName != entry2->fileName)
+        return entry1->fileName < entry2->fileName ? -1 : 1;
+    return 0;
 }
 
-static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
+/*
+ * Index of the first entry in the sorted table for which compare()
+ * doesn't return less than 0 (or greater than 0 with "after" set).
+ */
+static unsigned int searchZipEntries(const ZipArchive* pArchive,
+        const char* name, unsigned int nameLen, bool after,
+        int (*compare)(const ZipEntry*, const char*, unsigned int))
 {
-    unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
-    const ZipEntry* found;
-
-    found = (const ZipEntry*)mzHashTableLookup(pHash,
-                itemHash, pEntry, hashcmpZipEntry, true);
-    if (found != pEntry) {
-        LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
-            found->fileNameLen, found->fileName);
-        /* keep going */
+    unsigned int low = 0;
+    unsigned int high = pArchive->numEntries;
+
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        int diff = compare(&pArchive->pEntries[mid], name, nameLen);
+        if (diff < 0 || (after && diff == 0)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
     }
+    return low;
 }
 
 static int validFilename(const char *fileName, unsigned int fileNameLen)
@@ -178,10 +202,81 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
     return 1;
 }
 
+/*
+ * Archives with more than 65535 entries or with a central directory past
+ * 4G keep the real values in a Zip64 end of central directory record,
+ * found through the locator right in front of the EOCD.  If there is
+ * one, update *pNumEntries and *pCdOffset from it.
+ *
+ * Returns "false" if the archive has a locator that leads nowhere.
+ */
+static bool parseZip64Eocd(const ZipArchive* pArchive,
+        const unsigned char* eocd, unsigned long long* pNumEntries,
+        unsigned long long* pCdOffset)
+{
+    const unsigned char* locator = eocd - ZIP64_LOCHDR;
+    if (eocd - pArchive->addr < ZIP64_LOCHDR || get4LE(locator) != ZIP64_LOCSIG)
+        return true;
+
+    unsigned long long recordOffset = get8LE(locator + ZIP64_LOCOFF);
+    if (recordOffset > pArchive->length ||
+            pArchive->length - recordOffset < ZIP64_ENDHDR) {
+        LOGW("Bad offset to Zip64 end of central directory: %llu\n",
+            recordOffset);
+        return false;
+    }
+    const unsigned char* record = pArchive->addr + recordOffset;
+    if (get4LE(record) != ZIP64_ENDSIG) {
+        LOGW("Missed the Zip64 end of central directory sig\n");
+        return false;
+    }
+
+    *pNumEntries = get8LE(record + ZIP64_ENDTOT);
+    *pCdOffset = get8LE(record + ZIP64_ENDOFF);
+    return true;
+}
+
+/*
+ * Fill in the sizes and local header offset the central directory only
+ * has room for as 0xffffffff from the entry's Zip64 extra field.  Those,
+ * and only those, are in there in this order.
+ *
+ * Returns "false" if the extra field is missing or too short.
+ */
+static bool parseZip64Extra(const unsigned char* extra, unsigned int extraLen,
+        unsigned long long* pUncompLen, unsigned long long* pCompLen,
+        unsigned long long* pLocalHdrOffset)
+{
+    unsigned long long* fields[3] = { pUncompLen, pCompLen, pLocalHdrOffset };
+
+    while (extraLen >= 4) {
+        unsigned int id = get2LE(extra);
+        unsigned int len = get2LE(extra + 2);
+        if (len > extraLen - 4)
+            break;
+        if (id == ZIP64_EXTID) {
+            const unsigned char* p = extra + 4;
+            unsigned int i;
+            for (i = 0; i < 3; i++) {
+                if (*fields[i] != 0xffffffff)
+                    continue;
+                if (p + 8 > extra + 4 + len)
+                    return false;
+                *fields[i] = get8LE(p);
+                p += 8;
+            }
+            return true;
+        }
+        extra += 4 + len;
+        extraLen -= 4 + len;
+    }
+    return false;
+}
+
 /*
  * Parse the contents of a Zip archive.  After confirming that the file
  * is in fact a Zip, we scan out the contents of the central directory and
- * store it in a hash table.
+ * store it in a table sorted by name.
  *
  * Returns "true" on success.
  */
@@ -189,7 +284,8 @@ static bool parseZipArchive(ZipArchive* pArchive)
 {
     bool result = false;
     const unsigned char* ptr;
-    unsigned int i, numEntries, cdOffset;
+    unsigned int i, numEntries;
+    unsigned long long totalEntries, cdOffset;
     unsigned int val;
 
     /*
@@ -208,16 +304,20 @@ static bool parseZipArchive(ZipArchive* pArchive)
 
     /*
      * Find the EOCD.  We'll find it immediately unless they have a file
-     * comment.
+     * comment, which is at most 64k long; there's no point looking
+     * further back than that.
      */
+    const unsigned char* eocdStart = pArchive->addr;
+    if (pArchive->length > ENDHDR + 0xffff)
+        eocdStart = pArchive->addr + pArchive->length - ENDHDR - 0xffff;
     ptr = pArchive->addr + pArchive->length - ENDHDR;
 
-    while (ptr >= (const unsigned char*) pArchive->addr) {
+    while (ptr >= eocdStart) {
         if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
             break;
         ptr--;
     }
-    if (ptr < (const unsigned char*) pArchive->addr) {
+    if (ptr < eocdStart) {
         LOGI("Could not find end-of-central-directory in Zip\n");
         goto bail;
     }
@@ -227,30 +327,33 @@ static bool parseZipArchive(ZipArchive* pArchive)
      * entries in the file, and the file offset of the start of the
      * central directory.
      */
-    numEntries = get2LE(ptr + ENDSUB);
+    totalEntries = get2LE(ptr + ENDSUB);
     cdOffset = get4LE(ptr + ENDOFF);
+    if (!parseZip64Eocd(pArchive, ptr, &totalEntries, &cdOffset))
+        goto bail;
 
-    LOGVV("numEntries=%d cdOffset=%d\n", numEntries, cdOffset);
-    if (numEntries == 0 || cdOffset >= pArchive->length) {
-        LOGW("Invalid entries=%d offset=%d (len=%zd)\n",
-            numEntries, cdOffset, pArchive->length);
+    LOGVV("numEntries=%llu cdOffset=%llu\n", totalEntries, cdOffset);
+    if (totalEntries == 0 || cdOffset >= pArchive->length ||
+            totalEntries > (pArchive->length - cdOffset) / CENHDR) {
+        LOGW("Invalid entries=%llu offset=%llu (len=%zd)\n",
+            totalEntries, cdOffset, pArchive->length);
         goto bail;
     }
+    numEntries = totalEntries;
 
     /*
      * Create data structures to hold entries.
      */
     pArchive->numEntries = numEntries;
     pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
-    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+    if (pArchive->pEntries == NULL)
         goto bail;
 
     ptr = pArchive->addr + cdOffset;
     for (i = 0; i < numEntries; i++) {
         ZipEntry* pEntry;
-        unsigned int fileNameLen, extraLen, commentLen, localHdrOffset;
-        const unsigned char* localHdr;
+        unsigned int fileNameLen, extraLen, commentLen;
+        unsigned long long localHdrOffset, compLen, uncompLen;
         const char *fileName;
 
         if (ptr + CENHDR > (const unsigned char*)pArchive->addr + pArchive->length) {
@@ -267,7 +370,8 @@ static bool parseZipArchive(ZipArchive* pArchive)
         extraLen = get2LE(ptr + CENEXT);
         commentLen = get2LE(ptr + CENCOM);
         fileName = (const char*)ptr + CENHDR;
-        if (fileName + fileNameLen > (const char*)pArchive->addr + pArchive->length) {
+        if (fileName + fileNameLen + extraLen >
+                (const char*)pArchive->addr + pArchive->length) {
             LOGW("Filename ran off the end (at %d)\n", i);
             goto bail;
         }
@@ -276,63 +380,26 @@ static bool parseZipArchive(ZipArchive* pArchive)
             goto bail;
         }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
-
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
-        }
-#else
         pEntry = &pArchive->pEntries[i];
-#endif
         pEntry->fileNameLen = fileNameLen;
         pEntry->fileName = fileName;
 
-        pEntry->compLen = get4LE(ptr + CENSIZ);
-        pEntry->uncompLen = get4LE(ptr + CENLEN);
+        compLen = get4LE(ptr + CENSIZ);
+        uncompLen = get4LE(ptr + CENLEN);
+        if ((compLen == 0xffffffff || uncompLen == 0xffffffff ||
+                localHdrOffset == 0xffffffff) &&
+                !parseZip64Extra(ptr + CENHDR + fileNameLen, extraLen,
+                        &uncompLen, &compLen, &localHdrOffset)) {
+            LOGW("Missing Zip64 extra field (at %d)\n", i);
+            goto bail;
+        }
+        if (compLen > pArchive->length || uncompLen > LLONG_MAX ||
+                (get2LE(ptr + CENHOW) == STORED && compLen != uncompLen)) {
+            LOGW("Invalid sizes %llu/%llu (at %d)\n", compLen, uncompLen, i);
+            goto bail;
+        }
+        pEntry->compLen = compLen;
+        pEntry->uncompLen = uncompLen;
         pEntry->compression = get2LE(ptr + CENHOW);
         pEntry->modTime = get4LE(ptr + CENTIM);
         pEntry->crc32 = get4LE(ptr + CENCRC);
@@ -349,64 +416,38 @@ static bool parseZipArchive(ZipArchive* pArchive)
         }
         pEntry->externalFileAttributes = get4LE(ptr + CENATX);
 
-        // Perform pArchive->addr + localHdrOffset, ensuring that it won't
-        // overflow. This is needed because localHdrOffset is untrusted.
-        if (!safe_add((uintptr_t *)&localHdr, (uintptr_t)pArchive->addr,
-            (uintptr_t)localHdrOffset)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((uintptr_t)localHdr + LOCHDR >
-            (uintptr_t)pArchive->addr + pArchive->length) {
-            LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
-            goto bail;
-        }
-        if (get4LE(localHdr) != LOCSIG) {
-            LOGW("Missed a local header sig (at %d)\n", i);
+        // localHdrOffset is untrusted; make sure the header is inside
+        // the archive before touching it.
+        if (localHdrOffset > pArchive->length ||
+                pArchive->length - localHdrOffset < LOCHDR) {
+            LOGW("Bad offset to local header: %llu (at %d)\n", localHdrOffset, i);
             goto bail;
         }
-        pEntry->offset = localHdrOffset + LOCHDR
-            + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
-        if (!safe_add(NULL, pEntry->offset, (typeof(pEntry->offset))pEntry->compLen)) {
-            LOGW("Integer overflow adding in parseZipArchive\n");
-            goto bail;
-        }
-        if ((size_t)pEntry->offset + pEntry->compLen > pArchive->length) {
-            LOGW("Data ran off the end (at %d)\n", i);
-            goto bail;
-        }
-
-#if !SORT_ENTRIES
-        /* Add to hash table; no need to lock here.
-         * Can't do this now if we're sorting, because entries
-         * will move around.
-         */
-        addEntryToHashTable(pArchive->pHash, pEntry);
-#endif
+        // The local header itself is only read when the entry is used
+        // (mzGetZipEntryOffset), so opening a lazily mapped package
+        // doesn't fault in a page per entry.
+        pEntry->localHdrOffset = localHdrOffset;
 
         //dumpEntry(pEntry);
         ptr += CENHDR + fileNameLen + extraLen + commentLen;
     }
 
-#if SORT_ENTRIES
-    /* If we're sorting, we have to wait until all entries
-     * are in their final places, otherwise the pointers will
-     * probably point to the wrong things.
+    /* Sort the entries by name, so names and directories can be looked
+     * up by binary search.
      */
-    for (i = 0; i < numEntries; i++) {
-        /* Add to hash table; no need to lock here.
-         */
-        addEntryToHashTable(pArchive->pHash, &pArchive->pEntries[i]);
+    qsort(pArchive->pEntries, numEntries, sizeof(ZipEntry), sortcmpZipEntry);
+    for (i = 1; i < numEntries; i++) {
+        const ZipEntry* pEntry = &pArchive->pEntries[i];
+        if (compareZipName(pEntry - 1, pEntry->fileName, pEntry->fileNameLen) == 0) {
+            LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
+                pEntry->fileNameLen, pEntry->fileName);
+            /* keep going */
+        }
     }
-#endif
 
     result = true;
 
 bail:
-    if (!result) {
-        mzHashTableFree(pArchive->pHash);
-        pArchive->pHash = NULL;
-    }
     return result;
 }
 
@@ -464,9 +505,6 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 
     free(pArchive->pEntries);
 
-    mzHashTableFree(pArchive->pHash);
-
-    pArchive->pHash = NULL;
     pArchive->pEntries = NULL;
 }
 
@@ -478,10 +516,31 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName)
 {
-    unsigned int itemHash = computeHash(entryName, strlen(entryName));
+    unsigned int nameLen = strlen(entryName);
+    unsigned int i = searchZipEntries(pArchive, entryName, nameLen, false,
+            compareZipName);
+
+    if (i < pArchive->numEntries &&
+            compareZipName(&pArchive->pEntries[i], entryName, nameLen) == 0) {
+        return &pArchive->pEntries[i];
+    }
+    return NULL;
+}
 
-    return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
-                itemHash, (char*) entryName, hashcmpZipName, false);
+/*
+ * Find the entries whose names start with prefix.
+ */
+unsigned int mzFindZipEntriesWithPrefix(const ZipArchive* pArchive,
+        const char* prefix, unsigned int* pFirst)
+{
+    unsigned int prefixLen = strlen(prefix);
+    unsigned int first = searchZipEntries(pArchive, prefix, prefixLen, false,
+            compareZipPrefix);
+    unsigned int end = searchZipEntries(pArchive, prefix, prefixLen, true,
+            compareZipPrefix);
+
+    *pFirst = first;
+    return end - first;
 }
 
 /*
@@ -495,163 +554,150 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
     return false;
 }
 
-/* Call processFunction on the uncompressed data of a STORED entry.
+/*
+ * Find the data of an entry from its local header, which parseZipArchive()
+ * only checked to be inside the archive.
  */
-static bool processStoredEntry(const ZipArchive *pArchive,
-    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
+loff_t mzGetZipEntryOffset(const ZipArchive* pArchive, const ZipEntry* pEntry)
 {
-    return processFunction(pArchive->addr + pEntry->offset, pEntry->uncompLen, cookie);
-}
+    const unsigned char* localHdr = pArchive->addr + pEntry->localHdrOffset;
+    loff_t offset;
 
-static bool processXZEntry(const ZipArchive *pArchive,
-    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
-{
-    unsigned char out[32*1024];
-    struct xz_buf b;
-    struct xz_dec *s;
-    enum xz_ret ret;
-    size_t total = 0;
-
-    printf("ok!\n");
-    xz_crc32_init();
-    xz_crc64_init();
-    s = xz_dec_init(XZ_DYNALLOC, 1 << 26);
-    if (s == NULL) {
-        LOGE("XZ decompression alloc failed\n");
-        goto bail;
+    if (get4LE(localHdr) != LOCSIG) {
+        LOGW("Missed a local header sig for '%.*s'\n",
+                pEntry->fileNameLen, pEntry->fileName);
+        return -1;
     }
-
-    b.in = pArchive->addr + pEntry->offset;
-    b.in_pos = 0;
-    b.in_size = pEntry->compLen;
-    b.out = out;
-    b.out_pos = 0;
-    b.out_size = sizeof(out);
-
-    do {
-        ret = xz_dec_run(s, &b);
-
-        LOGVV("+++ b.in_pos = %zu b.out_pos = %zu ret=%d\n", b.in_pos, b.out_pos, ret);
-        if (b.out_pos == sizeof(out)) {
-            LOGVV("+++ processing %d bytes\n", b.out_pos);
-            bool err = processFunction(out, b.out_pos, cookie);
-            if (!err) {
-                LOGW("Process function elected to fail (in xz_dec)\n");
-                goto xz_bail;
-            }
-            b.out_pos = 0;
-        }
-
-    } while (ret == XZ_OK);
-
-    assert(ret == XZ_STREAM_END);
-
-    bool err = processFunction(out, b.out_pos, cookie);
-    if (!err) {
-        LOGW("Process function elected to fail (in xz_dec)\n");
-        goto xz_bail;
+    offset = pEntry->localHdrOffset + LOCHDR
+        + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT);
+    if ((unsigned long long)offset > pArchive->length ||
+            pEntry->compLen > (loff_t)pArchive->length - offset) {
+        LOGW("Data ran off the end for '%.*s'\n",
+                pEntry->fileNameLen, pEntry->fileName);
+        return -1;
     }
+    return offset;
+}
 
+/* Largest piece of data processFunction gets at a time.
+ */
+#define MZ_MAX_PROCESS_LEN (1 << 30)
 
-xz_bail:
-    xz_dec_end(s);
-
-bail:
-    if (b.in_pos != (unsigned long)pEntry->compLen) {
-        LOGW("Size mismatch on file after xz_dec (%ld vs %zu)\n",
-                pEntry->compLen, b.in_pos);
-        //return false;
-    }
+/* Call processFunction on the uncompressed data of a STORED entry.
+ */
+static bool processStoredData(const unsigned char *data, loff_t remaining,
+    ProcessZipEntryContentsFunction processFunction, void *cookie)
+{
+    /* processFunction takes an int length; hand huge entries over in
+     * pieces.
+     */
+    do {
+        int len = remaining > MZ_MAX_PROCESS_LEN ? MZ_MAX_PROCESS_LEN : (int)remaining;
+        if (!processFunction(data, len, cookie))
+            return false;
+        data += len;
+        remaining -= len;
+    } while (remaining > 0);
     return true;
 }
 
-static bool processDeflatedEntry(const ZipArchive *pArchive,
+static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    long result = -1;
-    unsigned char readBuf[32 * 1024];
-    unsigned char procBuf[32 * 1024];
-    z_stream zstream;
-    int zerr;
-    long compRemaining;
-
-    compRemaining = pEntry->compLen;
+    loff_t offset = mzGetZipEntryOffset(pArchive, pEntry);
+    if (offset < 0)
+        return false;
+    return processStoredData(pArchive->addr + offset,
+            pEntry->uncompLen, processFunction, cookie);
+}
 
-    /*
-     * Initialize the zlib stream.
-     */
-    memset(&zstream, 0, sizeof(zstream));
-    zstream.zalloc = Z_NULL;
-    zstream.zfree = Z_NULL;
-    zstream.opaque = Z_NULL;
-    zstream.next_in = pArchive->addr + pEntry->offset;
-    zstream.avail_in = pEntry->compLen;
-    zstream.next_out = (Bytef*) procBuf;
-    zstream.avail_out = sizeof(procBuf);
-    zstream.data_type = Z_UNKNOWN;
+/* Size of the batches decoded data is handed over in, see
+ * mzSetDecodeBatchSize().
+ */
+static size_t decodeBatchLen = 32 * 1024;
 
-    /*
-     * Use the undocumented "negative window bits" feature to tell zlib
-     * that there's no zlib header waiting for it.
-     */
-    zerr = inflateInit2(&zstream, -MAX_WBITS);
-    if (zerr != Z_OK) {
-        if (zerr == Z_VERSION_ERROR) {
-            LOGE("Installed zlib is not compatible with linked version (%s)\n",
-                ZLIB_VERSION);
-        } else {
-            LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
-        }
-        goto bail;
-    }
+void mzSetDecodeBatchSize(size_t batchLen)
+{
+    if (batchLen < 4096)
+        batchLen = 4096;
+    if (batchLen > MZ_MAX_PROCESS_LEN)
+        batchLen = MZ_MAX_PROCESS_LEN;
+    decodeBatchLen = batchLen;
+}
 
-    /*
-     * Loop while we have data.
-     */
-    do {
-        /* uncompress the data */
-        zerr = inflate(&zstream, Z_NO_FLUSH);
-        if (zerr != Z_OK && zerr != Z_STREAM_END) {
-            LOGD("zlib inflate call failed (zerr=%d)\n", zerr);
-            goto z_bail;
-        }
+/* Decode an entry's data with the backend of "codec", handing the output
+ * to processFunction in batches of batchLen bytes.  expectedLen is the
+ * size the output must have, or -1 if the archive doesn't know it.
+ */
+static bool processEncodedEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int codec, loff_t expectedLen, size_t batchLen,
+    ProcessZipEntryContentsFunction processFunction, void *cookie)
+{
+    const MzDecoder *decoder = mzGetDecoder(codec);
+    unsigned char stackBuf[32 * 1024];
+    unsigned char *buf = stackBuf;
+    loff_t offset = mzGetZipEntryOffset(pArchive, pEntry);
+    loff_t result;
 
-        /* write when we're full or when we're done */
-        if (zstream.avail_out == 0 ||
-            (zerr == Z_STREAM_END && zstream.avail_out != sizeof(procBuf)))
-        {
-            long procSize = zstream.next_out - procBuf;
-            LOGVV("+++ processing %d bytes\n", (int) procSize);
-            bool ret = processFunction(procBuf, procSize, cookie);
-            if (!ret) {
-                LOGW("Process function elected to fail (in inflate)\n");
-                goto z_bail;
-            }
+    if (offset < 0)
+        return false;
+    if (decoder == NULL) {
+        LOGE("No %s decoder for entry '%.*s'\n", mzCodecName(codec),
+                pEntry->fileNameLen, pEntry->fileName);
+        return false;
+    }
 
-            zstream.next_out = procBuf;
-            zstream.avail_out = sizeof(procBuf);
+    /* no need for more room than the whole output */
+    if (expectedLen >= 0 && (loff_t)batchLen > expectedLen)
+        batchLen = expectedLen > 4096 ? (size_t)expectedLen : 4096;
+    if (batchLen > sizeof(stackBuf)) {
+        buf = (unsigned char *)malloc(batchLen);
+        if (buf == NULL) {
+            buf = stackBuf;
+            batchLen = sizeof(stackBuf);
         }
-    } while (zerr == Z_OK);
-
-    assert(zerr == Z_STREAM_END);       /* other errors should've been caught */
+    }
+    result = decoder->decode(pArchive->addr + offset,
+            pEntry->compLen, buf, batchLen, processFunction, cookie);
+    if (buf != stackBuf)
+        free(buf);
 
-    // success!
-    result = zstream.total_out;
+    if (result == -1)           // error already shown
+        return false;
+    if (expectedLen >= 0 && result != expectedLen) {
+        LOGW("Size mismatch on %s entry (%lld vs %lld)\n",
+                mzCodecName(codec), (long long)result, (long long)expectedLen);
+        return false;
+    }
+    return true;
+}
 
-z_bail:
-    inflateEnd(&zstream);        /* free up any allocated structures */
+static bool processZipEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, size_t batchLen,
+    ProcessZipEntryContentsFunction processFunction, void *cookie)
+{
+    int codec;
 
-bail:
-    if (result != pEntry->uncompLen) {
-        if (result != -1)        // error already shown?
-            LOGW("Size mismatch on inflated file (%ld vs %ld)\n",
-                result, pEntry->uncompLen);
+    switch (pEntry->compression) {
+    case STORED:
+        return processStoredEntry(pArchive, pEntry, processFunction, cookie);
+    case DEFLATED:
+        codec = MZ_CODEC_DEFLATE;
+        break;
+    case ZSTD:
+        codec = MZ_CODEC_ZSTD;
+        break;
+    case XZ:
+        codec = MZ_CODEC_XZ;
+        break;
+    default:
+        LOGE("Unsupported compression type %d for entry '%.*s'\n",
+                pEntry->compression, pEntry->fileNameLen, pEntry->fileName);
         return false;
     }
-    return true;
+    return processEncodedEntry(pArchive, pEntry, codec, pEntry->uncompLen,
+            batchLen, processFunction, cookie);
 }
 
 /*
@@ -668,45 +714,36 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
-    bool ret = false;
-    off_t oldOff;
-
-    switch (pEntry->compression) {
-    case STORED:
-        ret = processStoredEntry(pArchive, pEntry, processFunction, cookie);
-        break;
-    case DEFLATED:
-        ret = processDeflatedEntry(pArchive, pEntry, processFunction, cookie);
-        break;
-    default:
-        LOGE("Unsupported compression type %d for entry '%s'\n",
-                pEntry->compression, pEntry->fileName);
-        break;
-    }
-
-    return ret;
+    return processZipEntry(pArchive, pEntry, decodeBatchLen, processFunction,
+            cookie);
 }
 
 /*
- * Similar to mzProcessZipEntryContents, but explicitly process the stream
- * using XZ/LZMA before calling processFunction.
- *
- * This is a separate function for use by the updater. LZMA provides huge
- * size reductions vs deflate, but isn't actually supported by the ZIP format.
- * We need to process it using as little memory as possible.
+ * Similar to mzProcessZipEntryContents, but explicitly decode the stream
+ * kept in a STORED entry with "codec" before calling processFunction.
  */
-bool mzProcessZipEntryContentsXZ(const ZipArchive *pArchive,
-    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
+bool mzProcessZipEntryContentsAs(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int codec,
+    ProcessZipEntryContentsFunction processFunction, void *cookie)
 {
     if (pEntry->compression == STORED) {
-        return processXZEntry(pArchive, pEntry, processFunction, cookie);
+        return processEncodedEntry(pArchive, pEntry, codec, -1,
+                decodeBatchLen, processFunction, cookie);
     }
-    LOGE("Explicit XZ decoding of entry '%s' unsupported for type %d",
-            pEntry->fileName, pEntry->compression);
+    LOGE("Explicit %s decoding of entry '%.*s' unsupported for type %d\n",
+            mzCodecName(codec), pEntry->fileNameLen, pEntry->fileName,
+            pEntry->compression);
     return false;
 }
 
+bool mzProcessZipEntryContentsXZ(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
+    void *cookie)
+{
+    return mzProcessZipEntryContentsAs(pArchive, pEntry, MZ_CODEC_XZ,
+            processFunction, cookie);
+}
+
 static bool crcProcessFunction(const unsigned char *data, int dataLen,
         void *crc)
 {
@@ -804,14 +841,117 @@ static bool writeProcessFunction(const unsigned char *data, int dataLen,
     }
 }
 
+/* The raw syscall: older C libraries either lack copy_file_range() or
+ * emulate it with read() and write().
+ */
+static ssize_t copyFileRange(int inFd, loff_t *inOff, int outFd, size_t len)
+{
+#ifdef __NR_copy_file_range
+    return syscall(__NR_copy_file_range, inFd, inOff, outFd, NULL, len, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static ssize_t sendFile(int outFd, int inFd, loff_t *inOff, size_t len)
+{
+    ssize_t n;
+#if (PLATFORM_SDK_VERSION >= 21)
+    off64_t off = *inOff;
+    n = sendfile64(outFd, inFd, &off, len);
+#else
+    // Older versions of Android do not have sendfile64
+    off_t off = (off_t)*inOff;
+    if ((loff_t)off != *inOff) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+    n = sendfile(outFd, inFd, &off, len);
+#endif
+    if (n > 0)
+        *inOff += n;
+    return n;
+}
+
+/* Copy as much of a STORED entry as the kernel will from where the
+ * archive is mapped from to "fd" at its current offset, without the data
+ * passing through user space: copy_file_range() for files (it can share
+ * extents), sendfile() for block devices and anything else it refuses.
+ * Block maps are copied a piece of the block device at a time.  Both
+ * calls read at an explicit offset, so extraction workers can share the
+ * source.
+ *
+ * Returns the number of bytes copied; whatever is left has to be
+ * written the usual way.
+ */
+static loff_t copyStoredEntry(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, loff_t offset, int fd)
+{
+    loff_t done = 0;
+    int method = 0;
+
+    while (done < pEntry->uncompLen && method < 2) {
+        loff_t remaining = pEntry->uncompLen - done;
+        int inFd;
+        loff_t inOff;
+        size_t len;
+        ssize_t n;
+
+        if (sysLocateMap(pArchive->pMap, offset + done, &inFd, &inOff,
+                &len) != 0) {
+            break;
+        }
+        if ((loff_t)len > remaining)
+            len = remaining;
+        if (len > MZ_MAX_PROCESS_LEN)
+            len = MZ_MAX_PROCESS_LEN;
+
+        if (method == 0)
+            n = copyFileRange(inFd, &inOff, fd, len);
+        else
+            n = sendFile(fd, inFd, &inOff, len);
+
+        if (n > 0) {
+            done += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            // Not supported for this pair of files (or a short source):
+            // try the next method from where this one stopped.
+            LOGV("%s failed after %lld bytes: %s\n",
+                 method == 0 ? "copy_file_range" : "sendfile",
+                 (long long)done, n < 0 ? strerror(errno) : "no data");
+            method++;
+        }
+    }
+    return done;
+}
+
 /*
  * Uncompress "pEntry" in "pArchive" to "fd" at the current offset.
  */
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd)
 {
-    bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
-                                         (void*)(intptr_t)fd);
+    bool ret;
+
+    if (pEntry->compression == STORED && pArchive->pMap != NULL) {
+        loff_t offset = mzGetZipEntryOffset(pArchive, pEntry);
+        if (offset < 0) {
+            LOGE("Can't extract entry to file.\n");
+            return false;
+        }
+        loff_t done = copyStoredEntry(pArchive, pEntry, offset, fd);
+        if (done == pEntry->uncompLen)
+            return true;
+        ret = processStoredData(pArchive->addr + offset + done,
+                pEntry->uncompLen - done, writeProcessFunction,
+                (void*)(intptr_t)fd);
+    } else {
+        ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
+                                        (void*)(intptr_t)fd);
+    }
     if (!ret) {
         LOGE("Can't extract entry to file.\n");
         return false;
@@ -831,14 +971,17 @@ bool mzGetStoredEntry(const ZipArchive *pArchive,
         return false;
     }
 
-    *addr = pArchive->addr + pEntry->offset;
+    loff_t offset = mzGetZipEntryOffset(pArchive, pEntry);
+    if (offset < 0)
+        return false;
+    *addr = pArchive->addr + offset;
     *length = pEntry->uncompLen;
     return true;
 }
 
 typedef struct {
     unsigned char* buffer;
-    long len;
+    loff_t len;
 } BufferExtractCookie;
 
 static bool bufferProcessFunction(const unsigned char *data, int dataLen,
@@ -933,6 +1076,327 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+/* Entries at least this large are inflated through a bigger buffer, so
+ * they reach the file in fewer, larger writes.
+ */
+#define MZ_LARGE_ENTRY (256 * 1024)
+#define MZ_LARGE_BUFFER (1024 * 1024)
+
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+#define MZ_EXTRACT_MAX_WORKERS 8
+/* Regular files that may be open at once, per worker.
+ */
+#define MZ_EXTRACT_WINDOW 8
+
+enum { MZ_JOB_NONE, MZ_JOB_DIR, MZ_JOB_SYMLINK, MZ_JOB_FILE };
+
+/* An entry mzExtractRecursive() extracts, in archive order.
+ */
+typedef struct {
+    const ZipEntry *pEntry;
+    char *targetFile;
+    int kind;
+    int fd;             /* target of a queued MZ_JOB_FILE */
+    bool done;
+    bool ok;
+} MzExtractJob;
+
+/* Regular files are opened by the caller's thread, in archive order,
+ * and inflated by the workers. Completions are reported back in
+ * archive order.
+ */
+typedef struct {
+    const ZipArchive *pArchive;
+    const struct utimbuf *timestamp;
+    MzExtractJob *jobs;
+    unsigned int *queue;        /* indexes of the opened regular files */
+    unsigned int queued;
+    unsigned int taken;
+    int inFlight;
+    bool closed;
+    bool failed;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t progress;
+} MzExtractPool;
+
+static bool extractEntryToFd(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int fd)
+{
+    if (pEntry->compression != STORED && pEntry->uncompLen >= MZ_LARGE_ENTRY &&
+            decodeBatchLen < MZ_LARGE_BUFFER) {
+        bool ret = processZipEntry(pArchive, pEntry, MZ_LARGE_BUFFER,
+                writeProcessFunction, (void*)(intptr_t)fd);
+        if (!ret) {
+            LOGE("Can't extract entry to file.\n");
+        }
+        return ret;
+    }
+    return mzExtractZipEntryToFile(pArchive, pEntry, fd);
+}
+
+/* Write a regular file opened by openExtractJob() and close it.
+ */
+static bool finishExtractJob(const ZipArchive *pArchive, MzExtractJob *job,
+    const struct utimbuf *timestamp)
+{
+    bool ok = extractEntryToFd(pArchive, job->pEntry, job->fd);
+    if (ok) {
+        ok = (fsync(job->fd) == 0);
+    }
+    if (close(job->fd) != 0) {
+        ok = false;
+    }
+    job->fd = -1;
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", job->targetFile);
+        return false;
+    }
+
+    if (timestamp != NULL && utime(job->targetFile, timestamp)) {
+        LOGE("Error touching \"%s\"\n", job->targetFile);
+        return false;
+    }
+
+    LOGV("Extracted file \"%s\"\n", job->targetFile);
+    return true;
+}
+
+/* Create the target of a regular file with its security context.
+ */
+static bool openExtractJob(MzExtractJob *job, struct selabel_handle *sehnd)
+{
+    char *secontext = NULL;
+
+    if (sehnd) {
+        selabel_lookup(sehnd, &secontext, job->targetFile, UNZIP_FILEMODE);
+        setfscreatecon(secontext);
+    }
+
+    job->fd = open(job->targetFile, O_CREAT|O_WRONLY|O_TRUNC|O_SYNC
+            , UNZIP_FILEMODE);
+
+    if (secontext) {
+        freecon(secontext);
+        setfscreatecon(NULL);
+    }
+
+    if (job->fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                job->targetFile, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+static bool extractSymlink(const ZipArchive *pArchive, MzExtractJob *job)
+{
+    const ZipEntry *pEntry = job->pEntry;
+
+    /* The entry is a symbolic link.
+     * The relative target of the symlink is in the
+     * data section of this entry.
+     */
+    if (pEntry->uncompLen == 0) {
+        LOGE("Symlink entry \"%s\" has no target\n",
+                job->targetFile);
+        return false;
+    }
+    char *linkTarget = malloc(pEntry->uncompLen + 1);
+    if (linkTarget == NULL) {
+        return false;
+    }
+    if (!mzReadZipEntry(pArchive, pEntry, linkTarget, pEntry->uncompLen)) {
+        LOGE("Can't read symlink target for \"%s\"\n",
+                job->targetFile);
+        free(linkTarget);
+        return false;
+    }
+    linkTarget[pEntry->uncompLen] = '\0';
+
+    /* Make the link.
+     */
+    if (symlink(linkTarget, job->targetFile) != 0) {
+        LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
+                job->targetFile, linkTarget, strerror(errno));
+        free(linkTarget);
+        return false;
+    }
+    LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
+            job->targetFile, linkTarget);
+    free(linkTarget);
+    return true;
+}
+
+static void *extractWorker(void *cookie)
+{
+    MzExtractPool *pool = (MzExtractPool *)cookie;
+
+    pthread_mutex_lock(&pool->lock);
+    while (true) {
+        while (pool->taken == pool->queued && !pool->closed) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+        if (pool->taken == pool->queued) {
+            break;
+        }
+        MzExtractJob *job = &pool->jobs[pool->queue[pool->taken++]];
+        bool skip = pool->failed;
+        pthread_mutex_unlock(&pool->lock);
+
+        bool ok;
+        if (skip) {
+            close(job->fd);
+            job->fd = -1;
+            ok = false;
+        } else {
+            ok = finishExtractJob(pool->pArchive, job, pool->timestamp);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        job->done = true;
+        job->ok = ok;
+        pool->inFlight--;
+        if (!ok) {
+            pool->failed = true;
+        }
+        pthread_cond_broadcast(&pool->progress);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* Invoke the callback for the jobs completed since *reported, in
+ * archive order, up to the first one that failed. Called with the pool
+ * lock held.
+ */
+static void reportExtractJobs(MzExtractPool *pool, unsigned int end,
+    unsigned int *reported, void (*callback)(const char *fn, void *),
+    void *cookie)
+{
+    while (*reported < end && pool->jobs[*reported].done &&
+            pool->jobs[*reported].ok) {
+        if (callback != NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            callback(pool->jobs[*reported].targetFile, cookie);
+            pthread_mutex_lock(&pool->lock);
+        }
+        ++*reported;
+    }
+}
+
+/* Extract jobs[0..jobCount), the directories of which already exist.
+ * Regular files are handed to "workers" threads, or written right away
+ * when there are none.
+ */
+static bool runExtractJobs(const ZipArchive *pArchive, MzExtractJob *jobs,
+    unsigned int jobCount, int workers, const struct utimbuf *timestamp,
+    void (*callback)(const char *fn, void *), void *cookie,
+    struct selabel_handle *sehnd)
+{
+    MzExtractPool pool;
+    pthread_t threads[MZ_EXTRACT_MAX_WORKERS];
+    int started = 0;
+    unsigned int i;
+    unsigned int reported = 0;
+    int extractCount = 0;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.pArchive = pArchive;
+    pool.timestamp = timestamp;
+    pool.jobs = jobs;
+    if (workers > 0) {
+        pool.queue = (unsigned int *)malloc(jobCount * sizeof(unsigned int));
+        if (pool.queue == NULL) {
+            workers = 0;
+        }
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work, NULL);
+    pthread_cond_init(&pool.progress, NULL);
+
+    while (started < workers &&
+            pthread_create(&threads[started], NULL, extractWorker, &pool) == 0) {
+        started++;
+    }
+
+    for (i = 0; i < jobCount; i++) {
+        MzExtractJob *job = &jobs[i];
+        bool ok = true;
+
+        /* Duplicate names are next to each other in the sorted table.
+         * The later one must not be truncated while the earlier one is
+         * still being written, so wait for the workers to drain: the
+         * last duplicate wins, as it does when extracting serially.
+         */
+        bool duplicate = i > 0 &&
+                strcmp(job->targetFile, jobs[i - 1].targetFile) == 0;
+
+        pthread_mutex_lock(&pool.lock);
+        while (started > 0 && !pool.failed &&
+                (pool.inFlight >= started * MZ_EXTRACT_WINDOW ||
+                 (duplicate && pool.inFlight > 0))) {
+            pthread_cond_wait(&pool.progress, &pool.lock);
+        }
+        reportExtractJobs(&pool, i, &reported, callback, cookie);
+        bool failed = pool.failed;
+        pthread_mutex_unlock(&pool.lock);
+        if (failed) {
+            break;
+        }
+
+        if (job->kind == MZ_JOB_SYMLINK) {
+            ok = extractSymlink(pArchive, job);
+        } else if (job->kind == MZ_JOB_FILE) {
+            ok = openExtractJob(job, sehnd);
+            if (ok && started > 0) {
+                extractCount++;
+                pthread_mutex_lock(&pool.lock);
+                pool.inFlight++;
+                pool.queue[pool.queued++] = i;
+                pthread_cond_signal(&pool.work);
+                pthread_mutex_unlock(&pool.lock);
+                continue;
+            }
+            if (ok) {
+                ok = finishExtractJob(pArchive, job, timestamp);
+                extractCount++;
+            }
+        }
+
+        pthread_mutex_lock(&pool.lock);
+        job->done = true;
+        job->ok = ok;
+        if (!ok) {
+            pool.failed = true;
+        }
+        pthread_mutex_unlock(&pool.lock);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.closed = true;
+    pthread_cond_broadcast(&pool.work);
+    while (pool.inFlight > 0) {
+        pthread_cond_wait(&pool.progress, &pool.lock);
+    }
+    bool ok = !pool.failed;
+    reportExtractJobs(&pool, jobCount, &reported, callback, cookie);
+    pthread_mutex_unlock(&pool.lock);
+
+    while (started > 0) {
+        pthread_join(threads[--started], NULL);
+    }
+    pthread_cond_destroy(&pool.progress);
+    pthread_cond_destroy(&pool.work);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.queue);
+
+    LOGD("Extracted %d file(s)\n", extractCount);
+    return ok;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -1003,51 +1467,22 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
-    /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-    //TODO: since the entries are sorted, binary search for the first match
-    //      and stop after the first non-match.
+    /* Pick the entries whose path begins with zpath; they're next to
+     * each other in the sorted table.  If zpath is empty, that's all
+     * of them, which is what we want.
+    //TODO: look out for a single empty directory entry that matches zpath, but
+    //      missing the trailing slash.  Most zip files seem to include
+    //      the trailing slash, but I think it's legal to leave it off.
+    //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
      */
+    MzExtractJob *jobs = NULL;
+    unsigned int jobCount = 0;
+    unsigned int first;
+    unsigned int count = mzFindZipEntriesWithPrefix(pArchive, zpath, &first);
     unsigned int i;
-    bool seenMatch = false;
     int ok = true;
-    int extractCount = 0;
-    for (i = 0; i < pArchive->numEntries; i++) {
+    for (i = first; i < first + count; i++) {
         ZipEntry *pEntry = pArchive->pEntries + i;
-        if (pEntry->fileNameLen < zipDirLen) {
-       //TODO: look out for a single empty directory entry that matches zpath, but
-       //      missing the trailing slash.  Most zip files seem to include
-       //      the trailing slash, but I think it's legal to leave it off.
-       //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-            /* No chance of matching.
-             */
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* If zpath is empty, this strncmp() will match everything,
-         * which is what we want.
-         */
-        if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* This entry begins with zipDir, so we'll extract it.
-         */
-        seenMatch = true;
 
         /* Find the target location of the entry.
          */
@@ -1066,133 +1501,72 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
             continue;
         }
 
-        /* Create the file or directory.
-         */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
-        if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
-            if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
-                int ret = dirCreateHierarchy(
-                        targetFile, UNZIP_DIRMODE, timestamp, false, sehnd);
-                if (ret != 0) {
-                    LOGE("Can't create containing directory for \"%s\": %s\n",
-                            targetFile, strerror(errno));
-                    ok = false;
-                    break;
-                }
-                LOGD("Extracted dir \"%s\"\n", targetFile);
-            }
-        } else {
-            /* This is not a directory.  First, make sure that
-             * the containing directory exists.
-             */
-            int ret = dirCreateHierarchy(
-                    targetFile, UNZIP_DIRMODE, timestamp, true, sehnd);
-            if (ret != 0) {
-                LOGE("Can't create containing directory for \"%s\": %s\n",
-                        targetFile, strerror(errno));
+        if ((jobCount & (jobCount - 1)) == 0) {
+            MzExtractJob *newJobs = (MzExtractJob *)realloc(jobs,
+                    (jobCount == 0 ? 1 : jobCount * 2) * sizeof(MzExtractJob));
+            if (newJobs == NULL) {
+                LOGE("Can't allocate extraction list\n");
                 ok = false;
                 break;
             }
-
+            jobs = newJobs;
+        }
+        MzExtractJob *job = &jobs[jobCount];
+        memset(job, 0, sizeof(*job));
+        job->pEntry = pEntry;
+        job->fd = -1;
+        job->targetFile = strdup(targetFile);
+        if (job->targetFile == NULL) {
+            ok = false;
+            break;
+        }
+        jobCount++;
+        if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
+            job->kind = (flags & MZ_EXTRACT_FILES_ONLY) ? MZ_JOB_NONE : MZ_JOB_DIR;
+        } else if (!(flags & MZ_EXTRACT_FILES_ONLY) && mzIsZipEntrySymlink(pEntry)) {
             /* With FILES_ONLY set, we need to ignore metadata entirely,
              * so treat symlinks as regular files.
              */
-            if (!(flags & MZ_EXTRACT_FILES_ONLY) && mzIsZipEntrySymlink(pEntry)) {
-                /* The entry is a symbolic link.
-                 * The relative target of the symlink is in the
-                 * data section of this entry.
-                 */
-                if (pEntry->uncompLen == 0) {
-                    LOGE("Symlink entry \"%s\" has no target\n",
-                            targetFile);
-                    ok = false;
-                    break;
-                }
-                char *linkTarget = malloc(pEntry->uncompLen + 1);
-                if (linkTarget == NULL) {
-                    ok = false;
-                    break;
-                }
-                ok = mzReadZipEntry(pArchive, pEntry, linkTarget,
-                        pEntry->uncompLen);
-                if (!ok) {
-                    LOGE("Can't read symlink target for \"%s\"\n",
-                            targetFile);
-                    free(linkTarget);
-                    break;
-                }
-                linkTarget[pEntry->uncompLen] = '\0';
-
-                /* Make the link.
-                 */
-                ret = symlink(linkTarget, targetFile);
-                if (ret != 0) {
-                    LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
-                            targetFile, linkTarget, strerror(errno));
-                    free(linkTarget);
-                    ok = false;
-                    break;
-                }
-                LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
-                        targetFile, linkTarget);
-                free(linkTarget);
-            } else {
-                /* The entry is a regular file.
-                 * Open the target for writing.
-                 */
-
-                char *secontext = NULL;
-
-                if (sehnd) {
-                    selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
-                    setfscreatecon(secontext);
-                }
-
-                int fd = open(targetFile, O_CREAT|O_WRONLY|O_TRUNC|O_SYNC
-                        , UNZIP_FILEMODE);
-
-                if (secontext) {
-                    freecon(secontext);
-                    setfscreatecon(NULL);
-                }
-
-                if (fd < 0) {
-                    LOGE("Can't create target file \"%s\": %s\n",
-                            targetFile, strerror(errno));
-                    ok = false;
-                    break;
-                }
-
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                if (ok) {
-                    ok = (fsync(fd) == 0);
-                }
-                if (close(fd) != 0) {
-                    ok = false;
-                }
-                if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
-
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
-
-                LOGV("Extracted file \"%s\"\n", targetFile);
-                ++extractCount;
-            }
+            job->kind = MZ_JOB_SYMLINK;
+        } else {
+            job->kind = MZ_JOB_FILE;
         }
+    }
 
-        if (callback != NULL) callback(targetFile, cookie);
+    /* Create the whole directory tree up front, so the files can be
+     * written in any order.
+     */
+    for (i = 0; ok && i < jobCount; i++) {
+        MzExtractJob *job = &jobs[i];
+        if (job->kind == MZ_JOB_NONE) {
+            continue;
+        }
+        int ret = dirCreateHierarchy(job->targetFile, UNZIP_DIRMODE, timestamp,
+                job->kind != MZ_JOB_DIR, sehnd);
+        if (ret != 0) {
+            LOGE("Can't create containing directory for \"%s\": %s\n",
+                    job->targetFile, strerror(errno));
+            ok = false;
+        } else if (job->kind == MZ_JOB_DIR) {
+            LOGD("Extracted dir \"%s\"\n", job->targetFile);
+        }
     }
 
-    LOGD("Extracted %d file(s)\n", extractCount);
+    if (ok && jobCount > 0) {
+        int workers = 0;
+        if (flags & MZ_EXTRACT_PARALLEL) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            workers = cpus < 1 ? 1 : cpus > MZ_EXTRACT_MAX_WORKERS ?
+                    MZ_EXTRACT_MAX_WORKERS : (int)cpus;
+        }
+        ok = runExtractJobs(pArchive, jobs, jobCount, workers, timestamp,
+                callback, cookie, sehnd);
+    }
 
+    for (i = 0; i < jobCount; i++) {
+        free(jobs[i].targetFile);
+    }
+    free(jobs);
     free(helper.buf);
     free(zpath);
 
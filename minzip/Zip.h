@@ -32,9 +32,9 @@ extern "C" {
 typedef struct ZipEntry {
     unsigned int fileNameLen;
     const char*  fileName;       // not null-terminated
-    loff_t         offset;
-    long         compLen;
-    long         uncompLen;
+    loff_t       localHdrOffset; // data offset is read from here on use
+    loff_t       compLen;
+    loff_t       uncompLen;
     int          compression;
     long         modTime;
     long         crc32;
@@ -47,10 +47,10 @@ typedef struct ZipEntry {
  */
 typedef struct ZipArchive {
     unsigned int   numEntries;
-    ZipEntry*      pEntries;
-    HashTable*     pHash;          // maps file name to ZipEntry
+    ZipEntry*      pEntries;       // sorted by name
     unsigned char* addr;
     size_t         length;
+    const MemMapping* pMap;        // where "addr" is mapped from, or NULL
 } ZipArchive;
 
 /*
@@ -78,6 +78,17 @@ int mzOpenZipArchive(unsigned char* addr, size_t length, ZipArchive* pArchive);
  */
 void mzCloseZipArchive(ZipArchive* pArchive);
 
+/*
+ * Tell the archive the MemMapping its data is mapped from.  STORED
+ * entries are then extracted to files and devices by the kernel,
+ * straight from the package file or the blocks of a block map,
+ * without copying them through the mapping.  The mapping has to
+ * stay until the archive is closed.
+ */
+INLINE void mzSetZipArchiveMapping(ZipArchive* pArchive, const MemMapping* pMap) {
+    pArchive->pMap = pMap;
+}
+
 
 /*
  * Find an entry in the Zip archive, by name.
@@ -85,6 +96,15 @@ void mzCloseZipArchive(ZipArchive* pArchive);
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName);
 
+/*
+ * Find the entries whose names start with "prefix", e.g. everything in
+ * a directory with "dir/".  They are consecutive in the archive's
+ * (sorted) entry table: returns their number and sets *pFirst to the
+ * index of the first one.
+ */
+unsigned int mzFindZipEntriesWithPrefix(const ZipArchive* pArchive,
+        const char* prefix, unsigned int* pFirst);
+
 /*
  * Get the number of entries in the Zip archive.
  */
@@ -121,10 +141,7 @@ INLINE UnterminatedString mzGetZipEntryFileName(const ZipEntry* pEntry) {
     ret.len = pEntry->fileNameLen;
     return ret;
 }
-INLINE loff_t mzGetZipEntryOffset(const ZipEntry* pEntry) {
-    return pEntry->offset;
-}
-INLINE long mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
+INLINE loff_t mzGetZipEntryUncompLen(const ZipEntry* pEntry) {
     return pEntry->uncompLen;
 }
 INLINE long mzGetZipEntryModTime(const ZipEntry* pEntry) {
@@ -135,6 +152,13 @@ INLINE long mzGetZipEntryCrc32(const ZipEntry* pEntry) {
 }
 bool mzIsZipEntrySymlink(const ZipEntry* pEntry);
 
+/*
+ * Where the data of pEntry starts in the archive, or -1 if its local
+ * header is bad.  The local header is only read here, when an entry is
+ * used.
+ */
+loff_t mzGetZipEntryOffset(const ZipArchive* pArchive, const ZipEntry* pEntry);
+
 
 /*
  * Type definition for the callback function used by
@@ -158,12 +182,83 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     void *cookie);
 
 /*
- * Similar to mzProcessZipEntryContents, but explicitly process the stream
- * using XZ/LZMA before calling processFunction.
+ * Decompression backends.  DEFLATED entries, and entries using the
+ * Zstandard (93) and XZ (95) methods, go through the backend of their
+ * codec; the updater also keeps xz, zstd and lz4 streams as STORED
+ * entries and decodes them explicitly, see mzProcessZipEntryContentsAs().
+ */
+enum {
+    MZ_CODEC_DEFLATE,
+    MZ_CODEC_XZ,
+    MZ_CODEC_ZSTD,
+    MZ_CODEC_LZ4,
+    MZ_CODEC_COUNT
+};
+
+/*
+ * Decode the inLen bytes of compressed data at "in", handing the output
+ * to processFunction each time the batchLen bytes of "buf" fill up, and
+ * once more for the rest at the end.
+ *
+ * Returns the number of bytes produced, or -1 after logging an error
+ * (or when processFunction failed).
+ */
+typedef loff_t (*MzDecodeFunction)(const unsigned char *in, loff_t inLen,
+    unsigned char *buf, size_t batchLen,
+    ProcessZipEntryContentsFunction processFunction, void *cookie);
+
+typedef struct MzDecoder {
+    const char*      name;
+    MzDecodeFunction decode;
+} MzDecoder;
+
+/*
+ * Get the backend decoding "codec", or NULL if none was built in
+ * (zstd needs HAVE_ZSTD) or registered.
+ */
+const MzDecoder* mzGetDecoder(int codec);
+
+/*
+ * Replace the backend for "codec", e.g. with a faster inflate; NULL
+ * restores the built-in one.  Not thread-safe: set backends up before
+ * anything is extracted.
+ */
+void mzSetDecoder(int codec, const MzDecoder* decoder);
+
+/*
+ * Set how much decoded data backends collect before each call to the
+ * process function (32K by default).  Every call typically costs a
+ * write() or a hand-off to another thread, so writers of large
+ * images want bigger batches.  Not thread-safe, like mzSetDecoder().
+ */
+void mzSetDecodeBatchSize(size_t batchLen);
+
+/*
+ * Name of a codec, for logs.
+ */
+const char* mzCodecName(int codec);
+
+/*
+ * Get the codec of a compressed stream from its file name (".xz",
+ * ".zst" or ".lz4"), or -1 if the name has none of these suffixes.
+ */
+int mzCodecForFileName(const char* fileName, unsigned int fileNameLen);
+
+/*
+ * Similar to mzProcessZipEntryContents, but explicitly decode the STORED
+ * entry's data with "codec" before calling processFunction.
  *
- * This is a separate function for use by the updater. LZMA provides huge
- * size reductions vs deflate, but isn't actually supported by the ZIP format.
- * We need to process it using as little memory as possible.
+ * This is for use by the updater. xz and zstd provide huge size
+ * reductions vs deflate, and lz4 decodes much faster, but the ZIP
+ * format has no (widely supported) methods for them.  The streams are
+ * decoded with as little memory as possible.
+ */
+bool mzProcessZipEntryContentsAs(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, int codec,
+    ProcessZipEntryContentsFunction processFunction, void *cookie);
+
+/*
+ * mzProcessZipEntryContentsAs() with MZ_CODEC_XZ.
  */
 bool mzProcessZipEntryContentsXZ(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
@@ -228,11 +323,15 @@ bool mzGetStoredEntry(const ZipArchive *pArchive,
  *
  * If timestamp is non-NULL, file timestamps will be set accordingly.
  *
- * If callback is non-NULL, it will be invoked with each unpacked file.
+ * If callback is non-NULL, it will be invoked with each unpacked file,
+ * in archive order.
+ *
+ * With MZ_EXTRACT_PARALLEL set, the directories are created first and
+ * the files are then inflated by a pool of worker threads.
  *
  * Returns true on success, false on failure.
  */
-enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2 };
+enum { MZ_EXTRACT_FILES_ONLY = 1, MZ_EXTRACT_DRY_RUN = 2, MZ_EXTRACT_PARALLEL = 4 };
 bool mzExtractRecursive(const ZipArchive *pArchive,
         const char *zipDir, const char *targetDir,
         int flags, const struct utimbuf *timestamp,
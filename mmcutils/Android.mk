@@ -12,7 +12,8 @@ $(foreach board_define,$(BOARD_RECOVERY_DEFINES), \
   )
 
 LOCAL_SRC_FILES := \
-	mmcutils.c
+	mmcutils.c \
+	mmc_image.c
 
 LOCAL_MODULE := libmmcutils
 LOCAL_MODULE_TAGS := eng
@@ -0,0 +1,672 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <linux/fs.h>
+
+#include "mmc_image.h"
+
+#ifndef BLKDISCARD
+#define BLKDISCARD _IO(0x12, 119)
+#endif
+#ifndef BLKZEROOUT
+#define BLKZEROOUT _IO(0x12, 127)
+#endif
+#ifndef BLKGETSIZE64
+#define BLKGETSIZE64 _IOR(0x12, 114, size_t)
+#endif
+
+// Android sparse image format (system/core/libsparse/sparse_format.h).
+#define SPARSE_HEADER_MAGIC     0xed26ff3a
+#define SPARSE_MAJOR_VERSION    1
+#define CHUNK_TYPE_RAW          0xCAC1
+#define CHUNK_TYPE_FILL         0xCAC2
+#define CHUNK_TYPE_DONT_CARE    0xCAC3
+#define CHUNK_TYPE_CRC32        0xCAC4
+
+typedef struct {
+    uint32_t magic;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint16_t file_hdr_sz;
+    uint16_t chunk_hdr_sz;
+    uint32_t blk_sz;
+    uint32_t total_blks;
+    uint32_t total_chunks;
+    uint32_t image_checksum;
+} SparseHeader;
+
+typedef struct {
+    uint16_t chunk_type;
+    uint16_t reserved1;
+    uint32_t chunk_sz;      // in blocks
+    uint32_t total_sz;      // in bytes, header included
+} ChunkHeader;
+
+#define LE16(p) ((unsigned)(p)[0] | ((unsigned)(p)[1] << 8))
+#define LE32(p) (LE16(p) | ((unsigned)(p)[2] << 16) | ((unsigned)(p)[3] << 24))
+
+static int read_at(int fd, void *data, size_t len, off64_t offset) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = pread64(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EINVAL && (fcntl(fd, F_GETFL) & O_DIRECT)) {
+            // unaligned tail: finish it through the page cache
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            continue;
+        }
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int write_at(int fd, const void *data, size_t len, off64_t offset) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = pwrite64(fd, p, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EINVAL && (fcntl(fd, F_GETFL) & O_DIRECT)) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            continue;
+        }
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int read_fully(int fd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_fully(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static uint64_t fd_size(int fd) {
+    struct stat st;
+    uint64_t size = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        return st.st_size;
+    if (ioctl(fd, BLKGETSIZE64, &size) == 0)
+        return size;
+    off64_t end = lseek64(fd, 0, SEEK_END);
+    return end < 0 ? 0 : (uint64_t)end;
+}
+
+static int is_block_device(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISBLK(st.st_mode);
+}
+
+static int block_is_zero(const unsigned char *p, size_t len) {
+    return p[0] == 0 && memcmp(p, p + 1, len - 1) == 0;
+}
+
+static void *alloc_buffer() {
+    void *buffer = NULL;
+    if (posix_memalign(&buffer, MMC_IMAGE_BLOCK_SIZE, MMC_IMAGE_BUFFER_SIZE) != 0)
+        return NULL;
+    return buffer;
+}
+
+#define BIT_SET(map, i)   ((map)[(i) >> 3] |= 1 << ((i) & 7))
+#define BIT_TEST(map, i)  ((map)[(i) >> 3] & (1 << ((i) & 7)))
+
+// ext4 on-disk layout, only what the bitmaps need
+#define EXT4_SUPER_MAGIC                0xEF53
+#define EXT4_FEATURE_INCOMPAT_RECOVER   0x0004
+#define EXT4_FEATURE_INCOMPAT_META_BG   0x0010
+#define EXT4_FEATURE_INCOMPAT_64BIT     0x0080
+#define EXT4_FEATURE_RO_COMPAT_GDT_CSUM 0x0010
+#define EXT4_FEATURE_RO_COMPAT_BIGALLOC 0x0200
+#define EXT4_FEATURE_RO_COMPAT_METADATA_CSUM 0x0400
+#define EXT4_BG_BLOCK_UNINIT            0x0002
+
+// Features that keep one bitmap bit per block and the group descriptors
+// where they're read below. Anything else (bigalloc's per-cluster
+// bitmaps, meta_bg, snapshots, compression, a journal device, features
+// newer than this list...) means a raw dump.
+//   incompat:  filetype, extents, 64bit, mmp, flex_bg, ea_inode,
+//              csum_seed, largedir, inline_data, encrypt, casefold
+//   ro_compat: all but snapshot, bigalloc and replica
+#define EXT4_INCOMPAT_SUPPORTED         0x3e7c2
+#define EXT4_RO_COMPAT_SUPPORTED        0x1f57f
+
+static void mark_used(unsigned char *used, uint64_t fs_block, unsigned fs_block_size, uint32_t blocks) {
+    uint64_t start = fs_block * fs_block_size;
+    uint64_t first = start / MMC_IMAGE_BLOCK_SIZE;
+    uint64_t last = (start + fs_block_size - 1) / MMC_IMAGE_BLOCK_SIZE;
+    for (; first <= last && first < blocks; first++)
+        BIT_SET(used, first);
+}
+
+// Returns a bitmap of the image blocks an ext4 filesystem on fd uses,
+// everything past the end of the filesystem (crypto footer...) included.
+// Returns NULL when there is no ext4 filesystem whose bitmaps can be
+// trusted; blocks are then only left out when they read as zeroes.
+static unsigned char *ext4_used_blocks(const char *device, uint32_t blocks) {
+    unsigned char sb[1024];
+    unsigned char *used = NULL;
+    unsigned char *desc = NULL;
+    unsigned char *bitmap = NULL;
+
+    // small metadata reads, through the page cache
+    int fd = open(device, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (read_at(fd, sb, sizeof(sb), 1024) != 0 || LE16(sb + 0x38) != EXT4_SUPER_MAGIC)
+        goto fail;
+
+    unsigned log_block_size = LE32(sb + 0x18);
+    unsigned first_data_block = LE32(sb + 0x14);
+    unsigned blocks_per_group = LE32(sb + 0x20);
+    unsigned incompat = LE32(sb + 0x60);
+    unsigned ro_compat = LE32(sb + 0x64);
+    uint64_t blocks_count = LE32(sb + 0x04);
+    unsigned desc_size = 32;
+    if (incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+        blocks_count |= (uint64_t)LE32(sb + 0x150) << 32;
+        desc_size = LE16(sb + 0xfe);
+    }
+
+    // an unreplayed journal means the bitmaps may be stale; bigalloc
+    // bitmaps have a bit per cluster
+    if (log_block_size > 6 || blocks_per_group == 0 || desc_size < 32 ||
+            (incompat & (EXT4_FEATURE_INCOMPAT_RECOVER | EXT4_FEATURE_INCOMPAT_META_BG)) ||
+            (ro_compat & EXT4_FEATURE_RO_COMPAT_BIGALLOC) ||
+            (incompat & ~EXT4_INCOMPAT_SUPPORTED) || (ro_compat & ~EXT4_RO_COMPAT_SUPPORTED))
+        goto fail;
+
+    unsigned block_size = 1024 << log_block_size;
+    if (blocks_count <= first_data_block ||
+            blocks_count * block_size > (uint64_t)blocks * MMC_IMAGE_BLOCK_SIZE)
+        goto fail;
+    uint64_t groups = (blocks_count - first_data_block + blocks_per_group - 1) / blocks_per_group;
+    int uninit_flags = (ro_compat & (EXT4_FEATURE_RO_COMPAT_GDT_CSUM | EXT4_FEATURE_RO_COMPAT_METADATA_CSUM)) != 0;
+
+    used = calloc((blocks + 7) / 8, 1);
+    desc = malloc(groups * desc_size);
+    bitmap = malloc(block_size);
+    if (used == NULL || desc == NULL || bitmap == NULL ||
+            read_at(fd, desc, groups * desc_size, (off64_t)(first_data_block + 1) * block_size) != 0)
+        goto fail;
+
+    uint64_t b;
+    for (b = 0; b < first_data_block; b++)
+        mark_used(used, b, block_size, blocks);
+    for (b = blocks_count * block_size / MMC_IMAGE_BLOCK_SIZE; b < blocks; b++)
+        BIT_SET(used, b);
+
+    uint64_t g;
+    for (g = 0; g < groups; g++) {
+        unsigned char *d = desc + g * desc_size;
+        uint64_t first = first_data_block + g * blocks_per_group;
+        uint64_t count = blocks_count - first < blocks_per_group ? blocks_count - first : blocks_per_group;
+        uint64_t bitmap_block = LE32(d);
+        if (desc_size >= 64)
+            bitmap_block |= (uint64_t)LE32(d + 0x20) << 32;
+
+        if (bitmap_block >= blocks_count)
+            goto fail;
+        if (uninit_flags && (LE16(d + 0x12) & EXT4_BG_BLOCK_UNINIT)) {
+            // the bitmap is computed at mount time; keep the whole group
+            for (b = 0; b < count; b++)
+                mark_used(used, first + b, block_size, blocks);
+            continue;
+        }
+        if (read_at(fd, bitmap, block_size, (off64_t)bitmap_block * block_size) != 0)
+            goto fail;
+        for (b = 0; b < count; b++) {
+            if (BIT_TEST(bitmap, b))
+                mark_used(used, first + b, block_size, blocks);
+        }
+    }
+
+    free(desc);
+    free(bitmap);
+    close(fd);
+    return used;
+
+fail:
+    free(used);
+    free(desc);
+    free(bitmap);
+    close(fd);
+    return NULL;
+}
+
+typedef struct {
+    int fd;
+    uint32_t chunks;
+    int hole_type;          // CHUNK_TYPE_FILL or CHUNK_TYPE_DONT_CARE
+    uint32_t hole_blocks;   // pending, not written yet
+} SparseWriter;
+
+static int sparse_write_chunk(SparseWriter *w, int type, uint32_t blocks, const void *data) {
+    ChunkHeader chunk;
+    uint32_t fill = 0;
+    size_t len = 0;
+
+    if (type == CHUNK_TYPE_RAW)
+        len = (size_t)blocks * MMC_IMAGE_BLOCK_SIZE;
+    else if (type == CHUNK_TYPE_FILL)
+        len = sizeof(fill);
+    chunk.chunk_type = type;
+    chunk.reserved1 = 0;
+    chunk.chunk_sz = blocks;
+    chunk.total_sz = sizeof(chunk) + len;
+    w->chunks++;
+
+    if (write_fully(w->fd, &chunk, sizeof(chunk)) != 0)
+        return -1;
+    if (type == CHUNK_TYPE_FILL)
+        data = &fill;
+    return len == 0 ? 0 : write_fully(w->fd, data, len);
+}
+
+static int sparse_flush_hole(SparseWriter *w) {
+    int ret = 0;
+    if (w->hole_blocks > 0)
+        ret = sparse_write_chunk(w, w->hole_type, w->hole_blocks, NULL);
+    w->hole_blocks = 0;
+    return ret;
+}
+
+static int sparse_add_hole(SparseWriter *w, int type, uint32_t blocks) {
+    if (w->hole_blocks > 0 && w->hole_type != type && sparse_flush_hole(w) != 0)
+        return -1;
+    w->hole_type = type;
+    w->hole_blocks += blocks;
+    return 0;
+}
+
+// Emits the blocks of one buffer, count of them starting at block first.
+// Runs of data go out as they are; holes are merged across buffers.
+static int sparse_add_blocks(SparseWriter *w, const unsigned char *data, uint32_t first, uint32_t count,
+                             const unsigned char *used) {
+    uint32_t i = 0;
+    while (i < count) {
+        uint32_t run = i;
+        int type;
+        if (used != NULL && !BIT_TEST(used, first + i)) {
+            type = CHUNK_TYPE_DONT_CARE;
+            while (run < count && !BIT_TEST(used, first + run))
+                run++;
+        } else if (block_is_zero(data + (size_t)i * MMC_IMAGE_BLOCK_SIZE, MMC_IMAGE_BLOCK_SIZE)) {
+            type = CHUNK_TYPE_FILL;
+            while (run < count && (used == NULL || BIT_TEST(used, first + run)) &&
+                    block_is_zero(data + (size_t)run * MMC_IMAGE_BLOCK_SIZE, MMC_IMAGE_BLOCK_SIZE))
+                run++;
+        } else {
+            type = CHUNK_TYPE_RAW;
+            while (run < count && (used == NULL || BIT_TEST(used, first + run)) &&
+                    !block_is_zero(data + (size_t)run * MMC_IMAGE_BLOCK_SIZE, MMC_IMAGE_BLOCK_SIZE))
+                run++;
+        }
+
+        if (type == CHUNK_TYPE_RAW) {
+            if (sparse_flush_hole(w) != 0 ||
+                    sparse_write_chunk(w, type, run - i, data + (size_t)i * MMC_IMAGE_BLOCK_SIZE) != 0)
+                return -1;
+        } else if (sparse_add_hole(w, type, run - i) != 0) {
+            return -1;
+        }
+        i = run;
+    }
+    return 0;
+}
+
+// Returns 1 if every block of the range is unused by the filesystem.
+static int range_unused(const unsigned char *used, uint32_t first, uint32_t count) {
+    uint32_t i;
+    if (used == NULL)
+        return 0;
+    for (i = 0; i < count; i++) {
+        if (BIT_TEST(used, first + i))
+            return 0;
+    }
+    return 1;
+}
+
+static int dump_sparse(const char *device, int in_fd, int out_fd, uint64_t size, unsigned char *buffer,
+                       mmc_image_progress progress, void *cookie) {
+    uint32_t blocks = size / MMC_IMAGE_BLOCK_SIZE;
+    uint32_t per_buffer = MMC_IMAGE_BUFFER_SIZE / MMC_IMAGE_BLOCK_SIZE;
+    SparseHeader header;
+    SparseWriter w;
+    uint32_t block;
+    int ret = 0;
+
+    unsigned char *used = ext4_used_blocks(device, blocks);
+    if (used != NULL)
+        printf("ext4 filesystem found, unused blocks are left out\n");
+
+    memset(&header, 0, sizeof(header));
+    header.magic = SPARSE_HEADER_MAGIC;
+    header.major_version = SPARSE_MAJOR_VERSION;
+    header.file_hdr_sz = sizeof(SparseHeader);
+    header.chunk_hdr_sz = sizeof(ChunkHeader);
+    header.blk_sz = MMC_IMAGE_BLOCK_SIZE;
+    header.total_blks = blocks;
+
+    memset(&w, 0, sizeof(w));
+    w.fd = out_fd;
+    // the chunk count is filled in once known
+    if (write_fully(out_fd, &header, sizeof(header)) != 0)
+        ret = -1;
+
+    for (block = 0; ret == 0 && block < blocks; block += per_buffer) {
+        uint32_t count = blocks - block < per_buffer ? blocks - block : per_buffer;
+        if (range_unused(used, block, count)) {
+            // nothing to read
+            ret = sparse_add_hole(&w, CHUNK_TYPE_DONT_CARE, count);
+        } else if (read_at(in_fd, buffer, (size_t)count * MMC_IMAGE_BLOCK_SIZE,
+                (off64_t)block * MMC_IMAGE_BLOCK_SIZE) != 0) {
+            printf("error reading block %u (%s)\n", block, strerror(errno));
+            ret = -1;
+        } else {
+            ret = sparse_add_blocks(&w, buffer, block, count, used);
+        }
+        if (ret == 0 && progress != NULL && progress(cookie, (uint64_t)(block + count) * MMC_IMAGE_BLOCK_SIZE))
+            ret = -1;
+    }
+
+    if (ret == 0)
+        ret = sparse_flush_hole(&w);
+    header.total_chunks = w.chunks;
+    if (ret == 0 && write_at(out_fd, &header, sizeof(header), 0) != 0)
+        ret = -1;
+    free(used);
+    return ret;
+}
+
+static int copy_plain(int in_fd, int out_fd, uint64_t size, unsigned char *buffer,
+                      mmc_image_progress progress, void *cookie) {
+    uint64_t done = 0;
+    while (done < size) {
+        size_t len = size - done < MMC_IMAGE_BUFFER_SIZE ? size - done : MMC_IMAGE_BUFFER_SIZE;
+        if (read_at(in_fd, buffer, len, done) != 0) {
+            printf("error reading at %llu (%s)\n", (unsigned long long)done, strerror(errno));
+            return -1;
+        }
+        if (write_at(out_fd, buffer, len, done) != 0) {
+            printf("error writing at %llu (%s)\n", (unsigned long long)done, strerror(errno));
+            return -1;
+        }
+        done += len;
+        if (progress != NULL && progress(cookie, done))
+            return -1;
+    }
+    return 0;
+}
+
+int mmc_image_dump(const char *device, const char *out_file, uint64_t size,
+                   mmc_image_progress progress, void *cookie) {
+    struct stat st;
+    int ret = -1;
+    int in_fd = open(device, O_RDONLY | O_DIRECT);
+    if (in_fd < 0)
+        in_fd = open(device, O_RDONLY);
+    if (in_fd < 0) {
+        printf("can't open %s (%s)\n", device, strerror(errno));
+        return -1;
+    }
+    int out_fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        printf("can't open %s (%s)\n", out_file, strerror(errno));
+        close(in_fd);
+        return -1;
+    }
+    unsigned char *buffer = alloc_buffer();
+    if (buffer == NULL)
+        goto done;
+
+    if (size == 0)
+        size = fd_size(in_fd);
+    if (fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode) && size >= MMC_IMAGE_SPARSE_MIN_SIZE &&
+            size % MMC_IMAGE_BLOCK_SIZE == 0 && size / MMC_IMAGE_BLOCK_SIZE <= UINT32_MAX) {
+        ret = dump_sparse(device, in_fd, out_fd, size, buffer, progress, cookie);
+    } else if (fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        ret = copy_plain(in_fd, out_fd, size, buffer, progress, cookie);
+    } else {
+        // pipe (backup to stdout): plain sequential writes
+        uint64_t done = 0;
+        ret = 0;
+        while (ret == 0 && done < size) {
+            size_t len = size - done < MMC_IMAGE_BUFFER_SIZE ? size - done : MMC_IMAGE_BUFFER_SIZE;
+            if (read_at(in_fd, buffer, len, done) != 0 || write_fully(out_fd, buffer, len) != 0)
+                ret = -1;
+            done += len;
+            if (ret == 0 && progress != NULL && progress(cookie, done))
+                ret = -1;
+        }
+    }
+
+    if (ret == 0 && fsync(out_fd) != 0 && errno != EINVAL)
+        ret = -1;
+done:
+    free(buffer);
+    if (close(out_fd) != 0)
+        ret = -1;
+    close(in_fd);
+    return ret;
+}
+
+int mmc_image_is_sparse(const char *file) {
+    uint32_t magic = 0;
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    int ret = read_fully(fd, &magic, sizeof(magic)) == 0 && magic == SPARSE_HEADER_MAGIC;
+    close(fd);
+    return ret;
+}
+
+// Clears or discards a range of the target. Regular files were truncated
+// on open and are sized at the end, so their holes need no writes.
+static int restore_hole(int fd, int type, uint64_t offset, uint64_t len, int block_device, unsigned char *buffer) {
+    uint64_t range[2] = { offset, len };
+
+    if (type == CHUNK_TYPE_DONT_CARE) {
+        if (block_device)
+            ioctl(fd, BLKDISCARD, &range);
+        return 0;
+    }
+    if (!block_device || ioctl(fd, BLKZEROOUT, &range) == 0)
+        return 0;
+
+    memset(buffer, 0, MMC_IMAGE_BUFFER_SIZE);
+    while (len > 0) {
+        size_t n = len < MMC_IMAGE_BUFFER_SIZE ? len : MMC_IMAGE_BUFFER_SIZE;
+        if (write_at(fd, buffer, n, offset) != 0)
+            return -1;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int restore_sparse(int in_fd, int out_fd, unsigned char *buffer,
+                          mmc_image_progress progress, void *cookie) {
+    SparseHeader header;
+    ChunkHeader chunk;
+    int block_device = is_block_device(out_fd);
+    uint32_t i;
+
+    if (read_fully(in_fd, &header, sizeof(header)) != 0 ||
+            header.major_version != SPARSE_MAJOR_VERSION ||
+            header.file_hdr_sz < sizeof(SparseHeader) ||
+            header.chunk_hdr_sz < sizeof(ChunkHeader) ||
+            header.blk_sz == 0 || header.blk_sz % 512 != 0 ||
+            lseek64(in_fd, header.file_hdr_sz, SEEK_SET) < 0) {
+        printf("bad sparse image header\n");
+        return -1;
+    }
+
+    uint64_t total = (uint64_t)header.total_blks * header.blk_sz;
+    if (block_device && total > fd_size(out_fd)) {
+        printf("image is larger than the partition (%llu bytes)\n", (unsigned long long)total);
+        return -1;
+    }
+
+    uint64_t offset = 0;
+    for (i = 0; i < header.total_chunks; i++) {
+        uint32_t fill;
+        if (read_fully(in_fd, &chunk, sizeof(chunk)) != 0 ||
+                lseek64(in_fd, header.chunk_hdr_sz - sizeof(chunk), SEEK_CUR) < 0) {
+            printf("truncated sparse image\n");
+            return -1;
+        }
+        uint64_t len = (uint64_t)chunk.chunk_sz * header.blk_sz;
+        if (chunk.chunk_type != CHUNK_TYPE_CRC32 && offset + len > total) {
+            printf("sparse chunk %u runs past the image end\n", i);
+            return -1;
+        }
+
+        switch (chunk.chunk_type) {
+            case CHUNK_TYPE_RAW: {
+                uint64_t done = 0;
+                if (chunk.total_sz != header.chunk_hdr_sz + len) {
+                    printf("bad raw chunk %u\n", i);
+                    return -1;
+                }
+                while (done < len) {
+                    size_t n = len - done < MMC_IMAGE_BUFFER_SIZE ? len - done : MMC_IMAGE_BUFFER_SIZE;
+                    if (read_fully(in_fd, buffer, n) != 0 || write_at(out_fd, buffer, n, offset + done) != 0) {
+                        printf("error restoring chunk %u (%s)\n", i, strerror(errno));
+                        return -1;
+                    }
+                    done += n;
+                }
+                break;
+            }
+            case CHUNK_TYPE_FILL:
+                if (read_fully(in_fd, &fill, sizeof(fill)) != 0)
+                    return -1;
+                if (fill == 0) {
+                    if (restore_hole(out_fd, CHUNK_TYPE_FILL, offset, len, block_device, buffer) != 0)
+                        return -1;
+                } else {
+                    uint64_t done = 0;
+                    size_t k;
+                    for (k = 0; k < MMC_IMAGE_BUFFER_SIZE / sizeof(fill); k++)
+                        ((uint32_t*)buffer)[k] = fill;
+                    while (done < len) {
+                        size_t n = len - done < MMC_IMAGE_BUFFER_SIZE ? len - done : MMC_IMAGE_BUFFER_SIZE;
+                        if (write_at(out_fd, buffer, n, offset + done) != 0)
+                            return -1;
+                        done += n;
+                    }
+                }
+                break;
+            case CHUNK_TYPE_DONT_CARE:
+                restore_hole(out_fd, CHUNK_TYPE_DONT_CARE, offset, len, block_device, buffer);
+                break;
+            case CHUNK_TYPE_CRC32:
+                if (read_fully(in_fd, &fill, sizeof(fill)) != 0)
+                    return -1;
+                break;
+            default:
+                printf("unknown sparse chunk type 0x%x\n", chunk.chunk_type);
+                return -1;
+        }
+        if (chunk.chunk_type != CHUNK_TYPE_CRC32)
+            offset += len;
+        if (progress != NULL && progress(cookie, offset))
+            return -1;
+    }
+
+    if (!block_device && ftruncate64(out_fd, total) != 0)
+        return -1;
+    return 0;
+}
+
+int mmc_image_restore(const char *in_file, const char *device,
+                      mmc_image_progress progress, void *cookie) {
+    int ret = -1;
+    int in_fd = open(in_file, O_RDONLY);
+    if (in_fd < 0) {
+        printf("can't open %s (%s)\n", in_file, strerror(errno));
+        return -1;
+    }
+    int out_fd = open(device, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd < 0) {
+        printf("can't open %s (%s)\n", device, strerror(errno));
+        close(in_fd);
+        return -1;
+    }
+    // aligned buffers and offsets let the partition take O_DIRECT writes
+    if (is_block_device(out_fd))
+        fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) | O_DIRECT);
+    posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    unsigned char *buffer = alloc_buffer();
+    if (buffer == NULL)
+        goto done;
+
+    if (mmc_image_is_sparse(in_file))
+        ret = restore_sparse(in_fd, out_fd, buffer, progress, cookie);
+    else
+        ret = copy_plain(in_fd, out_fd, fd_size(in_fd), buffer, progress, cookie);
+
+    if (ret == 0 && fsync(out_fd) != 0)
+        ret = -1;
+done:
+    free(buffer);
+    if (close(out_fd) != 0)
+        ret = -1;
+    close(in_fd);
+    return ret;
+}
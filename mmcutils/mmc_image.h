@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MMC_IMAGE_H_
+#define MMC_IMAGE_H_
+
+#include <stdint.h>
+
+// Raw partition imaging. Partitions are read with large O_DIRECT
+// transfers; images of partitions of MMC_IMAGE_SPARSE_MIN_SIZE and more
+// are written in the Android sparse format (the one fastboot and simg2img
+// take), leaving out zeroed blocks and, for ext4, the blocks the
+// filesystem does not use. Smaller partitions (boot, recovery, ...) keep
+// plain images. Restore takes either kind of image.
+
+#define MMC_IMAGE_BLOCK_SIZE        4096
+#define MMC_IMAGE_BUFFER_SIZE       (4 * 1024 * 1024)
+#define MMC_IMAGE_SPARSE_MIN_SIZE   (64 * 1024 * 1024)
+
+// Called as the copy advances with the partition bytes covered so far.
+// Returning nonzero aborts the copy.
+typedef int (*mmc_image_progress)(void *cookie, uint64_t bytes_done);
+
+// Images the first size bytes of device (all of it if size is 0) into
+// out_file. The image is plain when out_file is not a regular file.
+int mmc_image_dump(const char *device, const char *out_file, uint64_t size,
+                   mmc_image_progress progress, void *cookie);
+
+// Writes a plain or sparse image back. Zeroed blocks of a sparse image
+// are cleared with BLKZEROOUT and unused ones discarded.
+int mmc_image_restore(const char *in_file, const char *device,
+                      mmc_image_progress progress, void *cookie);
+
+// Returns 1 if file is a sparse image.
+int mmc_image_is_sparse(const char *file);
+
+// cmd_mmc_backup_raw_partition() with progress reports.
+int mmc_backup_raw_partition(const char *partition, const char *filename,
+                             mmc_image_progress progress, void *cookie);
+
+#endif  // MMC_IMAGE_H_
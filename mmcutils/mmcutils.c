@@ -40,6 +40,7 @@
 #include <sys/mount.h>  // for _IOW, _IOR, mount()
 
 #include "mmcutils.h"
+#include "mmc_image.h"
 
 #ifdef BOARD_HAS_MTK_CPU
 #ifdef BOARD_NEEDS_MTK_GETSIZE
@@ -426,118 +427,15 @@ mmc_mount_partition(const MmcPartition *partition, const char *mount_point,
 
 int
 mmc_raw_copy (const MmcPartition *partition, char *in_file) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned sz = 0;
-    unsigned i;
-    int ret = -1;
-    char *out_file = partition->device_index;
-
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
-
-    fseek(in, 0L, SEEK_END);
-    sz = ftell(in);
-    fseek(in, 0L, SEEK_SET);
-
-    if (sz % 512)
-    {
-        while ( ( ch = fgetc ( in ) ) != EOF )
-            fputc ( ch, out );
-    }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
-    }
-
-    fsync(fileno(out));
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
-    return ret;
-
+    return mmc_image_restore(in_file, partition->device_index, NULL, NULL);
 }
 
 
 int
 mmc_raw_dump_internal (const char* in_file, const char *out_file, unsigned sz) {
-    int ch;
-    FILE *in;
-    FILE *out;
-    int val = 0;
-    char buf[512];
-    unsigned i;
-    int ret = -1;
-
-    in  = fopen ( in_file,  "r" );
-    if (in == NULL)
-        goto ERROR3;
-
-    out = fopen ( out_file,  "w" );
-    if (out == NULL)
-        goto ERROR2;
-
-    if (sz == 0)
-    {
-        fseek(in, 0L, SEEK_END);
-        sz = ftell(in);
-        fseek(in, 0L, SEEK_SET);
-    }
-
-    if (sz % 512)
-    {
-        unsigned counter = 0;
-        while ( ( ch = fgetc ( in ) ) != EOF )
-        {
-            fputc ( ch, out );
-#ifdef BOARD_HAS_MTK_CPU
-#ifdef BOARD_NEEDS_MTK_GETSIZE
-            if (++counter == sz)
-                break;
-#endif
-#endif
-        }
-    }
-    else
-    {
-        for (i=0; i< (sz/512); i++)
-        {
-            if ((fread(buf, 512, 1, in)) != 1)
-                goto ERROR1;
-            if ((fwrite(buf, 512, 1, out)) != 1)
-                goto ERROR1;
-        }
-    }
-
-    fsync(fileno(out));
-    ret = 0;
-ERROR1:
-    fclose ( out );
-ERROR2:
-    fclose ( in );
-ERROR3:
-    return ret;
-
+    return mmc_image_dump(in_file, out_file, sz, NULL, NULL);
 }
 
-// TODO: refactor this to not be a giant copy paste mess
 int
 mmc_raw_dump (const MmcPartition *partition, char *out_file) {
     return mmc_raw_dump_internal(partition->device_index, out_file, 0);
@@ -611,11 +509,17 @@ int cmd_mmc_restore_raw_partition(const char *partition, const char *filename)
         return mmc_raw_copy(p, filename);
     }
     else {
-        return mmc_raw_dump_internal(filename, partition, 0);
+        return mmc_image_restore(filename, partition, NULL, NULL);
     }
 }
 
 int cmd_mmc_backup_raw_partition(const char *partition, const char *filename)
+{
+    return mmc_backup_raw_partition(partition, filename, NULL, NULL);
+}
+
+int mmc_backup_raw_partition(const char *partition, const char *filename,
+                             mmc_image_progress progress, void *cookie)
 {
     if (partition[0] != '/') {
         mmc_scan_partitions();
@@ -623,7 +527,7 @@ int cmd_mmc_backup_raw_partition(const char *partition, const char *filename)
         p = mmc_find_partition_by_name(partition);
         if (p == NULL)
             return -1;
-        return mmc_raw_dump(p, filename);
+        return mmc_image_dump(p->device_index, filename, 0, progress, cookie);
     }
     else {
         unsigned sz = 0;
@@ -695,7 +599,7 @@ int cmd_mmc_backup_raw_partition(const char *partition, const char *filename)
 #endif
 #endif
        
-        return mmc_raw_dump_internal(partition, filename, sz);
+        return mmc_image_dump(partition, filename, sz, progress, cookie);
     }
 }
 
@@ -35,6 +35,7 @@
 #include <dirent.h>
 #include <sys/stat.h>
 
+#include <pthread.h>
 #include <signal.h>
 #include <sys/wait.h>
 
@@ -54,9 +55,18 @@
 
 #include "extendedcommands.h"
 #include "nandroid.h"
+#include "nandroid_archive.h"
+#include "nandroid_compress.h"
+#include "nandroid_dedup.h"
+#include "nandroid_digest.h"
+#include "nandroid_journal.h"
+#include "nandroid_sched.h"
+#include "nandroid_stats.h"
+#include "nandroid_stream.h"
 #include "mtdutils/mounts.h"
 
 #include "flashutils/flashutils.h"
+#include "mmcutils/mmc_image.h"
 
 typedef void (*file_event_callback)(const char* filename);
 typedef int (*nandroid_backup_handler)(const char* backup_path, const char* backup_file_image, int callback);
@@ -65,6 +75,7 @@ typedef int (*nandroid_restore_handler)(const char* backup_file_image, const cha
 static int nandroid_backup_bitfield = 0;
 static unsigned int nandroid_files_total = 0;
 static unsigned int nandroid_files_count = 0;
+static uint64_t nandroid_bytes_total = 0;
 static int nandroid_canceled = 0;
 
 // time using gettimeofday()
@@ -155,7 +166,7 @@ static int print_and_error(const char* message, int ret) {
 }
 
 static void nandroid_callback(const char* filename) {
-    if (filename == NULL)
+    if (filename == NULL || nandroid_current_job() != NULL)
         return;
 
     char tmp[PATH_MAX];
@@ -174,37 +185,36 @@ static void nandroid_callback(const char* filename) {
     ui_set_log_stdout(1);
 }
 
-static void compute_directory_stats(const char* directory) {
-    char tmp[PATH_MAX];
-    char count_text[100];
+static const char* const* get_backup_excludes(const char* backup_path) {
+    static const char* const default_excludes[] = {
+        "data/data/com.google.android.music/files/*",
+        NULL
+    };
+    static const char* const data_media_excludes[] = {
+        "data/data/com.google.android.music/files/*",
+        "data/media",
+        NULL
+    };
+
+    if (strcmp(backup_path, "/data") == 0 && is_data_media())
+        return data_media_excludes;
+    return default_excludes;
+}
 
+static void compute_directory_stats(const char* directory) {
     // reset file count if we ever return before setting it
     nandroid_files_count = 0;
     nandroid_files_total = 0;
+    nandroid_bytes_total = 0;
 
-    sprintf(tmp, "find %s | %s wc -l > /tmp/dircount", directory, strcmp(directory, "/data") == 0 && is_data_media() ? "grep -v /data/media |" : "");
-    __system(tmp);
-
-    FILE* f = fopen("/tmp/dircount", "r");
-    if (f == NULL)
-        return;
-
-    if (fgets(count_text, sizeof(count_text), f) == NULL) {
-        fclose(f);
-        return;
-    }
-
-    size_t len = strlen(count_text);
-    if (count_text[len - 1] == '\n')
-        count_text[len - 1] = '\0';
-
-    fclose(f);
-    nandroid_files_total = atoi(count_text);
+    nandroid_archive_stats(directory, get_backup_excludes(directory),
+                           &nandroid_bytes_total, &nandroid_files_total);
     ui_reset_progress();
     ui_show_progress(1, 0);
 }
 
 void finish_nandroid_job() {
+    nandroid_verify_end();
     ui_print("[*] Finalizing, please wait...\n");
     sync();
         ui_set_background(BACKGROUND_ICON_NONE);
@@ -212,7 +222,9 @@ void finish_nandroid_job() {
     ui_reset_progress();
 }
 
-int user_cancel_nandroid(FILE **fp, const char* backup_file_image, int is_backup, int *nand_starts) {
+// Polls the keys while a nandroid job runs and asks for confirmation
+// when cancel is pressed. Returns 1 once the user confirmed.
+static int nandroid_cancel_requested(int *nand_starts) {
     if (!is_ui_initialized())
         return 0;
 
@@ -243,21 +255,6 @@ int user_cancel_nandroid(FILE **fp, const char* backup_file_image, int is_backup
 
             ui_print("[*] Cancelling, please wait...\n");
             ui_clear_key_queue();
-            __pclose(*fp);
-            nandroid_canceled = 1;
-            if (is_backup) {
-                char cmd[PATH_MAX];
-                ui_print("[*] Deleting backup...\n");
-                sync(); // before deleting backup folder
-                sprintf(cmd, "rm -rf '%s'", dirname(backup_file_image));
-                __system(cmd);
-            }
-
-            finish_nandroid_job();
-            if (!is_backup) {
-                ui_print("\n[!] Partition was left corrupted after cancel command!\n");
-            }
-
             return 1;
         }
     }
@@ -265,6 +262,48 @@ int user_cancel_nandroid(FILE **fp, const char* backup_file_image, int is_backup
     return 0;
 }
 
+static void nandroid_cancel_cleanup(const char* backup_file_image, int is_backup) {
+    nandroid_canceled = 1;
+    if (is_backup && nandroid_journal_active()) {
+        // what was completed is kept for "Resume backup"
+        sync();
+        ui_print("[*] Backup kept, it can be resumed later.\n");
+    } else if (is_backup) {
+        char cmd[PATH_MAX];
+        ui_print("[*] Deleting backup...\n");
+        sync(); // before deleting backup folder
+        sprintf(cmd, "rm -rf '%s'", dirname(backup_file_image));
+        __system(cmd);
+    }
+
+    finish_nandroid_job();
+    if (!is_backup) {
+        ui_print("\n[!] Partition was left corrupted after cancel command!\n");
+        if (nandroid_journal_active())
+            ui_print("[*] Resume the restore to finish it.\n");
+    }
+}
+
+int user_cancel_nandroid(FILE **fp, const char* backup_file_image, int is_backup, int *nand_starts) {
+    NandroidJob* job = nandroid_current_job();
+    if (job != NULL) {
+        // scheduled jobs only stop; keys are polled by the scheduler
+        if (!nandroid_job_progress(job, job->bytes_done))
+            return 0;
+        if (fp != NULL)
+            __pclose(*fp);
+        return 1;
+    }
+
+    if (!nandroid_cancel_requested(nand_starts))
+        return 0;
+
+    if (fp != NULL)
+        __pclose(*fp);
+    nandroid_cancel_cleanup(backup_file_image, is_backup);
+    return 1;
+}
+
 static int mkyaffs2image_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
     sprintf(tmp, "cd %s ; mkyaffs2image . %s.img ; exit $?", backup_path, backup_file_image);
@@ -313,25 +352,149 @@ static int do_tar_compress(char* command, int callback, const char* backup_file_
     return __pclose(fp);
 }
 
+typedef struct {
+    const char* backup_file_image;
+    int callback;
+    int nand_starts;
+} NandroidArchiveJob;
+
+static int nandroid_archive_progress(uint64_t bytes_done, void* cookie) {
+    NandroidJob* sched_job = nandroid_current_job();
+    if (sched_job != NULL)
+        return nandroid_job_progress(sched_job, bytes_done);
+
+    NandroidArchiveJob* job = (NandroidArchiveJob*)cookie;
+    if (job->callback)
+        nandroid_stats_show_progress(bytes_done, nandroid_bytes_total);
+    return nandroid_cancel_requested(&job->nand_starts);
+}
+
+// Archives backup_path with the in-process tar writer into sink, which
+// is closed here whatever the outcome.
+static int do_native_tar_compress(const char* backup_path, const char* backup_file_image, NandroidSink* sink, int callback) {
+    if (sink == NULL) {
+        ui_print("Unable to create backup archive!\n");
+        return -1;
+    }
+
+    NandroidArchiveJob job = { backup_file_image, callback, 1 };
+    set_perf_mode(1);
+    int ret = nandroid_archive_create(backup_path, get_backup_excludes(backup_path), sink,
+                                      nandroid_archive_progress, &job);
+    int close_ret = sink->close(sink, ret != NANDROID_ARCHIVE_OK);
+    set_perf_mode(0);
+
+    if (ret == NANDROID_ARCHIVE_CANCELED) {
+        // the scheduler cleans up once all of its jobs have stopped
+        if (nandroid_current_job() == NULL)
+            nandroid_cancel_cleanup(backup_file_image, 1);
+        return -1;
+    }
+    return (ret == NANDROID_ARCHIVE_OK && close_ret == 0) ? 0 : -1;
+}
+
 static int tar_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; touch %s.tar ; set -o pipefail ; (tar -cpv --exclude=data/data/com.google.android.music/files/* %s $(basename %s) | split -a 1 -b 1000000000 /proc/self/fd/0 %s.tar.) 2> /proc/self/fd/1 ; exit $?", backup_path, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "--exclude=data/media" : "", backup_path, backup_file_image);
+    sprintf(tmp, "%s.tar", backup_file_image);
 
-    return do_tar_compress(tmp, callback, backup_file_image);
+    return do_native_tar_compress(backup_path, backup_file_image, volume_sink_open(tmp, NANDROID_VOLUME_SIZE), callback);
 }
 
 static int tar_gzip_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; touch %s.tar.gz ; set -o pipefail ; (tar -cpv --exclude=data/data/com.google.android.music/files/* %s $(basename %s) | pigz -c | split -a 1 -b 1000000000 /proc/self/fd/0 %s.tar.gz.) 2> /proc/self/fd/1 ; exit $?", backup_path, backup_file_image, strcmp(backup_path, "/data") == 0 && is_data_media() ? "--exclude=data/media" : "", backup_path, backup_file_image);
+    char* const pigz_argv[] = { "pigz", "-c", NULL };
+    sprintf(tmp, "%s.tar.gz", backup_file_image);
 
-    return do_tar_compress(tmp, callback, backup_file_image);
+    NandroidSink* volumes = volume_sink_open(tmp, NANDROID_VOLUME_SIZE);
+    NandroidSink* sink = volumes == NULL ? NULL : filter_sink_open(pigz_argv, volumes);
+    return do_native_tar_compress(backup_path, backup_file_image, sink, callback);
 }
 
-static int tar_dump_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+static int tar_pgzip_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
     char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s); set -o pipefail ; tar -cpv --exclude=data/data/com.google.android.music/files/* %s $(basename %s) 2> /dev/null | cat", backup_path, strcmp(backup_path, "/data") == 0 && is_data_media() ? "--exclude=data/media" : "", backup_path);
+    sprintf(tmp, "%s.tar.gz", backup_file_image);
+
+    NandroidSink* volumes = volume_sink_open(tmp, NANDROID_VOLUME_SIZE);
+    NandroidSink* sink = volumes == NULL ? NULL : parallel_gzip_sink_open(volumes);
+    return do_native_tar_compress(backup_path, backup_file_image, sink, callback);
+}
 
-    return __system(tmp);
+// Chunk store shared by the backups next to the one backup_file_image is in.
+static void dedup_store_for_image(const char* backup_file_image, char* store) {
+    char dir[PATH_MAX];
+    strcpy(dir, backup_file_image);
+    char* slash = strrchr(dir, '/');
+    if (slash != NULL)
+        *slash = '\0';
+    dedup_store_path(dir, store);
+}
+
+static int dedup_compress_wrapper(const char* backup_path, const char* backup_file_image, int callback) {
+    char tmp[PATH_MAX];
+    char store[PATH_MAX];
+    sprintf(tmp, "%s%s", backup_file_image, DEDUP_MANIFEST_EXT);
+    dedup_store_for_image(backup_file_image, store);
+
+    return do_native_tar_compress(backup_path, backup_file_image, dedup_sink_open(store, tmp), callback);
+}
+
+// Chunks a raw emmc partition into the store; unused blocks repeat from
+// one backup to the next and cost nothing after the first one.
+static int dedup_raw_backup(const char* device, const char* backup_file_image) {
+    char tmp[PATH_MAX];
+    char store[PATH_MAX];
+    int ret = 0;
+
+    sprintf(tmp, "%s%s", backup_file_image, DEDUP_MANIFEST_EXT);
+    dedup_store_for_image(backup_file_image, store);
+
+    int fd = open(device, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("Can't open %s (%s)\n", device, strerror(errno));
+        return -1;
+    }
+    NandroidSink* sink = dedup_sink_open(store, tmp);
+    unsigned char* buffer = malloc(NANDROID_ARCHIVE_BUFFER_SIZE);
+    if (sink == NULL || buffer == NULL) {
+        if (sink != NULL)
+            sink->close(sink, 1);
+        free(buffer);
+        close(fd);
+        return -1;
+    }
+
+    NandroidJob* job = nandroid_current_job();
+    uint64_t done = 0;
+    NandroidPhase* stats = nandroid_stats_current();
+    for (;;) {
+        uint64_t start = nandroid_stats_now_us();
+        ssize_t n = read(fd, buffer, NANDROID_ARCHIVE_BUFFER_SIZE);
+        if (n > 0)
+            nandroid_stats_add_read(stats, n, nandroid_stats_now_us() - start);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            LOGE("Error reading %s (%s)\n", device, strerror(errno));
+            ret = -1;
+            break;
+        }
+        if (n == 0)
+            break;
+        if (sink->write(sink, buffer, n) != 0) {
+            ret = -1;
+            break;
+        }
+        done += n;
+        if (job != NULL && nandroid_job_progress(job, done)) {
+            ret = -1;
+            break;
+        }
+    }
+    if (sink->close(sink, ret != 0) != 0)
+        ret = -1;
+    free(buffer);
+    close(fd);
+    return ret;
 }
 
 static void build_configuration_path(char *path_buf, const char *file) {
@@ -344,6 +507,20 @@ void nandroid_force_backup_format(const char* fmt) {
     strcpy(forced_backup_format, fmt);
 }
 
+static void select_backup_handler(const char* format) {
+    char fmt[4];
+    strncpy(fmt, format, 3);
+    fmt[3] = '\0';
+    if (0 == strcmp(fmt, "tgz"))
+        default_backup_handler = tar_gzip_compress_wrapper;
+    else if (0 == strcmp(fmt, "pgz"))
+        default_backup_handler = tar_pgzip_compress_wrapper;
+    else if (0 == strcmp(fmt, "dup"))
+        default_backup_handler = dedup_compress_wrapper;
+    else
+        default_backup_handler = tar_compress_wrapper;
+}
+
 static void refresh_default_backup_handler() {
     char fmt[5];
     if (strlen(forced_backup_format) > 0) {
@@ -358,20 +535,32 @@ static void refresh_default_backup_handler() {
             default_backup_handler = tar_compress_wrapper;
             return;
         }
-        fread(fmt, 1, sizeof(fmt), f);
+        memset(fmt, 0, sizeof(fmt));
+        fread(fmt, 1, sizeof(fmt) - 1, f);
         fclose(f);
     }
-    fmt[3] = '\0';
-    if (0 == strcmp(fmt, "tgz"))
-        default_backup_handler = tar_gzip_compress_wrapper;
-    else
-        default_backup_handler = tar_compress_wrapper;
+    select_backup_handler(fmt);
+}
+
+// Format of the default handler, as the format file spells it.
+static const char* default_backup_format_name() {
+    if (default_backup_handler == tar_gzip_compress_wrapper)
+        return "tgz";
+    if (default_backup_handler == tar_pgzip_compress_wrapper)
+        return "pgz";
+    if (default_backup_handler == dedup_compress_wrapper)
+        return "dup";
+    return "tar";
 }
 
 unsigned int nandroid_get_default_backup_format() {
     refresh_default_backup_handler();
     if (default_backup_handler == tar_gzip_compress_wrapper) {
         return NANDROID_BACKUP_FORMAT_TGZ;
+    } else if (default_backup_handler == tar_pgzip_compress_wrapper) {
+        return NANDROID_BACKUP_FORMAT_PGZ;
+    } else if (default_backup_handler == dedup_compress_wrapper) {
+        return NANDROID_BACKUP_FORMAT_DUP;
     } else {
         return NANDROID_BACKUP_FORMAT_TAR;
     }
@@ -406,18 +595,145 @@ static nandroid_backup_handler get_backup_handler(const char *backup_path) {
     return default_backup_handler;
 }
 
-static int nandroid_backup_partition_extended(const char* backup_path, const char* mount_point, int umount_when_finished) {
-    int ret = 0;
+// One partition backup, prepared on the calling thread and run either
+// inline or as a scheduler job.
+typedef struct {
+    const char* root;
     char name[PATH_MAX];
+    char image[PATH_MAX];
+    Volume* vol;                      // raw partitions only
+    nandroid_backup_handler handler;  // archived partitions only
+    int callback;
+    int umount_when_finished;
+    int dedup;                        // raw emmc image goes to the chunk store
+} BackupJob;
+
+static int raw_image_progress(void* cookie, uint64_t bytes_done) {
+    return nandroid_job_progress((NandroidJob*)cookie, bytes_done);
+}
+
+static int run_backup_job_phase(NandroidJob* job, BackupJob* b) {
+    int ret;
+
+    if (b->vol != NULL) {
+        if (b->dedup)
+            ret = dedup_raw_backup(b->vol->device, b->image);
+        else if (strcmp(b->vol->fs_type, "emmc") == 0 && nandroid_current_job() != NULL)
+            ret = mmc_backup_raw_partition(b->vol->device, b->image, raw_image_progress, nandroid_current_job());
+        else
+            ret = backup_raw_partition(b->vol->fs_type, b->vol->device, b->image);
+        if (0 != ret) {
+            ui_print("[!] Error while backing up %s image!\n", b->name);
+            return ret;
+        }
+        ui_print("[*] Backup of %s image completed.\n", b->name);
+        return 0;
+    }
+
+    if (0 != (ret = b->handler(b->root, b->image, b->callback))) {
+        ui_print("[!] Error while making a backup image of %s!\n", b->root);
+        return ret;
+    }
+    ui_print("[*] Backup of %s completed.\n", b->name);
+    return 0;
+}
+
+// Fills in what the phase's readers and writers could not measure: the
+// output of external tools and raw images, which are copied outside of
+// the sinks. Raw copies have next to no computation, their whole time is
+// counted as I/O.
+static void backup_job_stats(NandroidJob* job, BackupJob* b, NandroidPhase* phase) {
+    char dir[PATH_MAX];
+    char* prefix;
+    struct dirent* de;
+
+    if (phase == NULL)
+        return;
+    if (phase->bytes_read == 0)
+        phase->bytes_read = job->bytes_total;
+    if (phase->kind == PHASE_RAW && !b->dedup)
+        phase->read_wait_us = nandroid_stats_now_us() - phase->start_us;
+    if (phase->bytes_written != 0 || strcmp(b->image, "/proc/self/fd/1") == 0)
+        return;
+
+    // all files of the image: <image>, <image>.tar.a, ...
+    strcpy(dir, b->image);
+    prefix = strrchr(dir, '/');
+    if (prefix == NULL)
+        return;
+    *prefix++ = '\0';
+    DIR* d = opendir(dir);
+    if (d == NULL)
+        return;
+    while ((de = readdir(d)) != NULL) {
+        char path[PATH_MAX];
+        struct stat st;
+        if (strncmp(de->d_name, prefix, strlen(prefix)) != 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+            phase->bytes_written += st.st_size;
+    }
+    closedir(d);
+}
+
+static int run_backup_job(NandroidJob* job) {
+    BackupJob* b = (BackupJob*)job->data;
+    NandroidPhase* phase = nandroid_stats_phase_begin(b->name, b->vol != NULL ? PHASE_RAW : PHASE_ARCHIVE);
+    int ret = run_backup_job_phase(job, b);
+
+    backup_job_stats(job, b, phase);
+    nandroid_stats_phase_end(phase, ret);
+    if (ret == 0)
+        nandroid_journal_partition_done(b->name);
+    return ret;
+}
+
+static uint64_t raw_partition_size(const char* device) {
+    if (device == NULL || device[0] != '/')
+        return 0;
+    int fd = open(device, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    off64_t size = lseek64(fd, 0, SEEK_END);
+    close(fd);
+    return size < 0 ? 0 : (uint64_t)size;
+}
+
+static void prepare_raw_backup_job(NandroidJob* job, BackupJob* b, Volume* vol, const char* name, const char* image) {
+    memset(job, 0, sizeof(NandroidJob));
+    memset(b, 0, sizeof(BackupJob));
+    b->root = vol->mount_point;
+    b->vol = vol;
+    strcpy(b->name, name);
+    strcpy(b->image, image);
+
+    job->name = b->name;
+    job->io_bound = 1;
+    job->run = run_backup_job;
+    job->data = b;
+    job->bytes_total = raw_partition_size(vol->device);
+    nandroid_job_set_disk(job, vol->device);
+}
+
+// Mounts mount_point and picks its backup handler. This must happen on the
+// main thread: the volume helpers are not thread safe.
+static int prepare_backup_job_extended(NandroidJob* job, BackupJob* b, const char* backup_path, const char* mount_point, int umount_when_finished) {
+    int ret = 0;
     char tmp[PATH_MAX];
-    strcpy(name, basename(mount_point));
+
+    memset(job, 0, sizeof(NandroidJob));
+    memset(b, 0, sizeof(BackupJob));
+    b->root = mount_point;
+    b->umount_when_finished = umount_when_finished;
+    strcpy(b->name, basename(mount_point));
 
     struct stat file_info;
     build_configuration_path(tmp, NANDROID_HIDE_PROGRESS_FILE);
     ensure_path_mounted(tmp);
-    int callback = stat(tmp, &file_info) != 0;
+    b->callback = stat(tmp, &file_info) != 0;
 
-    ui_print("\n[*] Backing up %s...\n", name);
+    ui_print("\n[*] Backing up %s...\n", b->name);
     if (0 != (ret = ensure_path_mounted(mount_point) != 0)) {
         ui_print("Can't mount %s!\n", mount_point);
         return ret;
@@ -430,64 +746,184 @@ static int nandroid_backup_partition_extended(const char* backup_path, const cha
         mv = find_mounted_volume_by_mount_point(v->mount_point);
 
     if (strcmp(backup_path, "-") == 0)
-        sprintf(tmp, "/proc/self/fd/1");
+        sprintf(b->image, "/proc/self/fd/1");
     else if (mv == NULL || mv->filesystem == NULL)
-        sprintf(tmp, "%s/%s.auto", backup_path, name);
+        sprintf(b->image, "%s/%s.auto", backup_path, b->name);
     else
-        sprintf(tmp, "%s/%s.%s", backup_path, name, mv->filesystem);
-    nandroid_backup_handler backup_handler = get_backup_handler(mount_point);
+        sprintf(b->image, "%s/%s.%s", backup_path, b->name, mv->filesystem);
+    b->handler = get_backup_handler(mount_point);
 
-    if (backup_handler == NULL) {
+    if (b->handler == NULL) {
         ui_print("[!] Error finding an appropriate backup handler.\n");
         return -2;
     }
-    ret = backup_handler(mount_point, tmp, callback);
-    if (umount_when_finished) {
-        ensure_path_unmounted(mount_point);
-    }
-    if (0 != ret) {
-        ui_print("[!] Error while making a backup image of %s!\n", mount_point);
-        return ret;
-    }
-    ui_print("[*] Backup of %s completed.\n", name);
+
+    job->name = b->name;
+    // compressed archives are CPU bound and may overlap other dumps
+    job->io_bound = b->handler == tar_compress_wrapper || b->handler == mkyaffs2image_wrapper;
+    job->run = run_backup_job;
+    job->data = b;
+    job->bytes_total = nandroid_bytes_total;
+    nandroid_job_set_disk(job, v != NULL ? v->device : NULL);
     return 0;
 }
 
-static int nandroid_backup_partition(const char* backup_path, const char* root) {
+// Returns 1 if root does not exist on this device and is skipped.
+static int prepare_backup_job(NandroidJob* job, BackupJob* b, const char* backup_path, const char* root) {
     Volume *vol = volume_for_path(root);
     // make sure the volume exists before attempting anything...
     if (vol == NULL || vol->fs_type == NULL)
-        return 0;
+        return 1;
 
     // see if we need a raw backup (mtd)
-    char tmp[PATH_MAX];
-    int ret;
     if (strcmp(vol->fs_type, "mtd") == 0 ||
             strcmp(vol->fs_type, "bml") == 0 ||
             strcmp(vol->fs_type, "emmc") == 0) {
-        ui_print("\n[*] Backing up %s...\n", root);
+        char tmp[PATH_MAX];
         const char* name = basename(root);
+        ui_print("\n[*] Backing up %s...\n", root);
         if (strcmp(backup_path, "-") == 0)
             strcpy(tmp, "/proc/self/fd/1");
         else
             sprintf(tmp, "%s/%s.img", backup_path, name);
-        //ui_print("[*] Backing up %s image...\n", name);
-
-        if (0 != (ret = backup_raw_partition(vol->fs_type, vol->device, tmp))) {
-            ui_print("[!] Error while backing up %s image!\n", name);
-            return ret;
+        prepare_raw_backup_job(job, b, vol, name, tmp);
+        if (default_backup_handler == dedup_compress_wrapper && strcmp(vol->fs_type, "emmc") == 0 &&
+                strcmp(backup_path, "-") != 0) {
+            b->dedup = 1;
+            // hashing dominates, let it overlap the other dumps
+            job->io_bound = 0;
         }
+        return 0;
+    }
+
+    return prepare_backup_job_extended(job, b, backup_path, root, 1);
+}
+
+static int nandroid_backup_partition_extended(const char* backup_path, const char* mount_point, int umount_when_finished) {
+    NandroidJob job;
+    BackupJob b;
+    int ret = prepare_backup_job_extended(&job, &b, backup_path, mount_point, umount_when_finished);
+    if (ret != 0)
+        return ret;
 
-        ui_print("[*] Backup of %s image completed.\n", name);
+    ret = run_backup_job(&job);
+    if (umount_when_finished) {
+        ensure_path_unmounted(mount_point);
+    }
+    return ret;
+}
+
+static int nandroid_backup_partition(const char* backup_path, const char* root) {
+    NandroidJob job;
+    BackupJob b;
+    int ret = prepare_backup_job(&job, &b, backup_path, root);
+    if (ret == 1)
         return 0;
+    if (ret != 0)
+        return ret;
+
+    ret = run_backup_job(&job);
+    if (b.umount_when_finished) {
+        ensure_path_unmounted(root);
     }
+    return ret;
+}
 
-    return nandroid_backup_partition_extended(backup_path, root, 1);
+// Collects the partitions of a backup run so they can be scheduled together.
+typedef struct {
+    NandroidJob jobs[NANDROID_MAX_JOBS];
+    BackupJob backups[NANDROID_MAX_JOBS];
+    int count;
+} BackupJobList;
+
+// Returns 1 if a resumed backup already completed name.
+static int backup_job_done(const char* name) {
+    if (!nandroid_journal_partition_is_done(name))
+        return 0;
+    ui_print("\n[*] %s was backed up before, skipping.\n", name);
+    return 1;
 }
 
-int nandroid_backup(const char* backup_path) {
+static int add_backup_job(BackupJobList* list, const char* backup_path, const char* root) {
+    if (list->count == NANDROID_MAX_JOBS)
+        return -1;
+    if (backup_job_done(basename(root)))
+        return 0;
+    int ret = prepare_backup_job(&list->jobs[list->count], &list->backups[list->count], backup_path, root);
+    if (ret == 0)
+        list->count++;
+    return ret == 1 ? 0 : ret;
+}
+
+static int add_backup_job_extended(BackupJobList* list, const char* backup_path, const char* mount_point, int umount_when_finished) {
+    if (list->count == NANDROID_MAX_JOBS)
+        return -1;
+    if (backup_job_done(basename(mount_point)))
+        return 0;
+    int ret = prepare_backup_job_extended(&list->jobs[list->count], &list->backups[list->count],
+                                          backup_path, mount_point, umount_when_finished);
+    if (ret == 0)
+        list->count++;
+    return ret;
+}
+
+static int poll_backup_cancel(void* cookie) {
+    return nandroid_cancel_requested((int*)cookie);
+}
+
+// Runs every job of the list, overlapping them as far as the job limits
+// allow, then unmounts what was only mounted for the backup.
+static int run_backup_jobs(BackupJobList* list, const char* backup_path) {
+    char tmp[PATH_MAX];
+    struct stat file_info;
+    int i, canceled, max_jobs, io_jobs_per_disk;
+    int nand_starts = 1;
+
+    build_configuration_path(tmp, NANDROID_HIDE_PROGRESS_FILE);
+    int show_progress = stat(tmp, &file_info) != 0;
+
+    nandroid_get_job_limits(&max_jobs, &io_jobs_per_disk);
+    set_perf_mode(1);
+    int ret = nandroid_run_jobs(list->jobs, list->count, max_jobs, io_jobs_per_disk,
+                                show_progress, poll_backup_cancel, &nand_starts, &canceled);
+    set_perf_mode(0);
+
+    for (i = 0; i < list->count; i++) {
+        if (list->backups[i].umount_when_finished)
+            ensure_path_unmounted(list->backups[i].root);
+    }
+    // the backup may live on a volume that was just unmounted (data media)
+    ensure_path_mounted(backup_path);
+
+    if (canceled) {
+        sprintf(tmp, "%s/nandroid", backup_path);
+        nandroid_cancel_cleanup(tmp, 1);
+    }
+    return ret;
+}
+
+// Writes the checksum manifests, then the timing report. A missing report
+// does not fail the backup.
+static int nandroid_backup_finish_checksums() {
+    ui_print("Writing checksums...\n");
+    NandroidPhase* phase = nandroid_stats_phase_begin("checksums", PHASE_CHECKSUMS);
+    int ret = nandroid_digest_finish();
+    nandroid_stats_phase_end(phase, ret);
+    if (ret != 0) {
+        ui_print("Error while generating md5 sum!\n");
+        return ret;
+    }
+    nandroid_stats_finish();
+    return 0;
+}
+
+// resume_format is the format of the interrupted backup being resumed,
+// NULL for a new backup.
+static int nandroid_backup_run(const char* backup_path, const char* resume_format) {
     nandroid_backup_bitfield = 0;
     refresh_default_backup_handler();
+    if (resume_format != NULL)
+        select_backup_handler(resume_format);
 
     if (ensure_path_mounted(backup_path) != 0) {
         return print_and_error("Can't mount backup path.\n", NANDROID_ERROR_GENERAL);
@@ -519,50 +955,60 @@ int nandroid_backup(const char* backup_path) {
 	
     char tmp[PATH_MAX];
     ensure_directory(backup_path);
+    nandroid_digest_begin(backup_path);
+    if (0 != nandroid_journal_begin(backup_path, JOURNAL_BACKUP, default_backup_format_name(), resume_format != NULL)) {
+        if (resume_format != NULL)
+            return print_and_error("Can't resume the backup.\n", NANDROID_ERROR_GENERAL);
+        ui_print("The backup can't be resumed if it is interrupted.\n");
+    }
+    nandroid_stats_begin(backup_path);
     ui_set_background(BACKGROUND_ICON_INSTALLING);
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/boot")))
+    BackupJobList jobs;
+    jobs.count = 0;
+
+    if (0 != (ret = add_backup_job(&jobs, backup_path, "/boot")))
         return print_and_error(NULL, ret);
 
     Volume *vol = volume_for_path("/wimax");
-    if (vol != NULL && 0 == stat(vol->device, &s)) {
+    if (vol != NULL && 0 == stat(vol->device, &s) && jobs.count < NANDROID_MAX_JOBS &&
+            !backup_job_done("wimax")) {
         char serialno[PROPERTY_VALUE_MAX];
         ui_print("[*] Backing up WiMAX...\n");
         serialno[0] = 0;
         property_get("ro.serialno", serialno, "");
         sprintf(tmp, "%s/wimax.%s.img", backup_path, serialno);
-        ret = backup_raw_partition(vol->fs_type, vol->device, tmp);
-        if (0 != ret)
-            return print_and_error("Error while dumping WiMAX image!\n", NANDROID_ERROR_GENERAL);
+        prepare_raw_backup_job(&jobs.jobs[jobs.count], &jobs.backups[jobs.count], vol, "wimax", tmp);
+        jobs.count++;
     }
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/system")))
+    if (0 != (ret = add_backup_job(&jobs, backup_path, "/system")))
         return print_and_error(NULL, ret);
         
 	if (volume_for_path("/custpack") != NULL) {
-	    if (0 != (ret = nandroid_backup_partition(backup_path, "/custpack")))
+	    if (0 != (ret = add_backup_job(&jobs, backup_path, "/custpack")))
 	        return print_and_error(NULL, ret);
 	}
 	
 	if (volume_for_path("/cust") != NULL) {
-	    if (0 != (ret = nandroid_backup_partition(backup_path, "/cust")))
+	    if (0 != (ret = add_backup_job(&jobs, backup_path, "/cust")))
 	        return print_and_error(NULL, ret);
 	}
 
-    if (0 != (ret = nandroid_backup_partition(backup_path, "/data")))
+    if (0 != (ret = add_backup_job(&jobs, backup_path, "/data")))
         return print_and_error(NULL, ret);
 
     if (has_datadata()) {
-        if (0 != (ret = nandroid_backup_partition(backup_path, "/datadata")))
+        if (0 != (ret = add_backup_job(&jobs, backup_path, "/datadata")))
             return print_and_error(NULL, ret);
     }
 
     if (0 == stat(get_android_secure_path(), &s)) {
-        if (0 != (ret = nandroid_backup_partition_extended(backup_path, get_android_secure_path(), 0)))
+        if (0 != (ret = add_backup_job_extended(&jobs, backup_path, get_android_secure_path(), 0)))
             return print_and_error(NULL, ret);
     }
 
-    if (0 != (ret = nandroid_backup_partition_extended(backup_path, "/cache", 0)))
+    if (0 != (ret = add_backup_job_extended(&jobs, backup_path, "/cache", 0)))
         return print_and_error(NULL, ret);
 
     vol = volume_for_path("/sd-ext");
@@ -571,16 +1017,15 @@ int nandroid_backup(const char* backup_path) {
     } else {
         if (0 != ensure_path_mounted("/sd-ext"))
             LOGI("Could not mount sd-ext. sd-ext backup may not be supported on this device. Skipping backup of sd-ext.\n");
-        else if (0 != (ret = nandroid_backup_partition(backup_path, "/sd-ext")))
+        else if (0 != (ret = add_backup_job(&jobs, backup_path, "/sd-ext")))
             return print_and_error(NULL, ret);
     }
 
-    ui_print("Generating md5 sum...\n");
-    sprintf(tmp, "nandroid-md5.sh %s", backup_path);
-    if (0 != (ret = __system(tmp))) {
-        ui_print("Error while generating md5 sum!\n");
+    if (0 != (ret = run_backup_jobs(&jobs, backup_path)))
+        return print_and_error(NULL, ret);
+
+    if (0 != (ret = nandroid_backup_finish_checksums()))
         return ret;
-    }
 
     sprintf(tmp, "cp /tmp/recovery.log %s/recovery.log", backup_path);
     __system(tmp);
@@ -601,6 +1046,32 @@ int nandroid_backup(const char* backup_path) {
     return 0;
 }
 
+int nandroid_backup(const char* backup_path) {
+    int ret = nandroid_backup_run(backup_path, NULL);
+    if (ret == 0)
+        nandroid_journal_finish();
+    else
+        nandroid_journal_end();
+    return ret;
+}
+
+int nandroid_resume_backup(const char* backup_path) {
+    char format[16];
+
+    if (ensure_path_mounted(backup_path) != 0)
+        return print_and_error("Can't mount backup path.\n", NANDROID_ERROR_GENERAL);
+    if (nandroid_journal_probe(backup_path, format) != JOURNAL_BACKUP)
+        return print_and_error("No interrupted backup to resume.\n", NANDROID_ERROR_GENERAL);
+
+    ui_print("-- Resuming the backup to %s.\n", backup_path);
+    int ret = nandroid_backup_run(backup_path, format);
+    if (ret == 0)
+        nandroid_journal_finish();
+    else
+        nandroid_journal_end();
+    return ret;
+}
+
 //=========================================/
 //=        Nandroid advanced backup       =/
 //=             by carliv@xda             =/
@@ -635,8 +1106,9 @@ int nandroid_advanced_backup(const char* backup_path, int boot, int system, int
         if (sdcard_free_mb < 150)
             ui_print("There may not be enough free space to complete backup... continuing...\n");
     }
-    char tmp[PATH_MAX];
     ensure_directory(backup_path);
+    nandroid_digest_begin(backup_path);
+    nandroid_stats_begin(backup_path);
     ui_set_background(BACKGROUND_ICON_INSTALLING);
 
     if (boot && 0 != (ret = nandroid_backup_partition(backup_path, "/boot")))
@@ -671,12 +1143,8 @@ int nandroid_advanced_backup(const char* backup_path, int boot, int system, int
     if (cache && 0 != (ret = nandroid_backup_partition_extended(backup_path, "/cache", 0)))
         return print_and_error(NULL, ret);
 
-    ui_print("Generating md5 sum...\n");
-    sprintf(tmp, "nandroid-md5.sh %s", backup_path);
-    if (0 != (ret = __system(tmp))) {
-        ui_print("Error while generating md5 sum!\n");
+    if (0 != (ret = nandroid_backup_finish_checksums()))
         return ret;
-    }
 
     finish_nandroid_job();
     ui_reset_progress();
@@ -727,6 +1195,8 @@ int nandroid_mtk_backup(const char* backup_path, int uboot, int logo, int nvram,
 	Volume* vol = volume_for_path("/data");
     sprintf(backup_file_image, "%s/nvdata.%s", backup_path, vol->fs_type == NULL ? "auto" : vol->fs_type);
     ensure_directory(backup_path);
+    nandroid_digest_begin(backup_path);
+    nandroid_stats_begin(backup_path);
     ui_set_background(BACKGROUND_ICON_INSTALLING);
 
     if (uboot && 0 != (ret = nandroid_backup_partition(backup_path, "/uboot")))
@@ -752,12 +1222,8 @@ int nandroid_mtk_backup(const char* backup_path, int uboot, int logo, int nvram,
     if (secro && 0 != (ret = nandroid_backup_partition(backup_path, "/secro")))
         return print_and_error(NULL, ret);
 
-    ui_print("Generating md5 sum...\n");
-    sprintf(tmp, "nandroid-md5.sh %s", backup_path);
-    if (0 != (ret = __system(tmp))) {
-        ui_print("Error while generating md5 sum!\n");
+    if (0 != (ret = nandroid_backup_finish_checksums()))
         return ret;
-    }
 
     finish_nandroid_job();
     ui_reset_progress();
@@ -767,50 +1233,6 @@ int nandroid_mtk_backup(const char* backup_path, int uboot, int logo, int nvram,
 
 #endif
 
-static int nandroid_dump(const char* partition) {
-    // silence our ui_print statements and other logging
-    ui_set_log_stdout(0);
-
-    nandroid_backup_bitfield = 0;
-    refresh_default_backup_handler();
-
-    // override our default to be the basic tar dumper
-    default_backup_handler = tar_dump_wrapper;
-
-    if (strcmp(partition, "boot") == 0) {
-        Volume *vol = volume_for_path("/boot");
-        // make sure the volume exists before attempting anything...
-        if (vol == NULL || vol->fs_type == NULL)
-            return 1;
-        char cmd[PATH_MAX];
-        sprintf(cmd, "cat %s", vol->device);
-        return __system(cmd);
-        // return nandroid_backup_partition("-", "/boot");
-    }
-
-    if (strcmp(partition, "recovery") == 0) {
-        return __system("set -o pipefail ; dump_image recovery /proc/self/fd/1 | cat");
-    }
-
-    if (strcmp(partition, "data") == 0) {
-        return nandroid_backup_partition("-", "/data");
-    }
-
-    if (strcmp(partition, "system") == 0) {
-        return nandroid_backup_partition("-", "/system");
-    }
-
-    if (strcmp(partition, "custpack") == 0) {
-        return nandroid_backup_partition("-", "/custpack");
-    }
-
-    if (strcmp(partition, "cust") == 0) {
-        return nandroid_backup_partition("-", "/cust");
-    }
-
-    return 1;
-}
-
 static int unyaffs_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
     char tmp[PATH_MAX];
     sprintf(tmp, "cd %s ; unyaffs %s ; exit $?", backup_path, backup_file_image);
@@ -858,25 +1280,261 @@ static int do_tar_extract(char* command, const char* backup_file_image, const ch
     return __pclose(fp);
 }
 
+typedef int (*tar_stream_producer)(const char* backup_file_image, int out_fd);
+
+typedef struct {
+    tar_stream_producer producer;
+    const char* backup_file_image;
+    int fd;
+    int ret;
+} TarStreamJob;
+
+static void* tar_stream_thread(void* cookie) {
+    TarStreamJob* job = (TarStreamJob*)cookie;
+    job->ret = job->producer(job->backup_file_image, job->fd);
+    close(job->fd);
+    return NULL;
+}
+
+// Size of the stream a volume set holds, to show restore progress.
+static uint64_t volume_set_size(const char* base) {
+    char path[PATH_MAX];
+    struct stat st;
+    uint64_t total = 0;
+    int i;
+
+    for (i = -1; i < 26; i++) {
+        if (i < 0)
+            strcpy(path, base);
+        else
+            sprintf(path, "%s.%c", base, 'a' + i);
+        if (stat(path, &st) == 0)
+            total += st.st_size;
+        else if (i >= 0)
+            break;
+    }
+    return total;
+}
+
+// Extracts the tar stream producer writes for backup_file_image into the
+// parent of backup_path, like "cd $(dirname backup_path) ; tar -xp". The
+// producer reads and decompresses the backup on its own thread and feeds
+// the in-process extractor through a pipe. stream_size is the length of
+// the tar stream when it is known, for the progress bar.
+static int do_tar_stream_extract(tar_stream_producer producer, const char* backup_file_image, const char* backup_path, uint64_t stream_size, int callback) {
+    char dest[PATH_MAX];
+    int pipefd[2];
+
+    strcpy(dest, backup_path);
+    char* slash = strrchr(dest, '/');
+    if (slash == NULL || slash == dest)
+        strcpy(dest, "/");
+    else
+        *slash = '\0';
+
+    if (pipe2(pipefd, O_CLOEXEC) != 0) {
+        ui_print("Unable to create pipe.\n");
+        return -1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    pthread_t thread;
+    TarStreamJob job = { producer, backup_file_image, pipefd[1], 0 };
+    if (pthread_create(&thread, NULL, tar_stream_thread, &job) != 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+
+    nandroid_bytes_total = stream_size;
+    if (callback && stream_size != 0) {
+        ui_reset_progress();
+        ui_show_progress(1, 0);
+    }
+    NandroidArchiveJob progress = { NULL, callback, 1 };
+    set_perf_mode(1);
+    int ret = nandroid_archive_extract(dest, pipefd[0], nandroid_archive_progress, &progress);
+    set_perf_mode(0);
+    nandroid_bytes_total = 0;
+
+    // unblocks the producer if extraction stopped early
+    close(pipefd[0]);
+    pthread_join(thread, NULL);
+
+    if (ret == NANDROID_ARCHIVE_CANCELED) {
+        nandroid_cancel_cleanup(NULL, 0);
+        return -1;
+    }
+    if (ret != NANDROID_ARCHIVE_OK) {
+        ui_print("Error extracting %s\n", backup_file_image);
+        return -1;
+    }
+    return job.ret;
+}
+
+// Block-parallel gzip backups are inflated on all cores and streamed into
+// the extractor instead of going through a single pigz -d.
+static int tar_pgzip_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return do_tar_stream_extract(parallel_gunzip, backup_file_image, backup_path, 0, callback);
+}
+
+static int dedup_restore_stream(const char* manifest, int out_fd) {
+    char store[PATH_MAX];
+    dedup_store_for_image(manifest, store);
+    return dedup_restore(store, manifest, out_fd);
+}
+
+static int tar_dedup_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return do_tar_stream_extract(dedup_restore_stream, backup_file_image, backup_path, 0, callback);
+}
+
+// Replaces "cat <base>*": the volumes go through the volume reader, which
+// checks them against the manifest as they stream.
+static int volume_stream(const char* backup_file_image, int out_fd) {
+    VolumeReader* r = volume_reader_open(backup_file_image);
+    unsigned char* buffer = malloc(NANDROID_ARCHIVE_BUFFER_SIZE);
+    int ret = -1;
+
+    if (r != NULL && buffer != NULL) {
+        ssize_t n;
+        while ((n = volume_reader_read(r, buffer, NANDROID_ARCHIVE_BUFFER_SIZE)) > 0) {
+            if (write(out_fd, buffer, n) != n)
+                break;
+        }
+        ret = n == 0 ? 0 : -1;
+    }
+    free(buffer);
+    volume_reader_close(r);
+    return ret;
+}
+
+// Volumes are only checksummed while they are extracted, after the
+// partition was formatted, so catch what can be caught before that: a
+// volume the manifest lists that is missing, a gap in the set, or a
+// volume shorter than the first (every volume but the last one is full).
+static int check_backup_volumes(const char* base) {
+    char path[PATH_MAX];
+    struct stat st;
+    off64_t volume_size = 0;
+    off64_t previous_size = 0;
+    int last = -1;
+    int i;
+
+    if (!md5_check_enabled)
+        return 0;
+    for (i = 0; i < 26; i++) {
+        sprintf(path, "%s.%c", base, 'a' + i);
+        if (stat(path, &st) != 0) {
+            if (nandroid_verify_listed(path)) {
+                ui_print("Missing backup volume: %s\n", path);
+                return -1;
+            }
+            continue;
+        }
+        if (last != i - 1) {
+            ui_print("Missing backup volume before %s\n", path);
+            return -1;
+        }
+        if (i == 0)
+            volume_size = st.st_size;
+        else if (previous_size != volume_size || st.st_size > volume_size) {
+            ui_print("Truncated backup volume: %s.%c\n", base, 'a' + i - 1);
+            return -1;
+        }
+        previous_size = st.st_size;
+        last = i;
+    }
+    return 0;
+}
+
+// Reads a volume set once for its checksums, for the restores that still
+// hand the volumes to a shell pipeline.
+static int verify_backup_volumes(const char* backup_file_image) {
+    if (!md5_check_enabled)
+        return 0;
+    int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int ret = volume_stream(backup_file_image, fd);
+    close(fd);
+    return ret;
+}
+
 static int tar_gzip_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; set -o pipefail ; cat %s* | pigz -d -c | tar -xpv ; exit $?", backup_path, backup_file_image);
+    if (parallel_gzip_probe(backup_file_image))
+        return tar_pgzip_extract_wrapper(backup_file_image, backup_path, callback);
 
-    return do_tar_extract(tmp, backup_file_image, backup_path, callback);
+    return do_tar_stream_extract(gunzip_volumes, backup_file_image, backup_path, 0, callback);
 }
 
 static int tar_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; set -o pipefail ; cat %s* | tar -xpv ; exit $?", backup_path, backup_file_image);
+    return do_tar_stream_extract(volume_stream, backup_file_image, backup_path, volume_set_size(backup_file_image), callback);
+}
 
-    return do_tar_extract(tmp, backup_file_image, backup_path, callback);
+// Where "nandroid undump" and "bu restore" read a partition from: the
+// current partition of a framed stream, or a plain tar/image stream.
+typedef struct {
+    NandroidStreamReader* reader;   // NULL for a plain stream
+    int fd;
+    const unsigned char* head;      // read while probing the stream
+    size_t head_len;
+} UndumpSource;
+
+static UndumpSource* undump_source = NULL;
+
+static ssize_t undump_read(UndumpSource* src, void* data, size_t len) {
+    if (src->head_len > 0) {
+        size_t n = len < src->head_len ? len : src->head_len;
+        memcpy(data, src->head, n);
+        src->head += n;
+        src->head_len -= n;
+        return n;
+    }
+    if (src->reader != NULL)
+        return stream_reader_read(src->reader, data, len);
+
+    ssize_t n;
+    do {
+        n = read(src->fd, data, len);
+    } while (n < 0 && errno == EINTR);
+    return n;
 }
 
-static int tar_undump_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
-    char tmp[PATH_MAX];
-    sprintf(tmp, "cd $(dirname %s) ; tar -xpv ", backup_path);
+// Copies the rest of the partition being undumped to out_fd.
+static int undump_copy(UndumpSource* src, int out_fd) {
+    NandroidSink* sink = fd_sink_open(out_fd);
+    unsigned char* buffer = malloc(NANDROID_STREAM_FRAME_SIZE);
+    ssize_t n;
+    int ret = 0;
+
+    if (sink == NULL || buffer == NULL) {
+        if (sink != NULL)
+            sink->close(sink, 1);
+        free(buffer);
+        return -1;
+    }
+    while ((n = undump_read(src, buffer, NANDROID_STREAM_FRAME_SIZE)) > 0) {
+        if (sink->write(sink, buffer, n) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+    if (n < 0) {
+        LOGE("Error reading the restore stream\n");
+        ret = -1;
+    }
+    if (sink->close(sink, ret != 0) != 0)
+        ret = -1;
+    free(buffer);
+    return ret;
+}
+
+static int undump_producer(const char* backup_file_image, int out_fd) {
+    return undump_copy(undump_source, out_fd);
+}
 
-    return __system(tmp);
+static int tar_undump_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return do_tar_stream_extract(undump_producer, backup_file_image, backup_path, 0, callback);
 }
 
 static nandroid_restore_handler get_restore_handler(const char *backup_path) {
@@ -952,6 +1610,12 @@ static int nandroid_restore_partition_extended(const char* backup_path, const ch
                 restore_handler = tar_gzip_extract_wrapper;
                 break;
             }
+            sprintf(tmp, "%s/%s.%s%s", backup_path, name, filesystem, DEDUP_MANIFEST_EXT);
+            if (0 == (ret = stat(tmp, &file_info))) {
+                backup_filesystem = filesystem;
+                restore_handler = tar_dedup_extract_wrapper;
+                break;
+            }
             i++;
         }
 
@@ -974,6 +1638,18 @@ static int nandroid_restore_partition_extended(const char* backup_path, const ch
                 (strcmp(backup_filesystem, "ext4") == 0 || strcmp(backup_filesystem, "f2fs") == 0))
         backup_filesystem = NULL;
 
+    // images not streamed through the volume reader are checked up front,
+    // before anything is erased; volume sets as far as they can be
+    if (strcmp(backup_path, "-") != 0 && restore_handler != tar_extract_wrapper &&
+            restore_handler != tar_gzip_extract_wrapper && 0 != nandroid_verify_file(tmp)) {
+        ui_print("Checksum mismatch, not restoring %s!\n", mount_point);
+        return -1;
+    }
+    if (strcmp(backup_path, "-") != 0 && 0 != check_backup_volumes(tmp)) {
+        ui_print("Incomplete backup, not restoring %s!\n", mount_point);
+        return -1;
+    }
+
     ensure_directory(mount_point);
 
     char path[PATH_MAX];
@@ -1022,6 +1698,20 @@ static int nandroid_restore_partition_extended(const char* backup_path, const ch
     return 0;
 }
 
+static int dedup_raw_restore(const char* device, const char* manifest) {
+    int fd = open(device, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("Can't open %s (%s)\n", device, strerror(errno));
+        return -1;
+    }
+    int ret = dedup_restore_stream(manifest, fd);
+    if (fsync(fd) != 0)
+        ret = -1;
+    if (close(fd) != 0)
+        ret = -1;
+    return ret;
+}
+
 static int nandroid_restore_partition(const char* backup_path, const char* root) {
     Volume *vol = volume_for_path(root);
     // make sure the volume exists...
@@ -1038,16 +1728,27 @@ static int nandroid_restore_partition(const char* backup_path, const char* root)
         const char* name = basename(root);
         
         struct stat file_check;
+        int dedup = 0;
         if (strcmp(backup_path, "-") == 0)
             strcpy(tmp, backup_path);
         else
             sprintf(tmp, "%s%s.img", backup_path, root);
 
         if (0 != strcmp(backup_path, "-") && 0 != stat(tmp, &file_check)) {
-            ui_print("%s not found. Skipping restore of %s\n", basename(tmp), root);
-            return 0;
+            strcat(tmp, DEDUP_MANIFEST_EXT);
+            if (strcmp(vol->fs_type, "emmc") != 0 || 0 != stat(tmp, &file_check)) {
+                tmp[strlen(tmp) - strlen(DEDUP_MANIFEST_EXT)] = '\0';
+                ui_print("%s not found. Skipping restore of %s\n", basename(tmp), root);
+                return 0;
+            }
+            dedup = 1;
         }
-        
+
+        if (0 != strcmp(backup_path, "-") && 0 != nandroid_verify_file(tmp)) {
+            ui_print("Checksum mismatch, not restoring %s!\n", root);
+            return -1;
+        }
+
         ui_print("[*] Erasing %s before restore...\n", name);
         if (0 != (ret = format_volume(root))) {
             ui_print("Error while erasing %s image!", name);
@@ -1055,7 +1756,11 @@ static int nandroid_restore_partition(const char* backup_path, const char* root)
         }
 
         ui_print("[*] Restoring %s image...\n", name);
-        if (0 != (ret = restore_raw_partition(vol->fs_type, vol->device, tmp))) {
+        if (dedup)
+            ret = dedup_raw_restore(vol->device, tmp);
+        else
+            ret = restore_raw_partition(vol->fs_type, vol->device, tmp);
+        if (0 != ret) {
             ui_print("Error while flashing %s image!", name);
             return ret;
         }
@@ -1064,7 +1769,46 @@ static int nandroid_restore_partition(const char* backup_path, const char* root)
     return nandroid_restore_partition_extended(backup_path, root, 1);
 }
 
-int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax) {
+// Loads the checksums of the backup when md5 checking is on. Files are
+// then verified while they are restored instead of in a separate pass.
+static int nandroid_restore_verify_begin(const char* backup_path) {
+    nandroid_verify_end();
+    if (!md5_check_enabled)
+        return 0;
+    ui_print("Checksums are verified while restoring.\n");
+    return nandroid_verify_begin(backup_path);
+}
+
+// Restores root unless a resumed restore already did, and journals it
+// once it is on disk.
+static int nandroid_restore_journaled(const char* backup_path, const char* root, int extended) {
+    const char* name = basename(root);
+    int ret;
+
+    if (nandroid_journal_partition_is_done(name)) {
+        ui_print("\n[*] %s was restored before, skipping.\n", root);
+        return 0;
+    }
+    if (extended)
+        ret = nandroid_restore_partition_extended(backup_path, root, 0);
+    else
+        ret = nandroid_restore_partition(backup_path, root);
+    if (ret == 0) {
+        sync();
+        nandroid_journal_partition_done(name);
+    }
+    return ret;
+}
+
+#define RESTORE_PARTITIONS 6
+
+// restore holds the boot, system, data, cache, sd-ext and wimax flags.
+static int nandroid_restore_run(const char* backup_path, const int* restore, int resume) {
+    int restore_boot = restore[0], restore_system = restore[1], restore_data = restore[2];
+    int restore_cache = restore[3], restore_sdext = restore[4], restore_wimax = restore[5];
+    char mask[RESTORE_PARTITIONS + 1];
+    int i;
+
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_show_indeterminate_progress();
     nandroid_files_total = 0;
@@ -1073,25 +1817,33 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
         return print_and_error("Can't mount backup path\n", NANDROID_ERROR_GENERAL);
 
     char tmp[PATH_MAX];
-    if (md5_check_enabled) {
-		ui_print("Checking MD5 sums...\n");
-	    sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
-	    if (0 != __system(tmp))
-	        return print_and_error("MD5 mismatch!\n", NANDROID_ERROR_GENERAL);
-	}	
+    if (nandroid_journal_probe(backup_path, tmp) == JOURNAL_BACKUP)
+        return print_and_error("This backup is incomplete, resume it first!\n", NANDROID_ERROR_GENERAL);
+    if (0 != nandroid_restore_verify_begin(backup_path))
+        return print_and_error("No checksum manifest found!\n", NANDROID_ERROR_GENERAL);	
+
+    for (i = 0; i < RESTORE_PARTITIONS; i++)
+        mask[i] = restore[i] ? '1' : '0';
+    mask[RESTORE_PARTITIONS] = '\0';
+    if (0 != nandroid_journal_begin(backup_path, JOURNAL_RESTORE, mask, resume)) {
+        if (resume)
+            return print_and_error("Can't resume the restore.\n", NANDROID_ERROR_GENERAL);
+        ui_print("The restore can't be resumed if it is interrupted.\n");
+    }
     
     int ret;
 	struct stat st;
 	sprintf(tmp, "%s/boot.img", backup_path);
 	
 	if (restore_boot && (stat(tmp, &st) == 0)) {
-	    if (0 != (ret = nandroid_restore_partition(backup_path, "/boot")))
+	    if (0 != (ret = nandroid_restore_journaled(backup_path, "/boot", 0)))
             return print_and_error(NULL, ret);           
     }
 
     struct stat s;
     Volume *vol = volume_for_path("/wimax");
-    if (restore_wimax && vol != NULL && 0 == stat(vol->device, &s)) {
+    if (restore_wimax && vol != NULL && 0 == stat(vol->device, &s) &&
+            !nandroid_journal_partition_is_done("wimax")) {
         char serialno[PROPERTY_VALUE_MAX];
 
         serialno[0] = 0;
@@ -1105,45 +1857,49 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
             ui_print("         You should create a new backup to\n");
             ui_print("         protect your WiMAX keys.\n");
         } else {
+            if (0 != nandroid_verify_file(tmp))
+                return print_and_error("Checksum mismatch in WiMAX image!\n", NANDROID_ERROR_GENERAL);
             ui_print("[*] Erasing WiMAX before restore...\n");
             if (0 != (ret = format_volume("/wimax")))
                 return print_and_error("Error while formatting wimax!\n", NANDROID_ERROR_GENERAL);
             ui_print("[*] Restoring WiMAX image...\n");
             if (0 != (ret = restore_raw_partition(vol->fs_type, vol->device, tmp)))
                 return print_and_error(NULL, ret);
+            sync();
+            nandroid_journal_partition_done("wimax");
         }
     }
 
-    if (restore_system && 0 != (ret = nandroid_restore_partition(backup_path, "/system")))
+    if (restore_system && 0 != (ret = nandroid_restore_journaled(backup_path, "/system", 0)))
         return print_and_error(NULL, ret);
         
 	if (volume_for_path("/custpack") != NULL) {
-	    if (restore_system && 0 != (ret = nandroid_restore_partition(backup_path, "/custpack")))
+	    if (restore_system && 0 != (ret = nandroid_restore_journaled(backup_path, "/custpack", 0)))
         return print_and_error(NULL, ret);
 	}
 	
 	if (volume_for_path("/cust") != NULL) {
-	    if (restore_system && 0 != (ret = nandroid_restore_partition(backup_path, "/cust")))
+	    if (restore_system && 0 != (ret = nandroid_restore_journaled(backup_path, "/cust", 0)))
         return print_and_error(NULL, ret);
 	}
 
-    if (restore_data && 0 != (ret = nandroid_restore_partition(backup_path, "/data")))
+    if (restore_data && 0 != (ret = nandroid_restore_journaled(backup_path, "/data", 0)))
         return print_and_error(NULL, ret);
 
     if (has_datadata()) {
-        if (restore_data && 0 != (ret = nandroid_restore_partition(backup_path, "/datadata")))
+        if (restore_data && 0 != (ret = nandroid_restore_journaled(backup_path, "/datadata", 0)))
             return print_and_error(NULL, ret);
     }
     
     if (restore_data && 0 == stat(get_android_secure_path(), &s)) {
-        if (0 != (ret = nandroid_restore_partition_extended(backup_path, get_android_secure_path(), 0)))
+        if (0 != (ret = nandroid_restore_journaled(backup_path, get_android_secure_path(), 1)))
 			return print_and_error(NULL, ret);
     }
 
-    if (restore_cache && 0 != (ret = nandroid_restore_partition_extended(backup_path, "/cache", 0)))
+    if (restore_cache && 0 != (ret = nandroid_restore_journaled(backup_path, "/cache", 1)))
         return print_and_error(NULL, ret);
 
-    if (restore_sdext && 0 != (ret = nandroid_restore_partition(backup_path, "/sd-ext")))
+    if (restore_sdext && 0 != (ret = nandroid_restore_journaled(backup_path, "/sd-ext", 0)))
         return print_and_error(NULL, ret);
 
     finish_nandroid_job();
@@ -1152,6 +1908,37 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
     return 0;
 }
 
+int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax) {
+    int restore[RESTORE_PARTITIONS] = { restore_boot, restore_system, restore_data, restore_cache, restore_sdext, restore_wimax };
+    int ret = nandroid_restore_run(backup_path, restore, 0);
+    if (ret == 0)
+        nandroid_journal_finish();
+    else
+        nandroid_journal_end();
+    return ret;
+}
+
+int nandroid_resume_restore(const char* backup_path) {
+    int restore[RESTORE_PARTITIONS];
+    char mask[16];
+    int i;
+
+    if (ensure_path_mounted(backup_path) != 0)
+        return print_and_error("Can't mount backup path\n", NANDROID_ERROR_GENERAL);
+    if (nandroid_journal_probe(backup_path, mask) != JOURNAL_RESTORE || strlen(mask) != RESTORE_PARTITIONS)
+        return print_and_error("No interrupted restore to resume.\n", NANDROID_ERROR_GENERAL);
+    for (i = 0; i < RESTORE_PARTITIONS; i++)
+        restore[i] = mask[i] == '1';
+
+    ui_print("-- Resuming the restore from %s.\n", backup_path);
+    int ret = nandroid_restore_run(backup_path, restore, 1);
+    if (ret == 0)
+        nandroid_journal_finish();
+    else
+        nandroid_journal_end();
+    return ret;
+}
+
 //=========================================/
 //=       Nandroid advanced restore       =/
 //=             by carliv@xda             =/
@@ -1167,12 +1954,8 @@ int nandroid_advanced_restore(const char* backup_path, int boot, int system, int
         return print_and_error("Can't mount backup path\n", NANDROID_ERROR_GENERAL);
 
     char tmp[PATH_MAX];
-    if (md5_check_enabled) {
-		ui_print("Checking MD5 sums...\n");
-	    sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
-	    if (0 != __system(tmp))
-	        return print_and_error("MD5 mismatch!\n", NANDROID_ERROR_GENERAL);
-	}
+    if (0 != nandroid_restore_verify_begin(backup_path))
+        return print_and_error("No checksum manifest found!\n", NANDROID_ERROR_GENERAL);
 
     ui_print("-- Start the advanced restore from %s.\n", backup_path);
 
@@ -1238,12 +2021,8 @@ int nandroid_mtk_restore(const char* backup_path, int uboot, int logo, int nvram
         return print_and_error("Can't mount backup path\n", NANDROID_ERROR_GENERAL);
 
     char tmp[PATH_MAX];
-    if (md5_check_enabled) {
-		ui_print("Checking MD5 sums...\n");
-	    sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
-	    if (0 != __system(tmp))
-	        return print_and_error("MD5 mismatch!\n", NANDROID_ERROR_GENERAL);
-	}
+    if (0 != nandroid_restore_verify_begin(backup_path))
+        return print_and_error("No checksum manifest found!\n", NANDROID_ERROR_GENERAL);
 
     ui_print("-- Start mtk partitions restore from %s.\n", backup_path);
 
@@ -1274,6 +2053,8 @@ int nandroid_mtk_restore(const char* backup_path, int uboot, int logo, int nvram
 		    while ((filesystem = filesystems[i]) != NULL) {
 		        sprintf(backup_file_image, "%s/nvdata.%s.tar.gz", backup_path, filesystem);
 		        if (0 == stat(backup_file_image, &sn)) {
+		            if (0 != verify_backup_volumes(backup_file_image))
+		                return print_and_error("Checksum mismatch in nvdata backup!\n", NANDROID_ERROR_GENERAL);
 					restore_handler = tar_gzip_extract_wrapper;
 		            sprintf(nvd, "cd / ; rm -rf data/nvram ; set -o pipefail ; cat %s* | pigz -d -c | tar xv ; exit $?", backup_file_image);
 		            break;
@@ -1295,47 +2076,186 @@ int nandroid_mtk_restore(const char* backup_path, int uboot, int logo, int nvram
 
 #endif
 
-static int nandroid_undump(const char* partition) {
-    nandroid_files_total = 0;
+static int is_raw_volume(const Volume* vol) {
+    return strcmp(vol->fs_type, "mtd") == 0 ||
+           strcmp(vol->fs_type, "bml") == 0 ||
+           strcmp(vol->fs_type, "emmc") == 0;
+}
 
+typedef struct {
+    const Volume* vol;
+    int fd;
     int ret;
+} RawDumpJob;
+
+static void* raw_dump_thread(void* cookie) {
+    RawDumpJob* job = (RawDumpJob*)cookie;
+    char path[32];
+    sprintf(path, "/proc/self/fd/%d", job->fd);
+    job->ret = backup_raw_partition(job->vol->fs_type, job->vol->device, path);
+    close(job->fd);
+    return NULL;
+}
 
-    if (strcmp(partition, "boot") == 0) {
-        Volume *vol = volume_for_path("/boot");
-        if (vol == NULL || vol->fs_type == NULL)
-            return 1;
-        char cmd[PATH_MAX];
-        sprintf(cmd, "cat /proc/self/fd/0 > %s", vol->device);
-        return __system(cmd);
+// Reads the image of a raw partition through a pipe, so mtd, bml and
+// emmc all go through their usual dumpers.
+static int dump_raw_partition(const Volume* vol, NandroidSink* sink) {
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) != 0) {
+        LOGE("Unable to create pipe.\n");
+        return -1;
     }
+    signal(SIGPIPE, SIG_IGN);
 
-    if (strcmp(partition, "recovery") == 0) {
-        if (0 != (ret = nandroid_restore_partition("-", "/recovery")))
-            return ret;
+    pthread_t thread;
+    RawDumpJob job = { vol, pipefd[1], 0 };
+    unsigned char* buffer = malloc(NANDROID_STREAM_FRAME_SIZE);
+    if (buffer == NULL || pthread_create(&thread, NULL, raw_dump_thread, &job) != 0) {
+        free(buffer);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
     }
 
-    if (strcmp(partition, "system") == 0) {
-        if (0 != (ret = nandroid_restore_partition("-", "/system")))
-            return ret;
+    ssize_t n;
+    int ret = 0;
+    while ((n = read(pipefd[0], buffer, NANDROID_STREAM_FRAME_SIZE)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || sink->write(sink, buffer, n) != 0) {
+            ret = -1;
+            break;
+        }
     }
+    // unblocks the dumper if the stream failed
+    close(pipefd[0]);
+    pthread_join(thread, NULL);
+    free(buffer);
+    return ret != 0 ? ret : job.ret;
+}
 
-    if (strcmp(partition, "custpack") == 0) {
-        if (0 != (ret = nandroid_restore_partition("-", "/custpack")))
-            return ret;
+// Streams one partition into writer, or as a plain tar/image to out_fd
+// when writer is NULL. Raw partitions are imaged, the others archived by
+// the in-process tar writer.
+static int dump_partition(const char* partition, NandroidStreamWriter* writer, int out_fd) {
+    char mount_point[PATH_MAX];
+    snprintf(mount_point, sizeof(mount_point), "/%s", partition);
+    Volume* vol = volume_for_path(mount_point);
+    if (vol == NULL || vol->fs_type == NULL || strcmp(vol->mount_point, mount_point) != 0) {
+        LOGE("Unknown partition %s\n", partition);
+        return 1;
+    }
+
+    int raw = is_raw_volume(vol);
+    NandroidSink* sink;
+    if (writer != NULL)
+        sink = stream_writer_begin(writer, partition, raw ? STREAM_KIND_RAW : STREAM_KIND_TAR);
+    else
+        sink = fd_sink_open(out_fd);
+    if (sink == NULL)
+        return -1;
+
+    int ret;
+    if (raw) {
+        ret = dump_raw_partition(vol, sink);
+    } else if (0 != ensure_path_mounted(vol->mount_point)) {
+        LOGE("Can't mount %s\n", vol->mount_point);
+        ret = -1;
+    } else {
+        set_perf_mode(1);
+        ret = nandroid_archive_create(vol->mount_point, get_backup_excludes(vol->mount_point),
+                                      sink, NULL, NULL) == NANDROID_ARCHIVE_OK ? 0 : -1;
+        set_perf_mode(0);
     }
-    
-    if (strcmp(partition, "cust") == 0) {
-        if (0 != (ret = nandroid_restore_partition("-", "/cust")))
-            return ret;
+    if (sink->close(sink, ret != 0) != 0)
+        ret = -1;
+    return ret;
+}
+
+static int nandroid_dump(const char* partition) {
+    // silence our ui_print statements and other logging
+    ui_set_log_stdout(0);
+
+    // anything else printing to stdout would corrupt the stream
+    int out_fd = dup(STDOUT_FILENO);
+    if (out_fd < 0)
+        return 1;
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    int ret = dump_partition(partition, NULL, out_fd);
+    if (close(out_fd) != 0)
+        ret = -1;
+    return ret;
+}
+
+// bml and emmc images are written straight to the device as the stream
+// arrives, so a stream that breaks off leaves the partition partly
+// overwritten. mtd needs erasing and bad block handling, so its image
+// goes through a temporary file and the usual flasher, and the partition
+// is only touched once the whole image was read and checked.
+static int undump_raw_partition(const Volume* vol, const char* partition, UndumpSource* src) {
+    char tmp[PATH_MAX];
+    int mtd = strcmp(vol->fs_type, "mtd") == 0;
+    int ret;
+
+    if (mtd)
+        snprintf(tmp, sizeof(tmp), "/tmp/%s.img", partition);
+    else
+        strcpy(tmp, vol->device);
+
+    int fd = open(tmp, mtd ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_WRONLY | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOGE("Can't open %s (%s)\n", tmp, strerror(errno));
+        return -1;
     }
+    ret = undump_copy(src, fd);
+    if (fsync(fd) != 0)
+        ret = -1;
+    close(fd);
 
-    if (strcmp(partition, "data") == 0) {
-        if (0 != (ret = nandroid_restore_partition("-", "/data")))
-            return ret;
+    if (mtd) {
+        if (ret == 0 && 0 != (ret = format_volume(vol->mount_point)))
+            LOGE("Error while erasing %s\n", vol->mount_point);
+        if (ret == 0)
+            ret = restore_raw_partition(vol->fs_type, vol->device, tmp);
+        unlink(tmp);
+    }
+    return ret;
+}
+
+// kind is NULL for a plain stream, whose format follows from the volume.
+static int undump_partition(const char* partition, const char* kind, UndumpSource* src) {
+    char mount_point[PATH_MAX];
+    snprintf(mount_point, sizeof(mount_point), "/%s", partition);
+    Volume* vol = volume_for_path(mount_point);
+    if (vol == NULL || vol->fs_type == NULL || strcmp(vol->mount_point, mount_point) != 0) {
+        LOGE("Unknown partition %s\n", partition);
+        return 1;
+    }
+
+    int raw = is_raw_volume(vol);
+    if (kind != NULL && strcmp(kind, raw ? STREAM_KIND_RAW : STREAM_KIND_TAR) != 0) {
+        LOGE("Can't restore a %s stream to %s\n", kind, mount_point);
+        return -1;
     }
 
+    nandroid_files_total = 0;
+    if (raw)
+        return undump_raw_partition(vol, partition, src);
+
+    // the partition is formatted before its data is read; see
+    // nandroid_stream.h
+    undump_source = src;
+    int ret = nandroid_restore_partition_extended("-", mount_point, 1);
+    undump_source = NULL;
+    return ret;
+}
+
+static int nandroid_undump(const char* partition) {
+    UndumpSource src = { NULL, STDIN_FILENO, NULL, 0 };
+    int ret = undump_partition(partition, NULL, &src);
     sync();
-    return 0;
+    return ret;
 }
 
 int nandroid_usage() {
@@ -1347,63 +2267,149 @@ int nandroid_usage() {
 }
 
 static int bu_usage() {
-    printf("Usage: bu <fd> backup partition\n");
-    printf("Usage: Prior to restore:\n");
-    printf("Usage: echo -n <partition> > /tmp/ro.bu.restore\n");
+    printf("Usage: bu <fd> backup [--compress] <partition> [<partition> ...]\n");
     printf("Usage: bu <fd> restore\n");
+    printf("Usage: To restore only some partitions of a stream, or a plain\n");
+    printf("Usage: stream of older versions:\n");
+    printf("Usage: echo -n <partition> [<partition> ...] > /tmp/ro.bu.restore\n");
     return 1;
 }
 
-int bu_main(int argc, char** argv) {
-    load_volume_table();
-    setup_data_media();
+static int bu_backup(int fd, int argc, char** argv) {
+    int compress = 0;
+    int i = 0;
+    int ret = 0;
 
-    if (strcmp(argv[2], "backup") == 0) {
-        if (argc != 4) {
-            return bu_usage();
-        }
+    if (i < argc && strcmp(argv[i], "--compress") == 0) {
+        compress = 1;
+        i++;
+    }
+    if (i == argc)
+        return bu_usage();
 
-        int fd = atoi(argv[1]);
-        char* partition = argv[3];
+    // silence our ui_print statements and other logging
+    ui_set_log_stdout(0);
 
-        if (fd != STDOUT_FILENO) {
-            dup2(fd, STDOUT_FILENO);
-            close(fd);
-        }
+    NandroidStreamWriter* writer = stream_writer_open(fd, compress);
+    if (writer == NULL)
+        return 1;
+    for (; i < argc && ret == 0; i++)
+        ret = dump_partition(argv[i], writer, fd);
+    if (stream_writer_close(writer, ret != 0) != 0 && ret == 0)
+        ret = -1;
+
+    // adbd forwards what is left in the socket before closing it
+    nandroid_stream_drain(fd, 10000);
+    close(fd);
+    return ret;
+}
 
-        int ret = nandroid_dump(partition);
-        sleep(10);
-        return ret;
-    } else if (strcmp(argv[2], "restore") == 0) {
-        if (argc != 3) {
-            return bu_usage();
-        }
+// Names listed in /tmp/ro.bu.restore, empty if there is none.
+static void bu_restore_selection(char* selection, size_t size) {
+    selection[0] = '\0';
+    FILE* f = fopen("/tmp/ro.bu.restore", "r");
+    if (f == NULL)
+        return;
+    size_t len = fread(selection, 1, size - 1, f);
+    selection[len] = '\0';
+    fclose(f);
+}
+
+static int bu_restore_selected(const char* selection, const char* partition) {
+    size_t len = strlen(partition);
+    const char* p = selection;
+
+    if (selection[0] == '\0')
+        return 1;
+    if (len == 0)
+        return 0;
+    while ((p = strstr(p, partition)) != NULL) {
+        if ((p == selection || isspace((unsigned char)p[-1])) &&
+                (p[len] == '\0' || isspace((unsigned char)p[len])))
+            return 1;
+        p += len;
+    }
+    return 0;
+}
+
+static int bu_restore(int fd) {
+    unsigned char head[NANDROID_STREAM_MAGIC_SIZE];
+    char selection[256];
+    size_t head_len = 0;
+    int ret = 0;
 
-        int fd = atoi(argv[1]);
-        if (fd != STDIN_FILENO) {
-            dup2(fd, STDIN_FILENO);
-            close(fd);
+    while (head_len < sizeof(head)) {
+        ssize_t n = read(fd, head + head_len, sizeof(head) - head_len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        head_len += n;
+    }
+    bu_restore_selection(selection, sizeof(selection));
+
+    if (head_len == sizeof(head) && nandroid_stream_probe(head)) {
+        NandroidStreamReader* reader = stream_reader_open(fd);
+        UndumpSource src = { reader, fd, NULL, 0 };
+        char name[64], kind[16];
+        int count = 0;
+        int next;
+
+        if (reader == NULL)
+            return 1;
+        while ((next = stream_reader_next(reader, name, sizeof(name), kind, sizeof(kind))) == 0) {
+            if (!bu_restore_selected(selection, name)) {
+                printf("Skipping %s\n", name);
+                continue;
+            }
+            printf("Restoring %s\n", name);
+            if (0 != (ret = undump_partition(name, kind, &src))) {
+                printf("%s is only partly restored!\n", name);
+                break;
+            }
+            count++;
         }
+        stream_reader_close(reader);
+        sync();
+        if (ret == 0 && next < 0) {
+            printf("Restore stream is damaged or incomplete!\n");
+            return 1;
+        }
+        if (ret == 0 && count == 0)
+            printf("nothing to restore!\n");
+        return ret;
+    }
+
+    // plain stream of one partition
+    char* partition = strtok(selection, " \t\r\n");
+    if (partition == NULL) {
+        printf("nothing to restore!\n");
+        return bu_usage();
+    }
+    UndumpSource src = { NULL, fd, head, head_len };
+    ret = undump_partition(partition, NULL, &src);
+    sync();
+    return ret;
+}
+
+int bu_main(int argc, char** argv) {
+    load_volume_table();
+    setup_data_media();
+
+    if (argc < 3)
+        return bu_usage();
 
-        char partition[100];
-        FILE* f = fopen("/tmp/ro.bu.restore", "r");
-        if (f == NULL) {
-            printf("cannot open ro.bu.restore\n");
+    int fd = atoi(argv[1]);
+    if (strcmp(argv[2], "backup") == 0) {
+        if (argc < 4) {
             return bu_usage();
         }
-
-        if (fgets(partition, sizeof(partition), f) == NULL) {
-            fclose(f);
-            printf("nothing to restore!\n");
+        return bu_backup(fd, argc - 3, argv + 3);
+    } else if (strcmp(argv[2], "restore") == 0) {
+        if (argc != 3) {
             return bu_usage();
         }
-
-        size_t len = strlen(partition);
-        if (partition[len - 1] == '\n')
-            partition[len - 1] = '\0';
-
-        // fprintf(stderr, "%d %d %s\n", fd, STDIN_FILENO, argv[3]);
-        return nandroid_undump(partition);
+        return bu_restore(fd);
     }
 
     return bu_usage();
@@ -8,6 +8,10 @@ int nandroid_backup(const char* backup_path);
 int nandroid_advanced_backup(const char* backup_path, int boot, int system, int data, int cache);
 int nandroid_advanced_restore(const char* backup_path, int boot, int system, int data, int cache);
 int nandroid_restore(const char* backup_path, int restore_boot, int restore_system, int restore_data, int restore_cache, int restore_sdext, int restore_wimax);
+// Continue an interrupted nandroid_backup() or nandroid_restore() from
+// the checkpoint journal in backup_path.
+int nandroid_resume_backup(const char* backup_path);
+int nandroid_resume_restore(const char* backup_path);
 
 #ifdef BOARD_HAS_MTK_CPU
 int nandroid_mtk_backup(const char* backup_path, int uboot, int logo, int nvram, int secro);
@@ -24,6 +28,8 @@ unsigned int nandroid_get_default_backup_format();
 #define NANDROID_BACKUP_FORMAT_FILE  "clockworkmod/.default_backup_format"
 #define NANDROID_BACKUP_FORMAT_TAR 0
 #define NANDROID_BACKUP_FORMAT_TGZ 1
+#define NANDROID_BACKUP_FORMAT_PGZ 2
+#define NANDROID_BACKUP_FORMAT_DUP 3
 
 #define NANDROID_ERROR_GENERAL 1
 
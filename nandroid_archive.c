@@ -0,0 +1,1986 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// In-process tar writer for nandroid backups. Replaces the
+// "tar -cpv | split" shell pipelines: the tree is walked directly, the
+// records are written through a chain of NandroidSinks and the output is
+// split into volumes without any extra processes or pipe copies.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "nandroid_archive.h"
+#include "nandroid_digest.h"
+#include "nandroid_journal.h"
+#include "nandroid_stats.h"
+
+#define TAR_BLOCK_SIZE 512
+
+// Pax records carrying xattrs are rarely larger than a few hundred bytes,
+// but a single xattr value may be up to 64k.
+#define PAX_BUFFER_SIZE (128 * 1024)
+#define XATTR_VALUE_MAX (64 * 1024)
+
+static int write_all(int fd, const void* data, size_t len) {
+    const unsigned char* p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static unsigned char* alloc_aligned_buffer(size_t size) {
+    void* buf = NULL;
+    if (posix_memalign(&buf, 4096, size) != 0)
+        return NULL;
+    return buf;
+}
+
+//=========================================/
+//=             Volume sink               =/
+//=========================================/
+
+typedef struct {
+    NandroidSink sink;
+    char base[PATH_MAX];
+    uint64_t volume_size;      // 0: single unbounded stream
+    uint64_t volume_written;
+    int volume_index;
+    int fd;
+    int owns_fd;
+    unsigned char* buf;
+    size_t buf_used;
+    int error;
+    char path[PATH_MAX];       // volume being written
+    FileDigest digest;         // of that volume, for the checksum manifest
+    int digesting;
+    NandroidPhase* stats;      // of the job that opened the sink
+    int journaled;             // volumes go to the backup journal
+    int resuming;              // no volume had to be written again yet
+    int comparing;             // checking the stream against a kept volume
+    uint64_t compare_size;     // of that volume
+    unsigned char* compare_buf;
+} VolumeSink;
+
+// The stream no longer matches the volume kept from the interrupted
+// backup: it is cut where they differ and written from there on, and so
+// is every volume after it.
+static int volume_sink_diverge(VolumeSink* vs) {
+    vs->comparing = 0;
+    vs->resuming = 0;
+    nandroid_journal_volume_reopened(vs->path);
+    if (ftruncate(vs->fd, vs->volume_written) != 0 ||
+            lseek(vs->fd, vs->volume_written, SEEK_SET) < 0) {
+        LOGE("Can't rewrite %s (%s)\n", vs->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int volume_sink_close_volume(VolumeSink* vs) {
+    char md5[MD5_HEX_SIZE];
+    char xxh64[XXH64_HEX_SIZE];
+    int ret = 0;
+
+    if (vs->comparing && vs->digesting && vs->volume_written != vs->compare_size)
+        ret = volume_sink_diverge(vs);
+    // only what is on disk is journaled
+    int journal = vs->journaled && vs->digesting && !vs->comparing;
+    if (ret == 0 && journal && fsync(vs->fd) != 0)
+        ret = -1;
+    if (close(vs->fd) != 0)
+        ret = -1;
+    vs->fd = -1;
+    vs->comparing = 0;
+    if (ret != 0) {
+        LOGE("Error closing backup volume (%s)\n", strerror(errno));
+        return -1;
+    }
+    // A volume kept by a resumed backup gets its checksums from the
+    // regenerated stream it was compared against, like any other; the
+    // journal only supplied its size.
+    if (vs->digesting) {
+        file_digest_final(&vs->digest, md5, xxh64);
+        nandroid_digest_set(vs->path, md5, xxh64);
+        if (journal)
+            nandroid_journal_volume_done(vs->path, vs->volume_written, md5, xxh64);
+    }
+    vs->digesting = 0;
+    return 0;
+}
+
+static int volume_sink_open_volume(VolumeSink* vs) {
+    uint64_t size;
+
+    if (vs->volume_index >= 26) {
+        LOGE("Too many backup volumes for %s\n", vs->base);
+        return -1;
+    }
+    snprintf(vs->path, sizeof(vs->path), "%s.%c", vs->base, 'a' + vs->volume_index);
+    vs->owns_fd = 1;
+    // checksummed on the way out, so no second pass reads it back
+    vs->digesting = nandroid_digest_wanted(vs->path);
+    if (vs->digesting)
+        file_digest_init(&vs->digest, vs->digesting);
+
+    // a resumed backup reads back the volumes it kept instead of writing
+    // them again; the partition is still read and compressed in full, so
+    // only the writes are saved
+    if (vs->resuming && vs->digesting && nandroid_journal_volume_complete(vs->path, &size)) {
+        if (vs->compare_buf == NULL)
+            vs->compare_buf = alloc_aligned_buffer(NANDROID_ARCHIVE_BUFFER_SIZE);
+        if (vs->compare_buf != NULL)
+            vs->fd = open(vs->path, O_RDWR | O_CLOEXEC);
+        if (vs->fd >= 0) {
+            vs->comparing = 1;
+            vs->compare_size = size;
+            return 0;
+        }
+    }
+
+    vs->resuming = 0;
+    if (vs->journaled)
+        nandroid_journal_volume_reopened(vs->path);
+    vs->fd = open(vs->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (vs->fd < 0) {
+        LOGE("Can't create %s (%s)\n", vs->path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Checks up to *len bytes of the stream against the kept volume. Returns
+// 0 and the length checked if they match, 1 if they differ.
+static int volume_sink_compare(VolumeSink* vs, const unsigned char* data, size_t* len) {
+    size_t n = *len;
+    if (n > NANDROID_ARCHIVE_BUFFER_SIZE)
+        n = NANDROID_ARCHIVE_BUFFER_SIZE;
+    if (n > vs->compare_size - vs->volume_written)
+        n = vs->compare_size - vs->volume_written;
+    if (n == 0)
+        return 1;
+
+    uint64_t start = nandroid_stats_now_us();
+    size_t done = 0;
+    while (done < n) {
+        ssize_t r = pread(vs->fd, vs->compare_buf + done, n - done, vs->volume_written + done);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return 1;
+        done += r;
+    }
+    nandroid_stats_add_written(vs->stats, 0, nandroid_stats_now_us() - start);
+    if (memcmp(vs->compare_buf, data, n) != 0)
+        return 1;
+    *len = n;
+    return 0;
+}
+
+static int volume_sink_emit(VolumeSink* vs, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        if (vs->fd < 0 && volume_sink_open_volume(vs) != 0)
+            return -1;
+
+        size_t n = len;
+        if (vs->volume_size != 0 && n > vs->volume_size - vs->volume_written)
+            n = vs->volume_size - vs->volume_written;
+        if (vs->comparing) {
+            if (volume_sink_compare(vs, data, &n) != 0) {
+                if (volume_sink_diverge(vs) != 0)
+                    return -1;
+                continue;
+            }
+        } else {
+            uint64_t start = nandroid_stats_now_us();
+            if (write_all(vs->fd, data, n) != 0) {
+                LOGE("Error writing backup volume (%s)\n", strerror(errno));
+                return -1;
+            }
+            nandroid_stats_add_written(vs->stats, n, nandroid_stats_now_us() - start);
+        }
+        if (vs->digesting)
+            file_digest_update(&vs->digest, data, n);
+        data += n;
+        len -= n;
+        vs->volume_written += n;
+
+        if (vs->volume_size != 0 && vs->volume_written == vs->volume_size) {
+            if (volume_sink_close_volume(vs) != 0)
+                return -1;
+            vs->volume_written = 0;
+            vs->volume_index++;
+        }
+    }
+    return 0;
+}
+
+static int volume_sink_flush(VolumeSink* vs) {
+    if (vs->buf_used == 0)
+        return 0;
+    int ret = volume_sink_emit(vs, vs->buf, vs->buf_used);
+    vs->buf_used = 0;
+    return ret;
+}
+
+static int volume_sink_write(NandroidSink* sink, const void* data, size_t len) {
+    VolumeSink* vs = (VolumeSink*)sink;
+    if (vs->error)
+        return -1;
+
+    if (vs->buf_used + len > NANDROID_ARCHIVE_BUFFER_SIZE) {
+        if (volume_sink_flush(vs) != 0) {
+            vs->error = 1;
+            return -1;
+        }
+        // large writes bypass the buffer, they are already big enough
+        if (len >= NANDROID_ARCHIVE_BUFFER_SIZE) {
+            if (volume_sink_emit(vs, data, len) != 0) {
+                vs->error = 1;
+                return -1;
+            }
+            return 0;
+        }
+    }
+    memcpy(vs->buf + vs->buf_used, data, len);
+    vs->buf_used += len;
+    return 0;
+}
+
+// Removes volumes past the end of the stream, left over from a longer
+// interrupted backup.
+static void volume_sink_remove_stale(VolumeSink* vs) {
+    char path[PATH_MAX];
+    int i;
+
+    for (i = vs->volume_index + (vs->volume_written != 0 ? 1 : 0); i < 26; i++) {
+        snprintf(path, sizeof(path), "%s.%c", vs->base, 'a' + i);
+        if (unlink(path) != 0)
+            break;
+    }
+}
+
+static int volume_sink_close(NandroidSink* sink, int discard) {
+    VolumeSink* vs = (VolumeSink*)sink;
+    int ret = vs->error ? -1 : 0;
+    if (!discard && ret == 0)
+        ret = volume_sink_flush(vs);
+    if (discard || ret != 0)
+        vs->digesting = 0;
+    if (vs->fd >= 0 && vs->owns_fd && volume_sink_close_volume(vs) != 0)
+        ret = -1;
+    if (vs->journaled && !discard && ret == 0)
+        volume_sink_remove_stale(vs);
+    free(vs->compare_buf);
+    free(vs->buf);
+    free(vs);
+    return ret;
+}
+
+static VolumeSink* volume_sink_alloc() {
+    VolumeSink* vs = calloc(1, sizeof(VolumeSink));
+    if (vs == NULL)
+        return NULL;
+    vs->buf = alloc_aligned_buffer(NANDROID_ARCHIVE_BUFFER_SIZE);
+    if (vs->buf == NULL) {
+        free(vs);
+        return NULL;
+    }
+    vs->sink.write = volume_sink_write;
+    vs->sink.close = volume_sink_close;
+    vs->fd = -1;
+    // compressors write from their own threads
+    vs->stats = nandroid_stats_current();
+    return vs;
+}
+
+NandroidSink* volume_sink_open(const char* base, uint64_t volume_size) {
+    // equivalent of the old "touch <base>" so restore finds the volume set
+    int fd = open(base, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOGE("Can't create %s (%s)\n", base, strerror(errno));
+        return NULL;
+    }
+    close(fd);
+
+    VolumeSink* vs = volume_sink_alloc();
+    if (vs == NULL)
+        return NULL;
+    strncpy(vs->base, base, sizeof(vs->base) - 1);
+    vs->volume_size = volume_size;
+    vs->journaled = nandroid_journal_active();
+    vs->resuming = vs->journaled;
+    return &vs->sink;
+}
+
+NandroidSink* fd_sink_open(int fd) {
+    VolumeSink* vs = volume_sink_alloc();
+    if (vs == NULL)
+        return NULL;
+    vs->fd = fd;
+    vs->owns_fd = 0;
+    return &vs->sink;
+}
+
+struct VolumeReader {
+    char base[PATH_MAX];
+    int volume_index;      // -1 while reading <base> itself
+    int fd;
+    char path[PATH_MAX];   // file behind fd
+    FileDigest digest;     // checked against the manifest at its end
+    int verifying;
+};
+
+static void volume_reader_open_file(VolumeReader* r) {
+    r->fd = open(r->path, O_RDONLY | O_CLOEXEC);
+    r->verifying = r->fd >= 0 && nandroid_verify_expect(r->path, &r->digest);
+}
+
+static int volume_reader_next(VolumeReader* r) {
+    if (r->fd >= 0)
+        close(r->fd);
+    r->fd = -1;
+    if (r->volume_index >= 25)
+        return 0;
+    r->volume_index++;
+    snprintf(r->path, sizeof(r->path), "%s.%c", r->base, 'a' + r->volume_index);
+    volume_reader_open_file(r);
+    if (r->fd < 0) {
+        // the end of the set, unless the manifest says otherwise
+        if (errno == ENOENT && !nandroid_verify_listed(r->path))
+            return 0;
+        LOGE("Can't open %s (%s)\n", r->path, strerror(errno));
+        return -1;
+    }
+    posix_fadvise(r->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return 1;
+}
+
+VolumeReader* volume_reader_open(const char* base) {
+    VolumeReader* r = calloc(1, sizeof(VolumeReader));
+    if (r == NULL)
+        return NULL;
+    strncpy(r->base, base, sizeof(r->base) - 1);
+    strncpy(r->path, base, sizeof(r->path) - 1);
+    r->volume_index = -1;
+    volume_reader_open_file(r);
+    if (r->fd < 0 && volume_reader_next(r) <= 0) {
+        LOGE("Can't open backup %s\n", base);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+ssize_t volume_reader_read(VolumeReader* r, void* data, size_t len) {
+    size_t done = 0;
+    while (done < len && r->fd >= 0) {
+        ssize_t n = read(r->fd, (unsigned char*)data + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            LOGE("Error reading backup volume (%s)\n", strerror(errno));
+            return -1;
+        }
+        if (n == 0) {
+            if (r->verifying && nandroid_verify_check(r->path, &r->digest) != 0)
+                return -1;
+            if (volume_reader_next(r) < 0)
+                return -1;
+            continue;
+        }
+        if (r->verifying)
+            file_digest_update(&r->digest, (unsigned char*)data + done, n);
+        done += n;
+    }
+    return done;
+}
+
+void volume_reader_close(VolumeReader* r) {
+    if (r == NULL)
+        return;
+    if (r->fd >= 0)
+        close(r->fd);
+    free(r);
+}
+
+//=========================================/
+//=             Filter sink               =/
+//=========================================/
+
+typedef struct {
+    NandroidSink sink;
+    NandroidSink* next;
+    pid_t pid;
+    int in_fd;
+    int out_fd;
+    pthread_t pump;
+    int pump_error;
+    int error;
+} FilterSink;
+
+// Copies the filter's stdout into the next sink. Keeps draining after an
+// error so the filter never blocks on a full pipe.
+static void* filter_pump_thread(void* cookie) {
+    FilterSink* fs = cookie;
+    unsigned char* buf = malloc(NANDROID_ARCHIVE_BUFFER_SIZE);
+    if (buf == NULL)
+        fs->pump_error = 1;
+
+    for (;;) {
+        ssize_t n;
+        if (buf == NULL) {
+            char drain[4096];
+            n = read(fs->out_fd, drain, sizeof(drain));
+        } else {
+            n = read(fs->out_fd, buf, NANDROID_ARCHIVE_BUFFER_SIZE);
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n < 0)
+                fs->pump_error = 1;
+            break;
+        }
+        if (buf != NULL && !fs->pump_error && fs->next->write(fs->next, buf, n) != 0)
+            fs->pump_error = 1;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static int filter_sink_write(NandroidSink* sink, const void* data, size_t len) {
+    FilterSink* fs = (FilterSink*)sink;
+    if (fs->error || fs->pump_error)
+        return -1;
+    if (write_all(fs->in_fd, data, len) != 0) {
+        LOGE("Error writing to backup filter (%s)\n", strerror(errno));
+        fs->error = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static int filter_sink_close(NandroidSink* sink, int discard) {
+    FilterSink* fs = (FilterSink*)sink;
+    int status = 0;
+
+    close(fs->in_fd);
+    if (discard)
+        kill(fs->pid, SIGTERM);
+    pthread_join(fs->pump, NULL);
+    close(fs->out_fd);
+    while (waitpid(fs->pid, &status, 0) < 0 && errno == EINTR)
+        ;
+
+    int ret = 0;
+    if (fs->error || fs->pump_error || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        ret = -1;
+    if (fs->next->close(fs->next, discard || ret != 0) != 0)
+        ret = -1;
+    free(fs);
+    return ret;
+}
+
+NandroidSink* filter_sink_open(char* const argv[], NandroidSink* next) {
+    int in[2], out[2];
+    if (next == NULL)
+        return NULL;
+
+    FilterSink* fs = calloc(1, sizeof(FilterSink));
+    if (fs == NULL) {
+        next->close(next, 1);
+        return NULL;
+    }
+    if (pipe2(in, O_CLOEXEC) != 0) {
+        free(fs);
+        next->close(next, 1);
+        return NULL;
+    }
+    if (pipe2(out, O_CLOEXEC) != 0) {
+        close(in[0]);
+        close(in[1]);
+        free(fs);
+        next->close(next, 1);
+        return NULL;
+    }
+
+    // a dying filter must surface as a write error, not kill recovery
+    signal(SIGPIPE, SIG_IGN);
+
+    fs->pid = fork();
+    if (fs->pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    if (fs->pid < 0) {
+        LOGE("Can't start %s (%s)\n", argv[0], strerror(errno));
+        close(in[1]);
+        close(out[0]);
+        free(fs);
+        next->close(next, 1);
+        return NULL;
+    }
+
+    fs->sink.write = filter_sink_write;
+    fs->sink.close = filter_sink_close;
+    fs->next = next;
+    fs->in_fd = in[1];
+    fs->out_fd = out[0];
+    int err = pthread_create(&fs->pump, NULL, filter_pump_thread, fs);
+    if (err != 0) {
+        LOGE("Can't start pump thread for %s (%s)\n", argv[0], strerror(err));
+        close(in[1]);
+        close(out[0]);
+        kill(fs->pid, SIGTERM);
+        while (waitpid(fs->pid, NULL, 0) < 0 && errno == EINTR)
+            ;
+        free(fs);
+        next->close(next, 1);
+        return NULL;
+    }
+    return &fs->sink;
+}
+
+//=========================================/
+//=             Tar writer                =/
+//=========================================/
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    char* name;
+} HardLink;
+
+typedef struct {
+    NandroidSink* sink;
+    const char* const* excludes;
+    archive_progress_fn progress;
+    void* cookie;
+    unsigned char* buf;
+    char* pax;
+    char* xattr_names;
+    size_t xattr_names_alloc;
+    char* xattr_value;
+    uint64_t bytes_done;
+    uint64_t bytes_reported;
+    HardLink* links;
+    int links_count;
+    int links_alloc;
+    int canceled;
+    NandroidPhase* stats;
+} TarWriter;
+
+static int is_excluded(const char* const* excludes, const char* name) {
+    if (excludes == NULL)
+        return 0;
+    for (; *excludes != NULL; excludes++) {
+        if (fnmatch(*excludes, name, 0) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Numeric header fields are octal; values that do not fit use the GNU
+// base-256 encoding (high bit set), which busybox tar understands.
+static void put_number(char* field, size_t width, uint64_t value) {
+    if (width < 2 || value < (1ULL << (3 * (width - 1)))) {
+        snprintf(field, width, "%0*llo", (int)(width - 1), (unsigned long long)value);
+        return;
+    }
+    memset(field, 0, width);
+    size_t i;
+    for (i = width - 1; i > 0; i--) {
+        field[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+    field[0] = (char)0x80;
+}
+
+typedef struct {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} TarHeader;
+
+static void finish_header(TarHeader* h) {
+    unsigned int sum = 0;
+    unsigned int i;
+    const unsigned char* p = (const unsigned char*)h;
+
+    memcpy(h->magic, "ustar", 6);
+    memcpy(h->version, "00", 2);
+    memset(h->chksum, ' ', sizeof(h->chksum));
+    for (i = 0; i < sizeof(TarHeader); i++)
+        sum += p[i];
+    snprintf(h->chksum, sizeof(h->chksum), "%06o", sum);
+    h->chksum[7] = ' ';
+}
+
+static int tar_write_padded(TarWriter* w, const void* data, size_t len) {
+    static const unsigned char zeros[TAR_BLOCK_SIZE];
+    if (w->sink->write(w->sink, data, len) != 0)
+        return -1;
+    if (len % TAR_BLOCK_SIZE != 0)
+        return w->sink->write(w->sink, zeros, TAR_BLOCK_SIZE - len % TAR_BLOCK_SIZE);
+    return 0;
+}
+
+// Emits a GNU long name ('L') or long link ('K') record.
+static int tar_write_long_name(TarWriter* w, char type, const char* name) {
+    TarHeader h;
+    size_t len = strlen(name) + 1;
+
+    memset(&h, 0, sizeof(h));
+    strcpy(h.name, "././@LongLink");
+    put_number(h.mode, sizeof(h.mode), 0);
+    put_number(h.uid, sizeof(h.uid), 0);
+    put_number(h.gid, sizeof(h.gid), 0);
+    put_number(h.size, sizeof(h.size), len);
+    put_number(h.mtime, sizeof(h.mtime), 0);
+    h.typeflag = type;
+    finish_header(&h);
+    if (w->sink->write(w->sink, &h, sizeof(h)) != 0)
+        return -1;
+    return tar_write_padded(w, name, len);
+}
+
+// Appends "<len> <key>=<value>\n" to the pax buffer, where len counts
+// the whole record including its own digits.
+static int pax_append(char* pax, size_t* used, const char* key, const void* value, size_t value_len) {
+    size_t base = strlen(key) + value_len + 3;    // ' ', '=', '\n'
+    size_t len = base + 1;
+    char digits[24];
+    while (len != base + (size_t)snprintf(digits, sizeof(digits), "%zu", len))
+        len = base + strlen(digits);
+
+    if (*used + len > PAX_BUFFER_SIZE)
+        return -1;
+    char* p = pax + *used;
+    p += sprintf(p, "%zu %s=", len, key);
+    memcpy(p, value, value_len);
+    p[value_len] = '\n';
+    *used += len;
+    return 0;
+}
+
+// Collects xattrs into pax records. The SELinux label uses the
+// RHT.security.selinux key honoured by busybox and GNU tar; everything
+// else goes into SCHILY.xattr.* records. Returns -1 if the label or the
+// list of names can't be read, since restoring the file without them
+// would quietly leave it mislabeled.
+static ssize_t tar_collect_xattrs(TarWriter* w, const char* path) {
+    char key[PATH_MAX];
+    size_t used = 0;
+    ssize_t list_len;
+
+    for (;;) {
+        list_len = llistxattr(path, NULL, 0);
+        if (list_len > 0 && (size_t)list_len > w->xattr_names_alloc) {
+            char* names = realloc(w->xattr_names, list_len);
+            if (names == NULL) {
+                LOGE("Can't allocate %zd bytes for xattrs of %s\n", list_len, path);
+                return -1;
+            }
+            w->xattr_names = names;
+            w->xattr_names_alloc = list_len;
+        }
+        if (list_len > 0)
+            list_len = llistxattr(path, w->xattr_names, w->xattr_names_alloc);
+        // ERANGE: an xattr was added since we sized the list
+        if (list_len >= 0 || errno != ERANGE)
+            break;
+    }
+    if (list_len < 0) {
+        if (errno == ENOTSUP || errno == ENODATA)
+            return 0;
+        LOGE("Can't list xattrs of %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    char* name;
+    for (name = w->xattr_names; name < w->xattr_names + list_len; name += strlen(name) + 1) {
+        int is_label = strcmp(name, "security.selinux") == 0;
+        ssize_t value_len = lgetxattr(path, name, w->xattr_value, XATTR_VALUE_MAX);
+        if (value_len < 0) {
+            // ENODATA: removed since it was listed
+            if (errno == ENOTSUP || errno == ENODATA)
+                continue;
+            if (is_label) {
+                LOGE("Can't read %s of %s (%s)\n", name, path, strerror(errno));
+                return -1;
+            }
+            LOGW("Skipping unreadable xattr %s on %s (%s)\n", name, path, strerror(errno));
+            continue;
+        }
+        if (is_label) {
+            // the label is stored without its trailing NUL
+            while (value_len > 0 && w->xattr_value[value_len - 1] == '\0')
+                value_len--;
+            strcpy(key, "RHT.security.selinux");
+        } else {
+            snprintf(key, sizeof(key), "SCHILY.xattr.%s", name);
+        }
+        if (pax_append(w->pax, &used, key, w->xattr_value, value_len) != 0)
+            LOGW("Skipping oversized xattr %s on %s\n", name, path);
+    }
+    return used;
+}
+
+// Last component of a member name, ignoring the trailing '/' of
+// directories. Only used to label pax records.
+static const char* member_basename(const char* name) {
+    size_t len = strlen(name);
+    while (len > 1 && name[len - 1] == '/')
+        len--;
+    while (len > 0 && name[len - 1] != '/')
+        len--;
+    return name + len;
+}
+
+static int tar_write_header(TarWriter* w, const char* path, const char* name,
+                            const struct stat* st, char type, const char* linkname,
+                            uint64_t size) {
+    TarHeader h;
+    ssize_t pax_len = tar_collect_xattrs(w, path);
+
+    if (pax_len < 0)
+        return -1;
+    if (pax_len > 0) {
+        memset(&h, 0, sizeof(h));
+        snprintf(h.name, sizeof(h.name), "PaxHeaders/%s", member_basename(name));
+        put_number(h.mode, sizeof(h.mode), 0644);
+        put_number(h.uid, sizeof(h.uid), 0);
+        put_number(h.gid, sizeof(h.gid), 0);
+        put_number(h.size, sizeof(h.size), pax_len);
+        put_number(h.mtime, sizeof(h.mtime), st->st_mtime);
+        h.typeflag = 'x';
+        finish_header(&h);
+        if (w->sink->write(w->sink, &h, sizeof(h)) != 0 ||
+                tar_write_padded(w, w->pax, pax_len) != 0)
+            return -1;
+    }
+
+    memset(&h, 0, sizeof(h));
+    size_t name_len = strlen(name);
+    if (name_len <= sizeof(h.name)) {
+        memcpy(h.name, name, name_len);
+    } else {
+        // try the ustar prefix split before falling back to a long name
+        const char* slash = NULL;
+        if (name_len <= sizeof(h.prefix) + 1 + sizeof(h.name)) {
+            slash = strchr(name + name_len - sizeof(h.name) - 1, '/');
+            if (slash != NULL && (size_t)(slash - name) > sizeof(h.prefix))
+                slash = NULL;
+        }
+        if (slash != NULL && slash != name) {
+            memcpy(h.prefix, name, slash - name);
+            memcpy(h.name, slash + 1, name_len - (slash - name) - 1);
+        } else {
+            if (tar_write_long_name(w, 'L', name) != 0)
+                return -1;
+            memcpy(h.name, name, sizeof(h.name));
+        }
+    }
+
+    if (linkname != NULL) {
+        size_t link_len = strlen(linkname);
+        if (link_len > sizeof(h.linkname) && tar_write_long_name(w, 'K', linkname) != 0)
+            return -1;
+        memcpy(h.linkname, linkname, link_len < sizeof(h.linkname) ? link_len : sizeof(h.linkname));
+    }
+
+    put_number(h.mode, sizeof(h.mode), st->st_mode & 07777);
+    put_number(h.uid, sizeof(h.uid), st->st_uid);
+    put_number(h.gid, sizeof(h.gid), st->st_gid);
+    put_number(h.size, sizeof(h.size), size);
+    put_number(h.mtime, sizeof(h.mtime), st->st_mtime);
+    h.typeflag = type;
+    if (type == '3' || type == '4') {
+        put_number(h.devmajor, sizeof(h.devmajor), major(st->st_rdev));
+        put_number(h.devminor, sizeof(h.devminor), minor(st->st_rdev));
+    }
+    finish_header(&h);
+    return w->sink->write(w->sink, &h, sizeof(h));
+}
+
+static int tar_report(TarWriter* w, int force) {
+    if (w->progress == NULL)
+        return 0;
+    if (!force && w->bytes_done - w->bytes_reported < NANDROID_ARCHIVE_BUFFER_SIZE)
+        return 0;
+    w->bytes_reported = w->bytes_done;
+    if (w->progress(w->bytes_done, w->cookie) != 0) {
+        w->canceled = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static int tar_write_file_data(TarWriter* w, const char* path, uint64_t size) {
+    static const unsigned char zeros[TAR_BLOCK_SIZE];
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("Can't open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint64_t remaining = size;
+    while (remaining > 0) {
+        size_t want = remaining < NANDROID_ARCHIVE_BUFFER_SIZE ? remaining : NANDROID_ARCHIVE_BUFFER_SIZE;
+        uint64_t start = nandroid_stats_now_us();
+        ssize_t n = read(fd, w->buf, want);
+        if (n > 0)
+            nandroid_stats_add_read(w->stats, n, nandroid_stats_now_us() - start);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            LOGE("Error reading %s (%s)\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        if (n == 0) {
+            // file shrank while archiving: pad to the size already recorded
+            LOGW("%s: file shrank by %llu bytes; padding with zeros\n", path, (unsigned long long)remaining);
+            memset(w->buf, 0, want);
+            n = want;
+        }
+        if (w->sink->write(w->sink, w->buf, n) != 0) {
+            close(fd);
+            return -1;
+        }
+        remaining -= n;
+        w->bytes_done += n;
+        if (tar_report(w, 0) != 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+
+    if (size % TAR_BLOCK_SIZE != 0)
+        return w->sink->write(w->sink, zeros, TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE);
+    return 0;
+}
+
+static const char* tar_find_link(TarWriter* w, const struct stat* st, const char* name) {
+    int i;
+    for (i = 0; i < w->links_count; i++) {
+        if (w->links[i].dev == st->st_dev && w->links[i].ino == st->st_ino)
+            return w->links[i].name;
+    }
+
+    if (w->links_count == w->links_alloc) {
+        int alloc = w->links_alloc == 0 ? 64 : w->links_alloc * 2;
+        HardLink* links = realloc(w->links, alloc * sizeof(HardLink));
+        if (links == NULL)
+            return NULL;
+        w->links = links;
+        w->links_alloc = alloc;
+    }
+    w->links[w->links_count].dev = st->st_dev;
+    w->links[w->links_count].ino = st->st_ino;
+    w->links[w->links_count].name = strdup(name);
+    if (w->links[w->links_count].name != NULL)
+        w->links_count++;
+    return NULL;
+}
+
+static int compare_names(const struct dirent** a, const struct dirent** b) {
+    return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+static int skip_dots(const struct dirent* de) {
+    return strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0;
+}
+
+// path is the filesystem path, name its member name. Entries are visited
+// in sorted order so the same tree always produces the same stream.
+static int tar_write_tree(TarWriter* w, char* path, size_t path_len, char* name) {
+    struct stat st;
+    char link[PATH_MAX];
+
+    if (is_excluded(w->excludes, name))
+        return 0;
+
+    if (lstat(path, &st) != 0) {
+        LOGE("Can't stat %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        if (st.st_nlink > 1) {
+            const char* target = tar_find_link(w, &st, name);
+            if (target != NULL)
+                return tar_write_header(w, path, name, &st, '1', target, 0);
+        }
+        if (tar_write_header(w, path, name, &st, '0', NULL, st.st_size) != 0)
+            return -1;
+        return tar_write_file_data(w, path, st.st_size);
+    }
+    if (S_ISLNK(st.st_mode)) {
+        ssize_t len = readlink(path, link, sizeof(link) - 1);
+        if (len < 0) {
+            LOGE("Can't read link %s (%s)\n", path, strerror(errno));
+            return -1;
+        }
+        link[len] = '\0';
+        return tar_write_header(w, path, name, &st, '2', link, 0);
+    }
+    if (S_ISCHR(st.st_mode))
+        return tar_write_header(w, path, name, &st, '3', NULL, 0);
+    if (S_ISBLK(st.st_mode))
+        return tar_write_header(w, path, name, &st, '4', NULL, 0);
+    if (S_ISFIFO(st.st_mode))
+        return tar_write_header(w, path, name, &st, '6', NULL, 0);
+    if (!S_ISDIR(st.st_mode)) {
+        // sockets are not archived, same as tar
+        return 0;
+    }
+
+    size_t name_len = strlen(name);
+    name[name_len] = '/';
+    name[name_len + 1] = '\0';
+    int ret = tar_write_header(w, path, name, &st, '5', NULL, 0);
+    name[name_len] = '\0';
+    if (ret != 0 || tar_report(w, 1) != 0)
+        return -1;
+
+    struct dirent** entries;
+    int count = scandir(path, &entries, skip_dots, compare_names);
+    if (count < 0) {
+        LOGE("Can't open directory %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < count; i++) {
+        size_t len = strlen(entries[i]->d_name);
+        if (ret == 0) {
+            if (path_len + 1 + len >= PATH_MAX || name_len + 2 + len >= PATH_MAX) {
+                LOGE("Path too long: %s/%s\n", path, entries[i]->d_name);
+                ret = -1;
+            } else {
+                path[path_len] = '/';
+                strcpy(path + path_len + 1, entries[i]->d_name);
+                name[name_len] = '/';
+                strcpy(name + name_len + 1, entries[i]->d_name);
+                ret = tar_write_tree(w, path, path_len + 1 + len, name);
+                path[path_len] = '\0';
+                name[name_len] = '\0';
+            }
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    return ret;
+}
+
+// Splits "/data" into the tree path and the member name "data".
+static int split_archive_path(const char* root, char* path, char* name) {
+    size_t len = strlen(root);
+    while (len > 1 && root[len - 1] == '/')
+        len--;
+    if (len == 0 || len >= PATH_MAX)
+        return -1;
+    memcpy(path, root, len);
+    path[len] = '\0';
+
+    const char* base = strrchr(path, '/');
+    base = base == NULL ? path : base + 1;
+    if (*base == '\0')
+        return -1;
+    strcpy(name, base);
+    return 0;
+}
+
+int nandroid_archive_create(const char* root, const char* const* excludes,
+                            NandroidSink* sink, archive_progress_fn progress,
+                            void* cookie) {
+    char path[PATH_MAX];
+    char name[PATH_MAX];
+    TarWriter w;
+
+    if (split_archive_path(root, path, name) != 0) {
+        LOGE("Invalid archive path %s\n", root);
+        return NANDROID_ARCHIVE_ERROR;
+    }
+
+    memset(&w, 0, sizeof(w));
+    w.sink = sink;
+    w.excludes = excludes;
+    w.progress = progress;
+    w.cookie = cookie;
+    w.stats = nandroid_stats_current();
+    w.buf = alloc_aligned_buffer(NANDROID_ARCHIVE_BUFFER_SIZE);
+    w.pax = malloc(PAX_BUFFER_SIZE);
+    w.xattr_value = malloc(XATTR_VALUE_MAX);
+    if (w.buf == NULL || w.pax == NULL || w.xattr_value == NULL) {
+        free(w.buf);
+        free(w.pax);
+        free(w.xattr_value);
+        return NANDROID_ARCHIVE_ERROR;
+    }
+
+    int ret = tar_write_tree(&w, path, strlen(path), name);
+    if (ret == 0) {
+        // end of archive: two zero blocks
+        memset(w.buf, 0, 2 * TAR_BLOCK_SIZE);
+        ret = sink->write(sink, w.buf, 2 * TAR_BLOCK_SIZE);
+    }
+    if (ret == 0)
+        tar_report(&w, 1);
+
+    int i;
+    for (i = 0; i < w.links_count; i++)
+        free(w.links[i].name);
+    free(w.links);
+    free(w.buf);
+    free(w.pax);
+    free(w.xattr_names);
+    free(w.xattr_value);
+
+    if (w.canceled)
+        return NANDROID_ARCHIVE_CANCELED;
+    return ret == 0 ? NANDROID_ARCHIVE_OK : NANDROID_ARCHIVE_ERROR;
+}
+
+static void stats_walk(char* path, size_t path_len, char* name, const char* const* excludes,
+                       uint64_t* total_bytes, unsigned int* total_files) {
+    struct stat st;
+
+    if (is_excluded(excludes, name) || lstat(path, &st) != 0)
+        return;
+    (*total_files)++;
+    if (S_ISREG(st.st_mode))
+        *total_bytes += st.st_size;
+    if (!S_ISDIR(st.st_mode))
+        return;
+
+    DIR* d = opendir(path);
+    if (d == NULL)
+        return;
+    size_t name_len = strlen(name);
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        size_t len = strlen(de->d_name);
+        if (!skip_dots(de) || path_len + 1 + len >= PATH_MAX || name_len + 1 + len >= PATH_MAX)
+            continue;
+        path[path_len] = '/';
+        strcpy(path + path_len + 1, de->d_name);
+        name[name_len] = '/';
+        strcpy(name + name_len + 1, de->d_name);
+        stats_walk(path, path_len + 1 + len, name, excludes, total_bytes, total_files);
+        path[path_len] = '\0';
+        name[name_len] = '\0';
+    }
+    closedir(d);
+}
+
+int nandroid_archive_stats(const char* root, const char* const* excludes,
+                           uint64_t* total_bytes, unsigned int* total_files) {
+    char path[PATH_MAX];
+    char name[PATH_MAX];
+
+    *total_bytes = 0;
+    *total_files = 0;
+    if (split_archive_path(root, path, name) != 0)
+        return -1;
+    stats_walk(path, strlen(path), name, excludes, total_bytes, total_files);
+    return 0;
+}
+
+//=========================================/
+//=             Tar reader                =/
+//=========================================/
+
+// Restores are dominated by per-file syscalls on trees with many small
+// files (/data), so regular files are created by a pool of workers: the
+// calling thread parses the stream and hands each small file over with its
+// data and metadata, which the worker applies through the open descriptor.
+// Directory metadata is applied in one pass at the end, once nothing is
+// created in them anymore, and a single syncfs() replaces per-file fsync.
+
+#define EXTRACT_SMALL_FILE   (256 * 1024)
+#define EXTRACT_QUEUE_BYTES  (32 * 1024 * 1024)
+#define EXTRACT_MAX_WORKERS  8
+
+typedef struct {
+    char* name;
+    char* value;
+    size_t len;
+} TarXattr;
+
+// What gets applied to a node once it exists.
+typedef struct {
+    char type;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    time_t mtime;
+    uint64_t size;
+    TarXattr* xattrs;
+    int xattrs_count;
+} TarMeta;
+
+typedef struct {
+    char name[PATH_MAX];
+    char linkname[PATH_MAX];
+    dev_t rdev;
+    TarMeta meta;
+} TarEntry;
+
+typedef struct FileTask {
+    struct FileTask* next;
+    char* path;
+    unsigned char* data;
+    size_t cost;               // accounted against EXTRACT_QUEUE_BYTES
+    TarMeta meta;
+} FileTask;
+
+typedef struct {
+    char* path;
+    TarMeta meta;
+} DirTask;
+
+typedef struct {
+    int in_fd;
+    char dest[PATH_MAX];
+    archive_progress_fn progress;
+    void* cookie;
+    unsigned char* buf;
+    size_t buf_pos;
+    size_t buf_len;
+    int eof;
+    uint64_t bytes_done;
+    uint64_t bytes_reported;
+    int canceled;
+
+    // GNU long names and pax records, consumed by the next entry
+    char* long_name;
+    char* long_link;
+    TarEntry pax;
+    int pax_has_path;
+    int pax_has_link;
+    int pax_has_size;
+
+    DirTask* dirs;
+    int dirs_count;
+    int dirs_alloc;
+
+    pthread_t workers[EXTRACT_MAX_WORKERS];
+    int workers_count;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    FileTask* queue_head;
+    FileTask* queue_tail;
+    size_t queued_bytes;
+    int busy;
+    int stopping;
+    int error;
+} TarReader;
+
+static void tar_meta_free(TarMeta* m) {
+    int i;
+    for (i = 0; i < m->xattrs_count; i++) {
+        free(m->xattrs[i].name);
+        free(m->xattrs[i].value);
+    }
+    free(m->xattrs);
+    m->xattrs = NULL;
+    m->xattrs_count = 0;
+}
+
+static int tar_meta_add_xattr(TarMeta* m, const char* name, const char* value, size_t len) {
+    TarXattr* xattrs = realloc(m->xattrs, (m->xattrs_count + 1) * sizeof(TarXattr));
+    if (xattrs == NULL)
+        return -1;
+    m->xattrs = xattrs;
+    TarXattr* x = &xattrs[m->xattrs_count];
+    x->name = strdup(name);
+    x->value = malloc(len + 1);
+    if (x->name == NULL || x->value == NULL) {
+        free(x->name);
+        free(x->value);
+        return -1;
+    }
+    memcpy(x->value, value, len);
+    x->value[len] = '\0';
+    x->len = len;
+    // the label is archived without its trailing NUL; set it with one
+    if (strcmp(name, "security.selinux") == 0)
+        x->len = len + 1;
+    m->xattrs_count++;
+    return 0;
+}
+
+// Applies ownership, mode, xattrs and mtime through fd, or through path
+// when fd is -1 (symlinks, devices, directories).
+static int tar_apply_metadata(const char* path, int fd, const TarMeta* m) {
+    struct timespec times[2];
+    int i, ret = 0;
+
+    if ((fd >= 0 ? fchown(fd, m->uid, m->gid) : lchown(path, m->uid, m->gid)) != 0) {
+        LOGE("Can't chown %s (%s)\n", path, strerror(errno));
+        ret = -1;
+    }
+    // after chown, which drops the setuid bits
+    if (m->type != '2' && (fd >= 0 ? fchmod(fd, m->mode) : chmod(path, m->mode)) != 0) {
+        LOGE("Can't chmod %s (%s)\n", path, strerror(errno));
+        ret = -1;
+    }
+    for (i = 0; i < m->xattrs_count; i++) {
+        const TarXattr* x = &m->xattrs[i];
+        int r = fd >= 0 ? fsetxattr(fd, x->name, x->value, x->len, 0)
+                        : lsetxattr(path, x->name, x->value, x->len, 0);
+        if (r == 0)
+            continue;
+        // a file left with the wrong label can keep the system from booting
+        if (strcmp(x->name, "security.selinux") == 0) {
+            LOGE("Can't set %s on %s (%s)\n", x->name, path, strerror(errno));
+            ret = -1;
+        } else {
+            LOGW("Can't set %s on %s (%s)\n", x->name, path, strerror(errno));
+        }
+    }
+    times[0].tv_sec = times[1].tv_sec = m->mtime;
+    times[0].tv_nsec = times[1].tv_nsec = 0;
+    if (fd >= 0)
+        futimens(fd, times);
+    else
+        utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW);
+    return ret;
+}
+
+// mkdir -p of the parents of path, for archives that don't list them.
+static void tar_make_parents(const char* path) {
+    char tmp[PATH_MAX];
+    char* p;
+
+    strcpy(tmp, path);
+    for (p = tmp + 1; *p != '\0'; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        mkdir(tmp, 0755);
+        *p = '/';
+    }
+}
+
+static int tar_open_file(const char* path) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC;
+    int fd = open(path, flags, 0600);
+    if (fd < 0 && errno == ENOENT) {
+        tar_make_parents(path);
+        fd = open(path, flags, 0600);
+    }
+    if (fd < 0 && (errno == ELOOP || errno == EISDIR || errno == ETXTBSY)) {
+        // replace whatever is in the way, as tar does
+        if (unlink(path) != 0)
+            rmdir(path);
+        fd = open(path, flags, 0600);
+    }
+    if (fd < 0)
+        LOGE("Can't create %s (%s)\n", path, strerror(errno));
+    return fd;
+}
+
+static void tar_preallocate(int fd, uint64_t size) {
+    // one extent instead of growing the file write by write; not every
+    // filesystem supports it and nothing depends on it succeeding
+    if (size > 0)
+        fallocate(fd, 0, 0, size);
+}
+
+static int tar_write_small_file(FileTask* t) {
+    int fd = tar_open_file(t->path);
+    if (fd < 0)
+        return -1;
+    tar_preallocate(fd, t->meta.size);
+    int ret = write_all(fd, t->data, t->meta.size);
+    if (ret != 0)
+        LOGE("Error writing %s (%s)\n", t->path, strerror(errno));
+    if (tar_apply_metadata(t->path, fd, &t->meta) != 0)
+        ret = -1;
+    if (close(fd) != 0)
+        ret = -1;
+    return ret;
+}
+
+static void file_task_free(FileTask* t) {
+    tar_meta_free(&t->meta);
+    free(t->path);
+    free(t->data);
+    free(t);
+}
+
+static void* tar_worker_thread(void* cookie) {
+    TarReader* r = cookie;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (r->queue_head == NULL && !r->stopping)
+            pthread_cond_wait(&r->cond, &r->lock);
+        if (r->queue_head == NULL)
+            break;
+        FileTask* t = r->queue_head;
+        r->queue_head = t->next;
+        if (r->queue_head == NULL)
+            r->queue_tail = NULL;
+        r->busy++;
+        int skip = r->error;
+        pthread_mutex_unlock(&r->lock);
+
+        int ret = skip ? 0 : tar_write_small_file(t);
+        size_t cost = t->cost;
+        file_task_free(t);
+
+        pthread_mutex_lock(&r->lock);
+        r->busy--;
+        r->queued_bytes -= cost;
+        if (ret != 0)
+            r->error = 1;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+static void tar_queue_file(TarReader* r, FileTask* t) {
+    t->cost = sizeof(FileTask) + t->meta.size + strlen(t->path);
+    pthread_mutex_lock(&r->lock);
+    // bound the memory held by files waiting for a worker
+    while (r->queued_bytes > EXTRACT_QUEUE_BYTES && !r->error)
+        pthread_cond_wait(&r->cond, &r->lock);
+    t->next = NULL;
+    if (r->queue_tail != NULL)
+        r->queue_tail->next = t;
+    else
+        r->queue_head = t;
+    r->queue_tail = t;
+    r->queued_bytes += t->cost;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Waits until every queued file is written. Returns -1 if one failed.
+static int tar_drain_workers(TarReader* r) {
+    pthread_mutex_lock(&r->lock);
+    while (r->queue_head != NULL || r->busy > 0)
+        pthread_cond_wait(&r->cond, &r->lock);
+    int error = r->error;
+    pthread_mutex_unlock(&r->lock);
+    return error ? -1 : 0;
+}
+
+static int tar_reader_fill(TarReader* r) {
+    if (r->buf_pos < r->buf_len || r->eof)
+        return 0;
+    r->buf_pos = 0;
+    r->buf_len = 0;
+    for (;;) {
+        ssize_t n = read(r->in_fd, r->buf, NANDROID_ARCHIVE_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            LOGE("Error reading archive (%s)\n", strerror(errno));
+            return -1;
+        }
+        if (n == 0)
+            r->eof = 1;
+        r->buf_len = n;
+        return 0;
+    }
+}
+
+static int tar_reader_report(TarReader* r) {
+    if (r->progress == NULL || r->bytes_done - r->bytes_reported < NANDROID_ARCHIVE_BUFFER_SIZE)
+        return 0;
+    r->bytes_reported = r->bytes_done;
+    if (r->progress(r->bytes_done, r->cookie) != 0) {
+        r->canceled = 1;
+        return -1;
+    }
+    return 0;
+}
+
+// Consumes len bytes of the stream, copying them to out and/or writing
+// them to fd when those are set.
+static int tar_read(TarReader* r, void* out, int fd, uint64_t len) {
+    unsigned char* p = out;
+    while (len > 0) {
+        if (tar_reader_fill(r) != 0)
+            return -1;
+        if (r->buf_pos == r->buf_len) {
+            LOGE("Unexpected end of archive\n");
+            return -1;
+        }
+        size_t n = r->buf_len - r->buf_pos;
+        if (n > len)
+            n = len;
+        if (fd >= 0 && write_all(fd, r->buf + r->buf_pos, n) != 0)
+            return -1;
+        if (p != NULL) {
+            memcpy(p, r->buf + r->buf_pos, n);
+            p += n;
+        }
+        r->buf_pos += n;
+        r->bytes_done += n;
+        len -= n;
+        if (tar_reader_report(r) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Skips size bytes of member data and the padding after them.
+static int tar_skip_data(TarReader* r, uint64_t size) {
+    if (size % TAR_BLOCK_SIZE != 0)
+        size += TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE;
+    return tar_read(r, NULL, -1, size);
+}
+
+static int tar_skip_padding(TarReader* r, uint64_t size) {
+    if (size % TAR_BLOCK_SIZE == 0)
+        return 0;
+    return tar_read(r, NULL, -1, TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE);
+}
+
+static uint64_t get_number(const char* field, size_t width) {
+    uint64_t value = 0;
+    size_t i = 0;
+
+    if ((unsigned char)field[0] & 0x80) {
+        // GNU base-256
+        value = (unsigned char)field[0] & 0x7f;
+        for (i = 1; i < width; i++)
+            value = (value << 8) | (unsigned char)field[i];
+        return value;
+    }
+    while (i < width && (field[i] == ' ' || field[i] == '\0'))
+        i++;
+    for (; i < width && field[i] >= '0' && field[i] <= '7'; i++)
+        value = (value << 3) | (field[i] - '0');
+    return value;
+}
+
+static int header_is_zero(const TarHeader* h) {
+    const unsigned char* p = (const unsigned char*)h;
+    size_t i;
+    for (i = 0; i < sizeof(TarHeader); i++) {
+        if (p[i] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+static int header_checksum_ok(const TarHeader* h) {
+    TarHeader copy = *h;
+    const unsigned char* p = (const unsigned char*)&copy;
+    unsigned int sum = 0;
+    size_t i;
+
+    memset(copy.chksum, ' ', sizeof(copy.chksum));
+    for (i = 0; i < sizeof(TarHeader); i++)
+        sum += p[i];
+    return sum == get_number(h->chksum, sizeof(h->chksum));
+}
+
+// Reads a GNU long name/link record into a newly allocated string.
+static char* tar_read_long_name(TarReader* r, uint64_t size) {
+    if (size == 0 || size >= PATH_MAX) {
+        LOGE("Invalid long name record\n");
+        return NULL;
+    }
+    char* name = calloc(1, size + 1);
+    if (name == NULL || tar_read(r, name, -1, size) != 0 || tar_skip_padding(r, size) != 0) {
+        free(name);
+        return NULL;
+    }
+    return name;
+}
+
+static int tar_read_pax(TarReader* r, uint64_t size) {
+    if (size > PAX_BUFFER_SIZE) {
+        LOGE("Oversized pax header\n");
+        return -1;
+    }
+    char* pax = malloc(size + 1);
+    if (pax == NULL || tar_read(r, pax, -1, size) != 0 || tar_skip_padding(r, size) != 0) {
+        free(pax);
+        return -1;
+    }
+
+    size_t pos = 0;
+    while (pos < size) {
+        char* end;
+        size_t len = strtoul(pax + pos, &end, 10);
+        if (len == 0 || pos + len > size || *end != ' ')
+            break;
+        char* key = end + 1;
+        char* record_end = pax + pos + len - 1;    // the '\n'
+        char* eq = memchr(key, '=', record_end - key);
+        if (eq == NULL)
+            break;
+        *eq = '\0';
+        char* value = eq + 1;
+        size_t value_len = record_end - value;
+
+        if (strcmp(key, "path") == 0 && value_len < PATH_MAX) {
+            memcpy(r->pax.name, value, value_len);
+            r->pax.name[value_len] = '\0';
+            r->pax_has_path = 1;
+        } else if (strcmp(key, "linkpath") == 0 && value_len < PATH_MAX) {
+            memcpy(r->pax.linkname, value, value_len);
+            r->pax.linkname[value_len] = '\0';
+            r->pax_has_link = 1;
+        } else if (strcmp(key, "size") == 0) {
+            r->pax.meta.size = strtoull(value, NULL, 10);
+            r->pax_has_size = 1;
+        } else if (strcmp(key, "RHT.security.selinux") == 0) {
+            tar_meta_add_xattr(&r->pax.meta, "security.selinux", value, value_len);
+        } else if (strncmp(key, "SCHILY.xattr.", 13) == 0) {
+            const char* name = key + 13;
+            // some writers keep the label's trailing NUL
+            if (strcmp(name, "security.selinux") == 0)
+                while (value_len > 0 && value[value_len - 1] == '\0')
+                    value_len--;
+            tar_meta_add_xattr(&r->pax.meta, name, value, value_len);
+        }
+        pos += len;
+    }
+    free(pax);
+    return 0;
+}
+
+// Joins dest and a member name, refusing names that climb out of dest.
+// Returns 1 for names that designate dest itself.
+static int tar_member_path(TarReader* r, const char* name, char* path) {
+    while (*name == '/')
+        name++;
+    while (strncmp(name, "./", 2) == 0)
+        name += 2;
+    const char* p = name;
+    while ((p = strstr(p, "..")) != NULL) {
+        if ((p == name || p[-1] == '/') && (p[2] == '/' || p[2] == '\0')) {
+            LOGE("Refusing to extract %s\n", name);
+            return -1;
+        }
+        p += 2;
+    }
+    if (*name == '\0' || strcmp(name, ".") == 0)
+        return 1;
+    if ((size_t)snprintf(path, PATH_MAX, "%s/%s", r->dest, name) >= PATH_MAX) {
+        LOGE("Path too long: %s\n", name);
+        return -1;
+    }
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/')
+        path[--len] = '\0';
+    return 0;
+}
+
+static int tar_extract_dir(TarReader* r, const char* path, TarMeta* m) {
+    struct stat st;
+    if (mkdir(path, 0700) != 0) {
+        if (errno == ENOENT) {
+            tar_make_parents(path);
+            mkdir(path, 0700);
+        }
+        if (lstat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+            unlink(path);
+            if (mkdir(path, 0700) != 0) {
+                LOGE("Can't create %s (%s)\n", path, strerror(errno));
+                return -1;
+            }
+        }
+    }
+
+    // metadata waits for the end, once the tree below is complete
+    if (r->dirs_count == r->dirs_alloc) {
+        int alloc = r->dirs_alloc == 0 ? 256 : r->dirs_alloc * 2;
+        DirTask* dirs = realloc(r->dirs, alloc * sizeof(DirTask));
+        if (dirs == NULL)
+            return -1;
+        r->dirs = dirs;
+        r->dirs_alloc = alloc;
+    }
+    DirTask* d = &r->dirs[r->dirs_count];
+    d->path = strdup(path);
+    if (d->path == NULL)
+        return -1;
+    d->meta = *m;
+    m->xattrs = NULL;
+    m->xattrs_count = 0;
+    r->dirs_count++;
+    return 0;
+}
+
+// Creates a link, device or fifo, replacing what is in the way.
+static int tar_make_node(TarReader* r, const char* path, const TarEntry* e) {
+    char target[PATH_MAX];
+    int attempt;
+
+    if (e->meta.type == '1' && tar_member_path(r, e->linkname, target) != 0)
+        return -1;
+    for (attempt = 0; attempt < 3; attempt++) {
+        int ret;
+        switch (e->meta.type) {
+            case '1':
+                ret = link(target, path);
+                break;
+            case '2':
+                ret = symlink(e->linkname, path);
+                break;
+            case '3':
+                ret = mknod(path, S_IFCHR | e->meta.mode, e->rdev);
+                break;
+            case '4':
+                ret = mknod(path, S_IFBLK | e->meta.mode, e->rdev);
+                break;
+            default:
+                ret = mkfifo(path, e->meta.mode);
+                break;
+        }
+        if (ret == 0)
+            return 0;
+        if (errno == ENOENT && attempt == 0)
+            tar_make_parents(path);
+        else if (errno == EEXIST)
+            unlink(path);
+        else
+            break;
+    }
+    LOGE("Can't create %s (%s)\n", path, strerror(errno));
+    return -1;
+}
+
+static int tar_extract_file(TarReader* r, const char* path, TarMeta* m) {
+    if (m->size <= EXTRACT_SMALL_FILE) {
+        FileTask* t = calloc(1, sizeof(FileTask));
+        if (t == NULL)
+            return -1;
+        t->meta = *m;
+        m->xattrs = NULL;
+        m->xattrs_count = 0;
+        t->path = strdup(path);
+        t->data = malloc(t->meta.size > 0 ? t->meta.size : 1);
+        if (t->path == NULL || t->data == NULL || tar_read(r, t->data, -1, t->meta.size) != 0) {
+            file_task_free(t);
+            return -1;
+        }
+        tar_queue_file(r, t);
+        return 0;
+    }
+
+    // big files stream straight from the archive on this thread
+    int fd = tar_open_file(path);
+    if (fd < 0)
+        return -1;
+    tar_preallocate(fd, m->size);
+    int ret = tar_read(r, NULL, fd, m->size);
+    if (ret != 0 && !r->canceled)
+        LOGE("Error writing %s\n", path);
+    if (ret == 0 && tar_apply_metadata(path, fd, m) != 0)
+        ret = -1;
+    if (close(fd) != 0)
+        ret = -1;
+    return ret;
+}
+
+static int tar_extract_entry(TarReader* r, const TarHeader* h) {
+    TarEntry e;
+    char path[PATH_MAX];
+    uint64_t size = get_number(h->size, sizeof(h->size));
+    int ret = 0;
+
+    // meta records apply to the entry that follows them
+    if (h->typeflag == 'L' || h->typeflag == 'K') {
+        char* name = tar_read_long_name(r, size);
+        if (name == NULL)
+            return -1;
+        char** slot = h->typeflag == 'L' ? &r->long_name : &r->long_link;
+        free(*slot);
+        *slot = name;
+        return 0;
+    }
+    if (h->typeflag == 'x')
+        return tar_read_pax(r, size);
+    if (h->typeflag == 'g') {
+        // global pax headers carry nothing nandroid uses
+        return tar_skip_data(r, size);
+    }
+
+    memset(&e, 0, sizeof(e));
+    if (r->pax_has_path) {
+        strcpy(e.name, r->pax.name);
+    } else if (r->long_name != NULL) {
+        strcpy(e.name, r->long_name);
+    } else {
+        char name[sizeof(h->name) + 1];
+        memcpy(name, h->name, sizeof(h->name));
+        name[sizeof(h->name)] = '\0';
+        // GNU tar reuses the prefix area, only POSIX ustar has one
+        if (memcmp(h->magic, "ustar", 6) == 0 && h->prefix[0] != '\0') {
+            char prefix[sizeof(h->prefix) + 1];
+            memcpy(prefix, h->prefix, sizeof(h->prefix));
+            prefix[sizeof(h->prefix)] = '\0';
+            snprintf(e.name, sizeof(e.name), "%s/%s", prefix, name);
+        } else {
+            strcpy(e.name, name);
+        }
+    }
+    if (r->pax_has_link) {
+        strcpy(e.linkname, r->pax.linkname);
+    } else if (r->long_link != NULL) {
+        strcpy(e.linkname, r->long_link);
+    } else {
+        memcpy(e.linkname, h->linkname, sizeof(h->linkname));
+        e.linkname[sizeof(h->linkname)] = '\0';
+    }
+    if (r->pax_has_size)
+        size = r->pax.meta.size;
+
+    e.meta.type = h->typeflag;
+    e.meta.mode = get_number(h->mode, sizeof(h->mode)) & 07777;
+    e.meta.uid = get_number(h->uid, sizeof(h->uid));
+    e.meta.gid = get_number(h->gid, sizeof(h->gid));
+    e.meta.mtime = get_number(h->mtime, sizeof(h->mtime));
+    e.meta.size = size;
+    e.meta.xattrs = r->pax.meta.xattrs;
+    e.meta.xattrs_count = r->pax.meta.xattrs_count;
+    e.rdev = makedev(get_number(h->devmajor, sizeof(h->devmajor)),
+                     get_number(h->devminor, sizeof(h->devminor)));
+
+    free(r->long_name);
+    free(r->long_link);
+    r->long_name = NULL;
+    r->long_link = NULL;
+    memset(&r->pax, 0, sizeof(r->pax));
+    r->pax_has_path = r->pax_has_link = r->pax_has_size = 0;
+
+    int skip = tar_member_path(r, e.name, path);
+    if (skip < 0) {
+        tar_meta_free(&e.meta);
+        return -1;
+    }
+    if (skip) {
+        tar_meta_free(&e.meta);
+        return tar_skip_data(r, size);
+    }
+
+    switch (e.meta.type) {
+        case '0':
+        case '\0':
+        case '7':
+            ret = tar_extract_file(r, path, &e.meta);
+            tar_meta_free(&e.meta);
+            if (ret != 0)
+                return -1;
+            return tar_skip_padding(r, size);
+        case '5':
+            ret = tar_extract_dir(r, path, &e.meta);
+            break;
+        case '1':
+            // the target may still be waiting for a worker
+            ret = tar_drain_workers(r);
+            if (ret == 0)
+                ret = tar_make_node(r, path, &e);
+            break;
+        case '2':
+        case '3':
+        case '4':
+        case '6':
+            ret = tar_make_node(r, path, &e);
+            if (ret == 0)
+                ret = tar_apply_metadata(path, -1, &e.meta);
+            break;
+        default:
+            LOGW("Skipping %s: unsupported entry type '%c'\n", e.name, e.meta.type);
+            break;
+    }
+    tar_meta_free(&e.meta);
+    if (ret != 0)
+        return -1;
+    // only regular files carry data for us; skip whatever others declare
+    return tar_skip_data(r, size);
+}
+
+static int tar_finish_dirs(TarReader* r) {
+    int i, ret = 0;
+    // deepest first, so setting a parent's mtime is the last change to it
+    for (i = r->dirs_count - 1; i >= 0; i--) {
+        if (ret == 0 && tar_apply_metadata(r->dirs[i].path, -1, &r->dirs[i].meta) != 0)
+            ret = -1;
+        tar_meta_free(&r->dirs[i].meta);
+        free(r->dirs[i].path);
+    }
+    free(r->dirs);
+    r->dirs = NULL;
+    r->dirs_count = 0;
+    return ret;
+}
+
+static void tar_syncfs(const char* dest) {
+    int fd = open(dest, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#ifdef __NR_syncfs
+    if (fd >= 0 && syscall(__NR_syncfs, fd) == 0) {
+        close(fd);
+        return;
+    }
+#endif
+    if (fd >= 0)
+        close(fd);
+    sync();
+}
+
+static int tar_parse(TarReader* r) {
+    TarHeader h;
+    int zero_blocks = 0;
+
+    for (;;) {
+        if (tar_reader_fill(r) != 0)
+            return -1;
+        if (r->buf_pos == r->buf_len) {
+            // ended without the zero blocks; tar accepts that as well
+            return 0;
+        }
+        if (tar_read(r, &h, -1, sizeof(h)) != 0)
+            return -1;
+        if (header_is_zero(&h)) {
+            if (++zero_blocks == 2)
+                return 0;
+            continue;
+        }
+        zero_blocks = 0;
+        if (!header_checksum_ok(&h)) {
+            LOGE("Corrupted archive header\n");
+            return -1;
+        }
+        if (tar_extract_entry(r, &h) != 0)
+            return -1;
+
+        pthread_mutex_lock(&r->lock);
+        int error = r->error;
+        pthread_mutex_unlock(&r->lock);
+        if (error)
+            return -1;
+    }
+}
+
+int nandroid_archive_extract(const char* dest, int in_fd, archive_progress_fn progress,
+                             void* cookie) {
+    TarReader r;
+    int i;
+
+    memset(&r, 0, sizeof(r));
+    // member paths are joined as "<dest>/<name>"
+    if (strcmp(dest, "/") != 0)
+        strncpy(r.dest, dest, sizeof(r.dest) - 1);
+    r.in_fd = in_fd;
+    r.progress = progress;
+    r.cookie = cookie;
+    r.buf = alloc_aligned_buffer(NANDROID_ARCHIVE_BUFFER_SIZE);
+    if (r.buf == NULL)
+        return NANDROID_ARCHIVE_ERROR;
+    pthread_mutex_init(&r.lock, NULL);
+    pthread_cond_init(&r.cond, NULL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cpus < 1 ? 1 : (cpus > EXTRACT_MAX_WORKERS ? EXTRACT_MAX_WORKERS : (int)cpus);
+    for (i = 0; i < workers; i++) {
+        if (pthread_create(&r.workers[r.workers_count], NULL, tar_worker_thread, &r) != 0)
+            break;
+        r.workers_count++;
+    }
+
+    int ret = r.workers_count > 0 ? tar_parse(&r) : -1;
+    if (ret == 0) {
+        // consume what follows the end marker so the producer can finish
+        while (!r.eof && tar_reader_fill(&r) == 0)
+            r.buf_pos = r.buf_len;
+    }
+
+    pthread_mutex_lock(&r.lock);
+    r.stopping = 1;
+    if (ret != 0)
+        r.error = 1;
+    pthread_cond_broadcast(&r.cond);
+    pthread_mutex_unlock(&r.lock);
+    for (i = 0; i < r.workers_count; i++)
+        pthread_join(r.workers[i], NULL);
+    if (r.error)
+        ret = -1;
+
+    if (tar_finish_dirs(&r) != 0)
+        ret = -1;
+    free(r.long_name);
+    free(r.long_link);
+    tar_meta_free(&r.pax.meta);
+    free(r.buf);
+    pthread_mutex_destroy(&r.lock);
+    pthread_cond_destroy(&r.cond);
+
+    if (ret == 0)
+        tar_syncfs(dest);
+    if (r.canceled)
+        return NANDROID_ARCHIVE_CANCELED;
+    return ret == 0 ? NANDROID_ARCHIVE_OK : NANDROID_ARCHIVE_ERROR;
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NANDROID_ARCHIVE_H
+#define NANDROID_ARCHIVE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Same volume size the old "split -b 1000000000" pipeline produced, so
+// the .tar.a, .tar.b, ... layout stays restorable with "cat | tar -x".
+#define NANDROID_VOLUME_SIZE 1000000000ULL
+
+// Size of the aligned buffers used for file reads and volume writes.
+#define NANDROID_ARCHIVE_BUFFER_SIZE (1024 * 1024)
+
+#define NANDROID_ARCHIVE_OK        0
+#define NANDROID_ARCHIVE_ERROR    -1
+#define NANDROID_ARCHIVE_CANCELED -2
+
+// One stage of the backup output pipeline. Stages are chained: the tar
+// writer feeds a sink, which may transform the stream and forward it to
+// the next sink it owns.
+typedef struct NandroidSink {
+    // Returns 0 on success, -1 on error.
+    int (*write)(struct NandroidSink* sink, const void* data, size_t len);
+    // Flushes and frees the sink and every sink it owns. When discard is
+    // set the stream is being abandoned and nothing more is flushed.
+    // Returns 0 if the whole chain was written successfully.
+    int (*close)(struct NandroidSink* sink, int discard);
+} NandroidSink;
+
+// Writes the stream to <base>.a, <base>.b, ... of volume_size bytes each,
+// after creating an empty <base> so that "cat <base>*" picks them all up.
+// Volumes are checksummed as they are written when a backup records its
+// manifest (nandroid_digest_begin).
+NandroidSink* volume_sink_open(const char* base, uint64_t volume_size);
+
+// Writes the stream to an already open descriptor, which is left open.
+NandroidSink* fd_sink_open(int fd);
+
+// Pipes the stream through an external filter such as "pigz -c" and
+// forwards its output to next. Takes ownership of next.
+NandroidSink* filter_sink_open(char* const argv[], NandroidSink* next);
+
+// Reads back a volume set written by volume_sink_open(), or by the old
+// split pipeline: <base> followed by <base>.a, <base>.b, ... as one stream.
+// While a restore verifies checksums (nandroid_verify_begin), every volume
+// is checked as its end is reached and a mismatch, or a volume the
+// manifest lists but that is missing, is a read error.
+typedef struct VolumeReader VolumeReader;
+VolumeReader* volume_reader_open(const char* base);
+// Returns the number of bytes read, 0 at the end of the set, -1 on error.
+ssize_t volume_reader_read(VolumeReader* reader, void* data, size_t len);
+void volume_reader_close(VolumeReader* reader);
+
+// Polled by the archive writer as data is consumed. bytes_done counts
+// file payload bytes read so far. Return nonzero to cancel.
+typedef int (*archive_progress_fn)(uint64_t bytes_done, void* cookie);
+
+// Archives the tree at path into sink as a ustar stream. Member names are
+// relative to the parent of path ("/data/app" -> "data/app"), matching
+// "cd $(dirname path) ; tar -c $(basename path)". Extended attributes and
+// SELinux labels are carried in pax headers. excludes is a NULL
+// terminated list of fnmatch() patterns applied to member names; an
+// excluded directory is not descended into. The sink is not closed.
+int nandroid_archive_create(const char* path, const char* const* excludes,
+                            NandroidSink* sink, archive_progress_fn progress,
+                            void* cookie);
+
+// Counts the entries and regular file bytes nandroid_archive_create()
+// would store for the same arguments.
+int nandroid_archive_stats(const char* path, const char* const* excludes,
+                           uint64_t* total_bytes, unsigned int* total_files);
+
+// Extracts the tar stream read from in_fd below dest, like
+// "cd dest ; tar -xp". Small files are written by a pool of worker
+// threads and everything is flushed with one syncfs() at the end.
+// Ownership, modes, mtimes, xattrs and SELinux labels (pax records as
+// written by nandroid_archive_create(), GNU tar or busybox) are restored.
+// progress receives the archive bytes consumed so far.
+int nandroid_archive_extract(const char* dest, int in_fd, archive_progress_fn progress,
+                             void* cookie);
+
+#endif
@@ -0,0 +1,529 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "common.h"
+#include "nandroid_compress.h"
+
+// gzip member header: 10 fixed bytes, XLEN, then one 12 byte "NB"
+// subfield holding the member size and the uncompressed size.
+#define PGZ_HEADER_SIZE  24
+#define PGZ_TRAILER_SIZE 8
+#define PGZ_MAX_WORKERS  16
+
+#define SLOT_FREE   0
+#define SLOT_QUEUED 1
+#define SLOT_DONE   2
+
+static void put4le(unsigned char* p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static uint32_t get4le(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+int nandroid_worker_count() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        return 1;
+    if (cpus > PGZ_MAX_WORKERS)
+        return PGZ_MAX_WORKERS;
+    return (int)cpus;
+}
+
+//=========================================/
+//=       Ordered block worker pool       =/
+//=========================================/
+
+// Blocks are filled and submitted by one producer thread, processed by the
+// workers in any order, and retired by the producer strictly in
+// submission order, so the output stream stays sequential.
+
+typedef struct {
+    unsigned char* in;
+    size_t in_len;
+    unsigned char* out;
+    size_t out_len;
+    int state;
+    int error;
+} BlockSlot;
+
+typedef int (*block_process_fn)(BlockSlot* slot);
+
+typedef struct {
+    block_process_fn process;
+    BlockSlot* slots;
+    int nslots;
+    unsigned long long submitted;
+    unsigned long long taken;
+    unsigned long long retired;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    pthread_t* threads;
+    int nthreads;
+    int shutdown;
+} BlockPool;
+
+static void* block_worker_thread(void* cookie) {
+    BlockPool* pool = cookie;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shutdown && pool->taken == pool->submitted)
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        if (pool->shutdown)
+            break;
+        BlockSlot* slot = &pool->slots[pool->taken % pool->nslots];
+        pool->taken++;
+        pthread_mutex_unlock(&pool->lock);
+
+        slot->error = pool->process(slot);
+
+        pthread_mutex_lock(&pool->lock);
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static void block_pool_destroy(BlockPool* pool) {
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    for (i = 0; i < pool->nslots; i++) {
+        free(pool->slots[i].in);
+        free(pool->slots[i].out);
+    }
+    free(pool->slots);
+    free(pool->threads);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+}
+
+static int block_pool_init(BlockPool* pool, block_process_fn process, size_t in_size, size_t out_size) {
+    int i;
+
+    memset(pool, 0, sizeof(BlockPool));
+    pool->process = process;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    int workers = nandroid_worker_count();
+    // two blocks per worker keep everybody busy while the oldest is written
+    pool->nslots = workers * 2;
+    pool->slots = calloc(pool->nslots, sizeof(BlockSlot));
+    pool->threads = calloc(workers, sizeof(pthread_t));
+    if (pool->slots == NULL || pool->threads == NULL) {
+        block_pool_destroy(pool);
+        return -1;
+    }
+    for (i = 0; i < pool->nslots; i++) {
+        pool->slots[i].in = malloc(in_size);
+        pool->slots[i].out = malloc(out_size);
+        if (pool->slots[i].in == NULL || pool->slots[i].out == NULL) {
+            block_pool_destroy(pool);
+            return -1;
+        }
+    }
+    for (i = 0; i < workers; i++) {
+        if (pthread_create(&pool->threads[i], NULL, block_worker_thread, pool) != 0)
+            break;
+        pool->nthreads++;
+    }
+    if (pool->nthreads == 0) {
+        block_pool_destroy(pool);
+        return -1;
+    }
+    return 0;
+}
+
+// The slot the producer fills next. Always free: block_pool_submit()
+// does not return before it is retired.
+static BlockSlot* block_pool_current(BlockPool* pool) {
+    return &pool->slots[pool->submitted % pool->nslots];
+}
+
+// Returns the oldest outstanding block once it is processed, or NULL if
+// nothing is outstanding. With wait == 0 returns NULL if it is not ready.
+static BlockSlot* block_pool_oldest(BlockPool* pool, int wait) {
+    BlockSlot* slot = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->retired < pool->submitted) {
+        slot = &pool->slots[pool->retired % pool->nslots];
+        while (wait && slot->state != SLOT_DONE)
+            pthread_cond_wait(&pool->done_cond, &pool->lock);
+        if (slot->state != SLOT_DONE)
+            slot = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return slot;
+}
+
+static void block_pool_retire(BlockPool* pool, BlockSlot* slot) {
+    pthread_mutex_lock(&pool->lock);
+    slot->state = SLOT_FREE;
+    slot->in_len = 0;
+    slot->out_len = 0;
+    pool->retired++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void block_pool_submit(BlockPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    block_pool_current(pool)->state = SLOT_QUEUED;
+    pool->submitted++;
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Retires finished blocks in order through emit(). With drain set, waits
+// for every outstanding block; otherwise only waits when the ring is full.
+static int block_pool_retire_ready(BlockPool* pool, int drain,
+                                   int (*emit)(BlockSlot* slot, void* cookie), void* cookie) {
+    int ret = 0;
+    for (;;) {
+        int full = pool->submitted - pool->retired == (unsigned long long)pool->nslots;
+        BlockSlot* slot = block_pool_oldest(pool, drain || full);
+        if (slot == NULL)
+            break;
+        if (ret == 0 && (slot->error || emit(slot, cookie) != 0))
+            ret = -1;
+        block_pool_retire(pool, slot);
+    }
+    return ret;
+}
+
+//=========================================/
+//=          Parallel gzip sink           =/
+//=========================================/
+
+typedef struct {
+    NandroidSink sink;
+    NandroidSink* next;
+    BlockPool pool;
+    int error;
+} ParallelGzipSink;
+
+static size_t pgz_max_member_size() {
+    return PGZ_HEADER_SIZE + compressBound(PGZ_BLOCK_SIZE) + PGZ_TRAILER_SIZE;
+}
+
+static int pgz_compress_block(BlockSlot* slot) {
+    z_stream zs;
+    unsigned char* out = slot->out;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1;
+    zs.next_in = slot->in;
+    zs.avail_in = slot->in_len;
+    zs.next_out = out + PGZ_HEADER_SIZE;
+    zs.avail_out = pgz_max_member_size() - PGZ_HEADER_SIZE - PGZ_TRAILER_SIZE;
+    int zret = deflate(&zs, Z_FINISH);
+    size_t deflated = zs.total_out;
+    deflateEnd(&zs);
+    if (zret != Z_STREAM_END)
+        return -1;
+
+    size_t member = PGZ_HEADER_SIZE + deflated + PGZ_TRAILER_SIZE;
+    out[0] = 0x1f;
+    out[1] = 0x8b;
+    out[2] = Z_DEFLATED;
+    out[3] = 0x04;              // FEXTRA
+    put4le(out + 4, 0);         // mtime
+    out[8] = 0;                 // xfl
+    out[9] = 3;                 // unix
+    out[10] = 12;               // XLEN
+    out[11] = 0;
+    out[12] = 'N';
+    out[13] = 'B';
+    out[14] = 8;
+    out[15] = 0;
+    put4le(out + 16, member);
+    put4le(out + 20, slot->in_len);
+
+    unsigned char* trailer = out + PGZ_HEADER_SIZE + deflated;
+    put4le(trailer, crc32(crc32(0L, Z_NULL, 0), slot->in, slot->in_len));
+    put4le(trailer + 4, slot->in_len);
+    slot->out_len = member;
+    return 0;
+}
+
+static int pgz_emit_to_sink(BlockSlot* slot, void* cookie) {
+    NandroidSink* next = cookie;
+    return next->write(next, slot->out, slot->out_len);
+}
+
+static int pgz_sink_write(NandroidSink* sink, const void* data, size_t len) {
+    ParallelGzipSink* ps = (ParallelGzipSink*)sink;
+    const unsigned char* p = data;
+
+    if (ps->error)
+        return -1;
+    while (len > 0) {
+        BlockSlot* slot = block_pool_current(&ps->pool);
+        size_t n = PGZ_BLOCK_SIZE - slot->in_len;
+        if (n > len)
+            n = len;
+        memcpy(slot->in + slot->in_len, p, n);
+        slot->in_len += n;
+        p += n;
+        len -= n;
+
+        if (slot->in_len == PGZ_BLOCK_SIZE) {
+            block_pool_submit(&ps->pool);
+            if (block_pool_retire_ready(&ps->pool, 0, pgz_emit_to_sink, ps->next) != 0) {
+                ps->error = 1;
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int pgz_sink_close(NandroidSink* sink, int discard) {
+    ParallelGzipSink* ps = (ParallelGzipSink*)sink;
+    int ret = ps->error ? -1 : 0;
+
+    if (!discard && ret == 0) {
+        if (block_pool_current(&ps->pool)->in_len > 0)
+            block_pool_submit(&ps->pool);
+        ret = block_pool_retire_ready(&ps->pool, 1, pgz_emit_to_sink, ps->next);
+    }
+    block_pool_destroy(&ps->pool);
+    if (ps->next->close(ps->next, discard || ret != 0) != 0)
+        ret = -1;
+    free(ps);
+    return ret;
+}
+
+NandroidSink* parallel_gzip_sink_open(NandroidSink* next) {
+    if (next == NULL)
+        return NULL;
+
+    ParallelGzipSink* ps = calloc(1, sizeof(ParallelGzipSink));
+    if (ps == NULL || block_pool_init(&ps->pool, pgz_compress_block, PGZ_BLOCK_SIZE, pgz_max_member_size()) != 0) {
+        LOGE("Can't start compression workers\n");
+        free(ps);
+        next->close(next, 1);
+        return NULL;
+    }
+    ps->sink.write = pgz_sink_write;
+    ps->sink.close = pgz_sink_close;
+    ps->next = next;
+    return &ps->sink;
+}
+
+//=========================================/
+//=          Parallel gunzip              =/
+//=========================================/
+
+// Checks the fixed header and returns the member size, or 0 if this is
+// not one of our members.
+static size_t pgz_parse_header(const unsigned char* h) {
+    if (h[0] != 0x1f || h[1] != 0x8b || h[2] != Z_DEFLATED || h[3] != 0x04)
+        return 0;
+    if (h[10] != 12 || h[11] != 0 || h[12] != 'N' || h[13] != 'B' || h[14] != 8 || h[15] != 0)
+        return 0;
+    size_t member = get4le(h + 16);
+    if (member < PGZ_HEADER_SIZE + PGZ_TRAILER_SIZE || member > pgz_max_member_size())
+        return 0;
+    if (get4le(h + 20) > PGZ_BLOCK_SIZE)
+        return 0;
+    return member;
+}
+
+int parallel_gzip_probe(const char* base) {
+    unsigned char header[PGZ_HEADER_SIZE];
+    VolumeReader* r = volume_reader_open(base);
+    if (r == NULL)
+        return 0;
+    ssize_t n = volume_reader_read(r, header, sizeof(header));
+    volume_reader_close(r);
+    return n == PGZ_HEADER_SIZE && pgz_parse_header(header) != 0;
+}
+
+static int pgz_inflate_block(BlockSlot* slot) {
+    z_stream zs;
+    const unsigned char* trailer = slot->in + slot->in_len - PGZ_TRAILER_SIZE;
+    uint32_t expected = get4le(slot->in + 20);
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+        return -1;
+    zs.next_in = slot->in + PGZ_HEADER_SIZE;
+    zs.avail_in = slot->in_len - PGZ_HEADER_SIZE - PGZ_TRAILER_SIZE;
+    zs.next_out = slot->out;
+    zs.avail_out = PGZ_BLOCK_SIZE;
+    int zret = inflate(&zs, Z_FINISH);
+    slot->out_len = zs.total_out;
+    inflateEnd(&zs);
+
+    if (zret != Z_STREAM_END || slot->out_len != expected || get4le(trailer + 4) != expected)
+        return -1;
+    if (get4le(trailer) != crc32(crc32(0L, Z_NULL, 0), slot->out, slot->out_len))
+        return -1;
+    return 0;
+}
+
+static int write_fd(int fd, const unsigned char* p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int pgz_emit_to_fd(BlockSlot* slot, void* cookie) {
+    return write_fd(*(int*)cookie, slot->out, slot->out_len);
+}
+
+int parallel_gunzip(const char* base, int out_fd) {
+    BlockPool pool;
+    int ret = 0;
+
+    VolumeReader* r = volume_reader_open(base);
+    if (r == NULL)
+        return -1;
+    if (block_pool_init(&pool, pgz_inflate_block, pgz_max_member_size(), PGZ_BLOCK_SIZE) != 0) {
+        volume_reader_close(r);
+        return -1;
+    }
+
+    for (;;) {
+        BlockSlot* slot = block_pool_current(&pool);
+        ssize_t n = volume_reader_read(r, slot->in, PGZ_HEADER_SIZE);
+        if (n == 0)
+            break;
+        size_t member = n == PGZ_HEADER_SIZE ? pgz_parse_header(slot->in) : 0;
+        if (member == 0) {
+            LOGE("Corrupted or truncated compressed backup %s\n", base);
+            ret = -1;
+            break;
+        }
+        n = volume_reader_read(r, slot->in + PGZ_HEADER_SIZE, member - PGZ_HEADER_SIZE);
+        if (n != (ssize_t)(member - PGZ_HEADER_SIZE)) {
+            LOGE("Truncated compressed backup %s\n", base);
+            ret = -1;
+            break;
+        }
+        slot->in_len = member;
+        block_pool_submit(&pool);
+        if (block_pool_retire_ready(&pool, 0, pgz_emit_to_fd, &out_fd) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+    if (ret == 0 && block_pool_retire_ready(&pool, 1, pgz_emit_to_fd, &out_fd) != 0) {
+        LOGE("Error decompressing backup %s\n", base);
+        ret = -1;
+    }
+
+    block_pool_destroy(&pool);
+    volume_reader_close(r);
+    return ret;
+}
+
+int gunzip_volumes(const char* base, int out_fd) {
+    z_stream zs;
+    int ret = 0, zret = Z_OK;
+
+    VolumeReader* r = volume_reader_open(base);
+    if (r == NULL)
+        return -1;
+    unsigned char* in = malloc(NANDROID_ARCHIVE_BUFFER_SIZE);
+    unsigned char* out = malloc(NANDROID_ARCHIVE_BUFFER_SIZE);
+    memset(&zs, 0, sizeof(zs));
+    if (in == NULL || out == NULL || inflateInit2(&zs, MAX_WBITS + 16) != Z_OK) {
+        free(in);
+        free(out);
+        volume_reader_close(r);
+        return -1;
+    }
+
+    for (;;) {
+        if (zs.avail_in == 0) {
+            ssize_t n = volume_reader_read(r, in, NANDROID_ARCHIVE_BUFFER_SIZE);
+            if (n < 0) {
+                ret = -1;
+                break;
+            }
+            if (n == 0) {
+                if (zret != Z_STREAM_END) {
+                    LOGE("Truncated compressed backup %s\n", base);
+                    ret = -1;
+                }
+                break;
+            }
+            zs.next_in = in;
+            zs.avail_in = n;
+        }
+        if (zret == Z_STREAM_END) {
+            // pigz and gzip -c >> produce concatenated members
+            if (zs.next_in[0] != 0x1f) {
+                LOGW("Ignoring trailing data in %s\n", base);
+                break;
+            }
+            inflateReset(&zs);
+        }
+
+        zs.next_out = out;
+        zs.avail_out = NANDROID_ARCHIVE_BUFFER_SIZE;
+        zret = inflate(&zs, Z_NO_FLUSH);
+        if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) {
+            LOGE("Corrupted compressed backup %s\n", base);
+            ret = -1;
+            break;
+        }
+        if (write_fd(out_fd, out, NANDROID_ARCHIVE_BUFFER_SIZE - zs.avail_out) != 0) {
+            ret = -1;
+            break;
+        }
+    }
+
+    inflateEnd(&zs);
+    free(in);
+    free(out);
+    volume_reader_close(r);
+    return ret;
+}
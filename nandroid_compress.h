@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NANDROID_COMPRESS_H
+#define NANDROID_COMPRESS_H
+
+#include "nandroid_archive.h"
+
+// Block-parallel gzip. The stream is cut into PGZ_BLOCK_SIZE blocks that
+// are deflated independently on a pool of worker threads and written in
+// order, each as a separate gzip member. Concatenated members are a valid
+// gzip file, so plain gzip/pigz can still read the result; the "NB" extra
+// field on every member records its compressed and uncompressed sizes so
+// restore can hand whole members to parallel inflaters.
+#define PGZ_BLOCK_SIZE (1024 * 1024)
+
+// Compresses into next, which the returned sink takes ownership of.
+NandroidSink* parallel_gzip_sink_open(NandroidSink* next);
+
+// Returns 1 if the volume set at base starts with a block-parallel gzip
+// member, 0 otherwise.
+int parallel_gzip_probe(const char* base);
+
+// Inflates the block-parallel gzip volume set at base into out_fd.
+// Returns 0 on success.
+int parallel_gunzip(const char* base, int out_fd);
+
+// Inflates a volume set written by gzip or pigz into out_fd, on the
+// calling thread. Returns 0 on success.
+int gunzip_volumes(const char* base, int out_fd);
+
+// Number of compression workers: the online cores.
+int nandroid_worker_count();
+
+#endif
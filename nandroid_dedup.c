@@ -0,0 +1,518 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "mincrypt/sha256.h"
+
+#include "common.h"
+#include "nandroid_dedup.h"
+#include "nandroid_stats.h"
+
+// Gear hash content-defined chunking: boundaries depend on the data, not
+// on offsets, so an insertion only changes the chunks around it.
+#define CHUNK_MIN_SIZE  (16 * 1024)
+#define CHUNK_MAX_SIZE  (256 * 1024)
+#define CHUNK_MASK      0xffffULL        // ~64k average chunk
+
+#define MANIFEST_MAGIC  "nandroid-dedup 1"
+
+// Chunk files start with one byte telling how the payload is stored.
+#define CHUNK_RAW       'R'
+#define CHUNK_DEFLATED  'Z'
+
+static uint64_t gear[256];
+static int gear_initialized = 0;
+
+static void init_gear() {
+    // splitmix64: a fixed table, identical on every device and release
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    int i;
+    if (gear_initialized)
+        return;
+    for (i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+    gear_initialized = 1;
+}
+
+static void to_hex(const uint8_t* digest, char* hex) {
+    static const char digits[] = "0123456789abcdef";
+    int i;
+    for (i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 0xf];
+    }
+    hex[SHA256_DIGEST_SIZE * 2] = '\0';
+}
+
+static int from_hex(const char* hex, uint8_t* digest) {
+    int i;
+    for (i = 0; i < SHA256_DIGEST_SIZE * 2; i++) {
+        char c = hex[i];
+        int v;
+        if (c >= '0' && c <= '9')
+            v = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            v = c - 'a' + 10;
+        else
+            return -1;
+        if (i % 2 == 0)
+            digest[i / 2] = v << 4;
+        else
+            digest[i / 2] |= v;
+    }
+    return hex[i] == '\0' || hex[i] == ' ' ? 0 : -1;
+}
+
+static void chunk_path(const char* store, const char* hex, char* path) {
+    snprintf(path, PATH_MAX, "%s/%.2s/%s", store, hex, hex);
+}
+
+void dedup_store_path(const char* backup_path, char* store) {
+    char parent[PATH_MAX];
+    strcpy(parent, backup_path);
+    char* slash = strrchr(parent, '/');
+    if (slash != NULL && slash != parent)
+        *slash = '\0';
+    snprintf(store, PATH_MAX, "%s/%s", parent, DEDUP_STORE_DIR);
+}
+
+static int write_all(int fd, const void* data, size_t len) {
+    const unsigned char* p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//=========================================/
+//=             Dedup sink                =/
+//=========================================/
+
+typedef struct {
+    NandroidSink sink;
+    char store[PATH_MAX];
+    char manifest[PATH_MAX];
+    FILE* list;                  // manifest being written (.tmp)
+    unsigned char* chunk;
+    size_t chunk_len;
+    uint64_t hash;
+    unsigned char* packed;
+    uint64_t total;
+    unsigned int chunks_new;
+    unsigned int chunks_total;
+    int error;
+    NandroidPhase* stats;
+} DedupSink;
+
+static int store_chunk(DedupSink* ds) {
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    char hex[SHA256_DIGEST_SIZE * 2 + 1];
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    struct stat st;
+
+    SHA256_hash(ds->chunk, ds->chunk_len, digest);
+    to_hex(digest, hex);
+    chunk_path(ds->store, hex, path);
+    fprintf(ds->list, "%s %zu\n", hex, ds->chunk_len);
+    ds->chunks_total++;
+    ds->total += ds->chunk_len;
+
+    if (stat(path, &st) == 0)
+        return 0;
+
+    snprintf(tmp, sizeof(tmp), "%s/%.2s", ds->store, hex);
+    if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
+        LOGE("Can't create %s (%s)\n", tmp, strerror(errno));
+        return -1;
+    }
+
+    // deflate chunks that shrink; incompressible ones are stored as is
+    uLongf packed_len = compressBound(CHUNK_MAX_SIZE);
+    const unsigned char* payload = ds->chunk;
+    size_t payload_len = ds->chunk_len;
+    unsigned char type = CHUNK_RAW;
+    if (compress2(ds->packed, &packed_len, ds->chunk, ds->chunk_len, 1) == Z_OK &&
+            packed_len < ds->chunk_len) {
+        payload = ds->packed;
+        payload_len = packed_len;
+        type = CHUNK_DEFLATED;
+    }
+
+    // Parallel dedup jobs can store the same chunk at once, so each writer
+    // gets its own temp file. Later backups trust any chunk that exists,
+    // so it has to be on disk before it appears under its name.
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    uint64_t start = nandroid_stats_now_us();
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        LOGE("Can't create %s (%s)\n", tmp, strerror(errno));
+        return -1;
+    }
+    if (fchmod(fd, 0644) != 0 || write_all(fd, &type, 1) != 0 ||
+            write_all(fd, payload, payload_len) != 0 || fsync(fd) != 0) {
+        LOGE("Error writing chunk %s (%s)\n", hex, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    if (close(fd) != 0) {
+        LOGE("Error writing chunk %s (%s)\n", hex, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    if (stat(path, &st) == 0) {
+        // another job stored it first
+        unlink(tmp);
+        return 0;
+    }
+    if (rename(tmp, path) != 0) {
+        LOGE("Can't store chunk %s (%s)\n", hex, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    ds->chunks_new++;
+    nandroid_stats_add_written(ds->stats, payload_len + 1, nandroid_stats_now_us() - start);
+    return 0;
+}
+
+static int dedup_sink_write(NandroidSink* sink, const void* data, size_t len) {
+    DedupSink* ds = (DedupSink*)sink;
+    const unsigned char* p = data;
+
+    if (ds->error)
+        return -1;
+    while (len > 0) {
+        unsigned char b = *p++;
+        len--;
+        ds->chunk[ds->chunk_len++] = b;
+        ds->hash = (ds->hash << 1) + gear[b];
+        if ((ds->chunk_len >= CHUNK_MIN_SIZE && (ds->hash & CHUNK_MASK) == 0) ||
+                ds->chunk_len == CHUNK_MAX_SIZE) {
+            if (store_chunk(ds) != 0) {
+                ds->error = 1;
+                return -1;
+            }
+            ds->chunk_len = 0;
+            ds->hash = 0;
+        }
+    }
+    return 0;
+}
+
+static int dedup_sink_close(NandroidSink* sink, int discard) {
+    DedupSink* ds = (DedupSink*)sink;
+    char tmp[PATH_MAX];
+    int ret = ds->error ? -1 : 0;
+
+    if (!discard && ret == 0 && ds->chunk_len > 0)
+        ret = store_chunk(ds);
+    if (!discard && ret == 0) {
+        fprintf(ds->list, "end %llu\n", (unsigned long long)ds->total);
+        if (fflush(ds->list) != 0 || fsync(fileno(ds->list)) != 0)
+            ret = -1;
+    }
+    if (fclose(ds->list) != 0)
+        ret = -1;
+
+    // the manifest only appears once every chunk it lists is stored
+    snprintf(tmp, sizeof(tmp), "%s.tmp", ds->manifest);
+    if (!discard && ret == 0 && rename(tmp, ds->manifest) != 0)
+        ret = -1;
+    if (discard || ret != 0)
+        unlink(tmp);
+    else
+        LOGI("%s: %u chunks, %u new\n", ds->manifest, ds->chunks_total, ds->chunks_new);
+
+    free(ds->chunk);
+    free(ds->packed);
+    free(ds);
+    return ret;
+}
+
+NandroidSink* dedup_sink_open(const char* store, const char* manifest) {
+    char tmp[PATH_MAX];
+
+    init_gear();
+    if (mkdir(store, 0755) != 0 && errno != EEXIST) {
+        LOGE("Can't create chunk store %s (%s)\n", store, strerror(errno));
+        return NULL;
+    }
+
+    DedupSink* ds = calloc(1, sizeof(DedupSink));
+    if (ds == NULL)
+        return NULL;
+    ds->chunk = malloc(CHUNK_MAX_SIZE);
+    ds->packed = malloc(compressBound(CHUNK_MAX_SIZE));
+    snprintf(tmp, sizeof(tmp), "%s.tmp", manifest);
+    ds->list = fopen(tmp, "w");
+    if (ds->chunk == NULL || ds->packed == NULL || ds->list == NULL) {
+        LOGE("Can't create %s\n", tmp);
+        if (ds->list != NULL)
+            fclose(ds->list);
+        free(ds->chunk);
+        free(ds->packed);
+        free(ds);
+        return NULL;
+    }
+    strncpy(ds->store, store, sizeof(ds->store) - 1);
+    strncpy(ds->manifest, manifest, sizeof(ds->manifest) - 1);
+    fprintf(ds->list, "%s\n", MANIFEST_MAGIC);
+    ds->stats = nandroid_stats_current();
+    ds->sink.write = dedup_sink_write;
+    ds->sink.close = dedup_sink_close;
+    return &ds->sink;
+}
+
+//=========================================/
+//=             Restore                   =/
+//=========================================/
+
+static int load_chunk(const char* store, const char* hex, size_t len,
+                      unsigned char* out, unsigned char* packed) {
+    char path[PATH_MAX];
+    uint8_t expected[SHA256_DIGEST_SIZE];
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    if (len == 0 || len > CHUNK_MAX_SIZE || from_hex(hex, expected) != 0)
+        return -1;
+    chunk_path(store, hex, path);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("Missing chunk %s\n", hex);
+        return -1;
+    }
+    size_t max = compressBound(CHUNK_MAX_SIZE) + 1;
+    size_t got = 0;
+    for (;;) {
+        ssize_t n = read(fd, packed + got, max - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    close(fd);
+
+    if (got > 1 && packed[0] == CHUNK_RAW && got - 1 == len) {
+        memcpy(out, packed + 1, len);
+    } else if (got > 1 && packed[0] == CHUNK_DEFLATED) {
+        uLongf out_len = len;
+        if (uncompress(out, &out_len, packed + 1, got - 1) != Z_OK || out_len != len) {
+            LOGE("Corrupted chunk %s\n", hex);
+            return -1;
+        }
+    } else {
+        LOGE("Corrupted chunk %s\n", hex);
+        return -1;
+    }
+
+    SHA256_hash(out, len, digest);
+    if (memcmp(digest, expected, SHA256_DIGEST_SIZE) != 0) {
+        LOGE("Chunk %s does not match its hash\n", hex);
+        return -1;
+    }
+    return 0;
+}
+
+int dedup_restore(const char* store, const char* manifest, int out_fd) {
+    char line[256];
+    int ret = -1;
+    unsigned long long total = 0;
+
+    FILE* list = fopen(manifest, "r");
+    if (list == NULL) {
+        LOGE("Can't open %s\n", manifest);
+        return -1;
+    }
+    unsigned char* out = malloc(CHUNK_MAX_SIZE);
+    unsigned char* packed = malloc(compressBound(CHUNK_MAX_SIZE) + 1);
+    if (out == NULL || packed == NULL)
+        goto done;
+
+    if (fgets(line, sizeof(line), list) == NULL || strncmp(line, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)) != 0) {
+        LOGE("%s is not a dedup manifest\n", manifest);
+        goto done;
+    }
+    while (fgets(line, sizeof(line), list) != NULL) {
+        unsigned long long expected;
+        if (sscanf(line, "end %llu", &expected) == 1) {
+            if (expected == total)
+                ret = 0;
+            else
+                LOGE("%s: size mismatch\n", manifest);
+            break;
+        }
+        char* space = strchr(line, ' ');
+        if (space == NULL)
+            break;
+        *space = '\0';
+        size_t len = strtoul(space + 1, NULL, 10);
+        if (load_chunk(store, line, len, out, packed) != 0 || write_all(out_fd, out, len) != 0)
+            break;
+        total += len;
+    }
+    if (ret != 0)
+        LOGE("Error restoring from %s\n", manifest);
+
+done:
+    free(out);
+    free(packed);
+    fclose(list);
+    return ret;
+}
+
+//=========================================/
+//=         Garbage collection            =/
+//=========================================/
+
+typedef struct {
+    uint8_t* digests;
+    size_t count;
+    size_t alloc;
+} DigestSet;
+
+static int compare_digests(const void* a, const void* b) {
+    return memcmp(a, b, SHA256_DIGEST_SIZE);
+}
+
+static int collect_manifest(DigestSet* set, const char* manifest) {
+    char line[256];
+    FILE* list = fopen(manifest, "r");
+    if (list == NULL)
+        return -1;
+    if (fgets(line, sizeof(line), list) == NULL || strncmp(line, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)) != 0) {
+        fclose(list);
+        return 0;
+    }
+    while (fgets(line, sizeof(line), list) != NULL) {
+        if (set->count == set->alloc) {
+            size_t alloc = set->alloc == 0 ? 4096 : set->alloc * 2;
+            uint8_t* digests = realloc(set->digests, alloc * SHA256_DIGEST_SIZE);
+            if (digests == NULL) {
+                fclose(list);
+                return -1;
+            }
+            set->digests = digests;
+            set->alloc = alloc;
+        }
+        if (from_hex(line, set->digests + set->count * SHA256_DIGEST_SIZE) == 0)
+            set->count++;
+    }
+    fclose(list);
+    return 0;
+}
+
+int dedup_collect_garbage(const char* store) {
+    char backups[PATH_MAX];
+    char path[PATH_MAX];
+    DigestSet set;
+    unsigned int removed = 0;
+
+    memset(&set, 0, sizeof(set));
+    strcpy(backups, store);
+    char* slash = strrchr(backups, '/');
+    if (slash == NULL)
+        return -1;
+    *slash = '\0';
+
+    // every manifest of every backup next to the store keeps its chunks
+    DIR* d = opendir(backups);
+    if (d == NULL)
+        return -1;
+    struct dirent* de;
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", backups, de->d_name);
+        DIR* bd = opendir(path);
+        if (bd == NULL)
+            continue;
+        struct dirent* me;
+        while ((me = readdir(bd)) != NULL) {
+            size_t len = strlen(me->d_name);
+            size_t ext = strlen(DEDUP_MANIFEST_EXT);
+            if (len <= ext || strcmp(me->d_name + len - ext, DEDUP_MANIFEST_EXT) != 0)
+                continue;
+            snprintf(path, sizeof(path), "%s/%s/%s", backups, de->d_name, me->d_name);
+            if (collect_manifest(&set, path) != 0) {
+                // never delete anything on a partial view of the references
+                LOGE("Can't read %s, keeping all chunks\n", path);
+                closedir(bd);
+                closedir(d);
+                free(set.digests);
+                return -1;
+            }
+        }
+        closedir(bd);
+    }
+    closedir(d);
+    qsort(set.digests, set.count, SHA256_DIGEST_SIZE, compare_digests);
+
+    d = opendir(store);
+    if (d == NULL) {
+        free(set.digests);
+        return 0;
+    }
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", store, de->d_name);
+        DIR* cd = opendir(path);
+        if (cd == NULL)
+            continue;
+        struct dirent* ce;
+        while ((ce = readdir(cd)) != NULL) {
+            uint8_t digest[SHA256_DIGEST_SIZE];
+            if (ce->d_name[0] == '.')
+                continue;
+            if (from_hex(ce->d_name, digest) == 0 &&
+                    bsearch(digest, set.digests, set.count, SHA256_DIGEST_SIZE, compare_digests) != NULL)
+                continue;
+            // unreferenced chunk or a leftover .tmp from an aborted backup
+            snprintf(path, sizeof(path), "%s/%s/%s", store, de->d_name, ce->d_name);
+            if (unlink(path) == 0)
+                removed++;
+        }
+        closedir(cd);
+    }
+    closedir(d);
+    free(set.digests);
+
+    LOGI("Removed %u unreferenced chunks from %s\n", removed, store);
+    return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NANDROID_DEDUP_H
+#define NANDROID_DEDUP_H
+
+#include "nandroid_archive.h"
+
+// Deduplicating backups. Archive streams and raw images are cut into
+// content-defined chunks; every chunk is stored once, named by its
+// SHA-256, in a chunk store shared by all backups of the volume
+// (clockworkmod/backup/.chunks). Each backup only keeps small manifests
+// (<name>.<fs>.dup, <name>.img.dup) listing its chunks, so a repeat
+// backup writes just the chunks that changed.
+
+#define DEDUP_STORE_DIR     ".chunks"
+#define DEDUP_MANIFEST_EXT  ".dup"
+
+// Fills store with the chunk store used for backups in backup_path.
+void dedup_store_path(const char* backup_path, char* store);
+
+// Chunks the stream into store and writes the manifest on close.
+NandroidSink* dedup_sink_open(const char* store, const char* manifest);
+
+// Rebuilds the stream described by manifest into out_fd, verifying every
+// chunk against its hash. Returns 0 on success.
+int dedup_restore(const char* store, const char* manifest, int out_fd);
+
+// Deletes the chunks no manifest under the backup directory refers to
+// anymore. Called after backups are deleted.
+int dedup_collect_garbage(const char* store);
+
+#endif
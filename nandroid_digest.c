@@ -0,0 +1,540 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Backup checksums computed while the data streams, replacing the extra
+// read pass of nandroid-md5.sh after a backup and of "md5sum -c" before
+// a restore.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "nandroid_archive.h"
+#include "nandroid_digest.h"
+#include "nandroid_journal.h"
+
+//=========================================/
+//=               XXH64                   =/
+//=========================================/
+
+#define XXH_PRIME1 11400714785074694791ULL
+#define XXH_PRIME2 14029467366897019727ULL
+#define XXH_PRIME3  1609587929392839161ULL
+#define XXH_PRIME4  9650029242287828579ULL
+#define XXH_PRIME5  2870177450012600261ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));   // little endian, like every Android target
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME1;
+}
+
+static inline uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static void xxh64_init(Xxh64State* s) {
+    memset(s, 0, sizeof(*s));
+    s->v[0] = XXH_PRIME1 + XXH_PRIME2;
+    s->v[1] = XXH_PRIME2;
+    s->v[2] = 0;
+    s->v[3] = -XXH_PRIME1;
+}
+
+static void xxh64_update(Xxh64State* s, const unsigned char* p, size_t len) {
+    s->total += len;
+
+    if (s->mem_used + len < 32) {
+        memcpy(s->mem + s->mem_used, p, len);
+        s->mem_used += len;
+        return;
+    }
+    if (s->mem_used > 0) {
+        size_t fill = 32 - s->mem_used;
+        memcpy(s->mem + s->mem_used, p, fill);
+        s->v[0] = xxh64_round(s->v[0], read64(s->mem));
+        s->v[1] = xxh64_round(s->v[1], read64(s->mem + 8));
+        s->v[2] = xxh64_round(s->v[2], read64(s->mem + 16));
+        s->v[3] = xxh64_round(s->v[3], read64(s->mem + 24));
+        p += fill;
+        len -= fill;
+        s->mem_used = 0;
+    }
+
+    uint64_t v1 = s->v[0], v2 = s->v[1], v3 = s->v[2], v4 = s->v[3];
+    while (len >= 32) {
+        v1 = xxh64_round(v1, read64(p));
+        v2 = xxh64_round(v2, read64(p + 8));
+        v3 = xxh64_round(v3, read64(p + 16));
+        v4 = xxh64_round(v4, read64(p + 24));
+        p += 32;
+        len -= 32;
+    }
+    s->v[0] = v1;
+    s->v[1] = v2;
+    s->v[2] = v3;
+    s->v[3] = v4;
+
+    memcpy(s->mem, p, len);
+    s->mem_used = len;
+}
+
+static uint64_t xxh64_final(const Xxh64State* s) {
+    const unsigned char* p = s->mem;
+    size_t len = s->mem_used;
+    uint64_t h;
+
+    if (s->total >= 32) {
+        h = rotl64(s->v[0], 1) + rotl64(s->v[1], 7) + rotl64(s->v[2], 12) + rotl64(s->v[3], 18);
+        h = xxh64_merge(h, s->v[0]);
+        h = xxh64_merge(h, s->v[1]);
+        h = xxh64_merge(h, s->v[2]);
+        h = xxh64_merge(h, s->v[3]);
+    } else {
+        h = XXH_PRIME5;
+    }
+    h += s->total;
+
+    while (len >= 8) {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4) {
+        h ^= (uint64_t)read32(p) * XXH_PRIME1;
+        h = rotl64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+        len -= 4;
+    }
+    while (len > 0) {
+        h ^= (*p) * XXH_PRIME5;
+        h = rotl64(h, 11) * XXH_PRIME1;
+        p++;
+        len--;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+void file_digest_init(FileDigest* digest, int algorithms) {
+    digest->algorithms = algorithms;
+    if (algorithms & DIGEST_MD5)
+        MD5_Init(&digest->md5);
+    if (algorithms & DIGEST_XXH64)
+        xxh64_init(&digest->xxh64);
+}
+
+void file_digest_update(FileDigest* digest, const void* data, size_t len) {
+    if (digest->algorithms & DIGEST_MD5)
+        MD5_Update(&digest->md5, data, len);
+    if (digest->algorithms & DIGEST_XXH64)
+        xxh64_update(&digest->xxh64, data, len);
+}
+
+void file_digest_final(FileDigest* digest, char* md5_hex, char* xxh64_hex) {
+    if (digest->algorithms & DIGEST_MD5) {
+        unsigned char md5[MD5_DIGEST_LENGTH];
+        int i;
+        MD5_Final(md5, &digest->md5);
+        for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+            sprintf(md5_hex + i * 2, "%02x", md5[i]);
+    }
+    if (digest->algorithms & DIGEST_XXH64)
+        sprintf(xxh64_hex, "%016llx", (unsigned long long)xxh64_final(&digest->xxh64));
+}
+
+static int digest_fd(int fd, FileDigest* digest) {
+    unsigned char* buf = malloc(NANDROID_ARCHIVE_BUFFER_SIZE);
+    int ret = 0;
+    if (buf == NULL)
+        return -1;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    for (;;) {
+        ssize_t n = read(fd, buf, NANDROID_ARCHIVE_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            ret = -1;
+        if (n <= 0)
+            break;
+        file_digest_update(digest, buf, n);
+    }
+    free(buf);
+    return ret;
+}
+
+//=========================================/
+//=             Manifests                 =/
+//=========================================/
+
+typedef struct {
+    char* name;                // relative to the backup, without "./"
+    char md5[MD5_HEX_SIZE];
+    char xxh64[XXH64_HEX_SIZE];
+} DigestEntry;
+
+typedef struct {
+    char dir[PATH_MAX];
+    DigestEntry* entries;
+    int count;
+    int alloc;
+    int algorithm;             // verification only
+} DigestSet;
+
+static pthread_mutex_t record_lock = PTHREAD_MUTEX_INITIALIZER;
+static DigestSet recording;
+static DigestSet verifying;
+
+static void digest_set_reset(DigestSet* set, const char* dir) {
+    int i;
+    for (i = 0; i < set->count; i++)
+        free(set->entries[i].name);
+    free(set->entries);
+    memset(set, 0, sizeof(*set));
+    if (dir == NULL)
+        return;
+
+    // collapse "//" and drop trailing slashes so prefixes compare cleanly
+    char* out = set->dir;
+    const char* in;
+    for (in = dir; *in != '\0' && out - set->dir < PATH_MAX - 1; in++) {
+        if (*in == '/' && out > set->dir && out[-1] == '/')
+            continue;
+        *out++ = *in;
+    }
+    while (out - set->dir > 1 && out[-1] == '/')
+        out--;
+    *out = '\0';
+}
+
+// Name of path inside the set's backup directory, NULL if it's outside.
+static const char* digest_set_name(const DigestSet* set, const char* path, char* name) {
+    size_t dir_len = strlen(set->dir);
+    char* out = name;
+    const char* in;
+
+    if (dir_len == 0)
+        return NULL;
+    for (in = path; *in != '\0' && out - name < PATH_MAX - 1; in++) {
+        if (*in == '/' && out > name && out[-1] == '/')
+            continue;
+        *out++ = *in;
+    }
+    *out = '\0';
+    if (strncmp(name, set->dir, dir_len) != 0 || name[dir_len] != '/')
+        return NULL;
+    return name + dir_len + 1;
+}
+
+static DigestEntry* digest_set_find(DigestSet* set, const char* name) {
+    int i;
+    for (i = 0; i < set->count; i++) {
+        if (strcmp(set->entries[i].name, name) == 0)
+            return &set->entries[i];
+    }
+    return NULL;
+}
+
+static DigestEntry* digest_set_add(DigestSet* set, const char* name) {
+    DigestEntry* e = digest_set_find(set, name);
+    if (e != NULL)
+        return e;
+    if (set->count == set->alloc) {
+        int alloc = set->alloc == 0 ? 32 : set->alloc * 2;
+        DigestEntry* entries = realloc(set->entries, alloc * sizeof(DigestEntry));
+        if (entries == NULL)
+            return NULL;
+        set->entries = entries;
+        set->alloc = alloc;
+    }
+    e = &set->entries[set->count];
+    memset(e, 0, sizeof(*e));
+    e->name = strdup(name);
+    if (e->name == NULL)
+        return NULL;
+    set->count++;
+    return e;
+}
+
+//=========================================/
+//=             Backup side               =/
+//=========================================/
+
+void nandroid_digest_begin(const char* backup_path) {
+    pthread_mutex_lock(&record_lock);
+    digest_set_reset(&recording, backup_path);
+    pthread_mutex_unlock(&record_lock);
+}
+
+int nandroid_digest_wanted(const char* path) {
+    char buf[PATH_MAX];
+    pthread_mutex_lock(&record_lock);
+    int wanted = digest_set_name(&recording, path, buf) != NULL;
+    pthread_mutex_unlock(&record_lock);
+    return wanted ? DIGEST_MD5 | DIGEST_XXH64 : 0;
+}
+
+void nandroid_digest_record(const char* path, FileDigest* digest) {
+    char md5[MD5_HEX_SIZE];
+    char xxh64[XXH64_HEX_SIZE];
+
+    file_digest_final(digest, md5, xxh64);
+    nandroid_digest_set(path, md5, xxh64);
+}
+
+void nandroid_digest_set(const char* path, const char* md5, const char* xxh64) {
+    char buf[PATH_MAX];
+
+    pthread_mutex_lock(&record_lock);
+    const char* name = digest_set_name(&recording, path, buf);
+    DigestEntry* e = name == NULL ? NULL : digest_set_add(&recording, name);
+    if (e != NULL) {
+        strcpy(e->md5, md5);
+        strcpy(e->xxh64, xxh64);
+    }
+    pthread_mutex_unlock(&record_lock);
+}
+
+static int compare_names(const struct dirent** a, const struct dirent** b) {
+    return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+static int skip_dots(const struct dirent* de) {
+    return strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0;
+}
+
+// Lists every regular file below dir like "find . -type f" did, hashing
+// the ones nothing recorded while they were written.
+static int digest_walk(const char* dir, const char* prefix, FILE* md5_out, FILE* xxh64_out) {
+    struct dirent** names;
+    char path[PATH_MAX];
+    char name[PATH_MAX];
+    int i, ret = 0;
+
+    int count = scandir(dir, &names, skip_dots, compare_names);
+    if (count < 0) {
+        LOGE("Can't read %s (%s)\n", dir, strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]->d_name);
+        snprintf(name, sizeof(name), "%s%s", prefix, names[i]->d_name);
+        if (ret != 0 || lstat(path, &st) != 0)
+            goto next;
+        if (S_ISDIR(st.st_mode)) {
+            strcat(name, "/");
+            ret = digest_walk(path, name, md5_out, xxh64_out);
+            goto next;
+        }
+        if (!S_ISREG(st.st_mode))
+            goto next;
+        if (prefix[0] == '\0' && (strcmp(name, NANDROID_MD5_MANIFEST) == 0 ||
+                                  strcmp(name, NANDROID_XXH64_MANIFEST) == 0 ||
+                                  strcmp(name, NANDROID_JOURNAL) == 0))
+            goto next;
+
+        DigestEntry* e = digest_set_find(&recording, name);
+        if (e == NULL) {
+            FileDigest digest;
+            e = digest_set_add(&recording, name);
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (e == NULL || fd < 0) {
+                LOGE("Can't read %s\n", path);
+                if (fd >= 0)
+                    close(fd);
+                ret = -1;
+                goto next;
+            }
+            file_digest_init(&digest, DIGEST_MD5 | DIGEST_XXH64);
+            ret = digest_fd(fd, &digest);
+            close(fd);
+            file_digest_final(&digest, e->md5, e->xxh64);
+        }
+        fprintf(md5_out, "%s  ./%s\n", e->md5, name);
+        fprintf(xxh64_out, "%s  ./%s\n", e->xxh64, name);
+next:
+        free(names[i]);
+    }
+    free(names);
+    return ret;
+}
+
+int nandroid_digest_finish() {
+    char md5_path[PATH_MAX];
+    char xxh64_path[PATH_MAX];
+    int ret = 0;
+
+    pthread_mutex_lock(&record_lock);
+    snprintf(md5_path, sizeof(md5_path), "%s/%s", recording.dir, NANDROID_MD5_MANIFEST);
+    snprintf(xxh64_path, sizeof(xxh64_path), "%s/%s", recording.dir, NANDROID_XXH64_MANIFEST);
+    FILE* md5_out = fopen(md5_path, "w");
+    FILE* xxh64_out = fopen(xxh64_path, "w");
+    if (md5_out == NULL || xxh64_out == NULL) {
+        LOGE("Can't create checksum manifests in %s\n", recording.dir);
+        ret = -1;
+    } else {
+        ret = digest_walk(recording.dir, "", md5_out, xxh64_out);
+    }
+    if (md5_out != NULL && fclose(md5_out) != 0)
+        ret = -1;
+    if (xxh64_out != NULL && fclose(xxh64_out) != 0)
+        ret = -1;
+    if (ret != 0) {
+        unlink(md5_path);
+        unlink(xxh64_path);
+    }
+    digest_set_reset(&recording, NULL);
+    pthread_mutex_unlock(&record_lock);
+    return ret;
+}
+
+//=========================================/
+//=             Restore side              =/
+//=========================================/
+
+static int load_manifest(DigestSet* set, const char* path, int algorithm) {
+    char line[PATH_MAX + 64];
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    size_t hex_len = algorithm == DIGEST_MD5 ? MD5_HEX_SIZE - 1 : XXH64_HEX_SIZE - 1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (strlen(line) < hex_len + 2 || line[hex_len] != ' ')
+            continue;
+        // "<hex>  name", or "<hex> *name" for binary mode
+        char* name = line + hex_len + 2;
+        if (strncmp(name, "./", 2) == 0)
+            name += 2;
+        DigestEntry* e = digest_set_add(set, name);
+        if (e == NULL)
+            break;
+        if (algorithm == DIGEST_MD5)
+            memcpy(e->md5, line, hex_len);
+        else
+            memcpy(e->xxh64, line, hex_len);
+    }
+    fclose(f);
+    set->algorithm = algorithm;
+    return 0;
+}
+
+int nandroid_verify_begin(const char* backup_path) {
+    char path[PATH_MAX];
+
+    digest_set_reset(&verifying, backup_path);
+    snprintf(path, sizeof(path), "%s/%s", verifying.dir, NANDROID_XXH64_MANIFEST);
+    if (load_manifest(&verifying, path, DIGEST_XXH64) == 0)
+        return 0;
+    snprintf(path, sizeof(path), "%s/%s", verifying.dir, NANDROID_MD5_MANIFEST);
+    if (load_manifest(&verifying, path, DIGEST_MD5) == 0)
+        return 0;
+    digest_set_reset(&verifying, NULL);
+    return -1;
+}
+
+void nandroid_verify_end() {
+    digest_set_reset(&verifying, NULL);
+}
+
+int nandroid_verify_expect(const char* path, FileDigest* digest) {
+    char buf[PATH_MAX];
+    const char* name = digest_set_name(&verifying, path, buf);
+    if (name == NULL)
+        return 0;
+    if (digest_set_find(&verifying, name) == NULL) {
+        LOGW("%s is not listed in the checksum manifest\n", name);
+        return 0;
+    }
+    file_digest_init(digest, verifying.algorithm);
+    return 1;
+}
+
+int nandroid_verify_listed(const char* path) {
+    char buf[PATH_MAX];
+    const char* name = digest_set_name(&verifying, path, buf);
+    return name != NULL && digest_set_find(&verifying, name) != NULL;
+}
+
+int nandroid_verify_check(const char* path, FileDigest* digest) {
+    char buf[PATH_MAX];
+    char md5[MD5_HEX_SIZE];
+    char xxh64[XXH64_HEX_SIZE];
+
+    const char* name = digest_set_name(&verifying, path, buf);
+    DigestEntry* e = name == NULL ? NULL : digest_set_find(&verifying, name);
+    if (e == NULL)
+        return 0;
+    file_digest_final(digest, md5, xxh64);
+    if (verifying.algorithm == DIGEST_MD5 ? strcasecmp(md5, e->md5) != 0 : strcasecmp(xxh64, e->xxh64) != 0) {
+        ui_print("Checksum mismatch: %s\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+int nandroid_verify_file(const char* path) {
+    FileDigest digest;
+    if (!nandroid_verify_expect(path, &digest))
+        return 0;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOGE("Can't open %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+    int ret = digest_fd(fd, &digest);
+    close(fd);
+    if (ret != 0) {
+        LOGE("Error reading %s\n", path);
+        return -1;
+    }
+    return nandroid_verify_check(path, &digest);
+}
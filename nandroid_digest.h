@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NANDROID_DIGEST_H
+#define NANDROID_DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/md5.h>
+
+// Checksum manifests of a backup. nandroid.md5 keeps the "md5sum -c"
+// layout older recoveries verify; nandroid.xxh64 lists the same files
+// with XXH64 ("xxhsum -c" layout), which is several times cheaper to
+// check and preferred on restore when present.
+#define NANDROID_MD5_MANIFEST   "nandroid.md5"
+#define NANDROID_XXH64_MANIFEST "nandroid.xxh64"
+
+#define DIGEST_MD5    1
+#define DIGEST_XXH64  2
+
+#define MD5_HEX_SIZE   (MD5_DIGEST_LENGTH * 2 + 1)
+#define XXH64_HEX_SIZE 17
+
+typedef struct {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char mem[32];
+    size_t mem_used;
+} Xxh64State;
+
+typedef struct {
+    int algorithms;            // DIGEST_* mask
+    MD5_CTX md5;
+    Xxh64State xxh64;
+} FileDigest;
+
+void file_digest_init(FileDigest* digest, int algorithms);
+void file_digest_update(FileDigest* digest, const void* data, size_t len);
+// Fills the hex strings of the algorithms the digest was set up with.
+void file_digest_final(FileDigest* digest, char* md5_hex, char* xxh64_hex);
+
+// Backup side: while a recording is active, the files written by the
+// volume sink under backup_path report their digests as they are written.
+// nandroid_digest_finish() hashes whatever was written some other way
+// and writes both manifests.
+void nandroid_digest_begin(const char* backup_path);
+// Returns the algorithms to compute for path, 0 if it isn't recorded.
+int nandroid_digest_wanted(const char* path);
+void nandroid_digest_record(const char* path, FileDigest* digest);
+// Records digests known without hashing, such as those of the volumes a
+// resumed backup kept.
+void nandroid_digest_set(const char* path, const char* md5_hex, const char* xxh64_hex);
+int nandroid_digest_finish();
+
+// Restore side: loads the manifests of backup_path so that files read
+// back are checked as they stream. Returns -1 if the backup has none.
+int nandroid_verify_begin(const char* backup_path);
+void nandroid_verify_end();
+// Sets digest up for the files a manifest lists. Returns 0 if path is not
+// being verified.
+int nandroid_verify_expect(const char* path, FileDigest* digest);
+// Returns 1 if the manifest being verified lists path, so it must exist.
+int nandroid_verify_listed(const char* path);
+// Compares a finished digest with the manifest. Returns 0 if it matches.
+int nandroid_verify_check(const char* path, FileDigest* digest);
+// Checks a whole file in one pass, for images not restored through the
+// volume reader. Returns 0 if it matches or is not being verified.
+int nandroid_verify_file(const char* path);
+
+#endif
@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "nandroid_digest.h"
+#include "nandroid_journal.h"
+
+typedef struct {
+    char* name;                // relative to the backup
+    uint64_t size;
+    char md5[MD5_HEX_SIZE];
+    char xxh64[XXH64_HEX_SIZE];
+} JournalVolume;
+
+static struct {
+    int active;
+    int fd;
+    char dir[PATH_MAX];
+    JournalVolume* volumes;
+    int volume_count;
+    int volume_alloc;
+    char** done;
+    int done_count;
+    int done_alloc;
+} journal = { 0, -1 };
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* const operations[] = { NULL, "backup", "restore" };
+
+static void journal_reset() {
+    int i;
+    if (journal.fd >= 0)
+        close(journal.fd);
+    for (i = 0; i < journal.volume_count; i++)
+        free(journal.volumes[i].name);
+    for (i = 0; i < journal.done_count; i++)
+        free(journal.done[i]);
+    free(journal.volumes);
+    free(journal.done);
+    memset(&journal, 0, sizeof(journal));
+    journal.fd = -1;
+}
+
+static void journal_path(const char* dir, char* path) {
+    snprintf(path, PATH_MAX, "%s/%s", dir, NANDROID_JOURNAL);
+}
+
+// Name of path inside the backup, NULL if it's outside.
+static const char* journal_name(const char* path) {
+    size_t len = strlen(journal.dir);
+    if (strncmp(path, journal.dir, len) != 0 || path[len] != '/')
+        return NULL;
+    while (path[len] == '/')
+        len++;
+    return path + len;
+}
+
+static JournalVolume* find_volume(const char* name) {
+    int i;
+    for (i = 0; i < journal.volume_count; i++) {
+        if (strcmp(journal.volumes[i].name, name) == 0)
+            return &journal.volumes[i];
+    }
+    return NULL;
+}
+
+static void remove_volume(const char* name) {
+    JournalVolume* v = find_volume(name);
+    if (v == NULL)
+        return;
+    free(v->name);
+    *v = journal.volumes[--journal.volume_count];
+}
+
+static JournalVolume* add_volume(const char* name) {
+    JournalVolume* v = find_volume(name);
+    if (v != NULL)
+        return v;
+    if (journal.volume_count == journal.volume_alloc) {
+        int alloc = journal.volume_alloc == 0 ? 32 : journal.volume_alloc * 2;
+        JournalVolume* volumes = realloc(journal.volumes, alloc * sizeof(JournalVolume));
+        if (volumes == NULL)
+            return NULL;
+        journal.volumes = volumes;
+        journal.volume_alloc = alloc;
+    }
+    v = &journal.volumes[journal.volume_count];
+    memset(v, 0, sizeof(*v));
+    v->name = strdup(name);
+    if (v->name == NULL)
+        return NULL;
+    journal.volume_count++;
+    return v;
+}
+
+static int is_done(const char* name) {
+    int i;
+    for (i = 0; i < journal.done_count; i++) {
+        if (strcmp(journal.done[i], name) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+static int add_done(const char* name) {
+    if (is_done(name))
+        return 0;
+    if (journal.done_count == journal.done_alloc) {
+        int alloc = journal.done_alloc == 0 ? 16 : journal.done_alloc * 2;
+        char** done = realloc(journal.done, alloc * sizeof(char*));
+        if (done == NULL)
+            return -1;
+        journal.done = done;
+        journal.done_alloc = alloc;
+    }
+    journal.done[journal.done_count] = strdup(name);
+    if (journal.done[journal.done_count] == NULL)
+        return -1;
+    journal.done_count++;
+    return 0;
+}
+
+// Appends a record and syncs it, so the journal never claims more than
+// what survived.
+static int journal_append(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+static int journal_append(const char* fmt, ...) {
+    char line[PATH_MAX + 128];
+    va_list ap;
+
+    if (journal.fd < 0)
+        return -1;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (len < 0 || len >= (int)sizeof(line))
+        return -1;
+    if (write(journal.fd, line, len) != len || fdatasync(journal.fd) != 0) {
+        LOGE("Can't write the backup journal (%s)\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int read_header(FILE* f, int* operation, char* arg) {
+    char line[64];
+    char op[16];
+    int i;
+
+    if (fgets(line, sizeof(line), f) == NULL || sscanf(line, "%15s %15s", op, arg) != 2)
+        return -1;
+    for (i = JOURNAL_BACKUP; i <= JOURNAL_RESTORE; i++) {
+        if (strcmp(op, operations[i]) == 0) {
+            *operation = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int nandroid_journal_probe(const char* backup_path, char* arg) {
+    char path[PATH_MAX];
+    int operation = 0;
+
+    journal_path(backup_path, path);
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return 0;
+    if (read_header(f, &operation, arg) != 0)
+        operation = 0;
+    fclose(f);
+    return operation;
+}
+
+// Loads the records of a journal. Volumes that are gone or were cut
+// short since are not complete anymore.
+static int journal_load(FILE* f, int operation) {
+    char line[PATH_MAX + 128];
+    char name[sizeof(line)];
+    char arg[16];
+    int op;
+
+    if (read_header(f, &op, arg) != 0 || op != operation)
+        return -1;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        unsigned long long size;
+        char md5[MD5_HEX_SIZE], xxh64[XXH64_HEX_SIZE];
+
+        // a record torn by a crash is simply not there
+        if (strchr(line, '\n') == NULL)
+            break;
+        if (sscanf(line, "volume %s %llu %32s %16s", name, &size, md5, xxh64) == 4 &&
+                strlen(md5) == MD5_HEX_SIZE - 1 && strlen(xxh64) == XXH64_HEX_SIZE - 1) {
+            JournalVolume* v = add_volume(name);
+            if (v == NULL)
+                return -1;
+            v->size = size;
+            strcpy(v->md5, md5);
+            strcpy(v->xxh64, xxh64);
+        } else if (sscanf(line, "open %s", name) == 1) {
+            remove_volume(name);
+        } else if (sscanf(line, "done %s", name) == 1) {
+            if (add_done(name) != 0)
+                return -1;
+        }
+    }
+
+    int i = 0;
+    while (i < journal.volume_count) {
+        JournalVolume* v = &journal.volumes[i];
+        struct stat st;
+        snprintf(name, sizeof(name), "%s/%s", journal.dir, v->name);
+        if (stat(name, &st) != 0 || (uint64_t)st.st_size != v->size) {
+            remove_volume(v->name);
+            continue;
+        }
+        nandroid_digest_set(name, v->md5, v->xxh64);
+        i++;
+    }
+    return 0;
+}
+
+int nandroid_journal_begin(const char* backup_path, int operation, const char* arg, int resume) {
+    char path[PATH_MAX];
+    int ret = 0;
+
+    pthread_mutex_lock(&journal_lock);
+    journal_reset();
+    strncpy(journal.dir, backup_path, sizeof(journal.dir) - 1);
+    while (strlen(journal.dir) > 1 && journal.dir[strlen(journal.dir) - 1] == '/')
+        journal.dir[strlen(journal.dir) - 1] = '\0';
+    journal_path(journal.dir, path);
+
+    if (resume) {
+        FILE* f = fopen(path, "r");
+        if (f == NULL || journal_load(f, operation) != 0) {
+            LOGE("Can't resume from %s\n", path);
+            ret = -1;
+        }
+        if (f != NULL)
+            fclose(f);
+        if (ret == 0)
+            journal.fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    } else {
+        journal.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (journal.fd >= 0 && journal_append("%s %s\n", operations[operation], arg) != 0)
+            ret = -1;
+    }
+
+    if (ret == 0 && journal.fd < 0) {
+        LOGE("Can't open %s (%s)\n", path, strerror(errno));
+        ret = -1;
+    }
+    if (ret != 0)
+        journal_reset();
+    else
+        journal.active = 1;
+    pthread_mutex_unlock(&journal_lock);
+    return ret;
+}
+
+int nandroid_journal_active() {
+    pthread_mutex_lock(&journal_lock);
+    int active = journal.active;
+    pthread_mutex_unlock(&journal_lock);
+    return active;
+}
+
+void nandroid_journal_finish() {
+    char path[PATH_MAX];
+
+    pthread_mutex_lock(&journal_lock);
+    if (journal.active) {
+        journal_path(journal.dir, path);
+        unlink(path);
+    }
+    journal_reset();
+    pthread_mutex_unlock(&journal_lock);
+}
+
+void nandroid_journal_end() {
+    pthread_mutex_lock(&journal_lock);
+    journal_reset();
+    pthread_mutex_unlock(&journal_lock);
+}
+
+int nandroid_journal_volume_complete(const char* path, uint64_t* size) {
+    int complete = 0;
+
+    pthread_mutex_lock(&journal_lock);
+    const char* name = journal.active ? journal_name(path) : NULL;
+    JournalVolume* v = name != NULL ? find_volume(name) : NULL;
+    if (v != NULL) {
+        *size = v->size;
+        complete = 1;
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return complete;
+}
+
+void nandroid_journal_volume_reopened(const char* path) {
+    pthread_mutex_lock(&journal_lock);
+    const char* name = journal.active ? journal_name(path) : NULL;
+    if (name != NULL && find_volume(name) != NULL) {
+        remove_volume(name);
+        journal_append("open %s\n", name);
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+int nandroid_journal_volume_done(const char* path, uint64_t size, const char* md5, const char* xxh64) {
+    int ret = 0;
+
+    pthread_mutex_lock(&journal_lock);
+    const char* name = journal.active ? journal_name(path) : NULL;
+    if (name != NULL) {
+        JournalVolume* v = add_volume(name);
+        if (v != NULL) {
+            v->size = size;
+            strcpy(v->md5, md5);
+            strcpy(v->xxh64, xxh64);
+        }
+        ret = journal_append("volume %s %llu %s %s\n", name, (unsigned long long)size, md5, xxh64);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return ret;
+}
+
+// Flushes everything written to the backup's file system, so a partition
+// is only journaled once all of its files are on disk.
+static void journal_syncfs() {
+#ifdef __NR_syncfs
+    if (syscall(__NR_syncfs, journal.fd) == 0)
+        return;
+#endif
+    sync();
+}
+
+int nandroid_journal_partition_done(const char* name) {
+    int ret = 0;
+
+    pthread_mutex_lock(&journal_lock);
+    if (journal.active) {
+        journal_syncfs();
+        add_done(name);
+        ret = journal_append("done %s\n", name);
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return ret;
+}
+
+int nandroid_journal_partition_is_done(const char* name) {
+    pthread_mutex_lock(&journal_lock);
+    int done = journal.active && is_done(name);
+    pthread_mutex_unlock(&journal_lock);
+    return done;
+}
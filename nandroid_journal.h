@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NANDROID_JOURNAL_H
+#define NANDROID_JOURNAL_H
+
+#include <stdint.h>
+
+// Checkpoint journal of a backup or restore in progress, kept in the
+// backup folder until the operation completes:
+//
+//   backup <format>                 or: restore <partition mask>
+//   volume <file> <size> <md5> <xxh64>
+//   done <partition>
+//
+// A volume is journaled once it was written, synced and checksummed, a
+// partition once all of its files were. An interrupted operation is
+// resumed from there instead of starting over.
+#define NANDROID_JOURNAL "nandroid.journal"
+
+#define JOURNAL_BACKUP  1
+#define JOURNAL_RESTORE 2
+
+// Returns the operation backup_path's journal records, 0 if there is
+// none. arg receives its format or partition mask (at least 16 bytes).
+int nandroid_journal_probe(const char* backup_path, char* arg);
+
+// Starts journaling on backup_path. With resume set, the existing journal
+// is loaded and continued and the digests of its volumes are recorded
+// for the checksum manifests; otherwise a new journal replaces it.
+int nandroid_journal_begin(const char* backup_path, int operation, const char* arg, int resume);
+int nandroid_journal_active();
+// Removes the journal of a completed operation.
+void nandroid_journal_finish();
+// Stops journaling and keeps the journal for a later resume.
+void nandroid_journal_end();
+
+// Returns 1 and the size of path if a resumed backup completed it.
+int nandroid_journal_volume_complete(const char* path, uint64_t* size);
+// path is being written again; it is not complete anymore.
+void nandroid_journal_volume_reopened(const char* path);
+// Records a volume that was written and synced.
+int nandroid_journal_volume_done(const char* path, uint64_t size, const char* md5, const char* xxh64);
+
+int nandroid_journal_partition_done(const char* name);
+int nandroid_journal_partition_is_done(const char* name);
+
+#endif
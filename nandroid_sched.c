@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Runs independent nandroid partition jobs concurrently. Raw partition
+// dumps are bound by eMMC throughput while compressed archives are bound
+// by the CPU, so overlapping them shortens a full backup; I/O bound jobs
+// on the same disk are still serialized so they don't thrash it.
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "cutils/properties.h"
+
+#include "common.h"
+#include "nandroid_sched.h"
+#include "nandroid_stats.h"
+
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+static pthread_key_t job_key;
+static pthread_once_t job_key_once = PTHREAD_ONCE_INIT;
+static int sched_abort = 0;
+
+static void create_job_key() {
+    pthread_key_create(&job_key, NULL);
+}
+
+NandroidJob* nandroid_current_job() {
+    pthread_once(&job_key_once, create_job_key);
+    return (NandroidJob*)pthread_getspecific(job_key);
+}
+
+void nandroid_job_set_disk(NandroidJob* job, const char* device) {
+    char resolved[PATH_MAX];
+    const char* name;
+
+    if (device == NULL || device[0] != '/') {
+        // mtd/bml partitions are addressed by name and share one chip
+        strcpy(job->disk, "mtd");
+        return;
+    }
+    if (realpath(device, resolved) == NULL) {
+        strncpy(resolved, device, sizeof(resolved) - 1);
+        resolved[sizeof(resolved) - 1] = '\0';
+    }
+    name = strrchr(resolved, '/');
+    name = name == NULL ? resolved : name + 1;
+
+    strncpy(job->disk, name, sizeof(job->disk) - 1);
+    job->disk[sizeof(job->disk) - 1] = '\0';
+
+    // strip the partition number: mmcblk0p22 -> mmcblk0, sda1 -> sda
+    size_t len = strlen(job->disk);
+    while (len > 0 && isdigit((unsigned char)job->disk[len - 1]))
+        len--;
+    if (len > 1 && job->disk[len - 1] == 'p' && isdigit((unsigned char)job->disk[len - 2]))
+        len--;
+    if (len > 0 && len < strlen(job->disk))
+        job->disk[len] = '\0';
+}
+
+void nandroid_get_job_limits(int* max_jobs, int* io_jobs_per_disk) {
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get(NANDROID_JOBS_PROPERTY, value, "2");
+    *max_jobs = atoi(value);
+    if (*max_jobs < 1)
+        *max_jobs = 1;
+    if (*max_jobs > NANDROID_MAX_JOBS)
+        *max_jobs = NANDROID_MAX_JOBS;
+
+    property_get(NANDROID_IO_JOBS_PROPERTY, value, "1");
+    *io_jobs_per_disk = atoi(value);
+    if (*io_jobs_per_disk < 1)
+        *io_jobs_per_disk = 1;
+}
+
+int nandroid_job_progress(NandroidJob* job, uint64_t bytes_done) {
+    pthread_mutex_lock(&sched_lock);
+    job->bytes_done = bytes_done;
+    int abort = sched_abort;
+    pthread_mutex_unlock(&sched_lock);
+    return abort;
+}
+
+static void* job_thread(void* cookie) {
+    NandroidJob* job = cookie;
+
+    pthread_once(&job_key_once, create_job_key);
+    pthread_setspecific(job_key, job);
+    int result = job->run(job);
+    pthread_setspecific(job_key, NULL);
+
+    pthread_mutex_lock(&sched_lock);
+    job->result = result;
+    job->state = JOB_DONE;
+    job->bytes_done = job->bytes_total;
+    pthread_cond_broadcast(&sched_cond);
+    pthread_mutex_unlock(&sched_lock);
+    return NULL;
+}
+
+// Called with sched_lock held.
+static int job_can_start(NandroidJob* jobs, int count, int index, int io_jobs_per_disk) {
+    int i, same_disk = 0;
+
+    if (!jobs[index].io_bound)
+        return 1;
+    for (i = 0; i < count; i++) {
+        if (jobs[i].state == JOB_RUNNING && jobs[i].io_bound &&
+                strcmp(jobs[i].disk, jobs[index].disk) == 0)
+            same_disk++;
+    }
+    return same_disk < io_jobs_per_disk;
+}
+
+int nandroid_run_jobs(NandroidJob* jobs, int count, int max_jobs, int io_jobs_per_disk,
+                      int show_progress, int (*poll_cancel)(void* cookie), void* cookie,
+                      int* canceled) {
+    pthread_t threads[NANDROID_MAX_JOBS];
+    int joinable[NANDROID_MAX_JOBS];
+    int i, running = 0, ret = 0;
+
+    *canceled = 0;
+    if (count > NANDROID_MAX_JOBS)
+        return -1;
+
+    sched_abort = 0;
+    for (i = 0; i < count; i++) {
+        jobs[i].state = JOB_PENDING;
+        jobs[i].bytes_done = 0;
+        jobs[i].result = 0;
+        joinable[i] = 0;
+    }
+    if (show_progress) {
+        ui_reset_progress();
+        ui_show_progress(1, 0);
+    }
+
+    pthread_mutex_lock(&sched_lock);
+    for (;;) {
+        int pending = 0;
+
+        // start whatever the limits allow, in list order
+        for (i = 0; i < count; i++) {
+            if (jobs[i].state != JOB_PENDING)
+                continue;
+            if (sched_abort) {
+                // never start the remaining jobs once the run is failing
+                jobs[i].state = JOB_DONE;
+                continue;
+            }
+            if (running >= max_jobs || !job_can_start(jobs, count, i, io_jobs_per_disk)) {
+                pending++;
+                continue;
+            }
+            jobs[i].state = JOB_RUNNING;
+            if (pthread_create(&threads[i], NULL, job_thread, &jobs[i]) != 0) {
+                LOGE("Can't start backup job for %s\n", jobs[i].name);
+                jobs[i].state = JOB_DONE;
+                jobs[i].result = -1;
+                if (ret == 0)
+                    ret = -1;
+                sched_abort = 1;
+                continue;
+            }
+            joinable[i] = 1;
+            running++;
+        }
+        if (running == 0 && (pending == 0 || sched_abort))
+            break;
+
+        struct timeval now;
+        struct timespec deadline;
+        gettimeofday(&now, NULL);
+        deadline.tv_sec = now.tv_sec;
+        deadline.tv_nsec = (now.tv_usec + 200000) * 1000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&sched_cond, &sched_lock, &deadline);
+
+        uint64_t done = 0, total = 0;
+        for (i = 0; i < count; i++) {
+            if (joinable[i] && jobs[i].state == JOB_DONE) {
+                pthread_mutex_unlock(&sched_lock);
+                pthread_join(threads[i], NULL);
+                pthread_mutex_lock(&sched_lock);
+                joinable[i] = 0;
+                running--;
+                if (jobs[i].result != 0 && ret == 0) {
+                    ret = jobs[i].result;
+                    sched_abort = 1;
+                }
+            }
+            done += jobs[i].bytes_done;
+            total += jobs[i].bytes_total;
+        }
+        int aborting = sched_abort;
+        pthread_mutex_unlock(&sched_lock);
+
+        if (show_progress)
+            nandroid_stats_show_progress(done, total);
+        int cancel = !aborting && poll_cancel != NULL && poll_cancel(cookie);
+
+        pthread_mutex_lock(&sched_lock);
+        if (cancel) {
+            *canceled = 1;
+            sched_abort = 1;
+        }
+    }
+    pthread_mutex_unlock(&sched_lock);
+
+    if (*canceled)
+        return -1;
+    return ret;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NANDROID_SCHED_H
+#define NANDROID_SCHED_H
+
+#include <stdint.h>
+
+// Upper bound on the partitions a single nandroid run schedules.
+#define NANDROID_MAX_JOBS 16
+
+// Maximum number of jobs running at once (default 2).
+#define NANDROID_JOBS_PROPERTY     "ro.ctr.nandroid_jobs"
+// Maximum number of I/O bound jobs reading the same disk at once (default 1).
+#define NANDROID_IO_JOBS_PROPERTY  "ro.ctr.nandroid_io_jobs"
+
+#define JOB_PENDING 0
+#define JOB_RUNNING 1
+#define JOB_DONE    2
+
+typedef struct NandroidJob {
+    const char* name;          // shown in messages
+    char disk[32];             // source disk, used for I/O throttling
+    int io_bound;              // raw dumps and uncompressed archives
+    int (*run)(struct NandroidJob* job);
+    void* data;
+
+    // owned by the scheduler
+    uint64_t bytes_total;
+    uint64_t bytes_done;
+    int state;
+    int result;
+} NandroidJob;
+
+// Fills job->disk with the disk holding device, e.g.
+// "/dev/block/platform/msm_sdcc.1/by-name/system" -> "mmcblk0".
+void nandroid_job_set_disk(NandroidJob* job, const char* device);
+
+// Runs the jobs on worker threads, at most max_jobs at a time and at most
+// io_jobs_per_disk I/O bound jobs per source disk. Jobs are started in
+// list order as soon as the limits allow. poll_cancel is called from the
+// calling thread while it waits and may return nonzero to cancel; the
+// combined progress of all jobs is shown on the progress bar when
+// show_progress is set. Returns 0, the first failing job's result, or
+// -1 when canceled (*canceled is then set).
+int nandroid_run_jobs(NandroidJob* jobs, int count, int max_jobs, int io_jobs_per_disk,
+                      int show_progress, int (*poll_cancel)(void* cookie), void* cookie,
+                      int* canceled);
+
+// Reads the concurrency limits from the build properties.
+void nandroid_get_job_limits(int* max_jobs, int* io_jobs_per_disk);
+
+// Job running on the calling thread, or NULL outside the scheduler.
+NandroidJob* nandroid_current_job();
+
+// Called by jobs to report progress. Returns nonzero once the run is
+// canceled or another job failed, in which case the job should stop.
+int nandroid_job_progress(NandroidJob* job, uint64_t bytes_done);
+
+#endif
@@ -0,0 +1,258 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "cutils/properties.h"
+
+#include "common.h"
+#include "nandroid_stats.h"
+
+#define MAX_PHASES 32
+
+// How often the throughput under the progress bar changes.
+#define RATE_INTERVAL_US 1000000
+
+static const char* const phase_kinds[] = { "archive", "raw", "checksums" };
+
+static struct {
+    int active;
+    char path[PATH_MAX];
+    time_t started;
+    uint64_t start_us;
+    NandroidPhase phases[MAX_PHASES];
+    int count;
+} run;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t phase_key;
+static pthread_once_t phase_key_once = PTHREAD_ONCE_INIT;
+
+static void create_phase_key() {
+    pthread_key_create(&phase_key, NULL);
+}
+
+uint64_t nandroid_stats_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void nandroid_stats_begin(const char* backup_path) {
+    pthread_mutex_lock(&stats_lock);
+    memset(&run, 0, sizeof(run));
+    run.active = 1;
+    strncpy(run.path, backup_path, sizeof(run.path) - 1);
+    run.started = time(NULL);
+    run.start_us = nandroid_stats_now_us();
+    pthread_mutex_unlock(&stats_lock);
+}
+
+NandroidPhase* nandroid_stats_phase_begin(const char* name, int kind) {
+    NandroidPhase* phase = NULL;
+
+    pthread_once(&phase_key_once, create_phase_key);
+    pthread_mutex_lock(&stats_lock);
+    if (run.active && run.count < MAX_PHASES) {
+        phase = &run.phases[run.count++];
+        memset(phase, 0, sizeof(NandroidPhase));
+        strncpy(phase->name, name, sizeof(phase->name) - 1);
+        phase->kind = kind;
+        phase->start_us = nandroid_stats_now_us();
+    }
+    pthread_mutex_unlock(&stats_lock);
+    pthread_setspecific(phase_key, phase);
+    return phase;
+}
+
+void nandroid_stats_phase_end(NandroidPhase* phase, int result) {
+    pthread_once(&phase_key_once, create_phase_key);
+    pthread_setspecific(phase_key, NULL);
+    if (phase == NULL)
+        return;
+    pthread_mutex_lock(&stats_lock);
+    phase->result = result;
+    phase->end_us = nandroid_stats_now_us();
+    pthread_mutex_unlock(&stats_lock);
+}
+
+NandroidPhase* nandroid_stats_current() {
+    pthread_once(&phase_key_once, create_phase_key);
+    return (NandroidPhase*)pthread_getspecific(phase_key);
+}
+
+void nandroid_stats_add_read(NandroidPhase* phase, uint64_t bytes, uint64_t wait_us) {
+    if (phase == NULL)
+        return;
+    pthread_mutex_lock(&stats_lock);
+    phase->bytes_read += bytes;
+    phase->read_wait_us += wait_us;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void nandroid_stats_add_written(NandroidPhase* phase, uint64_t bytes, uint64_t wait_us) {
+    if (phase == NULL)
+        return;
+    pthread_mutex_lock(&stats_lock);
+    phase->bytes_written += bytes;
+    phase->write_wait_us += wait_us;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static double mb_per_s(uint64_t bytes, uint64_t us) {
+    return us == 0 ? 0 : (double)bytes / (1024.0 * 1024.0) / ((double)us / 1000000.0);
+}
+
+static double ratio(uint64_t read, uint64_t written) {
+    return written == 0 ? 0 : (double)read / (double)written;
+}
+
+static void write_json_string(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(f, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(f, "\\u%04x", *s);
+        else
+            fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+static void write_phase(FILE* f, const NandroidPhase* p) {
+    uint64_t wall = p->end_us > p->start_us ? p->end_us - p->start_us : 0;
+    uint64_t wait = p->read_wait_us + p->write_wait_us;
+
+    fprintf(f, "    { \"name\": ");
+    write_json_string(f, p->name);
+    fprintf(f, ", \"kind\": \"%s\", \"result\": %d,\n", phase_kinds[p->kind], p->result);
+    fprintf(f, "      \"start_ms\": %llu, \"wall_ms\": %llu,\n",
+            (unsigned long long)((p->start_us - run.start_us) / 1000), (unsigned long long)(wall / 1000));
+    fprintf(f, "      \"bytes_read\": %llu, \"bytes_written\": %llu, \"compression_ratio\": %.3f,\n",
+            (unsigned long long)p->bytes_read, (unsigned long long)p->bytes_written,
+            ratio(p->bytes_read, p->bytes_written));
+    // helper threads (compressors) write while the job computes, so the
+    // waits may add up to more than the wall time
+    fprintf(f, "      \"read_wait_ms\": %llu, \"write_wait_ms\": %llu, \"compute_ms\": %llu,\n",
+            (unsigned long long)(p->read_wait_us / 1000), (unsigned long long)(p->write_wait_us / 1000),
+            (unsigned long long)(wall > wait ? (wall - wait) / 1000 : 0));
+    fprintf(f, "      \"mb_per_s\": %.2f }", mb_per_s(p->bytes_read, wall));
+}
+
+int nandroid_stats_finish() {
+    char path[PATH_MAX];
+    char device[PROPERTY_VALUE_MAX];
+    uint64_t bytes_read = 0, bytes_written = 0;
+    int i;
+
+    pthread_mutex_lock(&stats_lock);
+    if (!run.active) {
+        pthread_mutex_unlock(&stats_lock);
+        return 0;
+    }
+    run.active = 0;
+    uint64_t wall = nandroid_stats_now_us() - run.start_us;
+    for (i = 0; i < run.count; i++) {
+        if (run.phases[i].kind == PHASE_CHECKSUMS)
+            continue;
+        bytes_read += run.phases[i].bytes_read;
+        bytes_written += run.phases[i].bytes_written;
+    }
+
+    property_get("ro.product.device", device, "");
+    snprintf(path, sizeof(path), "%s/%s", run.path, NANDROID_TIMING_REPORT);
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        pthread_mutex_unlock(&stats_lock);
+        LOGE("Can't write %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    fprintf(f, "{\n  \"version\": 1,\n  \"operation\": \"backup\",\n  \"device\": ");
+    write_json_string(f, device);
+#ifdef RECOVERY_VERSION
+    fprintf(f, ",\n  \"recovery\": ");
+    write_json_string(f, EXPAND(RECOVERY_VERSION));
+#endif
+    fprintf(f, ",\n  \"started\": %ld,\n  \"wall_ms\": %llu,\n", (long)run.started, (unsigned long long)(wall / 1000));
+    fprintf(f, "  \"bytes_read\": %llu,\n  \"bytes_written\": %llu,\n  \"compression_ratio\": %.3f,\n",
+            (unsigned long long)bytes_read, (unsigned long long)bytes_written, ratio(bytes_read, bytes_written));
+    fprintf(f, "  \"mb_per_s\": %.2f,\n  \"phases\": [\n", mb_per_s(bytes_read, wall));
+    for (i = 0; i < run.count; i++) {
+        write_phase(f, &run.phases[i]);
+        fprintf(f, "%s\n", i + 1 < run.count ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    int ret = ferror(f) ? -1 : 0;
+    if (fclose(f) != 0)
+        ret = -1;
+    pthread_mutex_unlock(&stats_lock);
+
+    ui_print("Backed up %llu MB in %llu:%02llu (%.1f MB/s, ratio %.2f)\n",
+             (unsigned long long)(bytes_read >> 20), (unsigned long long)(wall / 60000000),
+             (unsigned long long)(wall / 1000000 % 60), mb_per_s(bytes_read, wall),
+             ratio(bytes_read, bytes_written));
+    return ret;
+}
+
+// Throughput shown under the progress bar. Only the thread driving the
+// progress bar calls in.
+static struct {
+    uint64_t last_us;
+    uint64_t last_done;
+    double rate;               // bytes per second, smoothed
+} meter;
+
+void nandroid_stats_show_progress(uint64_t done, uint64_t total) {
+    char text[64];
+    uint64_t now = nandroid_stats_now_us();
+
+    if (total == 0)
+        return;
+    ui_set_progress((float)((double)done / (double)total));
+
+    if (meter.last_us == 0 || done < meter.last_done) {
+        // a new progress scope
+        meter.last_us = now;
+        meter.last_done = done;
+        meter.rate = 0;
+        ui_set_progress_text(NULL);
+        return;
+    }
+    if (now - meter.last_us < RATE_INTERVAL_US)
+        return;
+
+    double rate = (double)(done - meter.last_done) * 1000000.0 / (double)(now - meter.last_us);
+    meter.rate = meter.rate == 0 ? rate : 0.7 * meter.rate + 0.3 * rate;
+    meter.last_us = now;
+    meter.last_done = done;
+
+    if (meter.rate < 1.0 || done >= total) {
+        snprintf(text, sizeof(text), "%.1f MB/s", meter.rate / (1024 * 1024));
+    } else {
+        unsigned long left = (unsigned long)((double)(total - done) / meter.rate);
+        snprintf(text, sizeof(text), "%.1f MB/s - %lu:%02lu left", meter.rate / (1024 * 1024),
+                 left / 60, left % 60);
+    }
+    ui_set_progress_text(text);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NANDROID_STATS_H
+#define NANDROID_STATS_H
+
+#include <stdint.h>
+
+// Timing report of a backup, written next to nandroid.md5 so backup
+// performance can be compared across devices and releases.
+#define NANDROID_TIMING_REPORT "nandroid.timing.json"
+
+#define PHASE_ARCHIVE   0
+#define PHASE_RAW       1
+#define PHASE_CHECKSUMS 2
+
+// One partition (or other step) of a backup. Sinks and readers feed it
+// from any thread.
+typedef struct {
+    char name[32];
+    int kind;                  // PHASE_*
+    int result;
+    uint64_t start_us;
+    uint64_t end_us;
+    uint64_t bytes_read;       // source data
+    uint64_t bytes_written;    // backup files
+    uint64_t read_wait_us;     // blocked reading the source
+    uint64_t write_wait_us;    // blocked writing the backup
+} NandroidPhase;
+
+uint64_t nandroid_stats_now_us();
+
+// Starts recording a backup to backup_path.
+void nandroid_stats_begin(const char* backup_path);
+// Starts a phase and makes it the calling thread's current one.
+NandroidPhase* nandroid_stats_phase_begin(const char* name, int kind);
+void nandroid_stats_phase_end(NandroidPhase* phase, int result);
+// Phase of the calling thread, NULL when nothing is being recorded.
+NandroidPhase* nandroid_stats_current();
+
+// Both accept a NULL phase.
+void nandroid_stats_add_read(NandroidPhase* phase, uint64_t bytes, uint64_t wait_us);
+void nandroid_stats_add_written(NandroidPhase* phase, uint64_t bytes, uint64_t wait_us);
+
+// Writes the JSON report and prints a summary. Returns 0 on success.
+int nandroid_stats_finish();
+
+// Moves the progress bar to done/total and shows the current throughput
+// and time left under it.
+void nandroid_stats_show_progress(uint64_t done, uint64_t total);
+
+#endif
@@ -0,0 +1,414 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "common.h"
+#include "nandroid_stream.h"
+
+#define FRAME_MAGIC         "NFRM"
+#define FRAME_HEADER_SIZE   24
+
+#define FRAME_BEGIN     'B'
+#define FRAME_DATA      'D'
+#define FRAME_END       'E'
+#define FRAME_TRAILER   'T'
+
+#define FRAME_DEFLATED  0x01
+
+static void put_le32(unsigned char* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const unsigned char* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_le64(unsigned char* p, uint64_t v) {
+    put_le32(p, (uint32_t)v);
+    put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t get_le64(const unsigned char* p) {
+    return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static int write_all(int fd, const void* data, size_t len) {
+    const unsigned char* p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Returns 0 at a clean end of file before any byte, 1 once len bytes are
+// read, -1 otherwise.
+static int read_all(int fd, void* data, size_t len) {
+    unsigned char* p = data;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = read(fd, p + done, len - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            return done == 0 ? 0 : -1;
+        done += n;
+    }
+    return 1;
+}
+
+//=========================================/
+//=             Writer                    =/
+//=========================================/
+
+struct NandroidStreamWriter {
+    int fd;
+    int compress;
+    uint32_t sequence;
+    uint32_t partitions;
+    int error;
+    unsigned char* packed;
+};
+
+typedef struct {
+    NandroidSink sink;
+    NandroidStreamWriter* w;
+    unsigned char* buf;
+    size_t used;
+    uint64_t total;
+    int error;
+} StreamSink;
+
+static int write_frame(NandroidStreamWriter* w, int type, const unsigned char* data, size_t len) {
+    unsigned char header[FRAME_HEADER_SIZE];
+    int flags = 0;
+    size_t stored = len;
+
+    if (w->error)
+        return -1;
+    if (type == FRAME_DATA && w->compress) {
+        uLongf packed_len = compressBound(NANDROID_STREAM_FRAME_SIZE);
+        if (compress2(w->packed, &packed_len, data, len, 1) == Z_OK && packed_len < len) {
+            data = w->packed;
+            stored = packed_len;
+            flags = FRAME_DEFLATED;
+        }
+    }
+
+    memcpy(header, FRAME_MAGIC, 4);
+    header[4] = type;
+    header[5] = flags;
+    header[6] = header[7] = 0;
+    put_le32(header + 8, w->sequence++);
+    put_le32(header + 12, stored);
+    put_le32(header + 16, len);
+    uLong crc = crc32(0, header, FRAME_HEADER_SIZE - 4);
+    crc = crc32(crc, data, stored);
+    put_le32(header + 20, crc);
+
+    if (write_all(w->fd, header, sizeof(header)) != 0 || write_all(w->fd, data, stored) != 0) {
+        LOGE("Error writing backup stream (%s)\n", strerror(errno));
+        w->error = 1;
+        return -1;
+    }
+    return 0;
+}
+
+NandroidStreamWriter* stream_writer_open(int fd, int compress) {
+    NandroidStreamWriter* w = calloc(1, sizeof(NandroidStreamWriter));
+    if (w == NULL)
+        return NULL;
+    w->fd = fd;
+    w->compress = compress;
+    if (compress) {
+        w->packed = malloc(compressBound(NANDROID_STREAM_FRAME_SIZE));
+        if (w->packed == NULL) {
+            free(w);
+            return NULL;
+        }
+    }
+    if (write_all(fd, NANDROID_STREAM_MAGIC, NANDROID_STREAM_MAGIC_SIZE) != 0) {
+        LOGE("Error writing backup stream (%s)\n", strerror(errno));
+        free(w->packed);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+static int stream_sink_write(NandroidSink* sink, const void* data, size_t len) {
+    StreamSink* ss = (StreamSink*)sink;
+    const unsigned char* p = data;
+
+    if (ss->error)
+        return -1;
+    while (len > 0) {
+        size_t n = NANDROID_STREAM_FRAME_SIZE - ss->used;
+        if (n > len)
+            n = len;
+        memcpy(ss->buf + ss->used, p, n);
+        ss->used += n;
+        ss->total += n;
+        p += n;
+        len -= n;
+        if (ss->used == NANDROID_STREAM_FRAME_SIZE) {
+            if (write_frame(ss->w, FRAME_DATA, ss->buf, ss->used) != 0) {
+                ss->error = 1;
+                return -1;
+            }
+            ss->used = 0;
+        }
+    }
+    return 0;
+}
+
+static int stream_sink_close(NandroidSink* sink, int discard) {
+    StreamSink* ss = (StreamSink*)sink;
+    unsigned char length[8];
+    int ret = ss->error ? -1 : 0;
+
+    // a partition without its end frame is refused on restore
+    if (!discard && ret == 0 && ss->used > 0)
+        ret = write_frame(ss->w, FRAME_DATA, ss->buf, ss->used);
+    if (!discard && ret == 0) {
+        put_le64(length, ss->total);
+        ret = write_frame(ss->w, FRAME_END, length, sizeof(length));
+    }
+    if (ret == 0 && !discard)
+        ss->w->partitions++;
+    free(ss->buf);
+    free(ss);
+    return ret;
+}
+
+NandroidSink* stream_writer_begin(NandroidStreamWriter* w, const char* name, const char* kind) {
+    char label[PATH_MAX];
+    StreamSink* ss = calloc(1, sizeof(StreamSink));
+    if (ss == NULL)
+        return NULL;
+    ss->buf = malloc(NANDROID_STREAM_FRAME_SIZE);
+    snprintf(label, sizeof(label), "%s %s", name, kind);
+    if (ss->buf == NULL || write_frame(w, FRAME_BEGIN, (const unsigned char*)label, strlen(label)) != 0) {
+        free(ss->buf);
+        free(ss);
+        return NULL;
+    }
+    ss->w = w;
+    ss->sink.write = stream_sink_write;
+    ss->sink.close = stream_sink_close;
+    return &ss->sink;
+}
+
+int stream_writer_close(NandroidStreamWriter* w, int discard) {
+    unsigned char count[4];
+    int ret = w->error ? -1 : 0;
+
+    if (!discard && ret == 0) {
+        put_le32(count, w->partitions);
+        ret = write_frame(w, FRAME_TRAILER, count, sizeof(count));
+    }
+    free(w->packed);
+    free(w);
+    return ret;
+}
+
+//=========================================/
+//=             Reader                    =/
+//=========================================/
+
+struct NandroidStreamReader {
+    int fd;
+    uint32_t sequence;
+    uint32_t partitions;
+    int in_partition;
+    uint64_t total;          // data of the current partition so far
+    unsigned char* frame;    // payload of the last frame
+    size_t frame_len;
+    size_t frame_pos;
+    unsigned char* packed;
+    int error;
+};
+
+int nandroid_stream_probe(const unsigned char* head) {
+    return memcmp(head, NANDROID_STREAM_MAGIC, NANDROID_STREAM_MAGIC_SIZE) == 0;
+}
+
+NandroidStreamReader* stream_reader_open(int fd) {
+    NandroidStreamReader* r = calloc(1, sizeof(NandroidStreamReader));
+    if (r == NULL)
+        return NULL;
+    r->fd = fd;
+    r->frame = malloc(NANDROID_STREAM_FRAME_SIZE);
+    r->packed = malloc(compressBound(NANDROID_STREAM_FRAME_SIZE));
+    if (r->frame == NULL || r->packed == NULL) {
+        stream_reader_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+// Reads and checks the next frame into r->frame. Returns its type, or -1.
+static int read_frame(NandroidStreamReader* r) {
+    unsigned char header[FRAME_HEADER_SIZE];
+
+    if (r->error)
+        return -1;
+    r->error = 1;
+    if (read_all(r->fd, header, sizeof(header)) != 1) {
+        LOGE("Backup stream is truncated\n");
+        return -1;
+    }
+    uint32_t sequence = get_le32(header + 8);
+    uint32_t stored = get_le32(header + 12);
+    uint32_t len = get_le32(header + 16);
+    if (memcmp(header, FRAME_MAGIC, 4) != 0 || sequence != r->sequence ||
+            len > NANDROID_STREAM_FRAME_SIZE || stored > compressBound(NANDROID_STREAM_FRAME_SIZE) ||
+            (!(header[5] & FRAME_DEFLATED) && stored != len)) {
+        LOGE("Bad frame %u in backup stream\n", r->sequence);
+        return -1;
+    }
+    if (read_all(r->fd, r->packed, stored) != 1) {
+        LOGE("Backup stream is truncated\n");
+        return -1;
+    }
+    uLong crc = crc32(0, header, FRAME_HEADER_SIZE - 4);
+    crc = crc32(crc, r->packed, stored);
+    if (crc != get_le32(header + 20)) {
+        LOGE("Checksum mismatch in frame %u of backup stream\n", r->sequence);
+        return -1;
+    }
+
+    if (header[5] & FRAME_DEFLATED) {
+        uLongf out_len = NANDROID_STREAM_FRAME_SIZE;
+        if (uncompress(r->frame, &out_len, r->packed, stored) != Z_OK || out_len != len) {
+            LOGE("Can't inflate frame %u of backup stream\n", r->sequence);
+            return -1;
+        }
+    } else {
+        memcpy(r->frame, r->packed, len);
+    }
+    r->frame_len = len;
+    r->frame_pos = 0;
+    r->sequence++;
+    r->error = 0;
+    return header[4];
+}
+
+ssize_t stream_reader_read(NandroidStreamReader* r, void* data, size_t len) {
+    while (r->in_partition && r->frame_pos == r->frame_len) {
+        switch (read_frame(r)) {
+            case FRAME_DATA:
+                r->total += r->frame_len;
+                break;
+            case FRAME_END:
+                if (r->frame_len != 8 || get_le64(r->frame) != r->total) {
+                    LOGE("Partition length mismatch in backup stream\n");
+                    r->error = 1;
+                    return -1;
+                }
+                r->frame_pos = r->frame_len;
+                r->in_partition = 0;
+                r->partitions++;
+                return 0;
+            default:
+                r->error = 1;
+                return -1;
+        }
+    }
+    if (!r->in_partition)
+        return r->error ? -1 : 0;
+
+    size_t n = r->frame_len - r->frame_pos;
+    if (n > len)
+        n = len;
+    memcpy(data, r->frame + r->frame_pos, n);
+    r->frame_pos += n;
+    return n;
+}
+
+int stream_reader_next(NandroidStreamReader* r, char* name, size_t name_size, char* kind, size_t kind_size) {
+    char label[PATH_MAX];
+
+    while (r->in_partition) {
+        r->frame_pos = r->frame_len;
+        if (stream_reader_read(r, r->packed, 0) < 0)
+            return -1;
+    }
+
+    int type = read_frame(r);
+    if (type == FRAME_TRAILER) {
+        if (r->frame_len != 4 || get_le32(r->frame) != r->partitions) {
+            LOGE("Backup stream trailer doesn't match its partitions\n");
+            return -1;
+        }
+        return 1;
+    }
+    if (type != FRAME_BEGIN || r->frame_len >= sizeof(label))
+        return -1;
+
+    memcpy(label, r->frame, r->frame_len);
+    label[r->frame_len] = '\0';
+    char* space = strrchr(label, ' ');
+    if (space == NULL)
+        return -1;
+    *space = '\0';
+    snprintf(name, name_size, "%s", label);
+    snprintf(kind, kind_size, "%s", space + 1);
+    r->frame_pos = r->frame_len;
+    r->in_partition = 1;
+    r->total = 0;
+    return 0;
+}
+
+void stream_reader_close(NandroidStreamReader* r) {
+    if (r == NULL)
+        return;
+    free(r->frame);
+    free(r->packed);
+    free(r);
+}
+
+void nandroid_stream_drain(int fd, int timeout_ms) {
+    struct stat st;
+    int pending = 0;
+
+    if (fstat(fd, &st) != 0 || !S_ISSOCK(st.st_mode))
+        return;
+    for (; timeout_ms > 0; timeout_ms -= 20) {
+        if (ioctl(fd, TIOCOUTQ, &pending) != 0 || pending == 0)
+            return;
+        usleep(20 * 1000);
+    }
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NANDROID_STREAM_H
+#define NANDROID_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "nandroid_archive.h"
+
+// Framed nandroid stream, used by "bu" for adb backup/restore. Several
+// partitions travel in one stream:
+//
+//   "CTRSTRM1"
+//   frame 'B' "<name> <kind>"     partition begins, kind is tar or raw
+//   frame 'D' data ...            up to 1MB each, optionally deflated
+//   frame 'E' <u64 length>        partition ends, length of its data
+//   ...
+//   frame 'T' <u32 partitions>    end of the stream
+//
+// Every frame carries a sequence number and a CRC32 of its header and
+// payload, so no damaged frame is ever restored and a truncated or
+// damaged stream is reported. Partitions are restored while the stream
+// is read, though (there's nowhere to stage a whole /data), so damage is
+// only found once the partition was wiped or partly overwritten; it is
+// then left partly restored. Numbers are little endian.
+
+#define NANDROID_STREAM_MAGIC       "CTRSTRM1"
+#define NANDROID_STREAM_MAGIC_SIZE  8
+#define NANDROID_STREAM_FRAME_SIZE  (1024 * 1024)
+
+#define STREAM_KIND_TAR "tar"
+#define STREAM_KIND_RAW "raw"
+
+typedef struct NandroidStreamWriter NandroidStreamWriter;
+typedef struct NandroidStreamReader NandroidStreamReader;
+
+// Writes the stream magic to fd. Data frames are deflated when compress
+// is set and it makes them smaller.
+NandroidStreamWriter* stream_writer_open(int fd, int compress);
+// Starts a partition; the returned sink takes its data and ends it when
+// closed without discard.
+NandroidSink* stream_writer_begin(NandroidStreamWriter* w, const char* name, const char* kind);
+// Writes the trailer (unless discard is set) and frees the writer. The
+// fd stays open.
+int stream_writer_close(NandroidStreamWriter* w, int discard);
+
+// Returns 1 if head starts a framed stream.
+int nandroid_stream_probe(const unsigned char* head);
+// Reads a stream whose magic was already consumed from fd.
+NandroidStreamReader* stream_reader_open(int fd);
+// Moves to the next partition. Returns 0 and fills name and kind when
+// one begins, 1 at the end of the stream, -1 on a damaged stream. The
+// rest of the current partition is skipped.
+int stream_reader_next(NandroidStreamReader* r, char* name, size_t name_size, char* kind, size_t kind_size);
+// Reads data of the current partition. Returns 0 once all of it was
+// read and its length checked, -1 on a damaged stream.
+ssize_t stream_reader_read(NandroidStreamReader* r, void* data, size_t len);
+void stream_reader_close(NandroidStreamReader* r);
+
+// Waits until a socket fd has handed everything written to it to the
+// peer, at most timeout_ms. Returns at once for other fds.
+void nandroid_stream_drain(int fd, int timeout_ms);
+
+#endif
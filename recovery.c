@@ -713,12 +713,8 @@ void wipe_dalvik_cache(int confirm) {
 	ui_print("Dalvik Cache wiped.\n");
 }
 
-int install_zip(const char* packagefilepath) {
-    ui_print("\n-- Installing: %s\n", packagefilepath);
-    set_sdcard_update_bootloader_message();
-
-    int wipe_cache = 0;
-    int status = install_package(packagefilepath, &wipe_cache, TEMPORARY_INSTALL_FILE, true);
+// What install_zip() does once the package ran; returns 0 on success.
+static int finish_zip_install(int status, int wipe_cache) {
     ui_reset_progress();
     if (status != INSTALL_SUCCESS) {
         copy_logs();
@@ -740,10 +736,75 @@ int install_zip(const char* packagefilepath) {
 #endif
 
     ui_set_background(BACKGROUND_ICON_NONE);
+    return 0;
+}
+
+int install_zip(const char* packagefilepath) {
+    ui_print("\n-- Installing: %s\n", packagefilepath);
+    set_sdcard_update_bootloader_message();
+
+    int wipe_cache = 0;
+    int status = install_package(packagefilepath, &wipe_cache, TEMPORARY_INSTALL_FILE, true);
+    if (finish_zip_install(status, wipe_cache) != 0)
+        return 1;
     ui_print("\nInstall from sdcard complete.\n");
     return 0;
 }
 
+static const char* install_status_name(int status) {
+    switch (status) {
+        case INSTALL_SUCCESS: return "installed";
+        case INSTALL_CORRUPT: return "corrupt or not trusted";
+        case INSTALL_NONE: return "not installed";
+        default: return "install error";
+    }
+}
+
+int install_zips(const char* const* packagefilepaths, int count) {
+    int* status = (int*)malloc(count * sizeof(int));
+    InstallQueue* q = status != NULL ? install_queue_create(packagefilepaths, count) : NULL;
+    int failed = -1;
+    int i;
+
+    if (q == NULL) {
+        // no memory for the queue: one at a time
+        free(status);
+        for (i = 0; i < count; i++) {
+            if (install_zip(packagefilepaths[i]) != 0)
+                return 1;
+        }
+        return 0;
+    }
+
+    for (i = 0; i < count; i++)
+        status[i] = INSTALL_NONE;
+    set_sdcard_update_bootloader_message();
+    for (i = 0; i < count && failed < 0; i++) {
+        int wipe_cache = 0;
+        ui_print("\n-- Installing (%d/%d): %s\n", i + 1, count, packagefilepaths[i]);
+        status[i] = install_queue_install(q, i, &wipe_cache, TEMPORARY_INSTALL_FILE);
+        if (finish_zip_install(status[i], wipe_cache) != 0) {
+            if (status[i] == INSTALL_SUCCESS)
+                status[i] = INSTALL_ERROR;      // loki
+            failed = i;
+        }
+    }
+    install_queue_destroy(q);
+
+    // One summary for the whole batch; a failed package stops the ones after it.
+    if (failed < 0) {
+        ui_print("\nInstalled %d zip files.\n", count);
+    } else {
+        ui_print("\nInstalled %d of %d zip files:\n", failed, count);
+        for (i = 0; i < count; i++) {
+            if (status[i] != INSTALL_SUCCESS)
+                ui_print("  %s: %s\n", basename(packagefilepaths[i]), install_status_name(status[i]));
+        }
+    }
+    free(status);
+    return failed < 0 ? 0 : 1;
+}
+
 int enter_sideload_mode(int* wipe_cache) {
 
     ensure_path_mounted(CACHE_ROOT);
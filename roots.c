@@ -602,6 +602,25 @@ int format_volume(const char* volume) {
     return format_unknown_device(v->device, volume, v->fs_type);
 }
 
+// Volumes that setup_install_mounts() leaves mounted, such as the one
+// holding the zip being installed; set by keep_mounted_for_install().
+static const char* const* install_kept_paths = NULL;
+static int num_install_kept_paths = 0;
+
+void keep_mounted_for_install(const char* const* paths, int count) {
+    install_kept_paths = paths;
+    num_install_kept_paths = paths != NULL ? count : 0;
+}
+
+static int kept_for_install(const Volume* v) {
+    int i;
+    for (i = 0; i < num_install_kept_paths; i++) {
+        if (volume_for_path(install_kept_paths[i]) == v)
+            return 1;
+    }
+    return 0;
+}
+
 // mount /cache and unmount all other partitions before installing zip file
 int setup_install_mounts() {
 	device_volumes = get_device_volumes();
@@ -618,6 +637,8 @@ int setup_install_mounts() {
                 strcmp(v->mount_point, "/cache") == 0) {
             if (ensure_path_mounted(v->mount_point) != 0) return -1;
 
+        } else if (kept_for_install(v)) {
+            continue;
         } else if (is_encrypted_data()) {
             if (strcmp(v->mount_point, "/data") != 0 && ensure_path_unmounted(v->mount_point) != 0) return -1;
         } else {
@@ -66,6 +66,9 @@ int is_data_media_volume_path(const char* path);
 void preserve_data_media(int val);
 int is_data_media_preserved();
 int setup_install_mounts();
+// Volumes holding these paths are left mounted by setup_install_mounts();
+// pass NULL to clear them.
+void keep_mounted_for_install(const char* const* paths, int count);
 int encrypted_data_mounted;
 int data_is_decrypted;
 
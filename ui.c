@@ -96,6 +96,7 @@ static float gProgressScopeSize = 0.0;
 static float gProgress = 0.0;
 static double gProgressScopeTime;
 static double gProgressScopeDuration;
+static char gProgressText[64];
 
 // Set to 1 when both graphics pages are the same (except for the progress bar)
 static int gPagesIdentical = 0;
@@ -266,6 +267,16 @@ static void draw_progress_locked()
             gr_blit(gProgressBarIndeterminate[frame], 0, 0, width, height, dx, dy);
             frame = (frame + 1) % ui_parameters.indeterminate_frames;
         }
+
+        // throughput/time left line under the bar
+        int ty = dy + height + CHAR_HEIGHT / 2;
+        gr_color(0, 0, 0, 255);
+        gr_fill(0, ty, gr_fb_width(), CHAR_HEIGHT);
+        if (gProgressText[0] != '\0') {
+            int length = strlen(gProgressText) * CHAR_WIDTH;
+            gr_color(255, 255, 255, 255);
+            gr_text((gr_fb_width() - length) / 2, ty + CHAR_HEIGHT - 1, gProgressText, 0);
+        }
     }
 
     t_last_progress_update = timenow_msec();
@@ -1636,11 +1647,26 @@ void ui_set_progress(float fraction) {
     pthread_mutex_unlock(&gUpdateMutex);
 }
 
+void ui_set_progress_text(const char* text) {
+    if (!ui_has_initialized)
+        return;
+
+    pthread_mutex_lock(&gUpdateMutex);
+    if (text == NULL)
+        gProgressText[0] = '\0';
+    else
+        snprintf(gProgressText, sizeof(gProgressText), "%s", text);
+    if (gProgressBarType != PROGRESSBAR_TYPE_NONE)
+        update_progress_locked();
+    pthread_mutex_unlock(&gUpdateMutex);
+}
+
 void ui_reset_progress() {
     if (!ui_has_initialized)
         return;
 
     pthread_mutex_lock(&gUpdateMutex);
+    gProgressText[0] = '\0';
     gProgressBarType = PROGRESSBAR_TYPE_NONE;
     gProgressScopeStart = 0;
     gProgressScopeSize = 0;
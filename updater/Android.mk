@@ -5,6 +5,7 @@ LOCAL_PATH := $(call my-dir)
 updater_src_files := \
 	install.c \
 	blockimg.c \
+	blockio.c \
 	updater.c
 
 #
@@ -46,10 +47,17 @@ ifeq ($(BOARD_USE_MKE2FS_FORMAT),true)
   LOCAL_CFLAGS += -DUSE_MKE2FS_FORMAT
 endif
 
+ifeq ($(TARGET_UPDATER_USES_AIO),true)
+  LOCAL_CFLAGS += -DHAVE_LINUX_AIO
+endif
+
 LOCAL_STATIC_LIBRARIES += $(TARGET_RECOVERY_UPDATER_LIBS) $(TARGET_RECOVERY_UPDATER_EXTRA_LIBS)
 LOCAL_STATIC_LIBRARIES += libapplypatch libedify libmtdutils libminzip libz
 LOCAL_STATIC_LIBRARIES += libflashutils libmtdutils libmmcutils libbmlutils
-LOCAL_STATIC_LIBRARIES += libmincrypt libbz libxz
+LOCAL_STATIC_LIBRARIES += libmincrypt libbz libxz liblz4-static
+ifeq ($(TARGET_RECOVERY_USES_ZSTD),true)
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
 LOCAL_STATIC_LIBRARIES += libcutils liblog libstdc++ libc
 LOCAL_STATIC_LIBRARIES += libselinux libcrecovery
 tune2fs_static_libraries := \
@@ -115,3 +123,15 @@ LOCAL_32_BIT_ONLY := true
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES := blockio_bench.c blockio.c
+LOCAL_CFLAGS += -O2 -Wall -Wno-unused-parameter
+ifeq ($(TARGET_UPDATER_USES_AIO),true)
+LOCAL_CFLAGS += -DHAVE_LINUX_AIO
+endif
+LOCAL_MODULE := blockio_bench
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_TAGS := tests
+LOCAL_STATIC_LIBRARIES := libc
+include $(BUILD_EXECUTABLE)
@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/sysinfo.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/ioctl.h>
@@ -32,13 +33,13 @@
 #include <unistd.h>
 
 #include "applypatch/applypatch.h"
+#include "blockio.h"
+#include "cutils/properties.h"
 #include "edify/expr.h"
 #include "mincrypt/sha.h"
 #include "minzip/Hash.h"
 #include "updater.h"
 
-#define BLOCKSIZE 4096
-
 // Set this to 0 to interpret 'erase' transfers to mean do a
 // BLKDISCARD ioctl (the normal behavior).  Set to 1 to interpret
 // erase to mean fill the region with zeroes.
@@ -48,18 +49,15 @@
 #define BLKDISCARD _IO(0x12,119)
 #endif
 
+// Zeroing and range_sha1() go through buffers of up to this many blocks.
+#define CHUNK_BLOCKS 256
+
 #define STASH_DIRECTORY_BASE "/cache/recovery"
 #define STASH_DIRECTORY_MODE 0700
 #define STASH_FILE_MODE 0600
 
 char* PrintSha1(const uint8_t* digest);
 
-typedef struct {
-    int count;
-    int size;
-    int pos[0];
-} RangeSet;
-
 static RangeSet* parse_range(char* text) {
     char* save;
     int num;
@@ -139,28 +137,13 @@ static int write_all(int fd, const uint8_t* data, size_t size) {
     return 0;
 }
 
-static int check_lseek(int fd, off64_t offset, int whence) {
-    while (true) {
-        off64_t ret = lseek64(fd, offset, whence);
-        if (ret < 0) {
-            if (errno != EINTR) {
-                fprintf(stderr, "lseek64 failed: %s\n", strerror(errno));
-                return -1;
-            }
-        } else {
-            break;
-        }
-    }
-    return 0;
-}
-
 static void allocate(size_t size, uint8_t** buffer, size_t* buffer_alloc) {
     // if the buffer's big enough, reuse it.
     if (size <= *buffer_alloc) return;
 
     free(*buffer);
 
-    *buffer = (uint8_t*) malloc(size);
+    *buffer = AllocateBlocks(size);
     if (*buffer == NULL) {
         fprintf(stderr, "failed to allocate %zu bytes\n", size);
         exit(1);
@@ -191,7 +174,10 @@ static ssize_t RangeSinkWrite(const uint8_t* data, ssize_t size, void* token) {
             write_now = rss->p_remain;
         }
 
-        if (write_all(rss->fd, data, write_now) == -1) {
+        off64_t offset = (off64_t) rss->tgt->pos[rss->p_block * 2 + 1] * BLOCKSIZE -
+                rss->p_remain;
+
+        if (pwrite_all(rss->fd, data, write_now, offset) == -1) {
             break;
         }
 
@@ -207,11 +193,6 @@ static ssize_t RangeSinkWrite(const uint8_t* data, ssize_t size, void* token) {
             if (rss->p_block < rss->tgt->count) {
                 rss->p_remain = (rss->tgt->pos[rss->p_block * 2 + 1] -
                                  rss->tgt->pos[rss->p_block * 2]) * BLOCKSIZE;
-
-                if (check_lseek(rss->fd, (off64_t)rss->tgt->pos[rss->p_block*2] * BLOCKSIZE,
-                        SEEK_SET) == -1) {
-                    break;
-                }
             } else {
                 // we can't write any more; return how many bytes have
                 // been written so far.
@@ -230,56 +211,83 @@ static ssize_t RangeSinkWrite(const uint8_t* data, ssize_t size, void* token) {
 // can't write each section until it's that transfer's turn to go.
 //
 // To achieve this, we expand the new data from the archive in a
-// background thread, and block that threads 'receive uncompressed
-// data' function until the main thread has reached a point where we
-// want some new data to be written.  We signal the background thread
-// with the destination for the data and block the main thread,
-// waiting for the background thread to complete writing that section.
-// Then it signals the main thread to wake up and goes back to
-// blocking waiting for a transfer.
+// background thread into a ring buffer, which the main thread drains
+// to the target blocks when a 'new' transfer comes up.  While the main
+// thread is busy with moves, diffs and stashes, the background thread
+// keeps decompressing until the ring is full, so a 'new' transfer
+// mostly finds its data already expanded.
 //
 // NewThreadInfo is the struct used to pass information back and forth
-// between the two threads.  When the main thread wants some data
-// written, it sets rss to the destination location and signals the
-// condition.  When the background thread is done writing, it clears
-// rss and signals the condition again.
+// between the two threads.  The background thread only writes to the
+// free part of the ring and the main thread only reads the filled part,
+// so the copies happen outside the lock; "head" and "fill" are updated
+// under it and changes are signaled through the condition.
+
+// The ring gets this fraction of the free memory, within the limits.
+#define NEW_DATA_RING_RAM_SHARE 16
+#define NEW_DATA_RING_MIN (1 << 20)
+#define NEW_DATA_RING_MAX (64 << 20)
 
 typedef struct {
     ZipArchive* za;
     const ZipEntry* entry;
 
-    RangeSinkState* rss;
+    uint8_t* ring;
+    size_t ring_size;
+    size_t head;        // where the oldest unwritten data starts
+    size_t fill;        // bytes of it
+    bool finished;      // nothing more is coming
+    bool abort;         // the main thread wants no more data
 
     pthread_mutex_t mu;
     pthread_cond_t cv;
 } NewThreadInfo;
 
+static size_t new_data_ring_size() {
+    struct sysinfo si;
+    uint64_t size = NEW_DATA_RING_MIN;
+
+    if (sysinfo(&si) == 0) {
+        size = ((uint64_t) si.freeram + si.bufferram) * si.mem_unit / NEW_DATA_RING_RAM_SHARE;
+    }
+    if (size < NEW_DATA_RING_MIN) {
+        size = NEW_DATA_RING_MIN;
+    } else if (size > NEW_DATA_RING_MAX) {
+        size = NEW_DATA_RING_MAX;
+    }
+    return (size_t) size & ~(BLOCKSIZE - 1);
+}
+
 static bool receive_new_data(const unsigned char* data, int size, void* cookie) {
     NewThreadInfo* nti = (NewThreadInfo*) cookie;
 
     while (size > 0) {
-        // Wait for nti->rss to be non-NULL, indicating some of this
-        // data is wanted.
+        // Wait for room in the ring.
         pthread_mutex_lock(&nti->mu);
-        while (nti->rss == NULL) {
+        while (nti->fill == nti->ring_size && !nti->abort) {
             pthread_cond_wait(&nti->cv, &nti->mu);
         }
+        if (nti->abort) {
+            pthread_mutex_unlock(&nti->mu);
+            return false;
+        }
+        size_t tail = (nti->head + nti->fill) % nti->ring_size;
+        size_t room = nti->ring_size - nti->fill;
         pthread_mutex_unlock(&nti->mu);
 
-        // At this point nti->rss is set, and we own it.  The main
-        // thread is waiting for it to disappear from nti.
-        ssize_t written = RangeSinkWrite(data, size, nti->rss);
-        data += written;
-        size -= written;
-
-        if (nti->rss->p_block == nti->rss->tgt->count) {
-            // we have written all the bytes desired by this rss.
-
-            pthread_mutex_lock(&nti->mu);
-            nti->rss = NULL;
-            pthread_cond_broadcast(&nti->cv);
-            pthread_mutex_unlock(&nti->mu);
+        // The free part ends at the end of the buffer or at head.
+        if (room > nti->ring_size - tail) {
+            room = nti->ring_size - tail;
         }
+        size_t copy = (size_t) size < room ? (size_t) size : room;
+        memcpy(nti->ring + tail, data, copy);
+        data += copy;
+        size -= copy;
+
+        pthread_mutex_lock(&nti->mu);
+        nti->fill += copy;
+        pthread_cond_broadcast(&nti->cv);
+        pthread_mutex_unlock(&nti->mu);
     }
 
     return true;
@@ -287,65 +295,65 @@ static bool receive_new_data(const unsigned char* data, int size, void* cookie)
 
 static void* unzip_new_data(void* cookie) {
     NewThreadInfo* nti = (NewThreadInfo*) cookie;
-    if (strncmp(".xz", nti->entry->fileName + (nti->entry->fileNameLen - 3), 3) == 0) {
-        mzProcessZipEntryContentsXZ(nti->za, nti->entry, receive_new_data, nti);
+    int codec = mzCodecForFileName(nti->entry->fileName, nti->entry->fileNameLen);
+    if (codec >= 0) {
+        mzProcessZipEntryContentsAs(nti->za, nti->entry, codec, receive_new_data, nti);
     } else {
         mzProcessZipEntryContents(nti->za, nti->entry, receive_new_data, nti);
     }
 
+    pthread_mutex_lock(&nti->mu);
+    nti->finished = true;
+    pthread_cond_broadcast(&nti->cv);
+    pthread_mutex_unlock(&nti->mu);
+
     return NULL;
 }
 
-static int ReadBlocks(RangeSet* src, uint8_t* buffer, int fd) {
-    int i;
-    size_t p = 0;
-    size_t size;
-
-    if (!src || !buffer) {
-        return -1;
-    }
+// Writes the next new data to the blocks of rss, taking it from the ring
+// as the background thread expands it.
+static int write_new_data(NewThreadInfo* nti, RangeSinkState* rss) {
+    while (rss->p_block < rss->tgt->count) {
+        pthread_mutex_lock(&nti->mu);
+        while (nti->fill == 0 && !nti->finished) {
+            pthread_cond_wait(&nti->cv, &nti->mu);
+        }
+        size_t head = nti->head;
+        size_t avail = nti->fill;
+        pthread_mutex_unlock(&nti->mu);
 
-    for (i = 0; i < src->count; ++i) {
-        if (check_lseek(fd, (off64_t) src->pos[i * 2] * BLOCKSIZE, SEEK_SET) == -1) {
+        if (avail == 0) {
+            fprintf(stderr, "new data ended %zu bytes before the range\n", rss->p_remain);
             return -1;
         }
+        if (avail > nti->ring_size - head) {
+            avail = nti->ring_size - head;
+        }
 
-        size = (src->pos[i * 2 + 1] - src->pos[i * 2]) * BLOCKSIZE;
-
-        if (read_all(fd, buffer + p, size) == -1) {
+        ssize_t written = RangeSinkWrite(nti->ring + head, avail, rss);
+        if (written < (ssize_t) avail && rss->p_block < rss->tgt->count) {
+            fprintf(stderr, "failed to write new data\n");
             return -1;
         }
 
-        p += size;
+        pthread_mutex_lock(&nti->mu);
+        nti->head = (nti->head + written) % nti->ring_size;
+        nti->fill -= written;
+        pthread_cond_broadcast(&nti->cv);
+        pthread_mutex_unlock(&nti->mu);
     }
 
     return 0;
 }
 
-static int WriteBlocks(RangeSet* tgt, uint8_t* buffer, int fd) {
-    int i;
-    size_t p = 0;
-    size_t size;
-
-    if (!tgt || !buffer) {
-        return -1;
-    }
-
-    for (i = 0; i < tgt->count; ++i) {
-        if (check_lseek(fd, (off64_t) tgt->pos[i * 2] * BLOCKSIZE, SEEK_SET) == -1) {
-            return -1;
-        }
-
-        size = (tgt->pos[i * 2 + 1] - tgt->pos[i * 2]) * BLOCKSIZE;
-
-        if (write_all(fd, buffer + p, size) == -1) {
-            return -1;
-        }
-
-        p += size;
-    }
+// Stops the background thread, dropping whatever it hasn't handed over.
+static void stop_new_data(NewThreadInfo* nti, pthread_t thread) {
+    pthread_mutex_lock(&nti->mu);
+    nti->abort = true;
+    pthread_cond_broadcast(&nti->cv);
+    pthread_mutex_unlock(&nti->mu);
 
-    return 0;
+    pthread_join(thread, NULL);
 }
 
 // Do a source/target load for move/bsdiff/imgdiff in version 1.
@@ -800,13 +808,180 @@ csout:
     return rc;
 }
 
-static int SaveStash(const char* base, char** wordsave, uint8_t** buffer, size_t* buffer_alloc,
-                      int fd, int usehash, int* isunresumable) {
+// Stashes are kept in memory, up to a limit set by the transfer list's
+// maximum stash size and the free RAM.  A stash only goes to a file when
+// the memory runs out (the least recently used ones go first), or right
+// before a command writes over the blocks it was read from.  Until then
+// those blocks can be read again if the update is interrupted and
+// resumed, so the file isn't needed; after that the stash must survive
+// a restart.
+
+// Memory stashes may use this fraction of the free memory.
+#define STASH_RAM_SHARE 4
+
+typedef struct MemoryStash {
+    char* id;
+    RangeSet* src;              // the blocks the stash was read from
+    int blocks;
+    uint8_t* data;
+    int ondisk;                 // a stash file has the same contents
+    unsigned int lastuse;
+    struct MemoryStash* next;
+} MemoryStash;
+
+typedef struct {
+    const char* base;
+    MemoryStash* list;
+    size_t bytes;
+    size_t limit;
+    unsigned int clock;
+} StashStore;
+
+static size_t stash_memory_limit(int maxblocks) {
+    struct sysinfo si;
+    uint64_t size = (uint64_t) maxblocks * BLOCKSIZE;
+    uint64_t share;
+
+    if (sysinfo(&si) != 0) {
+        return 0;
+    }
+
+    share = ((uint64_t) si.freeram + si.bufferram) * si.mem_unit / STASH_RAM_SHARE;
+    return (size_t) (size < share ? size : share);
+}
+
+static MemoryStash* FindMemoryStash(StashStore* stashes, const char* id) {
+    MemoryStash* ms;
+
+    for (ms = stashes->list; ms != NULL; ms = ms->next) {
+        if (strcmp(ms->id, id) == 0) {
+            return ms;
+        }
+    }
+
+    return NULL;
+}
+
+static void RemoveMemoryStash(StashStore* stashes, MemoryStash* ms) {
+    MemoryStash** p;
+
+    for (p = &stashes->list; *p != NULL; p = &(*p)->next) {
+        if (*p == ms) {
+            *p = ms->next;
+            break;
+        }
+    }
+
+    stashes->bytes -= (size_t) ms->blocks * BLOCKSIZE;
+    free(ms->id);
+    free(ms->src);
+    free(ms->data);
+    free(ms);
+}
+
+static int SpillStash(StashStore* stashes, MemoryStash* ms) {
+    if (!ms->ondisk && WriteStash(stashes->base, ms->id, ms->blocks, ms->data, 0, NULL) != 0) {
+        return -1;
+    }
+
+    RemoveMemoryStash(stashes, ms);
+    return 0;
+}
+
+// Keeps the blocks of stash id, read from src, in memory, making room by
+// moving older stashes to files.  Returns -1 if they don't fit, in which
+// case the caller writes them to a file itself.
+static int KeepStash(StashStore* stashes, const char* id, const RangeSet* src, int blocks,
+                     const uint8_t* buffer) {
+    size_t size = (size_t) blocks * BLOCKSIZE;
+    size_t rangesize = sizeof(RangeSet) + src->count * 2 * sizeof(int);
+    MemoryStash* ms;
+    MemoryStash* oldest;
+
+    if (size > stashes->limit) {
+        return -1;
+    }
+
+    while (stashes->bytes + size > stashes->limit) {
+        oldest = stashes->list;
+
+        for (ms = stashes->list; ms != NULL; ms = ms->next) {
+            if (ms->lastuse < oldest->lastuse) {
+                oldest = ms;
+            }
+        }
+
+        fprintf(stderr, " moving %d stashed blocks of %s out of memory\n", oldest->blocks,
+            oldest->id);
+
+        if (SpillStash(stashes, oldest) != 0) {
+            return -1;
+        }
+    }
+
+    ms = calloc(1, sizeof(MemoryStash));
+
+    if (ms == NULL) {
+        return -1;
+    }
+
+    ms->id = strdup(id);
+    ms->src = malloc(rangesize);
+    ms->data = malloc(size);
+
+    if (ms->id == NULL || ms->src == NULL || ms->data == NULL) {
+        free(ms->id);
+        free(ms->src);
+        free(ms->data);
+        free(ms);
+        return -1;
+    }
+
+    memcpy(ms->src, src, rangesize);
+    memcpy(ms->data, buffer, size);
+    ms->blocks = blocks;
+    ms->lastuse = ++stashes->clock;
+    ms->next = stashes->list;
+    stashes->list = ms;
+    stashes->bytes += size;
+
+    fprintf(stderr, " keeping %d blocks of %s in memory\n", blocks, id);
+    return 0;
+}
+
+// Writes the memory stashes read from blocks in tgt to files, before tgt
+// is overwritten.
+static int PersistStashes(StashStore* stashes, RangeSet* tgt) {
+    MemoryStash* ms;
+
+    for (ms = stashes->list; ms != NULL; ms = ms->next) {
+        if (!ms->ondisk && range_overlaps(ms->src, tgt)) {
+            if (WriteStash(stashes->base, ms->id, ms->blocks, ms->data, 0, NULL) != 0) {
+                return -1;
+            }
+
+            ms->ondisk = 1;
+        }
+    }
+
+    return 0;
+}
+
+static void FreeStashStore(StashStore* stashes) {
+    while (stashes->list != NULL) {
+        RemoveMemoryStash(stashes, stashes->list);
+    }
+}
+
+static int SaveStash(StashStore* stashes, char** wordsave, uint8_t** buffer,
+                     size_t* buffer_alloc, int fd, int usehash, int* isunresumable) {
     char *id = NULL;
-    int res = -1;
+    char* word = NULL;
+    int rc = -1;
     int blocks = 0;
+    RangeSet* src = NULL;
 
-    if (!wordsave || !buffer || !buffer_alloc || !isunresumable) {
+    if (!stashes || !wordsave || !buffer || !buffer_alloc || !isunresumable) {
         return -1;
     }
 
@@ -817,28 +992,53 @@ static int SaveStash(const char* base, char** wordsave, uint8_t** buffer, size_t
         return -1;
     }
 
-    if (usehash && LoadStash(base, id, 1, &blocks, buffer, buffer_alloc, 0) == 0) {
+    if (FindMemoryStash(stashes, id) != NULL) {
+        return 0;
+    }
+
+    if (usehash && LoadStash(stashes->base, id, 1, &blocks, buffer, buffer_alloc, 0) == 0) {
         // Stash file already exists and has expected contents. Do not
         // read from source again, as the source may have been already
         // overwritten during a previous attempt.
         return 0;
     }
 
-    if (LoadSrcTgtVersion1(wordsave, NULL, &blocks, buffer, buffer_alloc, fd) == -1) {
+    word = strtok_r(NULL, " ", wordsave);
+
+    if (word == NULL) {
+        fprintf(stderr, "missing source blocks in stash command\n");
         return -1;
     }
 
+    src = parse_range(word);
+    blocks = src->size;
+    allocate(blocks * BLOCKSIZE, buffer, buffer_alloc);
+
+    if (ReadBlocks(src, *buffer, fd) == -1) {
+        goto ssout;
+    }
+
     if (usehash && VerifyBlocks(id, *buffer, blocks, 1) != 0) {
         // Source blocks have unexpected contents. If we actually need this
         // data later, this is an unrecoverable error. However, the command
         // that uses the data may have already completed previously, so the
         // possible failure will occur during source block verification.
         fprintf(stderr, "failed to load source blocks for stash %s\n", id);
-        return 0;
+        rc = 0;
+        goto ssout;
     }
 
     fprintf(stderr, "stashing %d blocks to %s\n", blocks, id);
-    return WriteStash(base, id, blocks, *buffer, 0, NULL);
+
+    if (KeepStash(stashes, id, src, blocks, *buffer) == 0) {
+        rc = 0;
+    } else {
+        rc = WriteStash(stashes->base, id, blocks, *buffer, 0, NULL);
+    }
+
+ssout:
+    free(src);
+    return rc;
 }
 
 static int FreeStash(const char* base, const char* id) {
@@ -860,6 +1060,26 @@ static int FreeStash(const char* base, const char* id) {
     return 0;
 }
 
+static int DropStash(StashStore* stashes, const char* id, int deletefile) {
+    MemoryStash* ms;
+
+    if (id == NULL) {
+        return -1;
+    }
+
+    ms = FindMemoryStash(stashes, id);
+
+    if (ms != NULL) {
+        RemoveMemoryStash(stashes, ms);
+    }
+
+    if (deletefile) {
+        return FreeStash(stashes->base, id);
+    }
+
+    return 0;
+}
+
 static void MoveRange(uint8_t* dest, RangeSet* locs, const uint8_t* source) {
     // source contains packed data, which we want to move to the
     // locations given in *locs in the dest buffer.  source and dest
@@ -895,12 +1115,13 @@ static void MoveRange(uint8_t* dest, RangeSet* locs, const uint8_t* source) {
 
 static int LoadSrcTgtVersion2(char** wordsave, RangeSet** tgt, int* src_blocks,
                                uint8_t** buffer, size_t* buffer_alloc, int fd,
-                               const char* stashbase, int* overlap) {
+                               StashStore* stashes, int* overlap) {
     char* word;
     char* colonsave;
     char* colon;
     int id;
     int res;
+    MemoryStash* ms;
     RangeSet* locs;
     size_t stashalloc = 0;
     uint8_t* stash = NULL;
@@ -950,19 +1171,27 @@ static int LoadSrcTgtVersion2(char** wordsave, RangeSet** tgt, int* src_blocks,
         colonsave = NULL;
         colon = strtok_r(word, ":", &colonsave);
 
-        res = LoadStash(stashbase, colon, 0, NULL, &stash, &stashalloc, 1);
+        // A stash in memory was verified when it was made and goes
+        // straight into place.
+        ms = FindMemoryStash(stashes, colon);
 
-        if (res == -1) {
-            // These source blocks will fail verification if used later, but we
-            // will let the caller decide if this is a fatal failure
-            fprintf(stderr, "failed to load stash %s\n", colon);
-            continue;
+        if (ms != NULL) {
+            ms->lastuse = ++stashes->clock;
+        } else {
+            res = LoadStash(stashes->base, colon, 0, NULL, &stash, &stashalloc, 1);
+
+            if (res == -1) {
+                // These source blocks will fail verification if used later, but we
+                // will let the caller decide if this is a fatal failure
+                fprintf(stderr, "failed to load stash %s\n", colon);
+                continue;
+            }
         }
 
         colon = strtok_r(NULL, ":", &colonsave);
         locs = parse_range(colon);
 
-        MoveRange(*buffer, locs, stash);
+        MoveRange(*buffer, locs, ms != NULL ? ms->data : stash);
         free(locs);
     }
 
@@ -979,6 +1208,7 @@ typedef struct {
     char* cpos;
     char* freestash;
     char* stashbase;
+    StashStore stashes;
     int canwrite;
     int createdstash;
     int fd;
@@ -988,6 +1218,9 @@ typedef struct {
     int written;
     NewThreadInfo nti;
     pthread_t thread;
+    int threadstarted;
+    int patchthreads;
+    size_t batchbytes;
     size_t bufsize;
     uint8_t* buffer;
     uint8_t* patch_start;
@@ -1042,11 +1275,11 @@ static int LoadSrcTgtVersion3(CommandParameters* params, RangeSet** tgt, int* sr
     }
 
     if (LoadSrcTgtVersion2(&params->cpos, tgt, src_blocks, &params->buffer, &params->bufsize,
-            params->fd, params->stashbase, overlap) == -1) {
+            params->fd, &params->stashes, overlap) == -1) {
         goto v3out;
     }
 
-    tgtbuffer = (uint8_t*) malloc((*tgt)->size * BLOCKSIZE);
+    tgtbuffer = AllocateBlocks((*tgt)->size * BLOCKSIZE);
 
     if (tgtbuffer == NULL) {
         fprintf(stderr, "failed to allocate %d bytes\n", (*tgt)->size * BLOCKSIZE);
@@ -1124,7 +1357,7 @@ static int PerformCommandMove(CommandParameters* params) {
                     &params->bufsize, params->fd);
     } else if (params->version == 2) {
         status = LoadSrcTgtVersion2(&params->cpos, &tgt, &blocks, &params->buffer,
-                    &params->bufsize, params->fd, params->stashbase, NULL);
+                    &params->bufsize, params->fd, &params->stashes, NULL);
     } else if (params->version >= 3) {
         status = LoadSrcTgtVersion3(params, &tgt, &blocks, 1, &overlap);
     }
@@ -1144,7 +1377,8 @@ static int PerformCommandMove(CommandParameters* params) {
         if (status == 0) {
             fprintf(stderr, "  moving %d blocks\n", blocks);
 
-            if (WriteBlocks(tgt, params->buffer, params->fd) == -1) {
+            if (PersistStashes(&params->stashes, tgt) == -1 ||
+                    WriteBlocks(tgt, params->buffer, params->fd) == -1) {
                 goto pcmout;
             }
         } else {
@@ -1174,7 +1408,7 @@ static int PerformCommandStash(CommandParameters* params) {
         return -1;
     }
 
-    return SaveStash(params->stashbase, &params->cpos, &params->buffer, &params->bufsize,
+    return SaveStash(&params->stashes, &params->cpos, &params->buffer, &params->bufsize,
                 params->fd, (params->version >= 3), &params->isunresumable);
 }
 
@@ -1183,17 +1417,16 @@ static int PerformCommandFree(CommandParameters* params) {
         return -1;
     }
 
-    if (params->createdstash || params->canwrite) {
-        return FreeStash(params->stashbase, params->cpos);
-    }
-
-    return 0;
+    return DropStash(&params->stashes, params->cpos,
+                params->createdstash || params->canwrite);
 }
 
 static int PerformCommandZero(CommandParameters* params) {
     char* range = NULL;
+    int chunk;
     int i;
     int j;
+    int n;
     int rc = -1;
     RangeSet* tgt = NULL;
 
@@ -1212,17 +1445,26 @@ static int PerformCommandZero(CommandParameters* params) {
 
     fprintf(stderr, "  zeroing %d blocks\n", tgt->size);
 
-    allocate(BLOCKSIZE, &params->buffer, &params->bufsize);
-    memset(params->buffer, 0, BLOCKSIZE);
+    chunk = tgt->size < CHUNK_BLOCKS ? tgt->size : CHUNK_BLOCKS;
+
+    if (chunk < 1) {
+        chunk = 1;
+    }
+
+    allocate(chunk * BLOCKSIZE, &params->buffer, &params->bufsize);
+    memset(params->buffer, 0, chunk * BLOCKSIZE);
 
     if (params->canwrite) {
+        if (PersistStashes(&params->stashes, tgt) == -1) {
+            goto pczout;
+        }
+
         for (i = 0; i < tgt->count; ++i) {
-            if (check_lseek(params->fd, (off64_t) tgt->pos[i * 2] * BLOCKSIZE, SEEK_SET) == -1) {
-                goto pczout;
-            }
+            for (j = tgt->pos[i * 2]; j < tgt->pos[i * 2 + 1]; j += n) {
+                n = tgt->pos[i * 2 + 1] - j < chunk ? tgt->pos[i * 2 + 1] - j : chunk;
 
-            for (j = tgt->pos[i * 2]; j < tgt->pos[i * 2 + 1]; ++j) {
-                if (write_all(params->fd, params->buffer, BLOCKSIZE) == -1) {
+                if (pwrite_all(params->fd, params->buffer, (size_t) n * BLOCKSIZE,
+                        (off64_t) j * BLOCKSIZE) == -1) {
                     goto pczout;
                 }
             }
@@ -1266,24 +1508,18 @@ static int PerformCommandNew(CommandParameters* params) {
     if (params->canwrite) {
         fprintf(stderr, " writing %d blocks of new data\n", tgt->size);
 
+        if (PersistStashes(&params->stashes, tgt) == -1) {
+            goto pcnout;
+        }
+
         rss.fd = params->fd;
         rss.tgt = tgt;
         rss.p_block = 0;
         rss.p_remain = (tgt->pos[1] - tgt->pos[0]) * BLOCKSIZE;
 
-        if (check_lseek(params->fd, (off64_t) tgt->pos[0] * BLOCKSIZE, SEEK_SET) == -1) {
+        if (write_new_data(&params->nti, &rss) == -1) {
             goto pcnout;
         }
-
-        pthread_mutex_lock(&params->nti.mu);
-        params->nti.rss = &rss;
-        pthread_cond_broadcast(&params->nti.cv);
-
-        while (params->nti.rss) {
-            pthread_cond_wait(&params->nti.cv, &params->nti.mu);
-        }
-
-        pthread_mutex_unlock(&params->nti.mu);
     }
 
     params->written += tgt->size;
@@ -1338,7 +1574,7 @@ static int PerformCommandDiff(CommandParameters* params) {
                     &params->bufsize, params->fd);
     } else if (params->version == 2) {
         status = LoadSrcTgtVersion2(&params->cpos, &tgt, &blocks, &params->buffer,
-                    &params->bufsize, params->fd, params->stashbase, NULL);
+                    &params->bufsize, params->fd, &params->stashes, NULL);
     } else if (params->version >= 3) {
         status = LoadSrcTgtVersion3(params, &tgt, &blocks, 0, &overlap);
     }
@@ -1358,6 +1594,10 @@ static int PerformCommandDiff(CommandParameters* params) {
         if (status == 0) {
             fprintf(stderr, "patching %d blocks to %d\n", blocks, tgt->size);
 
+            if (PersistStashes(&params->stashes, tgt) == -1) {
+                goto pcdout;
+            }
+
             patch_value.type = VAL_BLOB;
             patch_value.size = len;
             patch_value.data = (char*) (params->patch_start + offset);
@@ -1367,10 +1607,6 @@ static int PerformCommandDiff(CommandParameters* params) {
             rss.p_block = 0;
             rss.p_remain = (tgt->pos[1] - tgt->pos[0]) * BLOCKSIZE;
 
-            if (check_lseek(params->fd, (off64_t) tgt->pos[0] * BLOCKSIZE, SEEK_SET) == -1) {
-                goto pcdout;
-            }
-
             if (params->cmdname[0] == 'i') {      // imgdiff
                 ApplyImagePatch(params->buffer, blocks * BLOCKSIZE, &patch_value,
                     &RangeSinkWrite, &rss, NULL, NULL);
@@ -1448,6 +1684,10 @@ static int PerformCommandErase(CommandParameters* params) {
     if (params->canwrite) {
         fprintf(stderr, " erasing %d blocks\n", tgt->size);
 
+        if (PersistStashes(&params->stashes, tgt) == -1) {
+            goto pceout;
+        }
+
         for (i = 0; i < tgt->count; ++i) {
             // offset in bytes
             blocks[0] = tgt->pos[i * 2] * (uint64_t) BLOCKSIZE;
@@ -1473,6 +1713,485 @@ pceout:
     return rc;
 }
 
+// Consecutive bsdiff/imgdiff commands are often independent of each
+// other: none of them reads or rewrites blocks that an earlier one
+// writes.  In version 3 and up such a run is applied as a batch.  The
+// commands load and verify their blocks in order on the main thread,
+// exactly as they would one by one; worker threads apply the patches
+// into memory as soon as a command is loaded; and the results are
+// written to the target blocks in command order.  The partition goes
+// through the same states as with serial execution, so an interrupted
+// update resumes the same way.
+//
+// A command whose own source and target overlap stashes its source
+// before writing; it isn't batched, so the stash never holds more than
+// the transfer list planned for.
+
+#define DIFF_MAX_THREADS 4
+#define DIFF_BATCH_MAX_COMMANDS 16
+// A batch holds the source and target of its commands in memory; it may
+// use this fraction of the free memory, within the limits.
+#define DIFF_BATCH_RAM_SHARE 4
+#define DIFF_BATCH_MIN_BYTES (16 << 20)
+#define DIFF_BATCH_MAX_BYTES (256 << 20)
+
+typedef struct {
+    char* line;         // the command, split up while loading
+    char* logcmd;
+    RangeSet* src;      // as parsed up front, to find dependencies
+    RangeSet* tgt;
+    int src_blocks;
+    int imgdiff;
+    size_t offset;
+    size_t len;
+    int status;         // 0: patch it, 1: already patched
+    uint8_t* buffer;    // source blocks
+    size_t bufsize;
+    char* freestash;
+    uint8_t* out;       // patched target blocks
+    size_t out_size;
+    size_t produced;
+    int done;
+} DiffJob;
+
+typedef struct {
+    DiffJob* jobs;
+    int count;
+    int loaded;         // jobs ready to be patched
+    int next;           // the next of them for a worker
+    int loading;
+    const uint8_t* patch_start;
+
+    pthread_mutex_t mu;
+    pthread_cond_t cv;
+} DiffBatch;
+
+static int diff_threads() {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus < 1) {
+        return 1;
+    }
+    return cpus > DIFF_MAX_THREADS ? DIFF_MAX_THREADS : (int) cpus;
+}
+
+static size_t diff_batch_bytes() {
+    struct sysinfo si;
+    uint64_t size = DIFF_BATCH_MIN_BYTES;
+
+    if (sysinfo(&si) == 0) {
+        size = ((uint64_t) si.freeram + si.bufferram) * si.mem_unit / DIFF_BATCH_RAM_SHARE;
+    }
+    if (size < DIFF_BATCH_MIN_BYTES) {
+        size = DIFF_BATCH_MIN_BYTES;
+    } else if (size > DIFF_BATCH_MAX_BYTES) {
+        size = DIFF_BATCH_MAX_BYTES;
+    }
+    return (size_t) size;
+}
+
+// Collects patch output like RangeSinkWrite() would write it: up to the
+// size of the target ranges.
+static ssize_t MemorySinkWrite(const uint8_t* data, ssize_t size, void* token) {
+    DiffJob* job = (DiffJob*) token;
+    size_t room = job->out_size - job->produced;
+
+    if (room == 0) {
+        fprintf(stderr, "range sink write overrun\n");
+        return 0;
+    }
+
+    if ((size_t) size > room) {
+        size = room;
+    }
+
+    memcpy(job->out + job->produced, data, size);
+    job->produced += size;
+    return size;
+}
+
+static void* diff_worker(void* cookie) {
+    DiffBatch* batch = (DiffBatch*) cookie;
+
+    for (;;) {
+        pthread_mutex_lock(&batch->mu);
+        while (batch->next == batch->loaded && batch->loading) {
+            pthread_cond_wait(&batch->cv, &batch->mu);
+        }
+        if (batch->next == batch->loaded) {
+            pthread_mutex_unlock(&batch->mu);
+            break;
+        }
+        DiffJob* job = &batch->jobs[batch->next++];
+        pthread_mutex_unlock(&batch->mu);
+
+        if (job->status == 0) {
+            Value patch_value;
+            patch_value.type = VAL_BLOB;
+            patch_value.size = job->len;
+            patch_value.data = (char*) (batch->patch_start + job->offset);
+
+            if (job->imgdiff) {
+                ApplyImagePatch(job->buffer, job->src_blocks * BLOCKSIZE, &patch_value,
+                    &MemorySinkWrite, job, NULL, NULL);
+            } else {
+                ApplyBSDiffPatch(job->buffer, job->src_blocks * BLOCKSIZE, &patch_value,
+                    0, &MemorySinkWrite, job, NULL);
+            }
+        }
+
+        pthread_mutex_lock(&batch->mu);
+        job->done = 1;
+        pthread_cond_broadcast(&batch->cv);
+        pthread_mutex_unlock(&batch->mu);
+    }
+
+    return NULL;
+}
+
+// Finds the blocks a version 3 diff command reads and writes, without
+// touching the command.  src is NULL if it only uses stashes.
+static int ParseDiffRanges(const char* line, RangeSet** src, RangeSet** tgt,
+                           int* src_blocks) {
+    char* copy = strdup(line);
+    char* save = NULL;
+    char* word = NULL;
+    int i;
+
+    *src = NULL;
+    *tgt = NULL;
+
+    if (copy == NULL) {
+        return -1;
+    }
+
+    // cmd offset len srchash tgthash tgt src_blocks src|- ...
+    word = strtok_r(copy, " ", &save);
+    for (i = 1; word != NULL && i <= 5; ++i) {
+        word = strtok_r(NULL, " ", &save);
+    }
+    if (word == NULL) {
+        goto pdrout;
+    }
+    *tgt = parse_range(word);
+
+    word = strtok_r(NULL, " ", &save);
+    if (word == NULL) {
+        goto pdrout;
+    }
+    *src_blocks = strtol(word, NULL, 0);
+
+    word = strtok_r(NULL, " ", &save);
+    if (word == NULL) {
+        goto pdrout;
+    }
+    if (!(word[0] == '-' && word[1] == '\0')) {
+        *src = parse_range(word);
+    }
+
+    free(copy);
+    return 0;
+
+pdrout:
+    free(copy);
+    free(*tgt);
+    *tgt = NULL;
+    return -1;
+}
+
+static int IsDiffCommand(const char* line) {
+    return strncmp(line, "bsdiff ", 7) == 0 || strncmp(line, "imgdiff ", 8) == 0;
+}
+
+// Whether the command in job can be in a batch with the first n jobs.
+static int CanBatch(const DiffJob* jobs, int n, const DiffJob* job) {
+    int i;
+
+    if (job->src && range_overlaps(job->src, job->tgt)) {
+        return 0;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (range_overlaps(jobs[i].tgt, job->tgt) ||
+                (job->src && range_overlaps(jobs[i].tgt, job->src))) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Does the load part of PerformCommandDiff() for a batched command.
+static int LoadDiffJob(CommandParameters* params, DiffJob* job) {
+    char* value;
+    int overlap = 0;
+    int status;
+    RangeSet* tgt = NULL;
+    uint8_t* buffer = params->buffer;
+    size_t bufsize = params->bufsize;
+
+    params->cmdname = strtok_r(job->line, " ", &params->cpos);
+    job->imgdiff = params->cmdname[0] == 'i';
+
+    value = strtok_r(NULL, " ", &params->cpos);
+    job->offset = strtoul(value, NULL, 0);
+    value = strtok_r(NULL, " ", &params->cpos);
+    job->len = strtoul(value, NULL, 0);
+
+    // The job keeps its source blocks until they're patched.
+    params->buffer = NULL;
+    params->bufsize = 0;
+    status = LoadSrcTgtVersion3(params, &tgt, &job->src_blocks, 0, &overlap);
+    job->buffer = params->buffer;
+    job->bufsize = params->bufsize;
+    params->buffer = buffer;
+    params->bufsize = bufsize;
+
+    job->freestash = params->freestash;
+    params->freestash = NULL;
+
+    if (tgt) {
+        free(tgt);
+    }
+
+    if (status == -1) {
+        fprintf(stderr, "failed to read blocks for diff\n");
+        return -1;
+    }
+
+    if (status == 0) {
+        params->foundwrites = 1;
+    } else if (params->foundwrites) {
+        fprintf(stderr, "warning: commands executed out of order [%s]\n", params->cmdname);
+    }
+
+    job->status = status;
+
+    if (status == 0) {
+        job->out_size = (size_t) job->tgt->size * BLOCKSIZE;
+        job->out = malloc(job->out_size);
+
+        if (job->out == NULL) {
+            fprintf(stderr, "failed to allocate %zu bytes\n", job->out_size);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Does the write part of PerformCommandDiff() for a batched command.
+static int CommitDiffJob(CommandParameters* params, DiffJob* job) {
+    RangeSinkState rss;
+
+    if (job->status == 0) {
+        fprintf(stderr, "patching %d blocks to %d\n", job->src_blocks, job->tgt->size);
+
+        if (PersistStashes(&params->stashes, job->tgt) == -1) {
+            return -1;
+        }
+
+        rss.fd = params->fd;
+        rss.tgt = job->tgt;
+        rss.p_block = 0;
+        rss.p_remain = (job->tgt->pos[1] - job->tgt->pos[0]) * BLOCKSIZE;
+
+        if (job->produced > 0) {
+            RangeSinkWrite(job->out, job->produced, &rss);
+        }
+
+        // We expect the output of the patcher to fill the tgt ranges exactly.
+        if (rss.p_block != job->tgt->count || rss.p_remain != 0) {
+            fprintf(stderr, "range sink underrun?\n");
+        }
+    } else {
+        fprintf(stderr, "skipping %d blocks already patched to %d [%s]\n",
+            job->src_blocks, job->tgt->size, strchr(job->logcmd, ' ') + 1);
+    }
+
+    if (job->freestash) {
+        FreeStash(params->stashbase, job->freestash);
+        job->freestash = NULL;
+    }
+
+    params->written += job->tgt->size;
+    return 0;
+}
+
+static void FreeDiffJob(DiffJob* job) {
+    free(job->line);
+    free(job->logcmd);
+    free(job->src);
+    free(job->tgt);
+    free(job->buffer);
+    free(job->out);
+}
+
+// Adds the command in line to the batch if it can be patched along with
+// the commands already in it.  Returns 1 if it was added.
+static int AddDiffJob(CommandParameters* params, DiffJob* jobs, int count, size_t* bytes,
+                      const char* line, size_t linelen) {
+    DiffJob* job = &jobs[count];
+    size_t size;
+
+    memset(job, 0, sizeof(DiffJob));
+    job->line = strndup(line, linelen);
+
+    if (job->line == NULL || !IsDiffCommand(job->line) ||
+            ParseDiffRanges(job->line, &job->src, &job->tgt, &job->src_blocks) == -1) {
+        goto adjfail;
+    }
+
+    size = ((size_t) job->src_blocks + job->tgt->size) * BLOCKSIZE;
+
+    if ((count > 0 && *bytes + size > params->batchbytes) || !CanBatch(jobs, count, job)) {
+        goto adjfail;
+    }
+
+    job->logcmd = strdup(job->line);
+
+    if (job->logcmd == NULL) {
+        goto adjfail;
+    }
+
+    *bytes += size;
+    return 1;
+
+adjfail:
+    FreeDiffJob(job);
+    return 0;
+}
+
+// Runs the diff command in line and as many of the commands after it as
+// can go along in a batch, consuming their lines.  Returns 1 if line
+// isn't worth a batch and should run on its own.
+static int PerformDiffBatch(CommandParameters* params, char* line, char** linesave,
+                            FILE* cmd_pipe, int total_blocks) {
+    DiffBatch batch;
+    DiffJob jobs[DIFF_BATCH_MAX_COMMANDS];
+    pthread_t threads[DIFF_MAX_THREADS];
+    size_t bytes = 0;
+    int count = 0;
+    int nthreads = 0;
+    int failed = -1;
+    int rc = -1;
+    int i;
+
+    if (!AddDiffJob(params, jobs, 0, &bytes, line, strlen(line))) {
+        return 1;
+    }
+    count = 1;
+
+    // Look at the next lines without splitting them off the list.
+    while (count < DIFF_BATCH_MAX_COMMANDS) {
+        char* next = *linesave;
+
+        if (next == NULL) {
+            break;
+        }
+
+        next += strspn(next, "\n");
+        size_t len = strcspn(next, "\n");
+
+        if (len == 0 || !AddDiffJob(params, jobs, count, &bytes, next, len)) {
+            break;
+        }
+
+        strtok_r(NULL, "\n", linesave);
+        ++count;
+    }
+
+    if (count == 1) {
+        FreeDiffJob(&jobs[0]);
+        return 1;
+    }
+
+    fprintf(stderr, "patching %d independent commands on %d threads\n", count,
+        count < params->patchthreads ? count : params->patchthreads);
+
+    memset(&batch, 0, sizeof(batch));
+    batch.jobs = jobs;
+    batch.count = count;
+    batch.loading = 1;
+    batch.patch_start = params->patch_start;
+    pthread_mutex_init(&batch.mu, NULL);
+    pthread_cond_init(&batch.cv, NULL);
+
+    for (i = 0; i < count && i < params->patchthreads; ++i) {
+        if (pthread_create(&threads[nthreads], NULL, diff_worker, &batch) == 0) {
+            ++nthreads;
+        }
+    }
+
+    // Load in order; each command can be patched as soon as it's loaded.
+    for (i = 0; i < count; ++i) {
+        if (LoadDiffJob(params, &jobs[i]) == -1) {
+            failed = i;
+            break;
+        }
+
+        pthread_mutex_lock(&batch.mu);
+        batch.loaded = i + 1;
+        pthread_cond_broadcast(&batch.cv);
+        pthread_mutex_unlock(&batch.mu);
+    }
+
+    pthread_mutex_lock(&batch.mu);
+    batch.loading = 0;
+    pthread_cond_broadcast(&batch.cv);
+    pthread_mutex_unlock(&batch.mu);
+
+    if (nthreads == 0) {
+        diff_worker(&batch);
+    }
+
+    // Write in order, each as soon as it's patched, like the serial loop
+    // would have.
+    for (i = 0; i < batch.loaded; ++i) {
+        pthread_mutex_lock(&batch.mu);
+        while (!jobs[i].done) {
+            pthread_cond_wait(&batch.cv, &batch.mu);
+        }
+        pthread_mutex_unlock(&batch.mu);
+
+        if (CommitDiffJob(params, &jobs[i]) == -1) {
+            failed = i;
+            break;
+        }
+
+        if (fsync(params->fd) == -1) {
+            fprintf(stderr, "fsync failed: %s\n", strerror(errno));
+            goto pdbout;
+        }
+        fprintf(cmd_pipe, "set_progress %.4f\n", (double) params->written / total_blocks);
+        fflush(cmd_pipe);
+    }
+
+    if (failed == -1) {
+        rc = 0;
+    }
+
+pdbout:
+    if (failed != -1) {
+        fprintf(stderr, "failed to execute command [%s]\n", jobs[failed].logcmd);
+    }
+
+    // Workers only pick up loaded jobs and all of them are patched or
+    // being patched by now.
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&batch.mu);
+    pthread_cond_destroy(&batch.cv);
+
+    for (i = 0; i < count; ++i) {
+        FreeDiffJob(&jobs[i]);
+    }
+
+    return rc;
+}
+
 // Definitions for transfer list command functions
 typedef int (*CommandFunction)(CommandParameters*);
 
@@ -1503,6 +2222,16 @@ static unsigned int HashString(const char *s) {
     return hash;
 }
 
+static int block_io_depth() {
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get(BLOCK_IO_DEPTH_PROPERTY, value, "");
+    if (value[0] == '\0') {
+        return BLOCK_IO_DEFAULT_DEPTH;
+    }
+    return atoi(value);
+}
+
 // args:
 //    - block device (or file) to modify in-place
 //    - transfer list (blob)
@@ -1527,6 +2256,7 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int argc,
     int rc = -1;
     int stash_max_blocks = 0;
     int total_blocks = 0;
+    off64_t patch_offset;
     pthread_attr_t attr;
     unsigned int cmdhash;
     UpdaterInfo* ui = NULL;
@@ -1583,7 +2313,13 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int argc,
         goto pbiudone;
     }
 
-    params.patch_start = ui->package_zip_addr + mzGetZipEntryOffset(patch_entry);
+    patch_offset = mzGetZipEntryOffset(za, patch_entry);
+
+    if (patch_offset < 0) {
+        goto pbiudone;
+    }
+
+    params.patch_start = ui->package_zip_addr + patch_offset;
     new_entry = mzFindZipEntry(za, new_data_fn->data);
 
     if (new_entry == NULL) {
@@ -1598,9 +2334,20 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int argc,
         goto pbiudone;
     }
 
+    BlockIoSetup(blockdev_filename->data, params.fd, block_io_depth());
+
     if (params.canwrite) {
         params.nti.za = za;
         params.nti.entry = new_entry;
+        params.nti.ring_size = new_data_ring_size();
+        params.nti.ring = malloc(params.nti.ring_size);
+
+        if (params.nti.ring == NULL) {
+            fprintf(stderr, "failed to allocate %zu bytes for new data\n", params.nti.ring_size);
+            goto pbiudone;
+        }
+
+        fprintf(stderr, "new data is expanded up to %zu bytes ahead\n", params.nti.ring_size);
 
         pthread_mutex_init(&params.nti.mu, NULL);
         pthread_cond_init(&params.nti.cv, NULL);
@@ -1612,6 +2359,11 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int argc,
             fprintf(stderr, "pthread_create failed: %s\n", strerror(error));
             goto pbiudone;
         }
+
+        params.threadstarted = 1;
+
+        params.patchthreads = diff_threads();
+        params.batchbytes = diff_batch_bytes();
     }
 
     // The data in transfer_list_value is not necessarily null-terminated, so we need
@@ -1673,6 +2425,8 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int argc,
             }
 
             params.createdstash = res;
+            params.stashes.base = params.stashbase;
+            params.stashes.limit = stash_memory_limit(stash_max_blocks);
         }
     }
 
@@ -1688,6 +2442,17 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int argc,
     for (line = strtok_r(NULL, "\n", &linesave); line;
          line = strtok_r(NULL, "\n", &linesave)) {
 
+        if (params.canwrite && params.version >= 3 && params.patchthreads > 1 &&
+                IsDiffCommand(line)) {
+            res = PerformDiffBatch(&params, line, &linesave, cmd_pipe, total_blocks);
+
+            if (res == -1) {
+                goto pbiudone;
+            } else if (res == 0) {
+                continue;
+            }
+        }
+
         logcmd = strdup(line);
         params.cmdname = strtok_r(line, " ", &params.cpos);
 
@@ -1727,7 +2492,8 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int argc,
     }
 
     if (params.canwrite) {
-        pthread_join(params.thread, NULL);
+        stop_new_data(&params.nti, params.thread);
+        params.threadstarted = 0;
 
         fprintf(stderr, "wrote %d blocks; expected %d\n", params.written, total_blocks);
         fprintf(stderr, "max alloc needed was %zu\n", params.bufsize);
@@ -1742,6 +2508,17 @@ static Value* PerformBlockImageUpdate(const char* name, State* state, int argc,
     rc = 0;
 
 pbiudone:
+    if (params.threadstarted) {
+        stop_new_data(&params.nti, params.thread);
+    }
+
+    if (params.nti.ring) {
+        free(params.nti.ring);
+    }
+
+    BlockIoTeardown();
+    FreeStashStore(&params.stashes);
+
     if (params.fd != -1) {
         if (fsync(params.fd) == -1) {
             fprintf(stderr, "fsync failed: %s\n", strerror(errno));
@@ -1885,6 +2662,7 @@ Value* RangeSha1Fn(const char* name, State* state, int argc, Expr* argv[]) {
     Value* blockdev_filename;
     Value* ranges;
     const uint8_t* digest = NULL;
+    uint8_t* buffer = NULL;
     if (ReadValueArgs(state, argv, 2, &blockdev_filename, &ranges) < 0) {
         return NULL;
     }
@@ -1905,33 +2683,35 @@ Value* RangeSha1Fn(const char* name, State* state, int argc, Expr* argv[]) {
     }
 
     RangeSet* rs = parse_range(ranges->data);
-    uint8_t buffer[BLOCKSIZE];
+    buffer = malloc(CHUNK_BLOCKS * BLOCKSIZE);
+
+    if (buffer == NULL) {
+        ErrorAbort(state, "failed to allocate %d bytes", CHUNK_BLOCKS * BLOCKSIZE);
+        goto done;
+    }
 
     SHA_CTX ctx;
     SHA_init(&ctx);
 
-    int i, j;
+    int i, j, n;
     for (i = 0; i < rs->count; ++i) {
-        if (check_lseek(fd, (off64_t)rs->pos[i*2] * BLOCKSIZE, SEEK_SET) == -1) {
-            ErrorAbort(state, "failed to seek %s: %s", blockdev_filename->data,
-                strerror(errno));
-            goto done;
-        }
+        for (j = rs->pos[i*2]; j < rs->pos[i*2+1]; j += n) {
+            n = rs->pos[i*2+1] - j < CHUNK_BLOCKS ? rs->pos[i*2+1] - j : CHUNK_BLOCKS;
 
-        for (j = rs->pos[i*2]; j < rs->pos[i*2+1]; ++j) {
-            if (read_all(fd, buffer, BLOCKSIZE) == -1) {
+            if (pread_all(fd, buffer, (size_t) n * BLOCKSIZE, (off64_t) j * BLOCKSIZE) == -1) {
                 ErrorAbort(state, "failed to read %s: %s", blockdev_filename->data,
                     strerror(errno));
                 goto done;
             }
 
-            SHA_update(&ctx, buffer, BLOCKSIZE);
+            SHA_update(&ctx, buffer, n * BLOCKSIZE);
         }
     }
     digest = SHA_final(&ctx);
     close(fd);
 
 done:
+    free(buffer);
     FreeValue(blockdev_filename);
     FreeValue(ranges);
     if (digest == NULL) {
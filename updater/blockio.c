@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_AIO
+#include <fcntl.h>
+#include <linux/aio_abi.h>
+#include <sys/syscall.h>
+#endif
+
+#include "blockio.h"
+
+// A piece of a RangeSet that is contiguous on the device: one or more
+// ranges that touch.
+typedef struct {
+    const RangeSet* rs;
+    int i;              // the next range
+    size_t p;           // where its data is in the buffer
+} RunCursor;
+
+static int NextRun(RunCursor* c, off64_t* offset, size_t* size, size_t* p) {
+    int start, end;
+
+    if (c->i >= c->rs->count) {
+        return 0;
+    }
+
+    start = c->rs->pos[c->i * 2];
+    end = c->rs->pos[c->i * 2 + 1];
+    ++c->i;
+
+    while (c->i < c->rs->count && c->rs->pos[c->i * 2] == end) {
+        end = c->rs->pos[c->i * 2 + 1];
+        ++c->i;
+    }
+
+    *offset = (off64_t) start * BLOCKSIZE;
+    *size = (size_t) (end - start) * BLOCKSIZE;
+    *p = c->p;
+    c->p += *size;
+    return 1;
+}
+
+uint8_t* AllocateBlocks(size_t size) {
+    void* p;
+
+    if (posix_memalign(&p, BLOCKSIZE, size) != 0) {
+        return NULL;
+    }
+    return (uint8_t*) p;
+}
+
+int pread_all(int fd, uint8_t* data, size_t size, off64_t offset) {
+    size_t so_far = 0;
+
+    while (so_far < size) {
+        ssize_t r = TEMP_FAILURE_RETRY(pread64(fd, data + so_far, size - so_far,
+                                               offset + so_far));
+        if (r < 0) {
+            fprintf(stderr, "read failed: %s\n", strerror(errno));
+            return -1;
+        } else if (r == 0) {
+            fprintf(stderr, "read failed: unexpected end of file\n");
+            return -1;
+        }
+        so_far += r;
+    }
+
+    return 0;
+}
+
+int pwrite_all(int fd, const uint8_t* data, size_t size, off64_t offset) {
+    size_t written = 0;
+
+    while (written < size) {
+        ssize_t w = TEMP_FAILURE_RETRY(pwrite64(fd, data + written, size - written,
+                                                offset + written));
+        if (w < 0) {
+            fprintf(stderr, "write failed: %s\n", strerror(errno));
+            return -1;
+        }
+        written += w;
+    }
+
+    return 0;
+}
+
+static int TransferRun(int fd, uint8_t* data, size_t size, off64_t offset, int write) {
+    if (write) {
+        return pwrite_all(fd, data, size, offset);
+    }
+    return pread_all(fd, data, size, offset);
+}
+
+#ifdef HAVE_LINUX_AIO
+
+static aio_context_t aio_ctx;
+static int aio_depth;
+static int aio_fd = -1;         // the device again, O_DIRECT
+static int aio_buffered_fd = -1;
+
+int BlockIoSetup(const char* device, int fd, int depth) {
+    if (depth > BLOCK_IO_MAX_DEPTH) {
+        depth = BLOCK_IO_MAX_DEPTH;
+    }
+
+    if (aio_depth == 0 && depth > 1) {
+        // On a buffered fd io_submit() does the I/O before it returns, so
+        // nothing would be in flight; only O_DIRECT makes it asynchronous.
+        aio_fd = TEMP_FAILURE_RETRY(open(device, O_RDONLY | O_DIRECT));
+        aio_ctx = 0;
+
+        if (aio_fd == -1) {
+            fprintf(stderr, "can't open %s with O_DIRECT: %s; using pread/pwrite\n", device,
+                strerror(errno));
+        } else if (syscall(__NR_io_setup, depth, &aio_ctx) == 0) {
+            aio_depth = depth;
+            aio_buffered_fd = fd;
+        } else {
+            fprintf(stderr, "io_setup failed: %s; using pread/pwrite\n", strerror(errno));
+            close(aio_fd);
+            aio_fd = -1;
+        }
+    }
+
+    return aio_depth;
+}
+
+void BlockIoTeardown() {
+    if (aio_depth > 0) {
+        syscall(__NR_io_destroy, aio_ctx);
+        close(aio_fd);
+        aio_fd = -1;
+        aio_buffered_fd = -1;
+        aio_depth = 0;
+    }
+}
+
+// Reads the runs of rs through the O_DIRECT fd in batches of up to
+// aio_depth requests.  A request the kernel doesn't take, or finishes
+// short, is completed with pread on the buffered fd.  Direct reads write
+// back dirty cached blocks first, so they see what was written through
+// the buffered fd.
+static int AioReadBlocks(const RangeSet* rs, uint8_t* buffer, int fd) {
+    struct iocb cbs[BLOCK_IO_MAX_DEPTH];
+    struct iocb* list[BLOCK_IO_MAX_DEPTH];
+    struct io_event events[BLOCK_IO_MAX_DEPTH];
+    RunCursor c = { rs, 0, 0 };
+    off64_t offset;
+    size_t size, p;
+    int rc = 0;
+    int n, i, submitted, reaped;
+    long r;
+
+    for (;;) {
+        for (n = 0; n < aio_depth && NextRun(&c, &offset, &size, &p); ++n) {
+            memset(&cbs[n], 0, sizeof(struct iocb));
+            cbs[n].aio_fildes = aio_fd;
+            cbs[n].aio_lio_opcode = IOCB_CMD_PREAD;
+            cbs[n].aio_buf = (uint64_t) (uintptr_t) (buffer + p);
+            cbs[n].aio_nbytes = size;
+            cbs[n].aio_offset = offset;
+            list[n] = &cbs[n];
+        }
+
+        if (n == 0) {
+            return rc;
+        }
+
+        submitted = 0;
+
+        while (submitted < n) {
+            r = syscall(__NR_io_submit, aio_ctx, n - submitted, list + submitted);
+
+            if (r < 0 && errno == EINTR) {
+                continue;
+            } else if (r <= 0) {
+                break;
+            }
+
+            submitted += r;
+        }
+
+        for (i = submitted; i < n; ++i) {
+            if (pread_all(fd, (uint8_t*) (uintptr_t) cbs[i].aio_buf, cbs[i].aio_nbytes,
+                    cbs[i].aio_offset) == -1) {
+                rc = -1;
+            }
+        }
+
+        for (reaped = 0; reaped < submitted; ) {
+            r = syscall(__NR_io_getevents, aio_ctx, 1, submitted - reaped, events, NULL);
+
+            if (r < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // The requests still in flight use the buffer; io_destroy()
+                // waits for them before it returns. Later I/O goes through
+                // pread.
+                fprintf(stderr, "io_getevents failed: %s\n", strerror(errno));
+                BlockIoTeardown();
+                return -1;
+            }
+
+            for (i = 0; i < r; ++i) {
+                struct iocb* cb = (struct iocb*) (uintptr_t) events[i].obj;
+                int64_t res = events[i].res;
+
+                if (res < 0) {
+                    fprintf(stderr, "read failed: %s\n", strerror(-res));
+                    rc = -1;
+                } else if ((uint64_t) res < cb->aio_nbytes &&
+                        pread_all(fd, (uint8_t*) (uintptr_t) (cb->aio_buf + res),
+                            cb->aio_nbytes - res, cb->aio_offset + res) == -1) {
+                    rc = -1;
+                }
+            }
+
+            reaped += r;
+        }
+
+        if (rc == -1) {
+            return -1;
+        }
+    }
+}
+
+#else
+
+int BlockIoSetup(const char* device, int fd, int depth) {
+    return 0;
+}
+
+void BlockIoTeardown() {
+}
+
+#endif
+
+static int TransferBlocks(const RangeSet* rs, uint8_t* buffer, int fd, int write) {
+    RunCursor c = { rs, 0, 0 };
+    off64_t offset;
+    size_t size, p;
+
+    if (!rs || !buffer) {
+        return -1;
+    }
+
+#ifdef HAVE_LINUX_AIO
+    // O_DIRECT needs block aligned buffers; offsets and sizes always are
+    if (aio_depth > 0 && !write && fd == aio_buffered_fd && rs->count > 1 &&
+            ((uintptr_t) buffer % BLOCKSIZE) == 0) {
+        return AioReadBlocks(rs, buffer, fd);
+    }
+#endif
+
+    while (NextRun(&c, &offset, &size, &p)) {
+        if (TransferRun(fd, buffer + p, size, offset, write) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int ReadBlocks(const RangeSet* src, uint8_t* buffer, int fd) {
+    return TransferBlocks(src, buffer, fd, 0);
+}
+
+int WriteBlocks(const RangeSet* tgt, const uint8_t* buffer, int fd) {
+    return TransferBlocks(tgt, (uint8_t*) buffer, fd, 1);
+}
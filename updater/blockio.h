@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_BLOCKIO_H_
+#define _UPDATER_BLOCKIO_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Block I/O for block_image_update() and friends. All of it goes through
+// pread()/pwrite() at explicit offsets, so nothing depends on the file
+// position and no lseek() is needed. Ranges of a RangeSet that touch are
+// merged into one request. With Linux AIO (HAVE_LINUX_AIO) the reads of
+// a RangeSet from the device given to BlockIoSetup() are submitted
+// together through an O_DIRECT fd, up to its queue depth, when the
+// buffer is block aligned (see AllocateBlocks()). Writes stay buffered.
+
+#define BLOCKSIZE 4096
+
+typedef struct {
+    int count;
+    int size;
+    int pos[0];
+} RangeSet;
+
+// Number of AIO requests in flight (default 32, 0 to turn AIO off).
+#define BLOCK_IO_DEPTH_PROPERTY "ro.ctr.block_io_depth"
+#define BLOCK_IO_DEFAULT_DEPTH 32
+#define BLOCK_IO_MAX_DEPTH 256
+
+// Sets up AIO reads of device, which is open as fd. The context is
+// shared, so block I/O must come from one thread at a time. Depth 0 (or
+// a kernel without AIO, or a device that can't be opened O_DIRECT)
+// keeps plain pread()/pwrite(). Returns the depth in use.
+int BlockIoSetup(const char* device, int fd, int depth);
+void BlockIoTeardown();
+
+// Allocates a buffer AIO can read into; free() it.
+uint8_t* AllocateBlocks(size_t size);
+
+int pread_all(int fd, uint8_t* data, size_t size, off64_t offset);
+int pwrite_all(int fd, const uint8_t* data, size_t size, off64_t offset);
+
+// Reads the blocks of src into buffer, one after another.
+int ReadBlocks(const RangeSet* src, uint8_t* buffer, int fd);
+
+// Writes buffer to the blocks of tgt.
+int WriteBlocks(const RangeSet* tgt, const uint8_t* buffer, int fd);
+
+#endif
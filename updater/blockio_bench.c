@@ -0,0 +1,287 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Replays the block I/O of a transfer list against a block device (a
+// loop device over a copy of the image is the usual choice): the source
+// and, for version 3, target reads of every command and, with -w, its
+// target writes. Each pass runs with an lseek() and read()/write() per
+// range as block_image_update() used to, then with merged pread/pwrite,
+// then with AIO reads through an O_DIRECT fd if the build has it (writes
+// stay pwrite). The page cache is dropped before every pass.
+//
+//   blockio_bench <transfer.list> <device> [-n <rounds>] [-d <aio depth>] [-w]
+//
+// -w overwrites the target blocks with junk; never point it at a device
+// whose contents matter.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "blockio.h"
+
+typedef struct {
+    RangeSet* rs;
+    int write;
+} Transfer;
+
+static Transfer* transfers;
+static int transfer_count;
+static int transfer_alloc;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static RangeSet* parse_range(const char* text) {
+    char* copy = strdup(text);
+    char* save;
+    int num, i;
+
+    num = strtol(strtok_r(copy, ",", &save), NULL, 0);
+    RangeSet* out = malloc(sizeof(RangeSet) + num * sizeof(int));
+    out->count = num / 2;
+    out->size = 0;
+    for (i = 0; i < num; ++i) {
+        out->pos[i] = strtol(strtok_r(NULL, ",", &save), NULL, 0);
+        out->size += (i % 2) ? out->pos[i] : -out->pos[i];
+    }
+    free(copy);
+    return out;
+}
+
+static void add_transfer(const char* range, int write) {
+    if (range == NULL || (range[0] == '-' && range[1] == '\0')) {
+        return;
+    }
+    if (transfer_count == transfer_alloc) {
+        transfer_alloc = transfer_alloc ? transfer_alloc * 2 : 1024;
+        transfers = realloc(transfers, transfer_alloc * sizeof(Transfer));
+    }
+    transfers[transfer_count].rs = parse_range(range);
+    transfers[transfer_count].write = write;
+    ++transfer_count;
+}
+
+static int load_transfer_list(const char* fn) {
+    char line[64 * 1024];
+    char* word[8];
+    char* save;
+    int version, n, i;
+    FILE* f = fopen(fn, "r");
+
+    if (f == NULL) {
+        fprintf(stderr, "can't open %s: %s\n", fn, strerror(errno));
+        return -1;
+    }
+    if (fgets(line, sizeof(line), f) == NULL) {
+        fclose(f);
+        return -1;
+    }
+    version = atoi(line);
+    // total blocks, and for version 2+ the stash sizes
+    for (i = 0; i < (version >= 2 ? 3 : 1); ++i) {
+        if (fgets(line, sizeof(line), f) == NULL) {
+            fclose(f);
+            return -1;
+        }
+    }
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        n = 0;
+        for (char* w = strtok_r(line, " ", &save); w != NULL && n < 8;
+                w = strtok_r(NULL, " ", &save)) {
+            word[n++] = w;
+        }
+        if (n < 2) {
+            continue;
+        }
+
+        if (strcmp(word[0], "new") == 0 || strcmp(word[0], "zero") == 0) {
+            add_transfer(word[1], 1);
+        } else if (strcmp(word[0], "stash") == 0 && n >= 3) {
+            add_transfer(word[2], 0);
+        } else if (strcmp(word[0], "move") == 0 || strcmp(word[0], "bsdiff") == 0 ||
+                strcmp(word[0], "imgdiff") == 0) {
+            // skip the patch offset and length, then the hashes
+            i = word[0][0] == 'm' ? 1 : 3;
+            if (version >= 3) {
+                i += word[0][0] == 'm' ? 1 : 2;
+            }
+            if (version == 1 && i + 1 < n) {
+                add_transfer(word[i], 0);           // src tgt
+                add_transfer(word[i + 1], 1);
+            } else if (i + 2 < n) {
+                add_transfer(word[i + 2], 0);       // tgt src_blocks src
+                if (version >= 3) {
+                    add_transfer(word[i], 0);       // checked before it's written
+                }
+                add_transfer(word[i], 1);
+            }
+        }
+    }
+
+    fclose(f);
+    return 0;
+}
+
+static int seek_transfer(int fd, const Transfer* t, uint8_t* buffer) {
+    size_t p = 0;
+    int i;
+
+    for (i = 0; i < t->rs->count; ++i) {
+        size_t size = (size_t) (t->rs->pos[i * 2 + 1] - t->rs->pos[i * 2]) * BLOCKSIZE;
+        ssize_t r;
+
+        if (lseek64(fd, (off64_t) t->rs->pos[i * 2] * BLOCKSIZE, SEEK_SET) < 0) {
+            return -1;
+        }
+        r = t->write ? write(fd, buffer + p, size) : read(fd, buffer + p, size);
+        if (r != (ssize_t) size) {
+            return -1;
+        }
+        p += size;
+    }
+    return 0;
+}
+
+static int run(const char* what, int fd, uint8_t* buffer, int rounds, int mode) {
+    double start, elapsed = 0;
+    long long bytes = 0;
+    int round, i, rc;
+
+    for (round = 0; round < rounds; ++round) {
+        fsync(fd);
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+        start = now();
+        for (i = 0; i < transfer_count; ++i) {
+            const Transfer* t = &transfers[i];
+
+            if (mode == 0) {
+                rc = seek_transfer(fd, t, buffer);
+            } else if (t->write) {
+                rc = WriteBlocks(t->rs, buffer, fd);
+            } else {
+                rc = ReadBlocks(t->rs, buffer, fd);
+            }
+            if (rc == -1) {
+                fprintf(stderr, "%s: transfer %d failed\n", what, i);
+                return -1;
+            }
+            bytes += (long long) t->rs->size * BLOCKSIZE;
+        }
+        fsync(fd);
+        elapsed += now() - start;
+    }
+
+    printf("  %-24s %8.3f s %8.1f MB/s\n", what, elapsed / rounds,
+           bytes / elapsed / (1024 * 1024));
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int rounds = 3;
+    int depth = BLOCK_IO_DEFAULT_DEPTH;
+    int writes = 0;
+    int max_blocks = 0;
+    int ranges = 0;
+    int runs = 0;
+    int i, j, fd;
+    uint8_t* buffer;
+    char what[32];
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <transfer.list> <device> [-n <rounds>] [-d <aio depth>] [-w]\n",
+                argv[0]);
+        return 2;
+    }
+    for (i = 3; i < argc; ++i) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            depth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0) {
+            writes = 1;
+        }
+    }
+    if (rounds < 1) {
+        rounds = 1;
+    }
+
+    if (load_transfer_list(argv[1]) == -1) {
+        fprintf(stderr, "can't parse %s\n", argv[1]);
+        return 1;
+    }
+
+    // without -w only the reads are replayed
+    for (i = 0, j = 0; i < transfer_count; ++i) {
+        if (transfers[i].write && !writes) {
+            free(transfers[i].rs);
+            continue;
+        }
+        transfers[j++] = transfers[i];
+    }
+    transfer_count = j;
+
+    for (i = 0; i < transfer_count; ++i) {
+        const RangeSet* rs = transfers[i].rs;
+        if (rs->size > max_blocks) {
+            max_blocks = rs->size;
+        }
+        ranges += rs->count;
+        for (j = 0; j < rs->count; ++j) {
+            if (j == 0 || rs->pos[j * 2] != rs->pos[j * 2 - 1]) {
+                ++runs;
+            }
+        }
+    }
+
+    fd = open(argv[2], writes ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "can't open %s: %s\n", argv[2], strerror(errno));
+        return 1;
+    }
+    buffer = AllocateBlocks((size_t) max_blocks * BLOCKSIZE + BLOCKSIZE);
+    memset(buffer, 0x5a, (size_t) max_blocks * BLOCKSIZE + BLOCKSIZE);
+
+    printf("%d transfers, %d ranges, %d after merging, %s\n", transfer_count, ranges, runs,
+           writes ? "reads and writes" : "reads only");
+
+    if (run("lseek + read/write", fd, buffer, rounds, 0) == -1 ||
+            run("pread/pwrite", fd, buffer, rounds, 1) == -1) {
+        return 1;
+    }
+    depth = BlockIoSetup(argv[2], fd, depth);
+    if (depth > 0) {
+        snprintf(what, sizeof(what), "aio, depth %d", depth);
+        if (run(what, fd, buffer, rounds, 1) == -1) {
+            return 1;
+        }
+        BlockIoTeardown();
+    }
+
+    close(fd);
+    return 0;
+}
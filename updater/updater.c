@@ -81,6 +81,11 @@ int main(int argc, char** argv) {
                argv[3], strerror(err));
         return 3;
     }
+    mzSetZipArchiveMapping(&za, &map);
+    // Everything the updater decodes goes to files and block devices:
+    // hand it over in large pieces, for fewer writes and fewer wakeups
+    // of the block update thread.
+    mzSetDecodeBatchSize(1024 * 1024);
 
     const ZipEntry* script_entry = mzFindZipEntry(&za, SCRIPT_NAME);
     if (script_entry == NULL) {
@@ -17,6 +17,7 @@
 #include "asn1_decoder.h"
 #include "common.h"
 #include "verifier.h"
+#include "verifier_hash.h"
 
 #include "mincrypt/dsa_sig.h"
 #include "mincrypt/p256.h"
@@ -30,6 +31,9 @@
 #include <errno.h>
 #include <malloc.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 static bool read_pkcs7(uint8_t* pkcs7_der, size_t pkcs7_der_len, uint8_t** sig_der,
         size_t* sig_der_length) {
@@ -84,9 +88,10 @@ static bool read_pkcs7(uint8_t* pkcs7_der, size_t pkcs7_der_len, uint8_t** sig_d
 //
 // Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
 // or no key matches the signature).
-int verify_file(unsigned char* addr, size_t length,
-                const Certificate* pKeys, unsigned int numKeys) {
-    ui_set_progress(0.0);
+static int verify_package(unsigned char* addr, size_t length, const MemMapping* map,
+                          const Certificate* pKeys, unsigned int numKeys,
+                          bool show_progress) {
+    if (show_progress) ui_set_progress(0.0);
     
     // An archive with a whole-file signature will end in six bytes:
     //
@@ -161,21 +166,40 @@ int verify_file(unsigned char* addr, size_t length,
         }
     }
 
-#define BUFFER_SIZE 4096
+// Hashing large pieces at once leaves the kernels long runs of blocks;
+// the progress bar still moves about every 2%.
+#define BUFFER_SIZE (1024 * 1024)
 
-    bool need_sha1 = false;
-    bool need_sha256 = false;
+    int algorithms = 0;
     for (i = 0; i < numKeys; ++i) {
         switch (pKeys[i].hash_len) {
-            case SHA_DIGEST_SIZE: need_sha1 = true; break;
-            case SHA256_DIGEST_SIZE: need_sha256 = true; break;
+            case SHA_DIGEST_SIZE: algorithms |= VERIFIER_HASH_SHA1; break;
+            case SHA256_DIGEST_SIZE: algorithms |= VERIFIER_HASH_SHA256; break;
         }
     }
 
-    SHA_CTX sha1_ctx;
-    SHA256_CTX sha256_ctx;
-    SHA_init(&sha1_ctx);
-    SHA256_init(&sha256_ctx);
+    // The package is read front to back exactly once.  A block map is
+    // read from the block device a buffer at a time, with the next buffer
+    // already on its way; faulting the mapping in would take one small
+    // read per range.  Anything else is hashed in place, with the kernel
+    // reading ahead aggressively.
+    unsigned char* buffer = NULL;
+    if (map != NULL && map->dev_fd >= 0) {
+        buffer = malloc(BUFFER_SIZE);
+        if (buffer == NULL) {
+            LOGE("failed to allocate hash buffer\n");
+            return VERIFY_FAILURE;
+        }
+        sysPrefetchMap(map, 0, signed_len < BUFFER_SIZE ? signed_len : BUFFER_SIZE);
+    } else {
+        uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+        uintptr_t map_start = (uintptr_t)addr & ~(page - 1);
+        madvise((void*)map_start, (uintptr_t)addr + signed_len - map_start, MADV_SEQUENTIAL);
+    }
+
+    LOGI("hashing %zu bytes with %s kernels\n", signed_len, verifier_hash_kernels());
+    VerifierHash hash_ctx;
+    verifier_hash_init(&hash_ctx, algorithms);
 
     double frac = -1.0;
     size_t so_far = 0;
@@ -183,19 +207,34 @@ int verify_file(unsigned char* addr, size_t length,
         size_t size = signed_len - so_far;
         if (size > BUFFER_SIZE) size = BUFFER_SIZE;
 
-        if (need_sha1) SHA_update(&sha1_ctx, addr + so_far, size);
-        if (need_sha256) SHA256_update(&sha256_ctx, addr + so_far, size);
+        if (buffer != NULL) {
+            size_t next = signed_len - so_far - size;
+            if (next > 0) {
+                sysPrefetchMap(map, so_far + size, next < BUFFER_SIZE ? next : BUFFER_SIZE);
+            }
+            if (sysReadMap(map, so_far, buffer, size) != 0) {
+                LOGE("failed to read package at %zu (%s)\n", so_far, strerror(errno));
+                free(buffer);
+                return VERIFY_FAILURE;
+            }
+            verifier_hash_update(&hash_ctx, buffer, size);
+        } else {
+            verifier_hash_update(&hash_ctx, addr + so_far, size);
+        }
         so_far += size;
 
         double f = so_far / (double)signed_len;
-        if (f > frac + 0.02 || size == so_far) {
+        if (show_progress && (f > frac + 0.02 || size == so_far)) {
             ui_set_progress(f);
             frac = f;
         }
     }
 
-    const uint8_t* sha1 = SHA_final(&sha1_ctx);
-    const uint8_t* sha256 = SHA256_final(&sha256_ctx);
+    free(buffer);
+
+    uint8_t sha1[VERIFIER_SHA1_SIZE];
+    uint8_t sha256[VERIFIER_SHA256_SIZE];
+    verifier_hash_final(&hash_ctx, sha1, sha256);
 
     uint8_t* sig_der = NULL;
     size_t sig_der_length = 0;
@@ -266,6 +305,17 @@ int verify_file(unsigned char* addr, size_t length,
     return VERIFY_FAILURE;
 }
 
+int verify_file(unsigned char* addr, size_t length,
+                const Certificate* pKeys, unsigned int numKeys) {
+    return verify_package(addr, length, NULL, pKeys, numKeys, true);
+}
+
+int verify_mapped_file(const MemMapping* map,
+                       const Certificate* pKeys, unsigned int numKeys,
+                       bool show_progress) {
+    return verify_package(map->addr, map->length, map, pKeys, numKeys, show_progress);
+}
+
 // Reads a file containing one or more public keys as produced by
 // DumpPublicKey:  this is an RSAPublicKey struct as it would appear
 // as a C source literal, eg:
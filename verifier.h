@@ -17,8 +17,11 @@
 #ifndef _RECOVERY_VERIFIER_H
 #define _RECOVERY_VERIFIER_H
 
+#include <stdbool.h>
+
 #include "mincrypt/p256.h"
 #include "mincrypt/rsa.h"
+#include "minzip/SysUtil.h"
 
 typedef struct {
     p256_int x;
@@ -45,6 +48,15 @@ typedef struct Certificate{
 int verify_file(unsigned char* addr, size_t length,
                 const Certificate *pKeys, unsigned int numKeys);
 
+/* Like verify_file(), for a package mapped with sysMapFile().  Block
+ * maps are hashed with reads from the block device rather than through
+ * the mapping.  Without show_progress the progress bar is left alone,
+ * for packages checked while another one installs.
+ */
+int verify_mapped_file(const MemMapping* map,
+                       const Certificate *pKeys, unsigned int numKeys,
+                       bool show_progress);
+
 Certificate* load_keys(const char* filename, int* numKeys);
 
 #define VERIFY_SUCCESS        0
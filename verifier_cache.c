@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "roots.h"
+#include "verifier_cache.h"
+#include "verifier_hash.h"
+
+#include "cutils/properties.h"
+
+#ifndef FUSE_SUPER_MAGIC
+#define FUSE_SUPER_MAGIC 0x65735546
+#endif
+
+#ifdef __BIONIC__
+#define MTIME_NSEC(st) ((st)->st_mtime_nsec)
+#define CTIME_NSEC(st) ((st)->st_ctime_nsec)
+#else
+#define MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#define CTIME_NSEC(st) ((st)->st_ctim.tv_nsec)
+#endif
+
+// Blocks spread evenly over the package that go into its sample digest,
+// besides the tail with the signature and the end of the central directory.
+#define SAMPLE_BLOCKS     64
+#define SAMPLE_BLOCK_SIZE 4096
+#define SAMPLE_TAIL       (64 * 1024)
+
+#define DIGEST_HEX_SIZE (VERIFIER_SHA256_SIZE * 2 + 1)
+
+typedef struct {
+    char sample[DIGEST_HEX_SIZE];
+    char keys[DIGEST_HEX_SIZE];
+    unsigned long long size;
+    unsigned long long dev;
+    unsigned long long ino;
+    long long mtime;
+    long mtime_nsec;
+    long long ctime;
+    long ctime_nsec;
+} PackageId;
+
+static void to_hex(const uint8_t* digest, char* hex) {
+    static const char digits[] = "0123456789abcdef";
+    int i;
+
+    for (i = 0; i < VERIFIER_SHA256_SIZE; i++) {
+        hex[i * 2] = digits[digest[i] >> 4];
+        hex[i * 2 + 1] = digits[digest[i] & 15];
+    }
+    hex[VERIFIER_SHA256_SIZE * 2] = '\0';
+}
+
+static int cache_disabled() {
+    char value[PROPERTY_VALUE_MAX];
+
+    property_get(FULL_VERIFY_PROPERTY, value, "0");
+    return strcmp(value, "1") == 0;
+}
+
+static int digest_keys(const char* keys_file, char* hex) {
+    uint8_t buf[4096];
+    uint8_t digest[VERIFIER_SHA256_SIZE];
+    VerifierHash h;
+    ssize_t n;
+
+    int fd = open(keys_file, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    verifier_hash_init(&h, VERIFIER_HASH_SHA256);
+    while ((n = TEMP_FAILURE_RETRY(read(fd, buf, sizeof(buf)))) > 0)
+        verifier_hash_update(&h, buf, n);
+    close(fd);
+    if (n < 0)
+        return -1;
+    verifier_hash_final(&h, NULL, digest);
+    to_hex(digest, hex);
+    return 0;
+}
+
+// Identifies the package behind map, or returns -1 if it can't be cached.
+static int identify_package(const MemMapping* map, const char* keys_file, PackageId* id) {
+    struct stat st;
+    struct statfs sfs;
+    uint8_t digest[VERIFIER_SHA256_SIZE];
+    VerifierHash h;
+    size_t tail, off;
+    int i;
+
+    if (map->fd < 0 || fstat(map->fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return -1;
+    if (fstatfs(map->fd, &sfs) == 0 && sfs.f_type == FUSE_SUPER_MAGIC)
+        return -1;
+    if (map->offset != 0 || (unsigned long long)st.st_size != map->length)
+        return -1;
+
+    memset(id, 0, sizeof(*id));
+    id->size = st.st_size;
+    id->dev = st.st_dev;
+    id->ino = st.st_ino;
+    id->mtime = st.st_mtime;
+    id->mtime_nsec = MTIME_NSEC(&st);
+    id->ctime = st.st_ctime;
+    id->ctime_nsec = CTIME_NSEC(&st);
+
+    verifier_hash_init(&h, VERIFIER_HASH_SHA256);
+    tail = map->length < SAMPLE_TAIL ? map->length : SAMPLE_TAIL;
+    if (map->length - tail > SAMPLE_BLOCKS * SAMPLE_BLOCK_SIZE) {
+        size_t span = map->length - tail - SAMPLE_BLOCK_SIZE;
+        for (i = 0; i < SAMPLE_BLOCKS; i++) {
+            off = (size_t)((unsigned long long)span * i / (SAMPLE_BLOCKS - 1));
+            verifier_hash_update(&h, map->addr + off, SAMPLE_BLOCK_SIZE);
+        }
+    } else {
+        // small enough to take all of it
+        tail = map->length;
+    }
+    verifier_hash_update(&h, map->addr + map->length - tail, tail);
+    verifier_hash_final(&h, NULL, digest);
+    to_hex(digest, id->sample);
+
+    return digest_keys(keys_file, id->keys);
+}
+
+static int format_entry(char* line, size_t size, const PackageId* id, const char* path) {
+    return snprintf(line, size, "%s %s %llu %llu %llu %lld.%09ld %lld.%09ld %s\n",
+                    id->sample, id->keys, id->size, id->dev, id->ino,
+                    id->mtime, id->mtime_nsec, id->ctime, id->ctime_nsec, path);
+}
+
+// Splits a cache line into its id and path; returns NULL if it's malformed.
+static char* parse_entry(char* line, PackageId* id) {
+    int path_start = 0;
+
+    line[strcspn(line, "\n")] = '\0';
+    if (sscanf(line, "%64s %64s %llu %llu %llu %lld.%ld %lld.%ld %n",
+               id->sample, id->keys, &id->size, &id->dev, &id->ino,
+               &id->mtime, &id->mtime_nsec, &id->ctime, &id->ctime_nsec, &path_start) != 9 ||
+            path_start == 0 || line[path_start] == '\0') {
+        return NULL;
+    }
+    return line + path_start;
+}
+
+static int same_package(const PackageId* a, const PackageId* b) {
+    return strcmp(a->sample, b->sample) == 0 && strcmp(a->keys, b->keys) == 0 &&
+            a->size == b->size && a->dev == b->dev && a->ino == b->ino &&
+            a->mtime == b->mtime && a->mtime_nsec == b->mtime_nsec &&
+            a->ctime == b->ctime && a->ctime_nsec == b->ctime_nsec;
+}
+
+int verifier_cache_lookup(const char* path, const MemMapping* map, const char* keys_file) {
+    PackageId id, entry;
+    char line[PATH_MAX + 256];
+    char* entry_path;
+    int found = 0;
+
+    if (cache_disabled() || identify_package(map, keys_file, &id) != 0)
+        return 0;
+    if (ensure_path_mounted(VERIFIER_CACHE_FILE) != 0)
+        return 0;
+
+    FILE* f = fopen(VERIFIER_CACHE_FILE, "r");
+    if (f == NULL)
+        return 0;
+    while (!found && fgets(line, sizeof(line), f) != NULL) {
+        entry_path = parse_entry(line, &entry);
+        found = entry_path != NULL && strcmp(entry_path, path) == 0 && same_package(&entry, &id);
+    }
+    fclose(f);
+
+    if (found)
+        LOGI("%s verified before and is unchanged\n", path);
+    return found;
+}
+
+void verifier_cache_store(const char* path, const MemMapping* map, const char* keys_file) {
+    PackageId id, entry;
+    char line[PATH_MAX + 256];
+    char* entry_path;
+    int kept = 1;
+
+    if (strchr(path, '\n') != NULL || cache_disabled() ||
+            identify_package(map, keys_file, &id) != 0) {
+        return;
+    }
+    if (ensure_path_mounted(VERIFIER_CACHE_FILE) != 0)
+        return;
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", VERIFIER_CACHE_FILE);
+    FILE* out = fopen(tmp, "w");
+    if (out == NULL) {
+        LOGW("can't write %s (%s)\n", tmp, strerror(errno));
+        return;
+    }
+
+    // The newest entry goes first; older ones for the same path or file
+    // are replaced.
+    format_entry(line, sizeof(line), &id, path);
+    fputs(line, out);
+    FILE* in = fopen(VERIFIER_CACHE_FILE, "r");
+    if (in != NULL) {
+        while (kept < VERIFIER_CACHE_MAX_ENTRIES && fgets(line, sizeof(line), in) != NULL) {
+            entry_path = parse_entry(line, &entry);
+            if (entry_path == NULL || strcmp(entry_path, path) == 0 ||
+                    (entry.dev == id.dev && entry.ino == id.ino)) {
+                continue;
+            }
+            format_entry(line, sizeof(line), &entry, entry_path);
+            fputs(line, out);
+            kept++;
+        }
+        fclose(in);
+    }
+
+    if (fflush(out) != 0 || fsync(fileno(out)) != 0) {
+        LOGW("can't write %s (%s)\n", tmp, strerror(errno));
+        fclose(out);
+        unlink(tmp);
+        return;
+    }
+    fclose(out);
+    if (rename(tmp, VERIFIER_CACHE_FILE) != 0) {
+        LOGW("can't rename %s (%s)\n", tmp, strerror(errno));
+        unlink(tmp);
+    }
+}
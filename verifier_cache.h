@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_VERIFIER_CACHE_H
+#define _RECOVERY_VERIFIER_CACHE_H
+
+#include "minzip/SysUtil.h"
+
+// Packages that passed verify_file(), so installing the same file again
+// (a retry, or one package flashed over and over) can skip the full hash.
+// An entry is keyed by the file's identity (device, inode, size, mtime and
+// ctime) and holds a digest of sampled blocks plus the signed tail of the
+// package and a digest of the keys it verified against; all of them must
+// still match. Only regular files qualify: block maps and FUSE files
+// (sideload) can change underneath an unchanged inode.
+
+#define VERIFIER_CACHE_FILE "/cache/recovery/verified_packages"
+// Most recently verified packages that are remembered.
+#define VERIFIER_CACHE_MAX_ENTRIES 16
+
+// Set to 1 to always hash the whole package (default 0).
+#define FULL_VERIFY_PROPERTY "ro.ctr.full_verify"
+
+// Returns 1 if the package mapped from path verified against the keys in
+// keys_file before and is unchanged since.
+int verifier_cache_lookup(const char* path, const MemMapping* map, const char* keys_file);
+
+// Remembers that the package verified against the keys in keys_file.
+void verifier_cache_store(const char* path, const MemMapping* map, const char* keys_file);
+
+#endif  /* _RECOVERY_VERIFIER_CACHE_H */
@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "verifier_hash.h"
+
+// Input is fed to the algorithms in pieces this large, so the second one
+// reads what the first one just pulled into the cache.
+#define FUSED_CHUNK (16 * 1024)
+
+static const uint32_t sha1_init[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+};
+
+static const uint32_t sha256_init[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline uint32_t load_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void store_be32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+#define SHA1_ROUND(i, f, k)                                                           \
+    do {                                                                              \
+        if ((i) >= 16) {                                                              \
+            uint32_t x = w[((i) + 13) & 15] ^ w[((i) + 8) & 15] ^ w[((i) + 2) & 15] ^   \
+                    w[(i) & 15];                                                      \
+            w[(i) & 15] = ROL(x, 1);                                                  \
+        }                                                                             \
+        uint32_t t = ROL(a, 5) + (f) + e + (k) + w[(i) & 15];                         \
+        e = d;                                                                        \
+        d = c;                                                                        \
+        c = ROL(b, 30);                                                               \
+        b = a;                                                                        \
+        a = t;                                                                        \
+    } while (0)
+
+static void sha1_blocks_portable(uint32_t* state, const uint8_t* data, size_t blocks) {
+    uint32_t w[16];
+    int i;
+
+    while (blocks-- > 0) {
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+        for (i = 0; i < 16; i++)
+            w[i] = load_be32(data + i * 4);
+        for (i = 0; i < 20; i++)
+            SHA1_ROUND(i, d ^ (b & (c ^ d)), 0x5a827999);
+        for (; i < 40; i++)
+            SHA1_ROUND(i, b ^ c ^ d, 0x6ed9eba1);
+        for (; i < 60; i++)
+            SHA1_ROUND(i, (b & c) | (d & (b | c)), 0x8f1bbcdc);
+        for (; i < 80; i++)
+            SHA1_ROUND(i, b ^ c ^ d, 0xca62c1d6);
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        data += 64;
+    }
+}
+
+#define SHA256_ROUND(i)                                                               \
+    do {                                                                              \
+        if ((i) >= 16) {                                                              \
+            uint32_t w15 = w[((i) + 1) & 15], w2 = w[((i) + 14) & 15];                \
+            uint32_t s0 = ROR(w15, 7) ^ ROR(w15, 18) ^ (w15 >> 3);                    \
+            uint32_t s1 = ROR(w2, 17) ^ ROR(w2, 19) ^ (w2 >> 10);                     \
+            w[(i) & 15] += s0 + w[((i) + 9) & 15] + s1;                               \
+        }                                                                             \
+        uint32_t t1 = h + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + (g ^ (e & (f ^ g))) + \
+                sha256_k[i] + w[(i) & 15];                                            \
+        uint32_t t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + ((a & b) | (c & (a | b))); \
+        h = g;                                                                        \
+        g = f;                                                                        \
+        f = e;                                                                        \
+        e = d + t1;                                                                   \
+        d = c;                                                                        \
+        c = b;                                                                        \
+        b = a;                                                                        \
+        a = t1 + t2;                                                                  \
+    } while (0)
+
+static void sha256_blocks_portable(uint32_t* state, const uint8_t* data, size_t blocks) {
+    uint32_t w[16];
+    int i;
+
+    while (blocks-- > 0) {
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (i = 0; i < 16; i++) {
+            w[i] = load_be32(data + i * 4);
+            SHA256_ROUND(i);
+        }
+        for (; i < 64; i++)
+            SHA256_ROUND(i);
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+        data += 64;
+    }
+}
+
+typedef struct {
+    const char* name;
+    verifier_hash_blocks_fn sha1;
+    verifier_hash_blocks_fn sha256;
+} HashKernels;
+
+static const HashKernels portable_kernels = {
+    "portable", sha1_blocks_portable, sha256_blocks_portable
+};
+
+static HashKernels accel_kernels;
+static const HashKernels* best_kernels = &portable_kernels;
+static int force_portable = 0;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void detect_kernels() {
+    if (verifier_hash_accel_supported()) {
+        accel_kernels.name = verifier_hash_accel_name();
+        accel_kernels.sha1 = verifier_sha1_blocks_accel;
+        accel_kernels.sha256 = verifier_sha256_blocks_accel;
+        best_kernels = &accel_kernels;
+    }
+}
+
+static const HashKernels* kernels() {
+    pthread_once(&kernels_once, detect_kernels);
+    return force_portable ? &portable_kernels : best_kernels;
+}
+
+const char* verifier_hash_kernels() {
+    return kernels()->name;
+}
+
+void verifier_hash_force_portable(int force) {
+    force_portable = force;
+}
+
+void verifier_hash_init(VerifierHash* h, int algorithms) {
+    memset(h, 0, sizeof(*h));
+    h->algorithms = algorithms;
+    memcpy(h->sha1, sha1_init, sizeof(sha1_init));
+    memcpy(h->sha256, sha256_init, sizeof(sha256_init));
+}
+
+static void hash_blocks(VerifierHash* h, const HashKernels* k, const uint8_t* data, size_t blocks) {
+    while (blocks > 0) {
+        size_t n = blocks < FUSED_CHUNK / 64 ? blocks : FUSED_CHUNK / 64;
+        if (h->algorithms & VERIFIER_HASH_SHA1)
+            k->sha1(h->sha1, data, n);
+        if (h->algorithms & VERIFIER_HASH_SHA256)
+            k->sha256(h->sha256, data, n);
+        data += n * 64;
+        blocks -= n;
+    }
+}
+
+void verifier_hash_update(VerifierHash* h, const void* data, size_t len) {
+    const HashKernels* k = kernels();
+    const uint8_t* p = (const uint8_t*)data;
+
+    h->length += len;
+    if (h->block_used > 0) {
+        size_t n = 64 - h->block_used;
+        if (n > len)
+            n = len;
+        memcpy(h->block + h->block_used, p, n);
+        h->block_used += n;
+        p += n;
+        len -= n;
+        if (h->block_used < 64)
+            return;
+        hash_blocks(h, k, h->block, 1);
+        h->block_used = 0;
+    }
+
+    hash_blocks(h, k, p, len / 64);
+    p += len & ~(size_t)63;
+    len &= 63;
+    if (len > 0) {
+        memcpy(h->block, p, len);
+        h->block_used = len;
+    }
+}
+
+void verifier_hash_final(VerifierHash* h, uint8_t* sha1, uint8_t* sha256) {
+    const HashKernels* k = kernels();
+    uint64_t bits = h->length * 8;
+    int i;
+
+    h->block[h->block_used++] = 0x80;
+    if (h->block_used > 56) {
+        memset(h->block + h->block_used, 0, 64 - h->block_used);
+        hash_blocks(h, k, h->block, 1);
+        h->block_used = 0;
+    }
+    memset(h->block + h->block_used, 0, 56 - h->block_used);
+    store_be32(h->block + 56, (uint32_t)(bits >> 32));
+    store_be32(h->block + 60, (uint32_t)bits);
+    hash_blocks(h, k, h->block, 1);
+    h->block_used = 0;
+
+    if (sha1 != NULL) {
+        for (i = 0; i < 5; i++)
+            store_be32(sha1 + i * 4, h->sha1[i]);
+    }
+    if (sha256 != NULL) {
+        for (i = 0; i < 8; i++)
+            store_be32(sha256 + i * 4, h->sha256[i]);
+    }
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_VERIFIER_HASH_H
+#define _RECOVERY_VERIFIER_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SHA-1 and SHA-256 of whole packages for verify_file(). Both digests are
+// computed in a single pass: every cache sized piece of the input goes
+// through each selected algorithm before the next one is read. The block
+// functions are picked at run time: ARMv8 crypto extensions or x86 SHA
+// extensions when the CPU has them, portable C otherwise.
+
+#define VERIFIER_HASH_SHA1   1
+#define VERIFIER_HASH_SHA256 2
+
+#define VERIFIER_SHA1_SIZE   20
+#define VERIFIER_SHA256_SIZE 32
+
+typedef struct {
+    int algorithms;            // VERIFIER_HASH_* mask
+    uint32_t sha1[5];
+    uint32_t sha256[8];
+    uint64_t length;
+    uint8_t block[64];
+    size_t block_used;
+} VerifierHash;
+
+void verifier_hash_init(VerifierHash* h, int algorithms);
+void verifier_hash_update(VerifierHash* h, const void* data, size_t len);
+// Either digest may be NULL.
+void verifier_hash_final(VerifierHash* h, uint8_t* sha1, uint8_t* sha256);
+
+// Name of the block functions in use, for logs and benchmarks.
+const char* verifier_hash_kernels();
+// Makes later hashes use the portable functions (force set) or the best
+// ones available again. Only meant for tests and benchmarks.
+void verifier_hash_force_portable(int force);
+
+// Block functions; state is the algorithm's chaining value and data holds
+// blocks whole 64 byte blocks.
+typedef void (*verifier_hash_blocks_fn)(uint32_t* state, const uint8_t* data, size_t blocks);
+
+// Accelerated implementations, built with the instruction set extensions
+// they need. Only call them once the CPU is known to support those.
+int verifier_hash_accel_supported();
+const char* verifier_hash_accel_name();
+void verifier_sha1_blocks_accel(uint32_t* state, const uint8_t* data, size_t blocks);
+void verifier_sha256_blocks_accel(uint32_t* state, const uint8_t* data, size_t blocks);
+
+#endif  /* _RECOVERY_VERIFIER_HASH_H */
@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// SHA-1 and SHA-256 block functions using the ARMv8 crypto extensions or
+// the x86 SHA extensions. This file is built with the compiler flags
+// enabling those (-march=armv8-a+crypto, -msse4.1 -msha), and nothing in
+// it runs before verifier_hash_accel_supported() said the CPU has them.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "verifier_hash.h"
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_SHA2))
+
+#include <arm_neon.h>
+#include <sys/auxv.h>
+
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+
+int verifier_hash_accel_supported() {
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    return (hwcap & HWCAP_SHA1) && (hwcap & HWCAP_SHA2);
+}
+
+const char* verifier_hash_accel_name() {
+    return "armv8-ce";
+}
+
+static inline uint32x4_t load_be(const uint8_t* p) {
+    return vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p)));
+}
+
+// Rounds 4g to 4g+3 of SHA-1. w holds the last four schedule words
+// groups, e the two alternating E values.
+#define SHA1_ROUNDS(g, op, k)                                                         \
+    do {                                                                              \
+        if ((g) >= 4)                                                                 \
+            w[(g) & 3] = vsha1su1q_u32(vsha1su0q_u32(w[(g) & 3], w[((g) + 1) & 3],    \
+                                                     w[((g) + 2) & 3]),               \
+                                       w[((g) + 3) & 3]);                             \
+        uint32x4_t t = vaddq_u32(w[(g) & 3], vdupq_n_u32(k));                         \
+        e[((g) + 1) & 1] = vsha1h_u32(vgetq_lane_u32(abcd, 0));                       \
+        abcd = op(abcd, e[(g) & 1], t);                                               \
+    } while (0)
+
+void verifier_sha1_blocks_accel(uint32_t* state, const uint8_t* data, size_t blocks) {
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32_t e0 = state[4];
+
+    while (blocks-- > 0) {
+        uint32x4_t abcd_saved = abcd;
+        uint32x4_t w[4];
+        uint32_t e[2];
+
+        w[0] = load_be(data);
+        w[1] = load_be(data + 16);
+        w[2] = load_be(data + 32);
+        w[3] = load_be(data + 48);
+        e[0] = e0;
+
+        SHA1_ROUNDS(0, vsha1cq_u32, 0x5a827999);
+        SHA1_ROUNDS(1, vsha1cq_u32, 0x5a827999);
+        SHA1_ROUNDS(2, vsha1cq_u32, 0x5a827999);
+        SHA1_ROUNDS(3, vsha1cq_u32, 0x5a827999);
+        SHA1_ROUNDS(4, vsha1cq_u32, 0x5a827999);
+        SHA1_ROUNDS(5, vsha1pq_u32, 0x6ed9eba1);
+        SHA1_ROUNDS(6, vsha1pq_u32, 0x6ed9eba1);
+        SHA1_ROUNDS(7, vsha1pq_u32, 0x6ed9eba1);
+        SHA1_ROUNDS(8, vsha1pq_u32, 0x6ed9eba1);
+        SHA1_ROUNDS(9, vsha1pq_u32, 0x6ed9eba1);
+        SHA1_ROUNDS(10, vsha1mq_u32, 0x8f1bbcdc);
+        SHA1_ROUNDS(11, vsha1mq_u32, 0x8f1bbcdc);
+        SHA1_ROUNDS(12, vsha1mq_u32, 0x8f1bbcdc);
+        SHA1_ROUNDS(13, vsha1mq_u32, 0x8f1bbcdc);
+        SHA1_ROUNDS(14, vsha1mq_u32, 0x8f1bbcdc);
+        SHA1_ROUNDS(15, vsha1pq_u32, 0xca62c1d6);
+        SHA1_ROUNDS(16, vsha1pq_u32, 0xca62c1d6);
+        SHA1_ROUNDS(17, vsha1pq_u32, 0xca62c1d6);
+        SHA1_ROUNDS(18, vsha1pq_u32, 0xca62c1d6);
+        SHA1_ROUNDS(19, vsha1pq_u32, 0xca62c1d6);
+
+        abcd = vaddq_u32(abcd, abcd_saved);
+        e0 += e[0];
+        data += 64;
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e0;
+}
+
+void verifier_sha256_blocks_accel(uint32_t* state, const uint8_t* data, size_t blocks) {
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32x4_t efgh = vld1q_u32(state + 4);
+
+    while (blocks-- > 0) {
+        uint32x4_t abcd_saved = abcd;
+        uint32x4_t efgh_saved = efgh;
+        uint32x4_t w[4];
+        int g;
+
+        w[0] = load_be(data);
+        w[1] = load_be(data + 16);
+        w[2] = load_be(data + 32);
+        w[3] = load_be(data + 48);
+
+        for (g = 0; g < 16; g++) {
+            if (g >= 4)
+                w[g & 3] = vsha256su1q_u32(vsha256su0q_u32(w[g & 3], w[(g + 1) & 3]),
+                                           w[(g + 2) & 3], w[(g + 3) & 3]);
+            uint32x4_t t = vaddq_u32(w[g & 3], vld1q_u32(&sha256_k[g * 4]));
+            uint32x4_t abcd_prev = abcd;
+            abcd = vsha256hq_u32(abcd, efgh, t);
+            efgh = vsha256h2q_u32(efgh, abcd_prev, t);
+        }
+
+        abcd = vaddq_u32(abcd, abcd_saved);
+        efgh = vaddq_u32(efgh, efgh_saved);
+        data += 64;
+    }
+
+    vst1q_u32(state, abcd);
+    vst1q_u32(state + 4, efgh);
+}
+
+#elif (defined(__x86_64__) || defined(__i386__)) && defined(__SHA__) && defined(__SSE4_1__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+int verifier_hash_accel_supported() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 0;
+    // SSSE3 and SSE4.1
+    if (!(ecx & (1 << 9)) || !(ecx & (1 << 19)))
+        return 0;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return 0;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 29)) != 0;
+}
+
+const char* verifier_hash_accel_name() {
+    return "x86-sha";
+}
+
+// Rounds 4g to 4g+3 of SHA-1, see SHA1_ROUNDS above.
+#define SHA1_ROUNDS(g, f)                                                             \
+    do {                                                                              \
+        if ((g) >= 4)                                                                 \
+            w[(g) & 3] = _mm_sha1msg2_epu32(                                          \
+                _mm_xor_si128(_mm_sha1msg1_epu32(w[(g) & 3], w[((g) + 1) & 3]),       \
+                              w[((g) + 2) & 3]),                                      \
+                w[((g) + 3) & 3]);                                                    \
+        if ((g) == 0)                                                                 \
+            e[0] = _mm_add_epi32(e[0], w[0]);                                         \
+        else                                                                          \
+            e[(g) & 1] = _mm_sha1nexte_epu32(e[(g) & 1], w[(g) & 3]);                 \
+        e[((g) + 1) & 1] = abcd;                                                      \
+        abcd = _mm_sha1rnds4_epu32(abcd, e[(g) & 1], f);                              \
+    } while (0)
+
+void verifier_sha1_blocks_accel(uint32_t* state, const uint8_t* data, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1b);
+    __m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+    while (blocks-- > 0) {
+        __m128i abcd_saved = abcd;
+        __m128i w[4];
+        __m128i e[2];
+
+        w[0] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data), mask);
+        w[1] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), mask);
+        w[2] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), mask);
+        w[3] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), mask);
+        e[0] = e0;
+
+        SHA1_ROUNDS(0, 0);
+        SHA1_ROUNDS(1, 0);
+        SHA1_ROUNDS(2, 0);
+        SHA1_ROUNDS(3, 0);
+        SHA1_ROUNDS(4, 0);
+        SHA1_ROUNDS(5, 1);
+        SHA1_ROUNDS(6, 1);
+        SHA1_ROUNDS(7, 1);
+        SHA1_ROUNDS(8, 1);
+        SHA1_ROUNDS(9, 1);
+        SHA1_ROUNDS(10, 2);
+        SHA1_ROUNDS(11, 2);
+        SHA1_ROUNDS(12, 2);
+        SHA1_ROUNDS(13, 2);
+        SHA1_ROUNDS(14, 2);
+        SHA1_ROUNDS(15, 3);
+        SHA1_ROUNDS(16, 3);
+        SHA1_ROUNDS(17, 3);
+        SHA1_ROUNDS(18, 3);
+        SHA1_ROUNDS(19, 3);
+
+        e0 = _mm_sha1nexte_epu32(e[0], e0);
+        abcd = _mm_add_epi32(abcd, abcd_saved);
+        data += 64;
+    }
+
+    _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+void verifier_sha256_blocks_accel(uint32_t* state, const uint8_t* data, size_t blocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0xb1);  // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(state + 4)), 0x1b);  // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);    // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);         // CDGH
+
+    while (blocks-- > 0) {
+        __m128i abef_saved = state0;
+        __m128i cdgh_saved = state1;
+        __m128i w[4];
+        int g;
+
+        w[0] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data), mask);
+        w[1] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), mask);
+        w[2] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), mask);
+        w[3] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), mask);
+
+        for (g = 0; g < 16; g++) {
+            if (g >= 4)
+                w[g & 3] = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(_mm_sha256msg1_epu32(w[g & 3], w[(g + 1) & 3]),
+                                  _mm_alignr_epi8(w[(g + 3) & 3], w[(g + 2) & 3], 4)),
+                    w[(g + 3) & 3]);
+            __m128i msg = _mm_add_epi32(w[g & 3], _mm_loadu_si128((const __m128i*)&sha256_k[g * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+        }
+
+        state0 = _mm_add_epi32(state0, abef_saved);
+        state1 = _mm_add_epi32(state1, cdgh_saved);
+        data += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);               // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1);            // DCHG
+    _mm_storeu_si128((__m128i*)state, _mm_blend_epi16(tmp, state1, 0xf0));         // DCBA
+    _mm_storeu_si128((__m128i*)(state + 4), _mm_alignr_epi8(state1, tmp, 8));      // HGFE
+}
+
+#else
+
+// Nothing to accelerate with on this CPU or compiler.
+
+int verifier_hash_accel_supported() {
+    return 0;
+}
+
+const char* verifier_hash_accel_name() {
+    return "none";
+}
+
+void verifier_sha1_blocks_accel(uint32_t* state, const uint8_t* data, size_t blocks) {
+}
+
+void verifier_sha256_blocks_accel(uint32_t* state, const uint8_t* data, size_t blocks) {
+}
+
+#endif
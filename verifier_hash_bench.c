@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2026 The Carliv Touch Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Measures the package hashing of verify_file(): mincrypt as it was used
+// before, then the portable and the accelerated kernels, each algorithm
+// alone and both fused. Every result must match mincrypt's digests.
+//
+//   verifier_hash_bench [<file>] [-m <MiB of random data>] [-n <rounds>]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mincrypt/sha.h"
+#include "mincrypt/sha256.h"
+#include "verifier_hash.h"
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char* what, size_t len, int rounds, double seconds) {
+    printf("  %-28s %8.1f MB/s\n", what, (double)len * rounds / seconds / (1024 * 1024));
+}
+
+static void mincrypt_hash(const uint8_t* data, size_t len, int algorithms,
+                          uint8_t* sha1, uint8_t* sha256) {
+    SHA_CTX sha1_ctx;
+    SHA256_CTX sha256_ctx;
+    size_t off;
+
+    SHA_init(&sha1_ctx);
+    SHA256_init(&sha256_ctx);
+    // the 4k steps verify_file() used to take
+    for (off = 0; off < len; off += 4096) {
+        size_t n = len - off < 4096 ? len - off : 4096;
+        if (algorithms & VERIFIER_HASH_SHA1)
+            SHA_update(&sha1_ctx, data + off, n);
+        if (algorithms & VERIFIER_HASH_SHA256)
+            SHA256_update(&sha256_ctx, data + off, n);
+    }
+    memcpy(sha1, SHA_final(&sha1_ctx), VERIFIER_SHA1_SIZE);
+    memcpy(sha256, SHA256_final(&sha256_ctx), VERIFIER_SHA256_SIZE);
+}
+
+static void engine_hash(const uint8_t* data, size_t len, int algorithms,
+                        uint8_t* sha1, uint8_t* sha256) {
+    VerifierHash h;
+    size_t off;
+
+    verifier_hash_init(&h, algorithms);
+    for (off = 0; off < len; off += 1024 * 1024) {
+        size_t n = len - off < 1024 * 1024 ? len - off : 1024 * 1024;
+        verifier_hash_update(&h, data + off, n);
+    }
+    verifier_hash_final(&h, sha1, sha256);
+}
+
+typedef void (*hash_fn)(const uint8_t* data, size_t len, int algorithms,
+                        uint8_t* sha1, uint8_t* sha256);
+
+// Runs one configuration and checks it against the reference digests.
+static int bench(const char* what, hash_fn fn, const uint8_t* data, size_t len,
+                 int rounds, int algorithms, const uint8_t* ref_sha1, const uint8_t* ref_sha256) {
+    uint8_t sha1[VERIFIER_SHA1_SIZE];
+    uint8_t sha256[VERIFIER_SHA256_SIZE];
+    int i;
+
+    double start = now();
+    for (i = 0; i < rounds; i++)
+        fn(data, len, algorithms, sha1, sha256);
+    report(what, len, rounds, now() - start);
+
+    if (((algorithms & VERIFIER_HASH_SHA1) && memcmp(sha1, ref_sha1, sizeof(sha1)) != 0) ||
+            ((algorithms & VERIFIER_HASH_SHA256) && memcmp(sha256, ref_sha256, sizeof(sha256)) != 0)) {
+        printf("  %s: digest mismatch\n", what);
+        return 1;
+    }
+    return 0;
+}
+
+static int bench_kernels(const char* kernels, const uint8_t* data, size_t len, int rounds,
+                         const uint8_t* ref_sha1, const uint8_t* ref_sha256) {
+    char what[64];
+    int failed = 0;
+
+    snprintf(what, sizeof(what), "%s sha1", kernels);
+    failed += bench(what, engine_hash, data, len, rounds, VERIFIER_HASH_SHA1, ref_sha1, ref_sha256);
+    snprintf(what, sizeof(what), "%s sha256", kernels);
+    failed += bench(what, engine_hash, data, len, rounds, VERIFIER_HASH_SHA256, ref_sha1, ref_sha256);
+    snprintf(what, sizeof(what), "%s sha1+sha256", kernels);
+    failed += bench(what, engine_hash, data, len, rounds,
+                    VERIFIER_HASH_SHA1 | VERIFIER_HASH_SHA256, ref_sha1, ref_sha256);
+    return failed;
+}
+
+// Odd lengths exercise the partial block and padding paths.
+static int check_lengths(const uint8_t* data, size_t len) {
+    static const size_t lengths[] = { 0, 1, 55, 56, 63, 64, 65, 119, 120, 128, 4097, 65599 };
+    uint8_t ref_sha1[VERIFIER_SHA1_SIZE], ref_sha256[VERIFIER_SHA256_SIZE];
+    uint8_t sha1[VERIFIER_SHA1_SIZE], sha256[VERIFIER_SHA256_SIZE];
+    unsigned i;
+    size_t step;
+    int failed = 0;
+
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]) && lengths[i] <= len; i++) {
+        mincrypt_hash(data, lengths[i], VERIFIER_HASH_SHA1 | VERIFIER_HASH_SHA256,
+                      ref_sha1, ref_sha256);
+        // feed it in uneven pieces
+        for (step = 1; step <= 97; step += 32) {
+            VerifierHash h;
+            size_t off;
+            verifier_hash_init(&h, VERIFIER_HASH_SHA1 | VERIFIER_HASH_SHA256);
+            for (off = 0; off < lengths[i]; off += step)
+                verifier_hash_update(&h, data + off, lengths[i] - off < step ? lengths[i] - off : step);
+            verifier_hash_final(&h, sha1, sha256);
+            if (memcmp(sha1, ref_sha1, sizeof(sha1)) != 0 ||
+                    memcmp(sha256, ref_sha256, sizeof(sha256)) != 0) {
+                printf("  %s: digest mismatch for %zu bytes in %zu byte pieces\n",
+                       verifier_hash_kernels(), lengths[i], step);
+                failed++;
+            }
+        }
+    }
+    return failed;
+}
+
+int main(int argc, char** argv) {
+    const char* path = NULL;
+    size_t len = 64 * 1024 * 1024;
+    int rounds = 3;
+    uint8_t* data;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            len = (size_t)atoi(argv[++i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && path == NULL) {
+            path = argv[i];
+        } else {
+            fprintf(stderr, "usage: %s [<file>] [-m <MiB>] [-n <rounds>]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (rounds < 1)
+        rounds = 1;
+
+    if (path != NULL) {
+        struct stat st;
+        int fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            fprintf(stderr, "can't open %s (%s)\n", path, strerror(errno));
+            return 1;
+        }
+        len = st.st_size;
+        data = mmap(NULL, len > 0 ? len : 1, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "can't map %s (%s)\n", path, strerror(errno));
+            return 1;
+        }
+    } else {
+        data = malloc(len > 0 ? len : 1);
+        if (data == NULL) {
+            fprintf(stderr, "can't allocate %zu bytes\n", len);
+            return 1;
+        }
+        uint32_t x = 0x12345678;
+        size_t off;
+        for (off = 0; off < len; off++) {
+            x = x * 1103515245 + 12345;
+            data[off] = x >> 24;
+        }
+    }
+
+    uint8_t ref_sha1[VERIFIER_SHA1_SIZE];
+    uint8_t ref_sha256[VERIFIER_SHA256_SIZE];
+    int failed = 0;
+
+    printf("%zu bytes, %d rounds\n", len, rounds);
+    mincrypt_hash(data, len, VERIFIER_HASH_SHA1 | VERIFIER_HASH_SHA256, ref_sha1, ref_sha256);
+    failed += bench("mincrypt sha1", mincrypt_hash, data, len, rounds,
+                    VERIFIER_HASH_SHA1, ref_sha1, ref_sha256);
+    failed += bench("mincrypt sha256", mincrypt_hash, data, len, rounds,
+                    VERIFIER_HASH_SHA256, ref_sha1, ref_sha256);
+    failed += bench("mincrypt sha1+sha256", mincrypt_hash, data, len, rounds,
+                    VERIFIER_HASH_SHA1 | VERIFIER_HASH_SHA256, ref_sha1, ref_sha256);
+
+    verifier_hash_force_portable(1);
+    failed += check_lengths(data, len);
+    failed += bench_kernels(verifier_hash_kernels(), data, len, rounds, ref_sha1, ref_sha256);
+
+    verifier_hash_force_portable(0);
+    if (verifier_hash_accel_supported()) {
+        failed += check_lengths(data, len);
+        failed += bench_kernels(verifier_hash_kernels(), data, len, rounds, ref_sha1, ref_sha256);
+    } else {
+        printf("  no accelerated kernels on this CPU\n");
+    }
+
+    printf(failed ? "FAILED\n" : "all digests match\n");
+    return failed ? 1 : 0;
+}
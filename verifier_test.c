@@ -212,7 +212,7 @@ int main(int argc, char **argv) {
         return 4;
     }
 
-    int result = verify_file(map.addr, map.length, certs, num_keys);
+    int result = verify_mapped_file(&map, certs, num_keys, true);
 
     if (result == VERIFY_SUCCESS) {
         printf("VERIFIED\n");